@@ -0,0 +1,604 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <assert.h>
+
+#include "../GL/3dglBVH.h"
+#include "../GL/3dglThreadPool.h"
+
+#include "../glm/vec4.hpp"
+#include "../glm/common.hpp"
+#include "../glm/geometric.hpp"
+
+// SSE2 is available on all x64 and (by default, since VS2012) on x86 targets
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define _3DGL_SSE2
+#endif
+
+using namespace std;
+using namespace _3dgl;
+
+#define BVH_BINS			12		// SAH bins per split
+#define BVH_MAX_LEAF		16		// triangles; above this, nodes are split even if the SAH says otherwise
+#define BVH_TRAVERSAL_COST	1.0f	// cost of a node visit, relative to a 4-wide triangle test
+#define BVH_PARALLEL_SIZE	4096	// the smallest subtree built as a separate job
+#define BVH_SAH_DEPTH		24		// deeper nodes are split at the median: with up to 2^32 triangles, the depth is at most 24 + 28
+#define BVH_STACK_SIZE		64		// traversal stack - enough for the deepest tree
+
+// a triangle during the build
+struct C3dglBVH::BUILDREF
+{
+	glm::vec3 bbMin, bbMax, centre;
+	unsigned nTriangle;
+};
+
+static float area(const glm::vec3 &bbMin, const glm::vec3 &bbMax)
+{
+	glm::vec3 d = bbMax - bbMin;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static unsigned blocks(unsigned nTriangles)
+{
+	return (nTriangles + 3) / 4;
+}
+
+unsigned C3dglBVH::addTriangles(const glm::vec3 *pVertices, const unsigned *pIndices, unsigned nTriangles, const glm::mat4 *pMatrix)
+{
+	unsigned nFirst = getTriangleCount();
+	m_vertices.reserve(m_vertices.size() + nTriangles * 3);
+	for (unsigned i = 0; i < nTriangles * 3; i++)
+		m_vertices.push_back(pMatrix ? glm::vec3(*pMatrix * glm::vec4(pVertices[pIndices[i]], 1)) : pVertices[pIndices[i]]);
+	return nFirst;
+}
+
+void C3dglBVH::clear()
+{
+	m_nodes.clear();
+	m_blocks.clear();
+	m_vertices.clear();
+}
+
+// the bounds of a range of triangles
+template <class BUILDREF>
+static void bounds(const vector<BUILDREF> &refs, unsigned nBegin, unsigned nEnd, glm::vec3 &bbMin, glm::vec3 &bbMax)
+{
+	bbMin = glm::vec3(FLT_MAX);
+	bbMax = glm::vec3(-FLT_MAX);
+	for (unsigned i = nBegin; i < nEnd; i++)
+	{
+		bbMin = glm::min(bbMin, refs[i].bbMin);
+		bbMax = glm::max(bbMax, refs[i].bbMax);
+	}
+}
+
+// Partitions the triangles of a node with the binned surface area heuristic (Wald, "On fast Construction of SAH-based
+// Bounding Volume Hierarchies", 2007). Returns the first triangle of the second child, or nBegin if a leaf is better.
+// Below BVH_SAH_DEPTH, the nodes are split at the median - the SAH alone does not limit the depth of the tree.
+unsigned C3dglBVH::split(vector<BUILDREF> &refs, unsigned nBegin, unsigned nEnd, const NODE &node, unsigned nDepth)
+{
+	unsigned nCount = nEnd - nBegin;
+	if (nCount <= 4 || (nDepth >= BVH_SAH_DEPTH && nCount <= BVH_MAX_LEAF))
+		return nBegin;
+
+	// the axis of the largest extent of the centroids
+	glm::vec3 cMin(FLT_MAX), cMax(-FLT_MAX);
+	for (unsigned i = nBegin; i < nEnd; i++)
+	{
+		cMin = glm::min(cMin, refs[i].centre);
+		cMax = glm::max(cMax, refs[i].centre);
+	}
+	glm::vec3 extent = cMax - cMin;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+	unsigned nMid = nBegin;
+	if (extent[axis] > 0 && nDepth < BVH_SAH_DEPTH)
+	{
+		struct BIN { glm::vec3 bbMin, bbMax; unsigned nCount; } bins[BVH_BINS];
+		for (BIN &bin : bins)
+		{
+			bin.bbMin = glm::vec3(FLT_MAX);
+			bin.bbMax = glm::vec3(-FLT_MAX);
+			bin.nCount = 0;
+		}
+		float fScale = BVH_BINS * 0.9999f / extent[axis];
+		for (unsigned i = nBegin; i < nEnd; i++)
+		{
+			BIN &bin = bins[(int)((refs[i].centre[axis] - cMin[axis]) * fScale)];
+			bin.bbMin = glm::min(bin.bbMin, refs[i].bbMin);
+			bin.bbMax = glm::max(bin.bbMax, refs[i].bbMax);
+			bin.nCount++;
+		}
+
+		// sweep from the right, then from the left: the cost of splitting after each bin
+		float rightCosts[BVH_BINS];
+		glm::vec3 bbMin(FLT_MAX), bbMax(-FLT_MAX);
+		unsigned n = 0;
+		for (int b = BVH_BINS - 1; b > 0; b--)
+		{
+			bbMin = glm::min(bbMin, bins[b].bbMin);
+			bbMax = glm::max(bbMax, bins[b].bbMax);
+			n += bins[b].nCount;
+			rightCosts[b - 1] = n ? area(bbMin, bbMax) * blocks(n) : 0;
+		}
+		float fBest = FLT_MAX;
+		int iBest = -1;
+		bbMin = glm::vec3(FLT_MAX);
+		bbMax = glm::vec3(-FLT_MAX);
+		n = 0;
+		for (int b = 0; b < BVH_BINS - 1; b++)
+		{
+			bbMin = glm::min(bbMin, bins[b].bbMin);
+			bbMax = glm::max(bbMax, bins[b].bbMax);
+			n += bins[b].nCount;
+			if (n == 0 || n == nCount) continue;
+			float fCost = area(bbMin, bbMax) * blocks(n) + rightCosts[b];
+			if (fCost < fBest)
+			{
+				fBest = fCost;
+				iBest = b;
+			}
+		}
+
+		float fArea = area(node.bbMin, node.bbMax);
+		bool bSplit = iBest >= 0 && (nCount > BVH_MAX_LEAF || fArea <= 0 || BVH_TRAVERSAL_COST + fBest / fArea < blocks(nCount));
+		if (!bSplit && nCount <= BVH_MAX_LEAF)
+			return nBegin;
+		if (iBest >= 0)
+		{
+			float fMin = cMin[axis];
+			nMid = (unsigned)(partition(refs.begin() + nBegin, refs.begin() + nEnd, [&](const BUILDREF &ref)
+			{
+				return (int)((ref.centre[axis] - fMin) * fScale) <= iBest;
+			}) - refs.begin());
+		}
+	}
+
+	// no useful split, but too many triangles for a leaf: the median (the centroids may all be equal)
+	if (nMid == nBegin || nMid == nEnd)
+	{
+		nMid = nBegin + nCount / 2;
+		nth_element(refs.begin() + nBegin, refs.begin() + nMid, refs.begin() + nEnd, [axis](const BUILDREF &a, const BUILDREF &b)
+		{
+			return a.centre[axis] < b.centre[axis];
+		});
+	}
+	return nMid;
+}
+
+void C3dglBVH::makeLeaf(vector<NODE> &nodes, unsigned nNode, unsigned nBegin, unsigned nEnd)
+{
+	// triangle ranges for now - converted to the blocks when the tree is complete
+	nodes[nNode].nFirst = nBegin;
+	nodes[nNode].nCount = nEnd - nBegin;
+}
+
+void C3dglBVH::buildSubtree(vector<BUILDREF> &refs, vector<NODE> &nodes, unsigned nNode, unsigned nBegin, unsigned nEnd, unsigned nDepth)
+{
+	unsigned nMid = split(refs, nBegin, nEnd, nodes[nNode], nDepth);
+	if (nMid == nBegin)
+	{
+		makeLeaf(nodes, nNode, nBegin, nEnd);
+		return;
+	}
+
+	unsigned nLeft = nodes.size();
+	nodes[nNode].nFirst = nLeft;
+	nodes[nNode].nCount = 0;
+	nodes.resize(nodes.size() + 2);
+	bounds(refs, nBegin, nMid, nodes[nLeft].bbMin, nodes[nLeft].bbMax);
+	bounds(refs, nMid, nEnd, nodes[nLeft + 1].bbMin, nodes[nLeft + 1].bbMax);
+	buildSubtree(refs, nodes, nLeft, nBegin, nMid, nDepth + 1);
+	buildSubtree(refs, nodes, nLeft + 1, nMid, nEnd, nDepth + 1);
+}
+
+void C3dglBVH::build()
+{
+	m_nodes.clear();
+	m_blocks.clear();
+	unsigned nTriangles = getTriangleCount();
+	if (nTriangles == 0)
+		return;
+
+	C3dglThreadPool &pool = C3dglThreadPool::getDefault();
+	vector<BUILDREF> refs(nTriangles);
+	pool.parallelFor(0, nTriangles, [&](unsigned i0, unsigned i1)
+	{
+		for (unsigned i = i0; i < i1; i++)
+		{
+			const glm::vec3 *p = &m_vertices[i * 3];
+			refs[i].bbMin = glm::min(glm::min(p[0], p[1]), p[2]);
+			refs[i].bbMax = glm::max(glm::max(p[0], p[1]), p[2]);
+			refs[i].centre = (refs[i].bbMin + refs[i].bbMax) * 0.5f;
+			refs[i].nTriangle = i;
+		}
+	});
+
+	// the top of the tree is split on this thread, until there are enough subtrees to keep all the threads busy
+	struct TASK
+	{
+		unsigned nNode, nBegin, nEnd, nDepth;
+	};
+	vector<TASK> tasks, next;
+	m_nodes.resize(1);
+	bounds(refs, 0, nTriangles, m_nodes[0].bbMin, m_nodes[0].bbMax);
+	TASK root = { 0, 0, nTriangles, 0 };
+	tasks.push_back(root);
+	for (bool bSplit = true; bSplit && tasks.size() < 4 * pool.getThreadCount(); swap(tasks, next))
+	{
+		bSplit = false;
+		next.clear();
+		for (TASK &task : tasks)
+		{
+			unsigned nMid = task.nEnd - task.nBegin >= BVH_PARALLEL_SIZE ? split(refs, task.nBegin, task.nEnd, m_nodes[task.nNode], task.nDepth) : task.nBegin;
+			if (nMid == task.nBegin)
+			{
+				next.push_back(task);
+				continue;
+			}
+			unsigned nLeft = m_nodes.size();
+			m_nodes[task.nNode].nFirst = nLeft;
+			m_nodes[task.nNode].nCount = 0;
+			m_nodes.resize(nLeft + 2);
+			bounds(refs, task.nBegin, nMid, m_nodes[nLeft].bbMin, m_nodes[nLeft].bbMax);
+			bounds(refs, nMid, task.nEnd, m_nodes[nLeft + 1].bbMin, m_nodes[nLeft + 1].bbMax);
+			TASK left = { nLeft, task.nBegin, nMid, task.nDepth + 1 }, right = { nLeft + 1, nMid, task.nEnd, task.nDepth + 1 };
+			next.push_back(left);
+			next.push_back(right);
+			bSplit = true;
+		}
+	}
+
+	// the subtrees: each in its own node array, with its root at 0
+	vector<vector<NODE> > subtrees(tasks.size());
+	pool.parallelFor(0, tasks.size(), [&](unsigned i0, unsigned i1)
+	{
+		for (unsigned i = i0; i < i1; i++)
+		{
+			subtrees[i].push_back(m_nodes[tasks[i].nNode]);
+			buildSubtree(refs, subtrees[i], 0, tasks[i].nBegin, tasks[i].nEnd, tasks[i].nDepth);
+		}
+	}, 1);
+	for (unsigned i = 0; i < tasks.size(); i++)
+	{
+		vector<NODE> &nodes = subtrees[i];
+		unsigned nBase = m_nodes.size() - 1;	// where local node 1 goes
+		for (NODE &node : nodes)
+			if (node.nCount == 0)
+				node.nFirst += nBase;
+		m_nodes[tasks[i].nNode] = nodes[0];
+		m_nodes.insert(m_nodes.end(), nodes.begin() + 1, nodes.end());
+	}
+
+	// the leaves: triangle ranges to blocks of four; the unused slots of the blocks are degenerate and never hit
+	for (NODE &node : m_nodes)
+	{
+		if (node.nCount == 0) continue;
+		unsigned nBegin = node.nFirst, nEnd = node.nFirst + node.nCount;
+		node.nFirst = m_blocks.size();
+		node.nCount = blocks(nEnd - nBegin);
+		for (unsigned i = nBegin; i < nEnd; i += 4)
+		{
+			TRI4 block;
+			memset(&block, 0, sizeof(block));
+			for (unsigned j = 0; j < 4; j++)
+			{
+				block.ids[j] = (unsigned)-1;
+				if (i + j >= nEnd) continue;
+				unsigned nTriangle = refs[i + j].nTriangle;
+				const glm::vec3 *p = &m_vertices[nTriangle * 3];
+				for (int k = 0; k < 3; k++)
+				{
+					block.v0[k][j] = p[0][k];
+					block.e1[k][j] = p[1][k] - p[0][k];
+					block.e2[k][j] = p[2][k] - p[0][k];
+				}
+				block.ids[j] = nTriangle;
+			}
+			m_blocks.push_back(block);
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Queries
+
+// a ray prepared for the traversal
+struct TRAVRAY
+{
+	glm::vec3 origin, dir, invDir;
+	float tMax;
+
+	TRAVRAY(const C3dglBVH::RAY &ray) : origin(ray.origin), dir(ray.dir), tMax(ray.tMax)
+	{
+		// no division by zero: a tiny component gives a huge, but finite, inverse
+		for (int i = 0; i < 3; i++)
+			invDir[i] = 1.0f / (fabs(dir[i]) > 1e-20f ? dir[i] : (dir[i] < 0 ? -1e-20f : 1e-20f));
+	}
+};
+
+// slab test: the entry distance, or FLT_MAX if the box is missed
+static inline float testBox(const TRAVRAY &ray, const glm::vec3 &bbMin, const glm::vec3 &bbMax)
+{
+	glm::vec3 t0 = (bbMin - ray.origin) * ray.invDir, t1 = (bbMax - ray.origin) * ray.invDir;
+	glm::vec3 tNear = glm::min(t0, t1), tFar = glm::max(t0, t1);
+	float fNear = max(max(tNear.x, tNear.y), max(tNear.z, 0.0f));
+	float fFar = min(min(tFar.x, tFar.y), min(tFar.z, ray.tMax));
+	return fNear <= fFar ? fNear : FLT_MAX;
+}
+
+// Moller-Trumbore test of a ray against four triangles at once: the lane of the closest hit nearer than tMax, or -1
+template <class TRI4>
+static inline int testTriangles(const TRAVRAY &ray, const TRI4 &tri, float tMax, float &t, float &u, float &v)
+{
+#ifdef _3DGL_SSE2
+	__m128 e1x = _mm_loadu_ps(tri.e1[0]), e1y = _mm_loadu_ps(tri.e1[1]), e1z = _mm_loadu_ps(tri.e1[2]);
+	__m128 e2x = _mm_loadu_ps(tri.e2[0]), e2y = _mm_loadu_ps(tri.e2[1]), e2z = _mm_loadu_ps(tri.e2[2]);
+	__m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+
+	// p = dir x e2; det = e1 . p
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	// s = origin - v0; q = s x e1
+	__m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(tri.v0[0]));
+	__m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(tri.v0[1]));
+	__m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(tri.v0[2]));
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+	__m128 U = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+	__m128 V = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	__m128 T = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+	// the comparisons are false for NaNs, which the degenerate triangles give
+	__m128 zero = _mm_setzero_ps();
+	__m128 mask = _mm_and_ps(_mm_cmpge_ps(U, zero), _mm_cmpge_ps(V, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(U, V), _mm_set1_ps(1.0f)));
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(T, zero), _mm_cmplt_ps(T, _mm_set1_ps(tMax))));
+	int nMask = _mm_movemask_ps(mask);
+	if (nMask == 0)
+		return -1;
+
+	float ts[4], us[4], vs[4];
+	_mm_storeu_ps(ts, T);
+	_mm_storeu_ps(us, U);
+	_mm_storeu_ps(vs, V);
+#else
+	float ts[4], us[4], vs[4];
+	int nMask = 0;
+	for (int j = 0; j < 4; j++)
+	{
+		glm::vec3 e1(tri.e1[0][j], tri.e1[1][j], tri.e1[2][j]), e2(tri.e2[0][j], tri.e2[1][j], tri.e2[2][j]);
+		glm::vec3 p = glm::cross(ray.dir, e2);
+		float det = glm::dot(e1, p);
+		if (det == 0) continue;
+		float invDet = 1.0f / det;
+		glm::vec3 s = ray.origin - glm::vec3(tri.v0[0][j], tri.v0[1][j], tri.v0[2][j]);
+		glm::vec3 q = glm::cross(s, e1);
+		us[j] = glm::dot(s, p) * invDet;
+		vs[j] = glm::dot(ray.dir, q) * invDet;
+		ts[j] = glm::dot(e2, q) * invDet;
+		if (us[j] >= 0 && vs[j] >= 0 && us[j] + vs[j] <= 1 && ts[j] >= 0 && ts[j] < tMax)
+			nMask |= 1 << j;
+	}
+	if (nMask == 0)
+		return -1;
+#endif
+	int iBest = -1;
+	for (int j = 0; j < 4; j++)
+		if ((nMask & (1 << j)) && (iBest < 0 || ts[j] < ts[iBest]))
+			iBest = j;
+	t = ts[iBest];
+	u = us[iBest];
+	v = vs[iBest];
+	return iBest;
+}
+
+// the ray tMax shrinks as the hits are found; bAny stops at the first one
+template <class NODE, class TRI4>
+static bool traverse(const NODE *pNodes, const TRI4 *pBlocks, TRAVRAY ray, C3dglBVH::HIT &hit, bool bAny)
+{
+	hit.t = ray.tMax;
+	hit.u = hit.v = 0;
+	hit.nTriangle = (unsigned)-1;
+	if (testBox(ray, pNodes[0].bbMin, pNodes[0].bbMax) == FLT_MAX)
+		return false;
+
+	unsigned stack[BVH_STACK_SIZE];
+	unsigned nStack = 0;
+	unsigned nNode = 0;
+	for (;;)
+	{
+		const NODE &node = pNodes[nNode];
+		if (node.nCount)
+		{
+			for (unsigned b = node.nFirst; b < node.nFirst + node.nCount; b++)
+			{
+				float t, u, v;
+				int j = testTriangles(ray, pBlocks[b], ray.tMax, t, u, v);
+				if (j < 0) continue;
+				ray.tMax = hit.t = t;
+				hit.u = u;
+				hit.v = v;
+				hit.nTriangle = pBlocks[b].ids[j];
+				if (bAny) return true;
+			}
+		}
+		else
+		{
+			// the children are tested here, so that the nearer one is visited first
+			float t0 = testBox(ray, pNodes[node.nFirst].bbMin, pNodes[node.nFirst].bbMax);
+			float t1 = testBox(ray, pNodes[node.nFirst + 1].bbMin, pNodes[node.nFirst + 1].bbMax);
+			if (t0 != FLT_MAX && t1 != FLT_MAX)
+			{
+				assert(nStack < BVH_STACK_SIZE);
+				stack[nStack++] = t0 <= t1 ? node.nFirst + 1 : node.nFirst;
+				nNode = t0 <= t1 ? node.nFirst : node.nFirst + 1;
+				continue;
+			}
+			if (t0 != FLT_MAX) { nNode = node.nFirst; continue; }
+			if (t1 != FLT_MAX) { nNode = node.nFirst + 1; continue; }
+		}
+
+		// the next node from the stack - unless it is already further than the closest hit
+		do
+		{
+			if (nStack == 0)
+				return hit.nTriangle != (unsigned)-1;
+			nNode = stack[--nStack];
+		} while (testBox(ray, pNodes[nNode].bbMin, pNodes[nNode].bbMax) == FLT_MAX);
+	}
+}
+
+bool C3dglBVH::intersect(const RAY &ray, HIT &hit) const
+{
+	if (m_nodes.empty())
+	{
+		hit.t = ray.tMax;
+		hit.u = hit.v = 0;
+		hit.nTriangle = (unsigned)-1;
+		return false;
+	}
+	return traverse(m_nodes.data(), m_blocks.data(), TRAVRAY(ray), hit, false);
+}
+
+bool C3dglBVH::occluded(const RAY &ray) const
+{
+	HIT hit;
+	return !m_nodes.empty() && traverse(m_nodes.data(), m_blocks.data(), TRAVRAY(ray), hit, true);
+}
+
+// Four rays traversed together: a node is visited if any of the active rays hits it, and the leaves are tested
+// for each of these rays. The box tests, which dominate, are done for all four rays at once.
+template <class NODE, class TRI4>
+static unsigned traversePacket(const NODE *pNodes, const TRI4 *pBlocks, const C3dglBVH::RAY *pRays, unsigned nRays, C3dglBVH::HIT *pHits, bool *pOccluded)
+{
+	bool bAny = pOccluded != NULL;
+	float ox[4], oy[4], oz[4], ix[4], iy[4], iz[4], tMax[4];
+	TRAVRAY rays[4] = { pRays[0], pRays[min(1u, nRays - 1)], pRays[min(2u, nRays - 1)], pRays[min(3u, nRays - 1)] };
+	C3dglBVH::HIT hits[4];
+	unsigned nActive = (1 << nRays) - 1;		// the rays not yet done
+	for (unsigned j = 0; j < 4; j++)
+	{
+		ox[j] = rays[j].origin.x; oy[j] = rays[j].origin.y; oz[j] = rays[j].origin.z;
+		ix[j] = rays[j].invDir.x; iy[j] = rays[j].invDir.y; iz[j] = rays[j].invDir.z;
+		tMax[j] = rays[j].tMax;
+		hits[j].t = rays[j].tMax;
+		hits[j].u = hits[j].v = 0;
+		hits[j].nTriangle = (unsigned)-1;
+	}
+
+	// the mask of the active rays that hit the box
+	auto testBox4 = [&](const NODE &node) -> unsigned
+	{
+#ifdef _3DGL_SSE2
+		__m128 t0, t1, tNear = _mm_setzero_ps(), tFar = _mm_loadu_ps(tMax);
+		t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bbMin.x), _mm_loadu_ps(ox)), _mm_loadu_ps(ix));
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bbMax.x), _mm_loadu_ps(ox)), _mm_loadu_ps(ix));
+		tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+		tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+		t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bbMin.y), _mm_loadu_ps(oy)), _mm_loadu_ps(iy));
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bbMax.y), _mm_loadu_ps(oy)), _mm_loadu_ps(iy));
+		tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+		tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+		t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bbMin.z), _mm_loadu_ps(oz)), _mm_loadu_ps(iz));
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bbMax.z), _mm_loadu_ps(oz)), _mm_loadu_ps(iz));
+		tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+		tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+		return (unsigned)_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) & nActive;
+#else
+		unsigned nMask = 0;
+		for (unsigned j = 0; j < 4; j++)
+			if ((nActive & (1 << j)) && testBox(rays[j], node.bbMin, node.bbMax) != FLT_MAX)
+				nMask |= 1 << j;
+		return nMask;
+#endif
+	};
+
+	unsigned stack[BVH_STACK_SIZE];
+	unsigned nStack = 0;
+	if (testBox4(pNodes[0]))
+		stack[nStack++] = 0;
+	while (nStack && nActive)
+	{
+		const NODE &node = pNodes[stack[--nStack]];
+		unsigned nMask = testBox4(node);
+		if (nMask == 0) continue;
+		if (node.nCount == 0)
+		{
+			// the nearer child (for the first ray) on top
+			bool bSwap = testBox(rays[0], pNodes[node.nFirst].bbMin, pNodes[node.nFirst].bbMax) > testBox(rays[0], pNodes[node.nFirst + 1].bbMin, pNodes[node.nFirst + 1].bbMax);
+			assert(nStack + 2 <= BVH_STACK_SIZE);
+			stack[nStack++] = bSwap ? node.nFirst : node.nFirst + 1;
+			stack[nStack++] = bSwap ? node.nFirst + 1 : node.nFirst;
+			continue;
+		}
+		for (unsigned j = 0; j < 4; j++)
+		{
+			if (!(nMask & (1 << j))) continue;
+			for (unsigned b = node.nFirst; b < node.nFirst + node.nCount; b++)
+			{
+				float t, u, v;
+				int k = testTriangles(rays[j], pBlocks[b], tMax[j], t, u, v);
+				if (k < 0) continue;
+				tMax[j] = hits[j].t = t;
+				hits[j].u = u;
+				hits[j].v = v;
+				hits[j].nTriangle = pBlocks[b].ids[k];
+				if (bAny)
+				{
+					nActive &= ~(1 << j);
+					break;
+				}
+			}
+		}
+	}
+
+	unsigned nHits = 0;
+	for (unsigned j = 0; j < nRays; j++)
+	{
+		bool bHit = hits[j].nTriangle != (unsigned)-1;
+		if (pHits) pHits[j] = hits[j];
+		if (pOccluded) pOccluded[j] = bHit;
+		if (bHit) nHits++;
+	}
+	return nHits;
+}
+
+unsigned C3dglBVH::intersect(const RAY *pRays, HIT *pHits, unsigned nRays) const
+{
+	if (m_nodes.empty())
+	{
+		for (unsigned i = 0; i < nRays; i++)
+		{
+			pHits[i].t = pRays[i].tMax;
+			pHits[i].u = pHits[i].v = 0;
+			pHits[i].nTriangle = (unsigned)-1;
+		}
+		return 0;
+	}
+	unsigned nHits = 0;
+	for (unsigned i = 0; i < nRays; i += 4)
+		nHits += traversePacket(m_nodes.data(), m_blocks.data(), pRays + i, min(4u, nRays - i), pHits + i, NULL);
+	return nHits;
+}
+
+unsigned C3dglBVH::occluded(const RAY *pRays, bool *pOccluded, unsigned nRays) const
+{
+	if (m_nodes.empty())
+	{
+		fill(pOccluded, pOccluded + nRays, false);
+		return 0;
+	}
+	unsigned nHits = 0;
+	for (unsigned i = 0; i < nRays; i += 4)
+		nHits += traversePacket(m_nodes.data(), m_blocks.data(), pRays + i, min(4u, nRays - i), NULL, pOccluded + i);
+	return nHits;
+}
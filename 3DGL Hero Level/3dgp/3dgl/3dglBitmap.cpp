@@ -11,6 +11,7 @@ using namespace std;
 using namespace _3dgl;
 
 C3dglBitmap *C3dglBitmap::c_pBound = NULL;
+recursive_mutex C3dglBitmap::c_mutex;
 
 C3dglBitmap::C3dglBitmap(std::string fname, unsigned format)
 {
@@ -20,6 +21,8 @@ C3dglBitmap::C3dglBitmap(std::string fname, unsigned format)
 
 bool C3dglBitmap::load(std::string fname, unsigned format)
 {
+	lock_guard<recursive_mutex> lock(c_mutex);
+
 	// initialise IL
 	static bool bIlInitialised = false;
 	if (!bIlInitialised)
@@ -52,12 +55,17 @@ bool C3dglBitmap::load(std::string fname, unsigned format)
 
 void C3dglBitmap::destroy()
 {
+	lock_guard<recursive_mutex> lock(c_mutex);
 	if (m_idImage)
 		ilDeleteImages(1, &m_idImage);
+	m_idImage = 0;
+	if (c_pBound == this)
+		c_pBound = NULL;	// another bitmap may later be created at the same address
 }
 
 void C3dglBitmap::texture(GLuint &textureId)
 {
+	lock_guard<recursive_mutex> lock(c_mutex);
 	if (c_pBound != this)
 	{
 		ilBindImage(m_idImage);
@@ -70,6 +78,7 @@ void C3dglBitmap::texture(GLuint &textureId)
 
 long C3dglBitmap::getWidth()
 {
+	lock_guard<recursive_mutex> lock(c_mutex);
 	if (c_pBound != this)
 	{
 		ilBindImage(m_idImage);
@@ -80,6 +89,7 @@ long C3dglBitmap::getWidth()
 
 long C3dglBitmap::getHeight()
 {
+	lock_guard<recursive_mutex> lock(c_mutex);
 	if (c_pBound != this)
 	{
 		ilBindImage(m_idImage);
@@ -90,6 +100,7 @@ long C3dglBitmap::getHeight()
 
 void *C3dglBitmap::getBits()
 {
+	lock_guard<recursive_mutex> lock(c_mutex);
 	if (c_pBound != this)
 	{
 		ilBindImage(m_idImage);
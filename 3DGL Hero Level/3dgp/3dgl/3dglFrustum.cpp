@@ -0,0 +1,48 @@
+#include "../GL/3dglFrustum.h"
+
+#include "../glm/geometric.hpp"
+
+using namespace _3dgl;
+
+void C3dglFrustum::set(glm::mat4 matrixProjection, glm::mat4 matrixModelView)
+{
+	// Gribb & Hartmann method: planes are sums/differences of the rows of the clip matrix
+	glm::mat4 m = matrixProjection * matrixModelView;
+	glm::vec4 row[4];
+	for (int i = 0; i < 4; i++)
+		row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+
+	m_planes[0] = row[3] + row[0];	// left
+	m_planes[1] = row[3] - row[0];	// right
+	m_planes[2] = row[3] + row[1];	// bottom
+	m_planes[3] = row[3] - row[1];	// top
+	m_planes[4] = row[3] + row[2];	// near
+	m_planes[5] = row[3] - row[2];	// far
+
+	// normalise, so that testSphere may use true distances
+	for (glm::vec4 &plane : m_planes)
+	{
+		float len = glm::length(glm::vec3(plane));
+		if (len > 0) plane /= len;
+	}
+}
+
+bool C3dglFrustum::testAABB(glm::vec3 vecMin, glm::vec3 vecMax) const
+{
+	for (const glm::vec4 &plane : m_planes)
+	{
+		// the box corner furthest along the plane normal
+		glm::vec3 p(plane.x >= 0 ? vecMax.x : vecMin.x, plane.y >= 0 ? vecMax.y : vecMin.y, plane.z >= 0 ? vecMax.z : vecMin.z);
+		if (plane.x * p.x + plane.y * p.y + plane.z * p.z + plane.w < 0)
+			return false;
+	}
+	return true;
+}
+
+bool C3dglFrustum::testSphere(glm::vec3 centre, float radius) const
+{
+	for (const glm::vec4 &plane : m_planes)
+		if (plane.x * centre.x + plane.y * centre.y + plane.z * centre.z + plane.w < -radius)
+			return false;
+	return true;
+}
@@ -0,0 +1,157 @@
+#include <chrono>
+#include <cfloat>
+#include <algorithm>
+
+#include "../GL/3dglLoader.h"
+
+using namespace std;
+using namespace _3dgl;
+
+C3dglLoader::C3dglLoader(unsigned nThreads)
+{
+	m_nThreads = nThreads ? nThreads : max(1u, thread::hardware_concurrency());
+	m_bStarted = false;
+	m_nNextJob = m_nNextReady = m_nNextStep = 0;
+	m_nPrepared = m_nUploaded = m_nFailed = 0;
+}
+
+C3dglLoader::~C3dglLoader()
+{
+	// the preparation steps cannot be cancelled - the remaining uploads are dropped
+	for (thread &t : m_threads)
+		t.join();
+}
+
+void C3dglLoader::add(STEP prepare, STEP upload)
+{
+	if (m_bStarted)
+	{
+		logWarning("jobs cannot be added while loading");
+		return;
+	}
+	JOB job = { prepare, upload };
+	m_jobs.push_back(job);
+}
+
+void C3dglLoader::start()
+{
+	if (m_bStarted) return;
+	m_bStarted = true;
+	m_ready.clear();
+	m_steps.clear();
+	m_nNextJob = m_nNextReady = m_nNextStep = 0;
+	m_nPrepared = m_nUploaded = m_nFailed = 0;
+
+	// the loader has threads of its own, so that the calling thread is free to pump the uploads, and the
+	// thread pool is not held for the whole loading - it serves the parallelFor calls of the preparation steps
+	// and of the calling thread alike
+	unsigned nThreads = min(m_nThreads, (unsigned)m_jobs.size());
+	for (unsigned i = 0; i < nThreads; i++)
+		m_threads.push_back(thread(&C3dglLoader::worker, this));
+}
+
+void C3dglLoader::worker()
+{
+	// one job at a time: the jobs are few and their costs vary widely
+	for (;;)
+	{
+		unsigned i;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			if (m_nNextJob == m_jobs.size()) return;
+			i = m_nNextJob++;
+		}
+
+		bool bPrepared = m_jobs[i].prepare();
+		lock_guard<mutex> lock(m_mutex);
+		if (bPrepared)
+			m_ready.push_back(i);
+		else
+			m_nFailed++;
+		m_nPrepared++;
+		m_cvReady.notify_all();
+	}
+}
+
+void C3dglLoader::finish()
+{
+	for (thread &t : m_threads)
+		t.join();
+	m_threads.clear();
+	m_jobs.clear();
+	m_ready.clear();
+	m_steps.clear();
+	m_nNextReady = m_nNextStep = 0;
+	m_bStarted = false;
+	if (m_nFailed)
+		logWarning(to_string(m_nFailed) + " asset(s) failed to load");
+}
+
+bool C3dglLoader::pump(float fBudgetMs)
+{
+	if (!m_bStarted)
+	{
+		if (m_jobs.empty()) return true;
+		start();
+	}
+
+	auto timeStart = chrono::steady_clock::now();
+	for (;;)
+	{
+		// the remaining steps of the current job come first
+		STEP step;
+		if (m_nNextStep < m_steps.size())
+			step = move(m_steps[m_nNextStep++]);
+		else
+		{
+			m_steps.clear();
+			m_nNextStep = 0;
+			lock_guard<mutex> lock(m_mutex);
+			if (m_nNextReady == m_ready.size()) break;
+			step = m_jobs[m_ready[m_nNextReady++]].upload;
+		}
+
+		bool bUploaded = step();
+		if (!bUploaded)
+		{
+			m_steps.clear();
+			m_nNextStep = 0;
+		}
+		if (m_nNextStep == m_steps.size())
+		{
+			lock_guard<mutex> lock(m_mutex);
+			if (bUploaded)
+				m_nUploaded++;
+			else
+				m_nFailed++;
+		}
+
+		if (chrono::duration<float, milli>(chrono::steady_clock::now() - timeStart).count() >= fBudgetMs)
+			break;
+	}
+
+	bool bDone;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		bDone = m_nPrepared == m_jobs.size() && m_nNextReady == m_ready.size() && m_nNextStep == m_steps.size();
+	}
+	if (bDone)
+		finish();
+	return bDone;
+}
+
+void C3dglLoader::next(STEP upload)
+{
+	m_steps.push_back(upload);
+}
+
+bool C3dglLoader::wait()
+{
+	while (!pump(FLT_MAX))
+	{
+		// sleep until another job is prepared
+		unique_lock<mutex> lock(m_mutex);
+		m_cvReady.wait(lock, [this] { return m_nNextReady < m_ready.size() || m_nPrepared == m_jobs.size(); });
+	}
+	return m_nFailed == 0;
+}
@@ -0,0 +1,96 @@
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "../GL/3dglMappedFile.h"
+
+using namespace _3dgl;
+
+C3dglMappedFile::C3dglMappedFile()
+{
+	m_pData = NULL;
+	m_nSize = 0;
+#ifdef _WIN32
+	m_hFile = m_hMapping = NULL;
+#else
+	m_fd = -1;
+#endif
+}
+
+bool C3dglMappedFile::open(const std::string filename)
+{
+	close();
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return false;
+	m_hFile = hFile;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+
+	m_hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_hMapping)
+		m_pData = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m_pData)
+	{
+		close();
+		return false;
+	}
+	m_nSize = (size_t)size.QuadPart;
+#else
+	m_fd = ::open(filename.c_str(), O_RDONLY);
+	if (m_fd < 0) return false;
+
+	struct stat st;
+	if (fstat(m_fd, &st) != 0 || st.st_size == 0)
+	{
+		close();
+		return false;
+	}
+
+	void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (p == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+	m_pData = p;
+	m_nSize = (size_t)st.st_size;
+#endif
+	return true;
+}
+
+void C3dglMappedFile::close()
+{
+#ifdef _WIN32
+	if (m_pData) UnmapViewOfFile(m_pData);
+	if (m_hMapping) CloseHandle(m_hMapping);
+	if (m_hFile) CloseHandle(m_hFile);
+	m_hFile = m_hMapping = NULL;
+#else
+	if (m_pData) munmap((void*)m_pData, m_nSize);
+	if (m_fd >= 0) ::close(m_fd);
+	m_fd = -1;
+#endif
+	m_pData = NULL;
+	m_nSize = 0;
+}
+
+unsigned long long C3dglMappedFile::getHash()
+{
+	if (!m_pData) return 0;
+	const unsigned char *p = (const unsigned char*)m_pData;
+	unsigned long long nHash = 14695981039346656037ull;
+	for (size_t i = 0; i < m_nSize; i++)
+		nHash = (nHash ^ p[i]) * 1099511628211ull;
+	return nHash;
+}
@@ -4,6 +4,12 @@
 #include "../GL/3dglModel.h"
 #include "../GL/3dglShader.h"
 #include "../GL/3dglBitmap.h"
+#include "../GL/3dglMappedFile.h"
+#include "../GL/3dglTextureCache.h"
+#include "../GL/3dglLoader.h"
+#include "../GL/3dglThreadPool.h"
+#include "../GL/3dglFrustum.h"
+#include "../GL/3dglBVH.h"
 
 // assimp include file
 #include "../GL/assimp/cimport.h"
@@ -13,49 +19,380 @@
 #include "../glm/vec4.hpp"
 #include "../glm/mat4x4.hpp"
 #include "../glm/trigonometric.hpp"
+#include "../glm/matrix.hpp"
 #include "../glm/gtc/type_ptr.hpp"
+#include "../glm/gtc/matrix_transform.hpp"
+#include "../glm/gtc/packing.hpp"
+#include "../glm/packing.hpp"
 
 #include <assert.h>
+#include <cstdio>
+#include <cfloat>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <set>
+
+// SSE2 is available on all x64 and (by default, since VS2012) on x86 targets
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define _3DGL_SSE2
+#endif
 
 using namespace std;
 using namespace _3dgl;
 
-unsigned C3dglModel::MATERIAL::c_idTexBlank = 0xFFFFFFFF;
-
 bool C3dglModel::load(const char* pFile, unsigned int flags)
 {
+	STAGING staging;
+	if (!prepare(pFile, flags, staging))
+		return false;
+	upload(staging);
+	return true;
+}
+
+void C3dglModel::loadAsync(C3dglLoader &loader, const char* pFile, const char* pDefTexPath, unsigned int flags)
+{
+	// prepared by a model of its own, with the same settings - so that this one may be rendered and queried
+	// on the GL thread in the meantime
+	shared_ptr<STAGING> pStaging = make_shared<STAGING>();
+	C3dglModel *pModel = new C3dglModel;
+	pStaging->pModel.reset(pModel);
+	pModel->m_bCache = m_bCache;
+	pModel->m_nLODLevels = m_nLODLevels;
+	pModel->m_fLODError = m_fLODError;
+	pModel->m_bMeshlets = m_bMeshlets;
+	pModel->m_bBVH = m_bBVH;
+	pModel->m_maskEnabledBufData = m_maskEnabledBufData;
+	pModel->m_bCompactVertices = m_bCompactVertices;
+	pModel->m_bSharedBuffers = m_bSharedBuffers;
+
+	string file = pFile;
+	bool bMaterials = pDefTexPath != NULL;
+	string defTexPath = bMaterials ? pDefTexPath : "";
+	loader.add([=]
+	{
+		if (!pStaging->pModel->prepare(file.c_str(), flags, *pStaging))
+			return false;
+		if (bMaterials)
+			pStaging->pModel->prepareMaterials(defTexPath.c_str(), *pStaging);
+		return true;
+	},
+	[=, &loader]
+	{
+		// uploaded by the model that prepared it, one mesh and one material per step, so that the loader keeps to its budget
+		C3dglModel *pModel = pStaging->pModel.get();
+		vector<MESHDATA> &meshes = pStaging->meshes;
+		if (pModel->m_bSharedBuffers)
+			loader.next([=] { pModel->createShared(pStaging->meshes); return true; });
+		else
+			for (unsigned i = 0; i < meshes.size(); i++)
+				if (meshes[i].num[BUF_INDEX])
+					loader.next([=] { pModel->m_meshes[i].create(pStaging->meshes[i], pModel->m_maskEnabledBufData); return true; });
+		if (bMaterials)
+		{
+			pModel->m_materials.resize(pModel->m_materialData.size(), MATERIAL(pModel));
+			for (unsigned i = 0; i < pModel->m_materials.size(); i++)
+				loader.next([=] { pModel->m_materials[i].create(pModel->m_materialData[i], defTexPath.c_str(), i < pStaging->images.size() ? &pStaging->images[i] : NULL); return true; });
+		}
+		loader.next([=]
+		{
+			// the GL objects of the previous model are released here, on the GL thread
+			destroy();
+			takeModel(*pStaging->pModel);
+			flattenNodes();
+			if (!m_bKeepScene)
+				releaseScene();
+			if (bMaterials)
+				logMemoryUsage();
+			return true;
+		});
+		return true;
+	});
+}
+
+void C3dglModel::takeModel(C3dglModel &model)
+{
+	// everything prepare leaves in the model, and the meshes and materials uploaded
+	m_pScene = model.m_pScene;
+	m_pRootNode = model.m_pRootNode;
+	model.m_pScene = NULL;
+	model.m_pRootNode = NULL;
+	m_meshes.swap(model.m_meshes);
+	m_materials.swap(model.m_materials);
+	m_shared = model.m_shared;
+	model.m_shared = MESH(&model);
+	m_shared.setOwner(this);
+	for (MESH &mesh : m_meshes)
+		mesh.setOwner(this);
+	for (MATERIAL &mat : m_materials)
+		mat.setOwner(this);
+	m_materialData.swap(model.m_materialData);
+	m_animations.swap(model.m_animations);
+	m_mapBones.swap(model.m_mapBones);
+	m_offsetBones.swap(model.m_offsetBones);
+	m_GlobalInverseTransform = model.m_GlobalInverseTransform;
+	m_nFlags = model.m_nFlags;
+	m_name = model.m_name;
+	std::swap(m_bvh, model.m_bvh);
+	m_bvhParts.swap(model.m_bvhParts);
+}
+
+bool C3dglModel::prepare(const char* pFile, unsigned flags, STAGING &staging)
+{
+	// the name of the model: the file name without the path and extension
+	string name = pFile;
+	size_t i = name.find_last_of("/\\");
+	if (i != string::npos) name = name.substr(i + 1);
+	i = name.find_last_of(".");
+	if (i != string::npos) name = name.substr(0, i);
+
+	// cooked files are recognised by their header
+	if (loadCooked(pFile, 0, 0, staging))
+	{
+		m_name = name;
+		return true;
+	}
+
+	// with the cache, the cooked copy is used for as long as the hash of the model file matches
+	string cacheFile = string(pFile) + ".3dgm";
+	unsigned long long nHash = 0;
+	if (m_bCache)
+	{
+		C3dglMappedFile source;
+		if (source.open(pFile))
+			nHash = source.getHash();
+		if (nHash && loadCooked(cacheFile.c_str(), nHash, flags, staging))
+		{
+			m_name = name;
+			return true;
+		}
+	}
+
 	logInfo(string("Importing file: ") + pFile);
 	const aiScene *pScene = aiImportFile(pFile, flags);
 	if (pScene == NULL) return false;
-	m_name = pFile;
-	size_t i = m_name.find_last_of("/\\");
-	if (i != string::npos) m_name = m_name.substr(i + 1);
-	i = m_name.find_last_of(".");
-	if (i != string::npos) m_name = m_name.substr(0, i);
-	create(pScene);
+	m_name = name;
+	m_nFlags = flags;
+	prepareScene(pScene, staging);
+
+	if (nHash)
+		saveCooked(cacheFile.c_str(), nHash, flags, staging.meshes);
 	return true;
 }
 
 void C3dglModel::MESH::create(const aiMesh *pMesh, unsigned maskEnabledBufData)
+{
+	MESHDATA data;
+	if (prepare(pMesh, data))
+		create(data, maskEnabledBufData);
+}
+
+bool C3dglModel::MESH::prepare(const aiMesh *pMesh, MESHDATA &data)
 {
 	if (pMesh->mFaces[0].mNumIndices != 3 && pMesh->mNumFaces && pMesh->mNumVertices && pMesh->mVertices && pMesh->mNormals)
-		return;
+		return false;
 
 	// find the BB (bounding box)
+	aiVector3D *bb = data.bb;
 	bb[0] = bb[1] = pMesh->mVertices[0];
 	for (aiVector3D vec : vector<aiVector3D>(pMesh->mVertices, pMesh->mVertices + pMesh->mNumVertices))
 	{
 		if (vec.x < bb[0].x) bb[0].x = vec.x;
 		if (vec.y < bb[0].y) bb[0].y = vec.y;
 		if (vec.z < bb[0].z) bb[0].z = vec.z;
-		if (vec.x > bb[0].x) bb[1].x = vec.x;
-		if (vec.y > bb[0].y) bb[1].y = vec.y;
-		if (vec.z > bb[0].z) bb[1].z = vec.z;
+		if (vec.x > bb[1].x) bb[1].x = vec.x;
+		if (vec.y > bb[1].y) bb[1].y = vec.y;
+		if (vec.z > bb[1].z) bb[1].z = vec.z;
+	}
+
+	auto setStream = [&](ATTRIB_STD bufId, unsigned size, unsigned num, const void *pData)
+	{
+		data.pData[bufId] = pData;
+		data.size[bufId] = size;
+		data.num[bufId] = num;
+	};
+
+	// vertices, normals, tangents, bitangents and colours are used as they are
+	if (pMesh->mVertices)
+		setStream(BUF_VERTEX, sizeof(pMesh->mVertices[0]), pMesh->mNumVertices, &pMesh->mVertices[0]);
+	if (pMesh->mNormals)
+		setStream(BUF_NORMAL, sizeof(pMesh->mNormals[0]), pMesh->mNumVertices, &pMesh->mNormals[0]);
+	if (pMesh->mTangents)
+		setStream(BUF_TANGENT, sizeof(pMesh->mTangents[0]), pMesh->mNumVertices, &pMesh->mTangents[0]);
+	if (pMesh->mBitangents)
+		setStream(BUF_BITANGENT, sizeof(pMesh->mBitangents[0]), pMesh->mNumVertices, &pMesh->mBitangents[0]);
+	if (pMesh->mColors[0])
+		setStream(BUF_COLOR, sizeof(pMesh->mColors[0][0]), pMesh->mNumVertices, &pMesh->mColors[0][0]);
+
+	//Texture Coordinates
+	data.nUVComponents = pMesh->mNumUVComponents[0];	// should be 2
+	if (pMesh->mTextureCoords[0] && (data.nUVComponents == 2 || data.nUVComponents == 3))
+	{
+		// first, convert indices to occupy contageous memory space
+		for (aiVector3D vec : vector<aiVector3D>(pMesh->mTextureCoords[0], pMesh->mTextureCoords[0] + pMesh->mNumVertices))
+		{
+			data.texCoords.push_back(vec.x);
+			data.texCoords.push_back(vec.y);
+			if (data.nUVComponents == 3)
+				data.texCoords.push_back(vec.z);
+		}
+		setStream(BUF_TEXCOORD, sizeof(data.texCoords[0]), data.texCoords.size(), &data.texCoords[0]);
+	}
+
+	// convert the bones
+	if (pMesh->mNumBones)
+	{
+		vector<VERTEXBONES> &bones = data.bones;
+		bones.resize(pMesh->mNumVertices);
+		memset(&bones[0], 0, sizeof(bones[0]) * bones.size());
+
+		// load bone info - based on http://ogldev.atspace.co.uk/
+		m_pOwner->logInfo("bones found: " + to_string(pMesh->mNumBones));
+
+		// for each bone:
+		for (aiBone *pBone : vector<aiBone*>(pMesh->mBones, pMesh->mBones + pMesh->mNumBones))
+		{
+			// determine bone index from its name
+			unsigned iBone = m_pOwner->getBoneId(pBone->mName.data);
+
+			if (iBone >= m_pOwner->m_offsetBones.size())
+				m_pOwner->m_offsetBones.push_back(pBone->mOffsetMatrix);
+				
+			// collect bone weights
+			for (aiVertexWeight &weight : vector<aiVertexWeight>(pBone->mWeights, pBone->mWeights + pBone->mNumWeights))
+			{
+				// find a free location for the id and weight within bones[iVertex]
+				unsigned i = 0;
+				while (i < MAX_BONES_PER_VEREX && bones[weight.mVertexId].weights[i] != 0.0)
+					i++;
+				if (i < MAX_BONES_PER_VEREX)
+				{
+					bones[weight.mVertexId].ids[i] = iBone;
+					bones[weight.mVertexId].weights[i] = weight.mWeight;
+				}
+				else
+					m_pOwner->logWarning("Maximum number of bones per vertex exceeded");
+			}
+		}
+
+		// verify (and maybe, in future, normalize)
+		bool bProblem = false;
+		for (VERTEXBONES &bone : bones)
+		{
+			float total = 0.0f;
+			for (float weight : bone.weights)
+				total += weight;
+			bProblem = bProblem || total < 0.999f || total > 1.001f;
+			//cout << total << endl;
+		}
+		if (bProblem)
+			m_pOwner->logWarning("Some bone weights do not sum up to 1.0");
+
+		setStream(BUF_BONE, sizeof(bones[0]), bones.size(), &bones[0]);
+	}
+
+	// convert indices to occupy contageous memory space
+	for (aiFace f : vector<aiFace>(pMesh->mFaces, pMesh->mFaces + pMesh->mNumFaces))
+		for (unsigned n : vector<unsigned>(f.mIndices, f.mIndices + f.mNumIndices))
+			data.indices.push_back(n);
+	if (!data.indices.empty())
+		setStream(BUF_INDEX, sizeof(data.indices[0]), data.indices.size(), &data.indices[0]);
+
+	// reorder for the vertex cache (and group into meshlets), then add the levels of detail
+	optimise(data, m_pOwner->m_bMeshlets && !data.pData[BUF_BONE]);
+	if (m_pOwner->m_nLODLevels > 1)
+		simplify(data, m_pOwner->m_nLODLevels, m_pOwner->m_fLODError);
+
+	data.nMaterialIndex = pMesh->mMaterialIndex;
+	return true;
+}
+
+// grows the box BB to include the box bb, transformed by m (all 8 corners)
+static void addBB(aiVector3D BB[2], const aiVector3D bb[2], const glm::mat4 &m)
+{
+	if (bb[0].x > bb[1].x) return;	// empty
+	for (unsigned i = 0; i < 8; i++)
+	{
+		glm::vec4 v = m * glm::vec4(bb[i & 1].x, bb[(i >> 1) & 1].y, bb[(i >> 2) & 1].z, 1);
+		BB[0].x = min(BB[0].x, v.x); BB[0].y = min(BB[0].y, v.y); BB[0].z = min(BB[0].z, v.z);
+		BB[1].x = max(BB[1].x, v.x); BB[1].y = max(BB[1].y, v.y); BB[1].z = max(BB[1].z, v.z);
 	}
+}
+
+static void emptyBB(aiVector3D BB[2])
+{
+	BB[0].x = BB[0].y = BB[0].z =  1e10f;
+	BB[1].x = BB[1].y = BB[1].z = -1e10f;
+}
+
+void C3dglModel::MESH::setBounds(const MESHDATA &data)
+{
+	bb[0] = bbPosed[0] = data.bb[0];
+	bb[1] = bbPosed[1] = data.bb[1];
 	centre.x = 0.5f * (bb[0].x + bb[1].x);
 	centre.y = 0.5f * (bb[0].y + bb[1].y);
 	centre.z = 0.5f * (bb[0].z + bb[1].z);
 
+	// the bounding sphere, and the bounds of the vertices influenced by each bone
+	radius = 0;
+	m_boneBBs.clear();
+	const aiVector3D *pVertices = (const aiVector3D*)data.pData[BUF_VERTEX];
+	const VERTEXBONES *pBones = (const VERTEXBONES*)data.pData[BUF_BONE];
+	if (!pVertices) return;
+	map<unsigned, unsigned> mapBoneBBs;
+	for (unsigned i = 0; i < data.num[BUF_VERTEX]; i++)
+	{
+		const aiVector3D &vec = pVertices[i];
+		radius = max(radius, (vec - centre).SquareLength());
+		if (!pBones) continue;
+
+		auto addVertex = [&](unsigned iBone)
+		{
+			auto it = mapBoneBBs.find(iBone);
+			if (it == mapBoneBBs.end())
+			{
+				it = mapBoneBBs.insert(make_pair(iBone, (unsigned)m_boneBBs.size())).first;
+				BONEBB boneBB = { iBone, { vec, vec } };
+				m_boneBBs.push_back(boneBB);
+			}
+			aiVector3D *pBB = m_boneBBs[it->second].bb;
+			pBB[0].x = min(pBB[0].x, vec.x); pBB[0].y = min(pBB[0].y, vec.y); pBB[0].z = min(pBB[0].z, vec.z);
+			pBB[1].x = max(pBB[1].x, vec.x); pBB[1].y = max(pBB[1].y, vec.y); pBB[1].z = max(pBB[1].z, vec.z);
+		};
+		bool bWeighted = false;
+		for (unsigned j = 0; j < MAX_BONES_PER_VEREX; j++)
+			if (pBones[i].weights[j] > 0)
+			{
+				addVertex(pBones[i].ids[j]);
+				bWeighted = true;
+			}
+		if (!bWeighted)
+			addVertex((unsigned)-1);
+	}
+	radius = sqrt(radius);
+}
+
+void C3dglModel::MESH::updatePosedBB(const float *pTransforms)
+{
+	if (!pTransforms || m_boneBBs.empty())
+	{
+		bbPosed[0] = bb[0];
+		bbPosed[1] = bb[1];
+		return;
+	}
+
+	// a skinned vertex is a weighted average of its positions transformed by each of its bones - within the union of the bone bounds
+	emptyBB(bbPosed);
+	for (const BONEBB &boneBB : m_boneBBs)
+		addBB(bbPosed, boneBB.bb, boneBB.iBone == (unsigned)-1 ? glm::mat4(1) : glm::make_mat4(pTransforms + boneBB.iBone * 16));
+}
+
+void C3dglModel::MESH::create(const MESHDATA &data, unsigned maskEnabledBufData)
+{
+	setBounds(data);
+
 	// check shader parameters
 	GLuint attribVertex = (GLuint)-1, attribNormal = (GLuint)-1, attribTexCoord = (GLuint)-1, 
 		   attribTangent = (GLuint)-1, attribBitangent = (GLuint)-1, attribColor = (GLuint)-1,
@@ -80,14 +417,33 @@ void C3dglModel::MESH::create(const aiMesh *pMesh, unsigned maskEnabledBufData)
 	glGenVertexArrays(1, &m_idVAO);
 	glBindVertexArray(m_idVAO);
 
+	// compact layout: all attributes go to a single interleaved buffer - the separate buffers below are skipped
+	m_bCompact = false;
+	m_matDequant = glm::mat4(1.0f);
+	if (pProgram && m_pOwner->m_bCompactVertices && data.pData[BUF_VERTEX] && attribVertex != (GLuint)-1)
+	{
+		GLuint attrib[C3dglProgram::ATTR_LAST] = { attribVertex, attribNormal, attribTexCoord, attribTangent, attribBitangent, attribColor, attribBoneId, attribBoneWeight };
+		createCompact(data, attrib);
+		for (int bufId = BUF_VERTEX; bufId < BUF_INDEX; bufId++)
+			if (maskEnabledBufData & (1 << bufId)) 
+				m_buf[bufId].storeData(data.size[bufId], data.num[bufId], data.pData[bufId]);
+		m_nUVComponents = data.nUVComponents;
+		attribVertex = attribNormal = attribTexCoord = attribTangent = attribBitangent = attribColor = attribBoneId = attribBoneWeight = (GLuint)-1;
+	}
+
+	// generate a buffer, than bind it and send data to OpenGL
+	auto populate = [&](ATTRIB_STD bufId, GLenum target)
+	{
+		m_buf[bufId].populate(data.size[bufId], data.num[bufId], data.pData[bufId], target);
+		if (maskEnabledBufData & (1 << bufId)) 
+			m_buf[bufId].storeData(data.size[bufId], data.num[bufId], data.pData[bufId]);
+	};
+
 	// generate a vertex buffer, than bind it and send data to OpenGL
 	if (attribVertex != (GLuint)-1)
-		if (pMesh->mVertices)
+		if (data.pData[BUF_VERTEX])
 		{
-			m_buf[BUF_VERTEX].populate(sizeof(pMesh->mVertices[0]), pMesh->mNumVertices, &pMesh->mVertices[0]);
-			if (maskEnabledBufData & (1 << BUF_VERTEX)) 
-				m_buf[BUF_VERTEX].storeData(sizeof(pMesh->mVertices[0]), pMesh->mNumVertices, &pMesh->mVertices[0]);
-
+			populate(BUF_VERTEX, GL_ARRAY_BUFFER);
 			if (pProgram)
 			{
 				glEnableVertexAttribArray(attribVertex);
@@ -104,12 +460,9 @@ void C3dglModel::MESH::create(const aiMesh *pMesh, unsigned maskEnabledBufData)
 
 	// generate a normal buffer, than bind it and send data to OpenGL
 	if (attribNormal != (GLuint)-1)
-		if (pMesh->mNormals)
+		if (data.pData[BUF_NORMAL])
 		{
-			m_buf[BUF_NORMAL].populate(sizeof(pMesh->mNormals[0]), pMesh->mNumVertices, &pMesh->mNormals[0]);
-			if (maskEnabledBufData & (1 << BUF_NORMAL))
-				m_buf[BUF_NORMAL].storeData(sizeof(pMesh->mNormals[0]), pMesh->mNumVertices, &pMesh->mNormals[0]);
-
+			populate(BUF_NORMAL, GL_ARRAY_BUFFER);
 			if (pProgram)
 			{
 				glEnableVertexAttribArray(attribNormal);
@@ -127,27 +480,10 @@ void C3dglModel::MESH::create(const aiMesh *pMesh, unsigned maskEnabledBufData)
 	//Texture Coordinates
 	if (attribTexCoord != (GLuint)-1)
 	{
-		m_nUVComponents = pMesh->mNumUVComponents[0];	// should be 2
-		if (pMesh->mTextureCoords[0] == NULL)
-			m_pOwner->logWarning("is missing texture coordinate buffer information");
-		else if (m_nUVComponents != 2 && m_nUVComponents != 3)
-			m_pOwner->logWarning("is missing compatible texture coordinates");
-		else
+		m_nUVComponents = data.nUVComponents;	// should be 2
+		if (data.pData[BUF_TEXCOORD])
 		{
-			// first, convert indices to occupy contageous memory space
-			vector<GLfloat> texCoords;
-			for (aiVector3D vec : vector<aiVector3D>(pMesh->mTextureCoords[0], pMesh->mTextureCoords[0] + pMesh->mNumVertices))
-			{
-				texCoords.push_back(vec.x);
-				texCoords.push_back(vec.y);
-				if (m_nUVComponents == 3)
-					texCoords.push_back(vec.z);
-			}
-
-			m_buf[BUF_TEXCOORD].populate(sizeof(texCoords[0]), texCoords.size(), &texCoords[0]);
-			if (maskEnabledBufData & (1 << BUF_TEXCOORD))
-				m_buf[BUF_TEXCOORD].storeData(sizeof(texCoords[0]), texCoords.size(), &texCoords[0]);
-
+			populate(BUF_TEXCOORD, GL_ARRAY_BUFFER);
 			if (pProgram)
 			{
 				glEnableVertexAttribArray(attribTexCoord);
@@ -159,16 +495,17 @@ void C3dglModel::MESH::create(const aiMesh *pMesh, unsigned maskEnabledBufData)
 				glTexCoordPointer(m_nUVComponents, GL_FLOAT, 0, 0);
 			}
 		}
+		else if (m_nUVComponents == 0)
+			m_pOwner->logWarning("is missing texture coordinate buffer information");
+		else
+			m_pOwner->logWarning("is missing compatible texture coordinates");
 	}
 
 	// generate a tangent buffer, than bind it and send data to OpenGL
 	if (attribTangent != (GLuint)-1)
-		if (pMesh->mTangents)
+		if (data.pData[BUF_TANGENT])
 		{
-			m_buf[BUF_TANGENT].populate(sizeof(pMesh->mTangents[0]), pMesh->mNumVertices, &pMesh->mTangents[0]);
-			if (maskEnabledBufData & (1 << BUF_TANGENT))
-				m_buf[BUF_TANGENT].storeData(sizeof(pMesh->mTangents[0]), pMesh->mNumVertices, &pMesh->mTangents[0]);
-
+			populate(BUF_TANGENT, GL_ARRAY_BUFFER);
 			if (pProgram)
 			{
 				glEnableVertexAttribArray(attribTangent);
@@ -180,12 +517,9 @@ void C3dglModel::MESH::create(const aiMesh *pMesh, unsigned maskEnabledBufData)
 
 	// generate a biTangent buffer, than bind it and send data to OpenGL
 	if (attribBitangent != (GLuint)-1)
-		if (pMesh->mBitangents)
+		if (data.pData[BUF_BITANGENT])
 		{
-			m_buf[BUF_BITANGENT].populate(sizeof(pMesh->mBitangents[0]), pMesh->mNumVertices, &pMesh->mBitangents[0]);
-			if (maskEnabledBufData & (1 << BUF_BITANGENT))
-				m_buf[BUF_BITANGENT].storeData(sizeof(pMesh->mBitangents[0]), pMesh->mNumVertices, &pMesh->mBitangents[0]);
-
+			populate(BUF_BITANGENT, GL_ARRAY_BUFFER);
 			if (pProgram)
 			{
 				glEnableVertexAttribArray(attribBitangent);
@@ -197,12 +531,9 @@ void C3dglModel::MESH::create(const aiMesh *pMesh, unsigned maskEnabledBufData)
 
 	// generate a color buffer, than bind it and send data to OpenGL
 	if (attribColor != (GLuint)-1)
-		if (pMesh->mColors[0])
+		if (data.pData[BUF_COLOR])
 		{
-			m_buf[BUF_COLOR].populate(sizeof(pMesh->mColors[0][0]), pMesh->mNumVertices, &pMesh->mColors[0][0]);
-			if (maskEnabledBufData & (1 << BUF_COLOR))
-				m_buf[BUF_COLOR].storeData(sizeof(pMesh->mColors[0][0]), pMesh->mNumVertices, &pMesh->mColors[0][0]);
-
+			populate(BUF_COLOR, GL_ARRAY_BUFFER);
 			if (pProgram)
 			{
 				glEnableVertexAttribArray(attribColor);
@@ -212,92 +543,51 @@ void C3dglModel::MESH::create(const aiMesh *pMesh, unsigned maskEnabledBufData)
 		else
 			m_pOwner->logWarning("is missing color buffer information");
 
-	// generate and convert a bone buffer, than bind it and send data to OpenGL
+	// generate a bone buffer, than bind it and send data to OpenGL
 	if (attribBoneId != (GLuint)-1 && attribBoneWeight != (GLuint)-1)
 	{
-		// initislise the buffer
-		struct VertexBoneData
-		{        
-			unsigned ids[MAX_BONES_PER_VEREX];
-			float weights[MAX_BONES_PER_VEREX];
-		};
-		vector<VertexBoneData> bones;
-		bones.resize(pMesh->mNumVertices);
-		memset(&bones[0], 0, sizeof(bones[0]) * bones.size());
-
-		if (pMesh->mNumBones)
-		{
-			// load bone info - based on http://ogldev.atspace.co.uk/
-			m_pOwner->logInfo("bones found: " + to_string(pMesh->mNumBones));
-
-			// for each bone:
-			for (aiBone *pBone : vector<aiBone*>(pMesh->mBones, pMesh->mBones + pMesh->mNumBones))
-			{
-				// determine bone index from its name
-				unsigned iBone = m_pOwner->getBoneId(pBone->mName.data);
-
-				if (iBone >= m_pOwner->m_offsetBones.size())
-					m_pOwner->m_offsetBones.push_back(pBone->mOffsetMatrix);
-				
-				// collect bone weights
-				for (aiVertexWeight &weight : vector<aiVertexWeight>(pBone->mWeights, pBone->mWeights + pBone->mNumWeights))
-				{
-					// find a free location for the id and weight within bones[iVertex]
-					unsigned i = 0;
-					while (i < MAX_BONES_PER_VEREX && bones[weight.mVertexId].weights[i] != 0.0)
-						i++;
-					if (i < MAX_BONES_PER_VEREX)
-					{
-						bones[weight.mVertexId].ids[i] = iBone;
-						bones[weight.mVertexId].weights[i] = weight.mWeight;
-					}
-					else
-						m_pOwner->logWarning("Maximum number of bones per vertex exceeded");
-				}
-			}
-
-			// verify (and maybe, in future, normalize)
-			bool bProblem = false;
-			for (VertexBoneData &bone : bones)
-			{
-				float total = 0.0f;
-				for (float weight : bone.weights)
-					total += weight;
-				bProblem = bProblem || total < 0.999f || total > 1.001f;
-				//cout << total << endl;
-			}
-			if (bProblem)
-				m_pOwner->logWarning("Some bone weights do not sum up to 1.0");
-		}
+		if (data.pData[BUF_BONE])
+			populate(BUF_BONE, GL_ARRAY_BUFFER);
 		else
+		{
+			// no bones: all weights are zero
 			m_pOwner->logWarning("is missing bone information");
-
-		m_buf[BUF_BONE].populate(sizeof(bones[0]), pMesh->mNumVertices, &bones[0]);
-		if (maskEnabledBufData & (1 << BUF_BONE))
-			m_buf[BUF_BONE].storeData(sizeof(bones[0]), pMesh->mNumVertices, &bones[0]);
+			vector<VERTEXBONES> bones(data.num[BUF_VERTEX]);	// value-initialised to zeros
+			m_buf[BUF_BONE].populate(sizeof(VERTEXBONES), bones.size(), bones.data());
+			if (maskEnabledBufData & (1 << BUF_BONE))
+				m_buf[BUF_BONE].storeData(sizeof(VERTEXBONES), bones.size(), bones.data());
+		}
 
 		if (pProgram)
 		{
 			glEnableVertexAttribArray(attribBoneId);
-			glVertexAttribIPointer(attribBoneId, 4, GL_INT, sizeof(VertexBoneData), (const GLvoid*)0);
+			glVertexAttribIPointer(attribBoneId, 4, GL_INT, sizeof(VERTEXBONES), (const GLvoid*)0);
 			glEnableVertexAttribArray(attribBoneWeight); 
-			glVertexAttribPointer(attribBoneWeight, 4, GL_FLOAT, GL_FALSE, sizeof(VertexBoneData), (const GLvoid*)sizeof(bones[0].ids));
+			glVertexAttribPointer(attribBoneWeight, 4, GL_FLOAT, GL_FALSE, sizeof(VERTEXBONES), (const GLvoid*)sizeof(((VERTEXBONES*)0)->ids));
 		}
 	}
 
-	// first, convert indices to occupy contageous memory space
-	vector<unsigned> indices;
-	for (aiFace f : vector<aiFace>(pMesh->mFaces, pMesh->mFaces + pMesh->mNumFaces))
-		for (unsigned n : vector<unsigned>(f.mIndices, f.mIndices + f.mNumIndices))
-			indices.push_back(n);
-
-	// generate indices buffer, than bind it and send data to OpenGL
-	m_buf[BUF_INDEX].populate(sizeof(indices[0]), indices.size(), &indices[0], GL_ELEMENT_ARRAY_BUFFER);
-	if (maskEnabledBufData & (1 << BUF_INDEX))
-		m_buf[BUF_INDEX].storeData(sizeof(indices[0]), indices.size(), &indices[0]);
-	m_indexSize = indices.size();
+	// generate indices buffer, than bind it and send data to OpenGL - as 16-bit values whenever they fit.
+	// All the levels of detail are in the same buffer.
+	const unsigned *pIndices = (const unsigned*)data.pData[BUF_INDEX];
+	unsigned nIndices = data.num[BUF_INDEX];
+	if (pIndices && *max_element(pIndices, pIndices + nIndices) <= 0xFFFF)
+	{
+		vector<unsigned short> indices(pIndices, pIndices + nIndices);
+		m_buf[BUF_INDEX].populate(sizeof(unsigned short), indices.size(), indices.data(), GL_ELEMENT_ARRAY_BUFFER);
+		if (maskEnabledBufData & (1 << BUF_INDEX)) 
+			m_buf[BUF_INDEX].storeData(data.size[BUF_INDEX], data.num[BUF_INDEX], data.pData[BUF_INDEX]);
+		m_indexType = GL_UNSIGNED_SHORT;
+	}
+	else
+	{
+		populate(BUF_INDEX, GL_ELEMENT_ARRAY_BUFFER);
+		m_indexType = GL_UNSIGNED_INT;
+	}
+	setLODs(data);
+	m_meshlets.assign(data.pMeshlets, data.pMeshlets + data.nMeshlets);
 
-	m_nMaterialIndex = pMesh->mMaterialIndex;
+	m_nMaterialIndex = data.nMaterialIndex;
 
 	// Reset VAO & buffers
 	glBindVertexArray(0);
@@ -305,6 +595,157 @@ void C3dglModel::MESH::create(const aiMesh *pMesh, unsigned maskEnabledBufData)
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
+void C3dglModel::MESH::create(const MESHDATA &data, MESH *pShared, unsigned nBaseVertex, unsigned nFirstIndex, unsigned maskEnabledBufData)
+{
+	setBounds(data);
+
+	// no buffers of its own: the mesh is a range within the buffers of the shared mesh
+	m_pShared = pShared;
+	m_idVAO = pShared->m_idVAO;
+	m_nBaseVertex = nBaseVertex;
+	m_nFirstIndex = nFirstIndex;
+	m_indexType = pShared->m_indexType;
+	setLODs(data);
+	m_meshlets.assign(data.pMeshlets, data.pMeshlets + data.nMeshlets);
+	m_nUVComponents = data.nUVComponents;
+	m_nMaterialIndex = data.nMaterialIndex;
+
+	for (int bufId = BUF_VERTEX; bufId < BUF_LAST; bufId++)
+		if (maskEnabledBufData & (1 << bufId)) 
+			m_buf[bufId].storeData(data.size[bufId], data.num[bufId], data.pData[bufId]);
+}
+
+void C3dglModel::MESH::createCompact(const MESHDATA &data, GLuint attrib[])
+{
+	unsigned nVertices = data.num[BUF_VERTEX];
+	const aiVector3D *pVertices = (const aiVector3D*)data.pData[BUF_VERTEX];
+	const aiVector3D *pNormals = (const aiVector3D*)data.pData[BUF_NORMAL];
+	const aiVector3D *pTangents = (const aiVector3D*)data.pData[BUF_TANGENT];
+	const aiVector3D *pBitangents = (const aiVector3D*)data.pData[BUF_BITANGENT];
+	const aiColor4D *pColors = (const aiColor4D*)data.pData[BUF_COLOR];
+	const VERTEXBONES *pBones = (const VERTEXBONES*)data.pData[BUF_BONE];
+	const float *pTexCoords = (const float*)data.pData[BUF_TEXCOORD];
+
+	// missing information - reported just like for the separate buffers
+	if (attrib[C3dglProgram::ATTR_NORMAL] != (GLuint)-1 && !pNormals)
+		m_pOwner->logWarning("is missing normal buffer information");
+	if (attrib[C3dglProgram::ATTR_TEXCOORD] != (GLuint)-1 && !pTexCoords)
+		m_pOwner->logWarning(data.nUVComponents == 0 ? "is missing texture coordinate buffer information" : "is missing compatible texture coordinates");
+	if (attrib[C3dglProgram::ATTR_TANGENT] != (GLuint)-1 && !pTangents)
+		m_pOwner->logWarning("is missing tangent buffer information");
+	if (attrib[C3dglProgram::ATTR_COLOR] != (GLuint)-1 && !pColors)
+		m_pOwner->logWarning("is missing color buffer information");
+	bool bBones = attrib[C3dglProgram::ATTR_BONE_ID] != (GLuint)-1 && attrib[C3dglProgram::ATTR_BONE_WEIGHT] != (GLuint)-1;
+	if (bBones && !pBones)
+		m_pOwner->logWarning("is missing bone information");
+
+	// the layout: only the attributes used by the shader, each 4-byte aligned
+	unsigned nStride = 0;
+	auto add = [&](C3dglProgram::ATTRIB_STD attr, bool bPresent, unsigned nSize) -> unsigned
+	{
+		if (!bPresent || attrib[attr] == (GLuint)-1) return (unsigned)-1;
+		unsigned nOffset = nStride;
+		nStride += nSize;
+		return nOffset;
+	};
+	unsigned nUV = data.nUVComponents == 3 ? 3 : 2;
+	unsigned offVertex   = add(C3dglProgram::ATTR_VERTEX, true, 4 * sizeof(short));			// 3 x 16-bit + padding
+	unsigned offNormal   = add(C3dglProgram::ATTR_NORMAL, pNormals != NULL, 4);					// 2_10_10_10
+	unsigned offTexCoord = add(C3dglProgram::ATTR_TEXCOORD, pTexCoords != NULL, nUV == 3 ? 8 : 4);	// half floats
+	unsigned offTangent  = add(C3dglProgram::ATTR_TANGENT, pTangents != NULL, 4);				// 2_10_10_10
+	unsigned offColor    = add(C3dglProgram::ATTR_COLOR, pColors != NULL, 4);					// RGBA8
+	unsigned offBone     = bBones ? add(C3dglProgram::ATTR_BONE_ID, true, 4 * sizeof(unsigned short) + 4) : (unsigned)-1;	// ids 4 x 16-bit, weights 4 x 8-bit
+
+	// positions are quantised around the centre of the bounding box, with the same scale on all axes
+	// so that the dequantisation matrix does not distort the normals
+	aiVector3D vMin = pVertices[0], vMax = pVertices[0];
+	for (unsigned i = 1; i < nVertices; i++)
+	{
+		vMin.x = min(vMin.x, pVertices[i].x); vMax.x = max(vMax.x, pVertices[i].x);
+		vMin.y = min(vMin.y, pVertices[i].y); vMax.y = max(vMax.y, pVertices[i].y);
+		vMin.z = min(vMin.z, pVertices[i].z); vMax.z = max(vMax.z, pVertices[i].z);
+	}
+	aiVector3D vCentre = (vMin + vMax) * 0.5f;
+	float fExtent = 0.5f * max(vMax.x - vMin.x, max(vMax.y - vMin.y, vMax.z - vMin.z));
+	if (fExtent <= 0) fExtent = 1;
+	float fScale = 32767.0f / fExtent;
+	m_matDequant = glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(vCentre.x, vCentre.y, vCentre.z)), glm::vec3(1.0f / fScale));
+
+	auto quantise = [](float f) -> short	{ return (short)floor(min(max(f, -32767.0f), 32767.0f) + 0.5f); };
+	auto packNormal = [](const aiVector3D &v, float w) -> unsigned	{ return glm::packSnorm3x10_1x2(glm::vec4(v.x, v.y, v.z, w)); };
+
+	vector<unsigned char> buf((size_t)nStride * nVertices, 0);
+	for (unsigned i = 0; i < nVertices; i++)
+	{
+		unsigned char *p = &buf[(size_t)i * nStride];
+
+		aiVector3D v = (pVertices[i] - vCentre) * fScale;
+		short *pPos = (short*)(p + offVertex);
+		pPos[0] = quantise(v.x); pPos[1] = quantise(v.y); pPos[2] = quantise(v.z);
+
+		if (offNormal != (unsigned)-1)
+			*(unsigned*)(p + offNormal) = packNormal(pNormals[i], 0);
+
+		if (offTexCoord != (unsigned)-1)
+			for (unsigned j = 0; j < nUV; j++)
+				((unsigned short*)(p + offTexCoord))[j] = glm::packHalf1x16(pTexCoords[i * nUV + j]);
+
+		if (offTangent != (unsigned)-1)
+		{
+			// the bitangent is rebuilt in the shader as cross(normal, tangent) * w
+			float w = 1;
+			if (pBitangents && pNormals && ((pNormals[i] ^ pTangents[i]) * pBitangents[i]) < 0)
+				w = -1;
+			*(unsigned*)(p + offTangent) = packNormal(pTangents[i], w);
+		}
+
+		if (offColor != (unsigned)-1)
+			*(unsigned*)(p + offColor) = glm::packUnorm4x8(glm::vec4(pColors[i].r, pColors[i].g, pColors[i].b, pColors[i].a));
+
+		if (offBone != (unsigned)-1 && pBones)
+			for (unsigned j = 0; j < MAX_BONES_PER_VEREX; j++)
+			{
+				((unsigned short*)(p + offBone))[j] = (unsigned short)pBones[i].ids[j];
+				p[offBone + 4 * sizeof(unsigned short) + j] = glm::packUnorm1x8(pBones[i].weights[j]);
+			}
+	}
+
+	// upload & set up the attributes
+	m_buf[BUF_VERTEX].populate(nStride, nVertices, buf.data());
+	auto pointer = [&](C3dglProgram::ATTRIB_STD attr, unsigned nOffset, GLint size, GLenum type, GLboolean normalized)
+	{
+		if (nOffset == (unsigned)-1) return;
+		glEnableVertexAttribArray(attrib[attr]);
+		glVertexAttribPointer(attrib[attr], size, type, normalized, nStride, (const GLvoid*)(size_t)nOffset);
+	};
+	pointer(C3dglProgram::ATTR_VERTEX, offVertex, 3, GL_SHORT, GL_FALSE);
+	pointer(C3dglProgram::ATTR_NORMAL, offNormal, 4, GL_INT_2_10_10_10_REV, GL_TRUE);
+	pointer(C3dglProgram::ATTR_TEXCOORD, offTexCoord, nUV, GL_HALF_FLOAT, GL_FALSE);
+	pointer(C3dglProgram::ATTR_TANGENT, offTangent, 4, GL_INT_2_10_10_10_REV, GL_TRUE);
+	pointer(C3dglProgram::ATTR_COLOR, offColor, 4, GL_UNSIGNED_BYTE, GL_TRUE);
+	if (offBone != (unsigned)-1)
+	{
+		glEnableVertexAttribArray(attrib[C3dglProgram::ATTR_BONE_ID]);
+		glVertexAttribIPointer(attrib[C3dglProgram::ATTR_BONE_ID], 4, GL_UNSIGNED_SHORT, nStride, (const GLvoid*)(size_t)offBone);
+		pointer(C3dglProgram::ATTR_BONE_WEIGHT, offBone + 4 * sizeof(unsigned short), 4, GL_UNSIGNED_BYTE, GL_TRUE);
+	}
+	m_bCompact = true;
+}
+
+void C3dglModel::MESH::setLODs(const MESHDATA &data)
+{
+	m_nLODs = max(1u, min(data.nLODs, (unsigned)MAX_LODS));
+	if (data.nLODs)
+		memcpy(m_lods, data.lods, m_nLODs * sizeof(LOD));
+	else
+	{
+		m_lods[0].nFirst = 0;
+		m_lods[0].nCount = data.num[BUF_INDEX];
+		m_lods[0].fError = 0;
+	}
+	m_indexSize = m_lods[0].nCount;
+}
+
 void C3dglModel::MESH::destroy()
 {
 	m_buf[BUF_VERTEX].release();
@@ -315,13 +756,90 @@ void C3dglModel::MESH::destroy()
 	m_buf[BUF_COLOR].release();
 	m_buf[BUF_BONE].release();
 	m_buf[BUF_INDEX].release();
+	m_meshlets.clear();
+}
+
+void C3dglModel::MESH::render(unsigned nLevel) 
+{
+	glBindVertexArray(m_idVAO);
+	if (m_pShared)
+		glDrawElementsBaseVertex(GL_TRIANGLES, getIndexCount(nLevel), m_indexType, getIndexOffset(nLevel), m_nBaseVertex);
+	else
+		glDrawElements(GL_TRIANGLES, getIndexCount(nLevel), m_indexType, getIndexOffset(nLevel));
+	glBindVertexArray(0);
+}
+
+void C3dglModel::MESH::render(const GLsizei *pCounts, const GLvoid *const *pOffsets, unsigned nRanges)
+{
+	if (nRanges == 0) return;
+	glBindVertexArray(m_idVAO);
+	glMultiDrawElements(GL_TRIANGLES, pCounts, m_indexType, pOffsets, nRanges);
+	glBindVertexArray(0);
+}
+
+unsigned C3dglModel::MESH::cullMeshlets(const C3dglFrustum &frustum, const glm::mat4 &global, glm::vec3 camera, bool bCones, vector<GLsizei> &counts, vector<const GLvoid*> &offsets)
+{
+	float fScale = sqrt(max(max(glm::dot(glm::vec3(global[0]), glm::vec3(global[0])), glm::dot(glm::vec3(global[1]), glm::vec3(global[1]))), glm::dot(glm::vec3(global[2]), glm::vec3(global[2]))));
+	size_t nIndexSize = m_indexType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned);
+	unsigned nRanges = 0, nEnd = (unsigned)-1;		// nEnd: the end of the last range appended
+	for (const MESHLET &meshlet : m_meshlets)
+	{
+		glm::vec3 centre(meshlet.centre.x, meshlet.centre.y, meshlet.centre.z);
+		if (bCones && meshlet.coneCutoff < 1)
+		{
+			glm::vec3 view = centre - camera;
+			if (glm::dot(view, glm::vec3(meshlet.coneAxis.x, meshlet.coneAxis.y, meshlet.coneAxis.z)) >= meshlet.coneCutoff * glm::length(view) + meshlet.radius)
+				continue;
+		}
+		if (!frustum.testSphere(glm::vec3(global * glm::vec4(centre, 1)), meshlet.radius * fScale))
+			continue;
+
+		if (meshlet.nFirst == nEnd)
+			counts.back() += meshlet.nCount;
+		else
+		{
+			counts.push_back(meshlet.nCount);
+			offsets.push_back((const GLvoid*)((m_nFirstIndex + meshlet.nFirst) * nIndexSize));
+			nRanges++;
+		}
+		nEnd = meshlet.nFirst + meshlet.nCount;
+	}
+	return nRanges;
+}
+
+void C3dglModel::MESH::renderInstanced(unsigned nInstances)
+{
+	glBindVertexArray(m_idVAO);
+	if (m_pShared)
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, m_indexSize, m_indexType, getIndexOffset(), nInstances, m_nBaseVertex);
+	else
+		glDrawElementsInstanced(GL_TRIANGLES, m_indexSize, m_indexType, 0, nInstances);
+	glBindVertexArray(0);
 }
 
-void C3dglModel::MESH::render() 
+void C3dglModel::MESH::enableInstancing(GLuint idBuffer, GLuint attribMatrix, GLuint attribTint)
 {
+	if (m_bInstancing) return;
 	glBindVertexArray(m_idVAO);
-	glDrawElements(GL_TRIANGLES, m_indexSize, GL_UNSIGNED_INT, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, idBuffer);
+
+	// a mat4 attribute takes four consecutive locations, one per column
+	for (GLuint i = 0; i < 4; i++)
+	{
+		glEnableVertexAttribArray(attribMatrix + i);
+		glVertexAttribPointer(attribMatrix + i, 4, GL_FLOAT, GL_FALSE, sizeof(INSTANCE), (const GLvoid*)(i * sizeof(glm::vec4)));
+		glVertexAttribDivisor(attribMatrix + i, 1);
+	}
+	if (attribTint != (GLuint)-1)
+	{
+		glEnableVertexAttribArray(attribTint);
+		glVertexAttribPointer(attribTint, 4, GL_FLOAT, GL_FALSE, sizeof(INSTANCE), (const GLvoid*)sizeof(glm::mat4));
+		glVertexAttribDivisor(attribTint, 1);
+	}
+
 	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	m_bInstancing = true;
 }
 
 C3dglModel::MATERIAL *C3dglModel::MESH::createNewMaterial()
@@ -329,6 +847,7 @@ C3dglModel::MATERIAL *C3dglModel::MESH::createNewMaterial()
 	C3dglModel::MATERIAL mat(m_pOwner);
 	m_nMaterialIndex = m_pOwner->m_materials.size();
 	m_pOwner->m_materials.push_back(mat);
+	m_pOwner->flattenNodes();		// the draws are grouped by material
 	return getMaterial();
 }
 
@@ -343,14 +862,35 @@ C3dglModel::MATERIAL::MATERIAL(C3dglModel *pOwner) : m_pOwner(pOwner)
 }
 
 void C3dglModel::MATERIAL::create(const aiMaterial *pMat, const char* pDefTexPath)
+{
+	MATERIALDATA data;
+	read(pMat, data);
+	create(data, pDefTexPath);
+}
+
+void C3dglModel::MATERIAL::create(const MATERIALDATA &data, const char* pDefTexPath, const C3dglTextureCache::IMAGE *pImage)
 {
 	// texture
-	aiString texPath;	// contains filename of texture
-	if (pMat->GetTexture(aiTextureType_DIFFUSE, 0, &texPath) == AI_SUCCESS)
-		loadTexture(pDefTexPath ? pDefTexPath : "", texPath.C_Str());
+	if (!data.texPath.empty())
+		loadTexture(pDefTexPath ? pDefTexPath : "", data.texPath, pImage);
 	if (m_idTexture == 0xFFFFFFFF)
 		loadBlankTexture();
 
+	// solid colours
+	memcpy(m_amb, data.amb, sizeof(m_amb));
+	memcpy(m_diff, data.diff, sizeof(m_diff));
+	memcpy(m_spec, data.spec, sizeof(m_spec));
+	memcpy(m_emiss, data.emiss, sizeof(m_emiss));
+	m_shininess = data.shininess;
+}
+
+void C3dglModel::MATERIAL::read(const aiMaterial *pMat, MATERIALDATA &data)
+{
+	// texture
+	aiString texPath;	// contains filename of texture
+	if (pMat->GetTexture(aiTextureType_DIFFUSE, 0, &texPath) == AI_SUCCESS)
+		data.texPath = texPath.C_Str();
+
 	// solid colours
 	static float def_amb[3] = { 1.0, 1.0, 1.0 };
 	static float def_diff[3] = { 1.0, 1.0, 1.0 };
@@ -359,33 +899,34 @@ void C3dglModel::MATERIAL::create(const aiMaterial *pMat, const char* pDefTexPat
 	static float def_shininess = 0.1f;
 	aiColor4D color;
 	if(AI_SUCCESS == aiGetMaterialColor(pMat, AI_MATKEY_COLOR_AMBIENT, &color))
-		memcpy(this->m_amb, &color, sizeof(m_amb));
+		memcpy(data.amb, &color, sizeof(data.amb));
 	else
-		memcpy(this->m_amb, &def_amb, sizeof(m_amb));
+		memcpy(data.amb, &def_amb, sizeof(data.amb));
 	if(AI_SUCCESS == aiGetMaterialColor(pMat, AI_MATKEY_COLOR_DIFFUSE, &color))
-		memcpy(this->m_diff, &color, sizeof(m_diff));
+		memcpy(data.diff, &color, sizeof(data.diff));
 	else
-		memcpy(this->m_diff, &def_diff, sizeof(m_diff));
+		memcpy(data.diff, &def_diff, sizeof(data.diff));
 	if(AI_SUCCESS == aiGetMaterialColor(pMat, AI_MATKEY_COLOR_SPECULAR, &color))
-		memcpy(this->m_spec, &color, sizeof(m_spec));
+		memcpy(data.spec, &color, sizeof(data.spec));
 	else
-		memcpy(this->m_spec, &def_spec, sizeof(m_spec));
+		memcpy(data.spec, &def_spec, sizeof(data.spec));
 	if(AI_SUCCESS == aiGetMaterialColor(pMat, AI_MATKEY_COLOR_EMISSIVE, &color))
-		memcpy(this->m_emiss, &color, sizeof(m_emiss));
+		memcpy(data.emiss, &color, sizeof(data.emiss));
 	else
-		memcpy(this->m_emiss, &def_emiss, sizeof(m_emiss));
+		memcpy(data.emiss, &def_emiss, sizeof(data.emiss));
 	float shininess;
 	unsigned int max;
 	if(AI_SUCCESS == aiGetMaterialFloatArray(pMat, AI_MATKEY_SHININESS, &shininess, &max))
-		this->m_shininess = shininess;
+		data.shininess = shininess;
 	else
-		this->m_shininess = def_shininess;
+		data.shininess = def_shininess;
 }
 
 void C3dglModel::MATERIAL::destroy()
 {
 	if (m_idTexture != 0xffffffff)
-		glDeleteTextures(1, &m_idTexture);
+		C3dglTextureCache::getDefault().release(m_idTexture);
+	m_idTexture = 0xFFFFFFFF;
 }
 
 void C3dglModel::MATERIAL::bind()
@@ -405,9 +946,8 @@ void C3dglModel::MATERIAL::bind()
 	}
 }
 
-void C3dglModel::MATERIAL::loadTexture(string strDefTexPath, string strPath)
+string C3dglModel::MATERIAL::getTexturePath(string strDefTexPath, string strPath)
 {
-	// prepare path
 	std::ifstream f(strPath);
 	if (f.is_open())
 	{
@@ -424,67 +964,297 @@ void C3dglModel::MATERIAL::loadTexture(string strDefTexPath, string strPath)
 		else
 			strPath = strDefTexPath + "/" + strPath; 
 	}
-
-	// generate IL image id
-	C3dglBitmap bm;
-	if (bm.load(strPath, GL_RGBA))
-	{
-		// generate texture id
-		glGenTextures(1, &m_idTexture);
-
-		// load texture
-		glBindTexture(GL_TEXTURE_2D, m_idTexture); 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bm.getWidth(), bm.getHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.getBits()); 
-	}
+	return strPath;
 }
 
-void C3dglModel::MATERIAL::loadBlankTexture()
+void C3dglModel::MATERIAL::loadTexture(string strDefTexPath, string strPath, const C3dglTextureCache::IMAGE *pImage)
 {
-	if (c_idTexBlank == 0xffffffff)
-	{
-		glGenTextures(1, &c_idTexBlank);
-		glBindTexture(GL_TEXTURE_2D, c_idTexBlank);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		unsigned char bytes[] = { 255, 255, 255 };
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_BGR, GL_UNSIGNED_BYTE, &bytes);
-	}
-	m_idTexture = c_idTexBlank;
+	// the same file is decoded and uploaded only once, however many materials use it
+	destroy();
+	C3dglTextureCache &cache = C3dglTextureCache::getDefault();
+	unsigned idTexture = (pImage && !pImage->bits.empty()) ? cache.acquire(*pImage) : cache.acquire(getTexturePath(strDefTexPath, strPath));
+	if (idTexture)
+		m_idTexture = idTexture;
 }
 
-void C3dglModel::create(const aiScene *pScene)
+void C3dglModel::MATERIAL::loadBlankTexture()
 {
-	m_pScene = pScene;
-	m_meshes.resize(m_pScene->mNumMeshes, MESH(this));
-	aiMesh **ppMesh = m_pScene->mMeshes;
-	for (MESH &mesh : m_meshes)
-		mesh.create(*ppMesh++, m_maskEnabledBufData);
-
-	m_GlobalInverseTransform = m_pScene->mRootNode->mTransformation;
-	m_GlobalInverseTransform.Inverse();
+	destroy();
+	m_idTexture = C3dglTextureCache::getDefault().acquireBlank();
 }
 
-void C3dglModel::loadMaterials(const char* pTexRootPath)
+void C3dglModel::create(const aiScene *pScene)
 {
-	if (!m_pScene) return;
-
-	m_materials.resize(m_pScene->mNumMaterials, MATERIAL(this));
-	aiMaterial **ppMaterial = m_pScene->mMaterials;
-	for (MATERIAL &material : m_materials)
-		material.create(*ppMaterial++, pTexRootPath);
+	STAGING staging;
+	prepareScene(pScene, staging);
+	upload(staging);
 }
 
-void C3dglModel::destroy()
+// a copy of a node hierarchy: names, transformations and mesh indices only
+static aiNode *copyNode(const aiNode *pSrc, aiNode *pParent)
 {
-	if (m_pScene) 
+	aiNode *p = new aiNode(string(pSrc->mName.data, pSrc->mName.length));
+	p->mTransformation = pSrc->mTransformation;
+	p->mParent = pParent;
+	if (pSrc->mNumMeshes)
 	{
-		for (MESH mesh : m_meshes)
-			mesh.destroy();
-		for (MATERIAL mat : m_materials)
-			mat.destroy();
-		aiReleaseImport(m_pScene);
-		m_pScene = NULL;
+		p->mNumMeshes = pSrc->mNumMeshes;
+		p->mMeshes = new unsigned[pSrc->mNumMeshes];
+		memcpy(p->mMeshes, pSrc->mMeshes, pSrc->mNumMeshes * sizeof(unsigned));
+	}
+	if (pSrc->mNumChildren)
+	{
+		p->mNumChildren = pSrc->mNumChildren;
+		p->mChildren = new aiNode*[pSrc->mNumChildren];
+		for (unsigned i = 0; i < pSrc->mNumChildren; i++)
+			p->mChildren[i] = copyNode(pSrc->mChildren[i], p);
+	}
+	return p;
+}
+
+void C3dglModel::prepareScene(const aiScene *pScene, STAGING &staging)
+{
+	m_pScene = pScene;
+	m_pRootNode = copyNode(pScene->mRootNode, NULL);
+	m_meshes.resize(m_pScene->mNumMeshes, MESH(this));
+
+	// the materials and animations are copied, so that the scene can be released after the upload
+	m_materialData.resize(m_pScene->mNumMaterials);
+	for (unsigned i = 0; i < m_pScene->mNumMaterials; i++)
+		MATERIAL::read(m_pScene->mMaterials[i], m_materialData[i]);
+	m_animations.resize(m_pScene->mNumAnimations);
+	for (unsigned i = 0; i < m_pScene->mNumAnimations; i++)
+	{
+		const aiAnimation *pAnimation = m_pScene->mAnimations[i];
+		ANIMATION &animation = m_animations[i];
+		animation.fDuration = (float)pAnimation->mDuration;
+		animation.fTicksPerSecond = (float)pAnimation->mTicksPerSecond;
+		animation.channels.resize(pAnimation->mNumChannels);
+		for (unsigned j = 0; j < pAnimation->mNumChannels; j++)
+		{
+			const aiNodeAnim *pNodeAnim = pAnimation->mChannels[j];
+			ANIMCHANNEL &channel = animation.channels[j];
+			channel.nodeName = pNodeAnim->mNodeName.data;
+			channel.positionKeys.assign(pNodeAnim->mPositionKeys, pNodeAnim->mPositionKeys + pNodeAnim->mNumPositionKeys);
+			channel.rotationKeys.assign(pNodeAnim->mRotationKeys, pNodeAnim->mRotationKeys + pNodeAnim->mNumRotationKeys);
+			channel.scalingKeys.assign(pNodeAnim->mScalingKeys, pNodeAnim->mScalingKeys + pNodeAnim->mNumScalingKeys);
+		}
+	}
+
+	// prepare the meshes - all of them are kept until the upload
+	vector<MESHDATA> &meshes = staging.meshes;
+	meshes.assign(m_meshes.size(), MESHDATA());
+	unsigned nMissesBefore = 0, nMissesAfter = 0, nTriangles = 0, nVertices = 0, nMeshlets = 0, nMeshletTriangles = 0;
+	for (unsigned i = 0; i < m_meshes.size(); i++)
+	{
+		MESHDATA &data = meshes[i];
+		if (!m_meshes[i].prepare(m_pScene->mMeshes[i], data))
+			continue;
+		nMissesBefore += data.nMissesBefore;
+		nMissesAfter += data.nMissesAfter;
+		nTriangles += (data.nLODs ? data.lods[0].nCount : data.num[BUF_INDEX]) / 3;
+		nVertices += data.num[BUF_VERTEX];
+		nMeshlets += data.nMeshlets;
+		for (unsigned n = 0; n < data.nMeshlets; n++)
+			nMeshletTriangles += data.pMeshlets[n].nCount / 3;
+	}
+
+	// ACMR: cache misses per triangle; ATVR: cache misses per vertex (1.0 is ideal)
+	if (nTriangles && nVertices)
+	{
+		char buf[128];
+		snprintf(buf, sizeof(buf), "vertex cache: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f", (float)nMissesBefore / nTriangles, (float)nMissesAfter / nTriangles, (float)nMissesBefore / nVertices, (float)nMissesAfter / nVertices);
+		logInfo(buf);
+	}
+	if (m_nLODLevels > 1 && nTriangles)
+	{
+		// meshes not simplified any further count with their previous level
+		string str = "levels of detail: " + to_string(nTriangles);
+		for (unsigned n = 1; n < m_nLODLevels; n++)
+		{
+			unsigned nLevel = 0;
+			for (MESHDATA &data : meshes)
+				if (data.num[BUF_INDEX])
+					nLevel += (data.nLODs ? data.lods[min(n, data.nLODs - 1)].nCount : data.num[BUF_INDEX]) / 3;
+			str += " -> " + to_string(nLevel);
+		}
+		logInfo(str + " triangles");
+	}
+	if (nMeshlets)
+	{
+		char buf[128];
+		snprintf(buf, sizeof(buf), "meshlets: %u, %.1f triangles each", nMeshlets, (float)nMeshletTriangles / nMeshlets);
+		logInfo(buf);
+	}
+
+	m_GlobalInverseTransform = m_pScene->mRootNode->mTransformation;
+	m_GlobalInverseTransform.Inverse();
+	prepareBVH(staging);
+}
+
+void C3dglModel::upload(STAGING &staging)
+{
+	if (m_bSharedBuffers)
+		createShared(staging.meshes);
+	else
+		for (unsigned i = 0; i < staging.meshes.size(); i++)
+			if (staging.meshes[i].num[BUF_INDEX])
+				m_meshes[i].create(staging.meshes[i], m_maskEnabledBufData);
+	flattenNodes();
+
+	// nothing refers to the scene any more
+	if (!m_bKeepScene)
+		releaseScene();
+}
+
+void C3dglModel::releaseScene()
+{
+	if (m_pScene)
+		aiReleaseImport(m_pScene);
+	m_pScene = NULL;
+}
+
+void C3dglModel::createShared(vector<MESHDATA> &meshes)
+{
+	auto isValid = [](const MESHDATA &data) { return data.num[BUF_INDEX] && data.pData[BUF_VERTEX]; };
+
+	// the streams present in any of the meshes - missing ones will be filled with zeros
+	MESHDATA shared;
+	bool bPresent[BUF_LAST] = { false };
+	for (MESHDATA &data : meshes)
+		if (isValid(data))
+			for (int bufId = BUF_VERTEX; bufId < BUF_LAST; bufId++)
+				if (data.pData[bufId])
+				{
+					bPresent[bufId] = true;
+					if (bufId == BUF_TEXCOORD) shared.nUVComponents = max(shared.nUVComponents, data.nUVComponents);
+				}
+
+	// concatenate the meshes: indices remain local to each mesh and are offset by the base vertex when drawn
+	vector<char> streams[BUF_LAST];
+	vector<unsigned> baseVertex(meshes.size()), firstIndex(meshes.size());
+	unsigned nVertices = 0, nIndices = 0;
+	bool bFirst = true;
+	for (unsigned i = 0; i < meshes.size(); i++)
+	{
+		MESHDATA &data = meshes[i];
+		baseVertex[i] = nVertices;
+		firstIndex[i] = nIndices;
+		if (!isValid(data)) continue;
+		unsigned nNum = data.num[BUF_VERTEX];
+
+		for (int bufId = BUF_VERTEX; bufId < BUF_LAST; bufId++)
+		{
+			if (!bPresent[bufId]) continue;
+			vector<char> &stream = streams[bufId];
+			if (bufId == BUF_TEXCOORD)
+			{
+				// converted to the common number of components
+				const float *p = (const float*)data.pData[bufId];
+				vector<float> texCoords((size_t)nNum * shared.nUVComponents, 0.0f);
+				for (unsigned j = 0; p && j < nNum; j++)
+					for (unsigned k = 0; k < min(data.nUVComponents, shared.nUVComponents); k++)
+						texCoords[j * shared.nUVComponents + k] = p[j * data.nUVComponents + k];
+				stream.insert(stream.end(), (const char*)texCoords.data(), (const char*)(texCoords.data() + texCoords.size()));
+			}
+			else if (data.pData[bufId])
+				stream.insert(stream.end(), (const char*)data.pData[bufId], (const char*)data.pData[bufId] + (size_t)data.size[bufId] * data.num[bufId]);
+			else
+				stream.resize(stream.size() + (size_t)MESHDATA::getElementSize(bufId) * nNum, 0);
+		}
+		nVertices += nNum;
+		nIndices += data.num[BUF_INDEX];
+
+		// the bounding box of all meshes
+		if (bFirst)
+		{
+			shared.bb[0] = data.bb[0];
+			shared.bb[1] = data.bb[1];
+			bFirst = false;
+		}
+		if (data.bb[0].x < shared.bb[0].x) shared.bb[0].x = data.bb[0].x;
+		if (data.bb[0].y < shared.bb[0].y) shared.bb[0].y = data.bb[0].y;
+		if (data.bb[0].z < shared.bb[0].z) shared.bb[0].z = data.bb[0].z;
+		if (data.bb[1].x > shared.bb[1].x) shared.bb[1].x = data.bb[1].x;
+		if (data.bb[1].y > shared.bb[1].y) shared.bb[1].y = data.bb[1].y;
+		if (data.bb[1].z > shared.bb[1].z) shared.bb[1].z = data.bb[1].z;
+	}
+	if (nIndices == 0) return;
+
+	for (int bufId = BUF_VERTEX; bufId < BUF_LAST; bufId++)
+		if (bPresent[bufId])
+		{
+			shared.pData[bufId] = streams[bufId].data();
+			shared.size[bufId] = MESHDATA::getElementSize(bufId);
+			shared.num[bufId] = streams[bufId].size() / shared.size[bufId];
+		}
+
+	// one VAO for all meshes
+	m_shared.create(shared);
+	for (unsigned i = 0; i < meshes.size(); i++)
+		if (isValid(meshes[i]))
+			m_meshes[i].create(meshes[i], &m_shared, baseVertex[i], firstIndex[i], m_maskEnabledBufData);
+}
+
+void C3dglModel::loadMaterials(const char* pTexRootPath)
+{
+	loadMaterials(pTexRootPath, NULL);
+}
+
+void C3dglModel::loadMaterials(const char* pTexRootPath, const vector<C3dglTextureCache::IMAGE> *pImages)
+{
+	auto getImage = [&](unsigned i) { return (pImages && i < pImages->size()) ? &(*pImages)[i] : NULL; };
+	if (!m_pRootNode) return;
+	m_materials.resize(m_materialData.size(), MATERIAL(this));
+	for (unsigned i = 0; i < m_materials.size(); i++)
+		m_materials[i].create(m_materialData[i], pTexRootPath, getImage(i));
+
+	// the model is complete now
+	logMemoryUsage();
+}
+
+void C3dglModel::logMemoryUsage()
+{
+	MEMORYUSAGE usage = getMemoryUsage();
+	logInfo("memory: CPU " + to_string(usage.nCPUBytes / 1024) + " KB, buffers " + to_string(usage.nBufferBytes / 1024) + " KB, textures " + to_string(usage.nTextureBytes / 1024) + " KB");
+}
+
+void C3dglModel::prepareMaterials(const char* pTexRootPath, STAGING &staging)
+{
+	// the textures are decoded here; the upload goes through the texture cache
+	staging.images.resize(m_materialData.size());
+	for (unsigned i = 0; i < m_materialData.size(); i++)
+	{
+		const MATERIALDATA &data = m_materialData[i];
+		if (!data.texPath.empty())
+			C3dglTextureCache::decode(MATERIAL::getTexturePath(pTexRootPath ? pTexRootPath : "", data.texPath), staging.images[i]);
+	}
+}
+
+void C3dglModel::destroy()
+{
+	if (m_pRootNode)
+	{
+		for (MESH mesh : m_meshes)
+			mesh.destroy();
+		for (MATERIAL mat : m_materials)
+			mat.destroy();
+		m_meshes.clear();
+		m_materials.clear();
+		m_shared.destroy();
+		m_shared = MESH(this);
+		if (m_idInstanceBuffer)
+			glDeleteBuffers(1, &m_idInstanceBuffer);
+		m_idInstanceBuffer = 0;
+		m_nInstanceBytes = 0;
+		releaseScene();
+		delete m_pRootNode;
+		m_pRootNode = NULL;
+		m_materialData.clear();
+		m_animations.clear();
+		m_bvh.clear();
+		m_bvhParts.clear();
+		flattenNodes();
 	}
 }
 
@@ -496,53 +1266,339 @@ void C3dglModel::enableBufData(ATTRIB_STD bufId, bool bEnable)
 		m_maskEnabledBufData &= ~(1 << bufId);
 }
 
-void C3dglModel::renderNode(aiNode *pNode, glm::mat4 m)
+void C3dglModel::flattenNodes()
 {
-	aiMatrix4x4 mx = pNode->mTransformation;;
-	aiTransposeMatrix4(&mx);
-	m *= glm::make_mat4((GLfloat*)&mx);
+	m_nodes.clear();
+	m_draws.clear();
+	m_drawMeshes.clear();
+	m_drawCounts.clear();
+	m_drawOffsets.clear();
+	m_drawBaseVertices.clear();
+
+	bool bShared = m_shared.getVAO() != 0;
+	std::function<void(aiNode*, int)> flatten = [&](aiNode *pNode, int nParent)
+	{
+		unsigned i = m_nodes.size();
+		FLATNODE node;
+		node.pNode = pNode;
+		node.nParent = nParent;
+		aiMatrix4x4 mx = pNode->mTransformation;
+		aiTransposeMatrix4(&mx);
+		node.local = glm::make_mat4((GLfloat*)&mx);
+		node.global = (nParent >= 0) ? m_nodes[nParent].global * node.local : node.local;
+
+		// meshes grouped by material - sorted only with the shared buffers, where each group is drawn with a single call
+		vector<unsigned> meshes(pNode->mMeshes, pNode->mMeshes + pNode->mNumMeshes);
+		if (bShared)
+			stable_sort(meshes.begin(), meshes.end(), [&](unsigned a, unsigned b) { return m_meshes[a].getMaterialIndex() < m_meshes[b].getMaterialIndex(); });
+		node.nFirstDraw = m_draws.size();
+		for (unsigned iMesh : meshes)
+		{
+			MESH *pMesh = &m_meshes[iMesh];
+			if (pMesh->getIndexCount() == 0 || (bShared && !pMesh->getShared())) continue;
+			if (m_draws.size() == node.nFirstDraw || m_draws.back().nMaterialIndex != pMesh->getMaterialIndex())
+				m_draws.push_back(FLATDRAW{ pMesh->getMaterialIndex(), (unsigned)m_drawMeshes.size(), 0 });
+			m_draws.back().nCount++;
+			m_drawMeshes.push_back(iMesh);
+			if (bShared)
+			{
+				m_drawCounts.push_back(pMesh->getIndexCount());
+				m_drawOffsets.push_back(pMesh->getIndexOffset());
+				m_drawBaseVertices.push_back(pMesh->getBaseVertex());
+			}
+		}
+		node.nDraws = m_draws.size() - node.nFirstDraw;
+		m_nodes.push_back(node);
+
+		for (aiNode *p : vector<aiNode*>(pNode->mChildren, pNode->mChildren + pNode->mNumChildren))
+			flatten(p, i);
+		m_nodes[i].nEnd = m_nodes.size();
+	};
+	if (m_pRootNode)
+		flatten(m_pRootNode, -1);
+	m_worldTransforms.resize(m_nodes.size());
+	m_lodCounts.reserve(m_drawMeshes.size());
+	m_lodOffsets.reserve(m_drawMeshes.size());
+	m_lodBaseVertices.reserve(m_drawMeshes.size());
+	computeBounds();
+	resolveAnimations();
+}
+
+void C3dglModel::computeBounds()
+{
+	// the meshes of each node first; then the subtrees - children follow their parents, so a single backward pass collects them
+	for (FLATNODE &node : m_nodes)
+	{
+		emptyBB(node.bb);
+		for (unsigned iMesh : vector<unsigned>(node.pNode->mMeshes, node.pNode->mMeshes + node.pNode->mNumMeshes))
+			addBB(node.bb, m_meshes[iMesh].getPosedBB(), node.global);
+	}
+	for (unsigned i = m_nodes.size(); i-- > 1; )
+	{
+		const aiVector3D *bb = m_nodes[i].bb;
+		aiVector3D *BB = m_nodes[m_nodes[i].nParent].bb;
+		BB[0].x = min(BB[0].x, bb[0].x); BB[0].y = min(BB[0].y, bb[0].y); BB[0].z = min(BB[0].z, bb[0].z);
+		BB[1].x = max(BB[1].x, bb[1].x); BB[1].y = max(BB[1].y, bb[1].y); BB[1].z = max(BB[1].z, bb[1].z);
+	}
+}
+
+void C3dglModel::updateBounds(const float *pTransforms)
+{
+	for (MESH &mesh : m_meshes)
+		mesh.updatePosedBB(pTransforms);
+	computeBounds();
+}
+
+void C3dglModel::renderNodes(unsigned nFirst, unsigned nEnd, glm::mat4 matrix, unsigned nInstances, const C3dglFrustum *pFrustum, float fPixelsPerUnit)
+{
+	// world transforms: a single pass, parents are always ready before their children
+	for (unsigned i = nFirst; i < nEnd; i++)
+	{
+		const FLATNODE &node = m_nodes[i];
+		m_worldTransforms[i] = (node.nParent >= (int)nFirst ? m_worldTransforms[node.nParent] : matrix) * node.local;
+	}
 
 	// check if a shading program is active
 	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
-	
+
 	// send model view matrix
-	if (pProgram)
-		pProgram->SendStandardUniform(C3dglProgram::UNI_MODELVIEW, m);
-	else
+	auto sendMatrix = [&](const glm::mat4 &m)
+	{
+		if (pProgram)
+			pProgram->SendStandardUniform(C3dglProgram::UNI_MODELVIEW, m);
+		else
+		{
+			glMatrixMode(GL_MODELVIEW);
+			glLoadIdentity();
+			glMultMatrixf((GLfloat*)&m);
+		}
+	};
+
+	// bind the material - unless already bound by the previous draw
+	MATERIAL *pBoundMaterial = NULL;
+	auto bindMaterial = [&](MATERIAL *pMaterial)
 	{
-		glMatrixMode(GL_MODELVIEW);
-		glLoadIdentity();
-		glMultMatrixf((GLfloat*)&m);
+		if (pMaterial && pMaterial != pBoundMaterial)
+		{
+			pMaterial->bind();
+			pBoundMaterial = pMaterial;
+		}
+	};
+
+	// the coarsest level of detail whose error, projected to the screen, does not exceed m_fLODPixelError
+	auto selectLOD = [&](MESH *pMesh, const glm::mat4 &m) -> unsigned
+	{
+		if (fPixelsPerUnit <= 0 || pMesh->getLODCount() < 2) return 0;
+		float fScale = sqrt(max(max(glm::dot(glm::vec3(m[0]), glm::vec3(m[0])), glm::dot(glm::vec3(m[1]), glm::vec3(m[1]))), glm::dot(glm::vec3(m[2]), glm::vec3(m[2]))));
+		aiVector3D centre = pMesh->getCentre();
+		float fDistance = glm::length(glm::vec3(m * glm::vec4(centre.x, centre.y, centre.z, 1))) - pMesh->getRadius() * fScale;
+		if (fDistance <= 0 || fScale <= 0) return 0;
+		return pMesh->getLOD(m_fLODPixelError * fDistance / (fScale * fPixelsPerUnit));
+	};
+
+	// meshlets: the back-facing ones are culled only if GL culls the back faces (of the counter-clockwise front faces)
+	bool bMeshlets = m_bMeshlets && pFrustum && !nInstances, bCones = false;
+	if (bMeshlets && glIsEnabled(GL_CULL_FACE))
+	{
+		GLint nCullFace, nFrontFace;
+		glGetIntegerv(GL_CULL_FACE_MODE, &nCullFace);
+		glGetIntegerv(GL_FRONT_FACE, &nFrontFace);
+		bCones = nCullFace == GL_BACK && nFrontFace == GL_CCW;
 	}
 
-	for (unsigned iMesh : vector<unsigned>(pNode->mMeshes, pNode->mMeshes + pNode->mNumMeshes))
+	// the visible meshlets of a mesh, or its selected level of detail, appended to the multi-draw parameters
+	auto addRanges = [&](MESH *pMesh, const FLATNODE &node, unsigned nLevel, const glm::vec3 &camera, bool bNodeCones)
+	{
+		if (bMeshlets && nLevel == 0 && pMesh->getMeshletCount())
+			pMesh->cullMeshlets(*pFrustum, node.global, camera, bNodeCones, m_lodCounts, m_lodOffsets);
+		else
+		{
+			m_lodCounts.push_back(pMesh->getIndexCount(nLevel));
+			m_lodOffsets.push_back(pMesh->getIndexOffset(nLevel));
+		}
+		m_lodBaseVertices.resize(m_lodCounts.size(), pMesh->getBaseVertex());
+	};
+
+	// shared buffers: the VAO is bound once for all nodes
+	bool bShared = m_shared.getVAO() != 0;
+	if (bShared)
+		glBindVertexArray(m_shared.getVAO());
+
+	for (unsigned i = nFirst; i < nEnd; i++)
 	{
-		MESH *pMesh = &m_meshes[iMesh];
-		MATERIAL *pMaterial = pMesh->getMaterial();
-		if (pMaterial) pMaterial->bind();
-		pMesh->render();
+		const FLATNODE &node = m_nodes[i];
+
+		// skip the whole subtree if it is empty or outside the frustum
+		if (pFrustum && (node.bb[0].x > node.bb[1].x || !pFrustum->testAABB(glm::vec3(node.bb[0].x, node.bb[0].y, node.bb[0].z), glm::vec3(node.bb[1].x, node.bb[1].y, node.bb[1].z))))
+		{
+			i = node.nEnd - 1;
+			continue;
+		}
+
+		if (node.nDraws == 0) continue;
+		const glm::mat4 &m = m_worldTransforms[i];
+
+		// meshlets: the camera in the space of the node, unless the node is mirrored (which turns the faces around)
+		glm::vec3 camera(0);
+		bool bNodeCones = false;
+		if (bMeshlets)
+		{
+			camera = glm::vec3(glm::inverse(m)[3]);
+			bNodeCones = bCones && glm::determinant(glm::mat3(m)) > 0;
+		}
+
+		if (bShared)
+		{
+			// with the compact layout, a single dequantisation covers the whole model
+			if (m_shared.isCompact())
+				sendMatrix(m * m_shared.getDequantization());
+			else
+				sendMatrix(m);
+			for (unsigned d = node.nFirstDraw; d < node.nFirstDraw + node.nDraws; d++)
+			{
+				const FLATDRAW &draw = m_draws[d];
+				bindMaterial(getMaterial(draw.nMaterialIndex));
+				if (nInstances)
+					for (unsigned j = draw.nFirst; j < draw.nFirst + draw.nCount; j++)
+						glDrawElementsInstancedBaseVertex(GL_TRIANGLES, m_drawCounts[j], m_shared.getIndexType(), m_drawOffsets[j], nInstances, m_drawBaseVertices[j]);
+				else if (fPixelsPerUnit > 0)
+				{
+					m_lodCounts.clear();
+					m_lodOffsets.clear();
+					m_lodBaseVertices.clear();
+					for (unsigned j = draw.nFirst; j < draw.nFirst + draw.nCount; j++)
+					{
+						MESH *pMesh = &m_meshes[m_drawMeshes[j]];
+						addRanges(pMesh, node, selectLOD(pMesh, m), camera, bNodeCones);
+					}
+					if (!m_lodCounts.empty())
+						glMultiDrawElementsBaseVertex(GL_TRIANGLES, m_lodCounts.data(), m_shared.getIndexType(), m_lodOffsets.data(), m_lodCounts.size(), m_lodBaseVertices.data());
+				}
+				else
+					glMultiDrawElementsBaseVertex(GL_TRIANGLES, &m_drawCounts[draw.nFirst], m_shared.getIndexType(), &m_drawOffsets[draw.nFirst], draw.nCount, &m_drawBaseVertices[draw.nFirst]);
+			}
+		}
+		else
+		{
+			sendMatrix(m);
+			bool bDequant = false;		// true if the last matrix sent includes the dequantisation of a compact mesh
+			for (unsigned d = node.nFirstDraw; d < node.nFirstDraw + node.nDraws; d++)
+			{
+				const FLATDRAW &draw = m_draws[d];
+				for (unsigned j = draw.nFirst; j < draw.nFirst + draw.nCount; j++)
+				{
+					MESH *pMesh = &m_meshes[m_drawMeshes[j]];
+					if (pMesh->isCompact())
+						sendMatrix(m * pMesh->getDequantization());
+					else if (bDequant)
+						sendMatrix(m);
+					bDequant = pMesh->isCompact();
+
+					bindMaterial(getMaterial(draw.nMaterialIndex));
+					unsigned nLevel = nInstances ? 0 : selectLOD(pMesh, m);
+					if (nInstances)
+						pMesh->renderInstanced(nInstances);
+					else if (bMeshlets && nLevel == 0 && pMesh->getMeshletCount())
+					{
+						m_lodCounts.clear();
+						m_lodOffsets.clear();
+						unsigned nRanges = pMesh->cullMeshlets(*pFrustum, node.global, camera, bNodeCones, m_lodCounts, m_lodOffsets);
+						pMesh->render(m_lodCounts.data(), m_lodOffsets.data(), nRanges);
+					}
+					else
+						pMesh->render(nLevel);
+				}
+			}
+		}
 	}
 
-	// draw all children
-	for (aiNode *p : vector<aiNode*>(pNode->mChildren, pNode->mChildren + pNode->mNumChildren))
-		renderNode(p, m);
+	if (bShared)
+		glBindVertexArray(0);
+}
+
+void C3dglModel::renderNode(aiNode *pNode, glm::mat4 m)
+{
+	for (unsigned i = 0; i < m_nodes.size(); i++)
+		if (m_nodes[i].pNode == pNode)
+		{
+			renderNodes(i, m_nodes[i].nEnd, m);
+			return;
+		}
 }
 
 void C3dglModel::render(glm::mat4 matrix)
 {
-	if (m_pScene->mRootNode)
-		renderNode(m_pScene->mRootNode, matrix);
+	renderNodes(0, m_nodes.size(), matrix);
+}
+
+void C3dglModel::render(glm::mat4 matrix, glm::mat4 matrixProjection)
+{
+	// the frustum in the model space, where the node bounds are
+	C3dglFrustum frustum(matrixProjection, matrix);
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	renderNodes(0, m_nodes.size(), matrix, 0, &frustum, 0.5f * viewport[3] * matrixProjection[1][1]);
+}
+
+void C3dglModel::renderInstanced(glm::mat4 matrix, const glm::mat4 *pInstances, unsigned nInstances, const glm::vec4 *pTints)
+{
+	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
+	if (!pProgram || !pInstances || nInstances == 0 || m_nodes.empty()) return;
+	GLuint attribMatrix = pProgram->GetAttribLocation("aInstanceMatrix");
+	GLuint attribTint = pProgram->GetAttribLocation("aInstanceTint");
+	if (attribMatrix == (GLuint)-1) return;
+
+	// fill the instance buffer - the staging vector only grows, so that no allocations happen in a steady state
+	if (m_instances.size() < nInstances)
+		m_instances.resize(nInstances);
+	for (unsigned i = 0; i < nInstances; i++)
+	{
+		m_instances[i].matrix = matrix * pInstances[i];
+		m_instances[i].tint = pTints ? pTints[i] : glm::vec4(1.0f);
+	}
+	if (m_idInstanceBuffer == 0)
+		glGenBuffers(1, &m_idInstanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_idInstanceBuffer);
+	glBufferData(GL_ARRAY_BUFFER, nInstances * sizeof(INSTANCE), m_instances.data(), GL_STREAM_DRAW);
+	m_nInstanceBytes = nInstances * sizeof(INSTANCE);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// attach the buffer to the VAOs
+	if (m_shared.getVAO())
+		m_shared.enableInstancing(m_idInstanceBuffer, attribMatrix, attribTint);
+	else
+		for (MESH &mesh : m_meshes)
+			if (mesh.getIndexCount())
+				mesh.enableInstancing(m_idInstanceBuffer, attribMatrix, attribTint);
+
+	// the node transforms are sent as the model-view matrix; the shader applies the instance matrix on top
+	pProgram->SendUniform("instancing", 1);
+	renderNodes(0, m_nodes.size(), glm::mat4(1.0f), nInstances);
+	pProgram->SendUniform("instancing", 0);
 }
 
 void C3dglModel::render(unsigned iNode, glm::mat4 matrix)
 {
-	// update transform
-	aiMatrix4x4 m = m_pScene->mRootNode->mTransformation;
-	aiTransposeMatrix4(&m);
-	matrix *= glm::make_mat4((GLfloat*)&m);
+	if (!m_pRootNode || iNode >= m_pRootNode->mNumChildren) return;
+
+	// the children of the root follow one another - each after the subtree of the previous one
+	unsigned i = 1;
+	while (iNode--)
+		i = m_nodes[i].nEnd;
+	renderNodes(i, m_nodes[i].nEnd, matrix * m_nodes[0].local);
+}
 
-	if (m_pScene  && m_pScene->mRootNode && iNode <= m_pScene->mRootNode->mNumChildren)
-		renderNode(m_pScene->mRootNode->mChildren[iNode], matrix);
+void C3dglModel::render(unsigned iNode, glm::mat4 matrix, glm::mat4 matrixProjection)
+{
+	if (!m_pRootNode || iNode >= m_pRootNode->mNumChildren) return;
+
+	unsigned i = 1;
+	while (iNode--)
+		i = m_nodes[i].nEnd;
+	C3dglFrustum frustum(matrixProjection, matrix);
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	renderNodes(i, m_nodes[i].nEnd, matrix * m_nodes[0].local, 0, &frustum, 0.5f * viewport[3] * matrixProjection[1][1]);
 }
 
 void C3dglModel::render()
@@ -590,19 +1646,10 @@ bool C3dglModel::getBBNode(aiNode *pNode, aiVector3D BB[2], aiMatrix4x4* trafo)
 	aiMatrix4x4 prev = *trafo;
 	aiMultiplyMatrix4(trafo, &pNode->mTransformation);
 
+	aiMatrix4x4 mx = *trafo;
+	aiTransposeMatrix4(&mx);
 	for (unsigned iMesh : vector<unsigned>(pNode->mMeshes, pNode->mMeshes + pNode->mNumMeshes))
-	{
-		aiVector3D bb[2];
-		memcpy(bb, m_meshes[iMesh].getBB(), sizeof(bb));
-		aiTransformVecByMatrix4(&bb[0], trafo);
-		aiTransformVecByMatrix4(&bb[1], trafo);
-		if (bb[0].x < BB[0].x) BB[0].x = bb[0].x;
-		if (bb[0].y < BB[0].y) BB[0].y = bb[0].y;
-		if (bb[0].z < BB[0].z) BB[0].z = bb[0].z;
-		if (bb[1].x > BB[0].x) BB[1].x = bb[1].x;
-		if (bb[1].y > BB[0].y) BB[1].y = bb[1].y;
-		if (bb[1].z > BB[0].z) BB[1].z = bb[1].z;
-	}
+		addBB(BB, m_meshes[iMesh].getPosedBB(), glm::make_mat4((GLfloat*)&mx));
 
 	for (aiNode *pNode : vector<aiNode*>(pNode->mChildren, pNode->mChildren + pNode->mNumChildren))
 		getBBNode(pNode, BB, trafo);
@@ -613,12 +1660,30 @@ bool C3dglModel::getBBNode(aiNode *pNode, aiVector3D BB[2], aiMatrix4x4* trafo)
 
 void C3dglModel::getBB(aiVector3D BB[2])
 {
-	aiMatrix4x4 trafo;
-	aiIdentityMatrix4(&trafo);
+	if (m_nodes.empty())
+		emptyBB(BB);
+	else
+		memcpy(BB, m_nodes[0].bb, 2 * sizeof(aiVector3D));
+}
 
-	BB[0].x = BB[0].y = BB[0].z =  1e10f;
-	BB[1].x = BB[1].y = BB[1].z = -1e10f;
-	getBBNode(m_pScene->mRootNode, BB, &trafo);
+void C3dglModel::getBB(unsigned iNode, aiVector3D BB[2])
+{
+	emptyBB(BB);
+	if (!m_pRootNode || iNode >= m_pRootNode->mNumChildren) return;
+
+	unsigned i = 1;
+	while (iNode--)
+		i = m_nodes[i].nEnd;
+	memcpy(BB, m_nodes[i].bb, 2 * sizeof(aiVector3D));
+}
+
+void C3dglModel::getBoundingSphere(aiVector3D &centre, float &radius)
+{
+	// around the bounding box
+	aiVector3D BB[2];
+	getBB(BB);
+	centre = 0.5f * (BB[0] + BB[1]);
+	radius = (BB[0].x > BB[1].x) ? 0 : 0.5f * (BB[1] - BB[0]).Length();
 }
 
 std::string C3dglModel::getName()
@@ -629,103 +1694,1288 @@ std::string C3dglModel::getName()
 		return "Model(" + m_name + ")";
 }
 
+// capacity of a vector, in bytes
+template <class T> static size_t bytesOf(const vector<T> &v)	{ return v.capacity() * sizeof(T); }
+
+static size_t bytesOfNode(const aiNode *pNode)
+{
+	size_t n = sizeof(aiNode) + pNode->mNumMeshes * sizeof(unsigned) + pNode->mNumChildren * sizeof(aiNode*);
+	for (unsigned i = 0; i < pNode->mNumChildren; i++)
+		n += bytesOfNode(pNode->mChildren[i]);
+	return n;
+}
+
+C3dglModel::MEMORYUSAGE C3dglModel::getMemoryUsage()
+{
+	MEMORYUSAGE usage = { 0, 0, 0 };
+
+	// CPU: the node hierarchy and everything built from it
+	if (m_pRootNode)
+		usage.nCPUBytes += bytesOfNode(m_pRootNode);
+	usage.nCPUBytes += bytesOf(m_nodes) + bytesOf(m_draws) + bytesOf(m_drawMeshes) + bytesOf(m_drawCounts) + bytesOf(m_drawOffsets) + bytesOf(m_drawBaseVertices)
+		+ bytesOf(m_worldTransforms) + bytesOf(m_lodCounts) + bytesOf(m_lodOffsets) + bytesOf(m_lodBaseVertices) + bytesOf(m_instances);
+	usage.nCPUBytes += bytesOf(m_materialData) + bytesOf(m_offsetBones) + m_mapBones.size() * (sizeof(string) + sizeof(unsigned) + 32) + bytesOf(m_nodeBones);
+	for (ANIMATION &animation : m_animations)
+	{
+		usage.nCPUBytes += sizeof(ANIMATION) + bytesOf(animation.channels);
+		for (ANIMCHANNEL &channel : animation.channels)
+			usage.nCPUBytes += bytesOf(channel.positionKeys) + bytesOf(channel.rotationKeys) + bytesOf(channel.scalingKeys);
+	}
+	for (vector<int> &channels : m_nodeChannels)
+		usage.nCPUBytes += bytesOf(channels);
+	usage.nCPUBytes += m_bvh.getMemorySize() + bytesOf(m_bvhParts);
+
+	// the copies kept for getBufferData, and the buffers
+	for (MESH &mesh : m_meshes)
+	{
+		usage.nCPUBytes += mesh.getDataBytes() + mesh.getMeshletCount() * sizeof(MESHLET);
+		usage.nBufferBytes += mesh.getBufferBytes();
+	}
+	usage.nCPUBytes += m_shared.getDataBytes();
+	usage.nBufferBytes += m_shared.getBufferBytes();
+	usage.nBufferBytes += m_nInstanceBytes;
+
+	// textures - each counted once
+	set<unsigned> textures;
+	for (MATERIAL &material : m_materials)
+		if (material.getTexture() != 0xFFFFFFFF && textures.insert(material.getTexture()).second)
+			usage.nTextureBytes += C3dglTextureCache::getDefault().getTextureBytes(material.getTexture());
+
+	return usage;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Ray Queries
+
+void C3dglModel::prepareBVH(const STAGING &staging)
+{
+	m_bvh.clear();
+	m_bvhParts.clear();
+	if (!m_bBVH || !m_pRootNode)
+		return;
+
+	// the nodes in pre-order, as flattenNodes numbers them, with their transforms to the model space
+	unsigned iNode = 0;
+	std::function<void(aiNode*, const glm::mat4&)> add = [&](aiNode *pNode, const glm::mat4 &parent)
+	{
+		aiMatrix4x4 mx = pNode->mTransformation;
+		aiTransposeMatrix4(&mx);
+		glm::mat4 m = parent * glm::make_mat4((GLfloat*)&mx);
+		for (unsigned iMesh : vector<unsigned>(pNode->mMeshes, pNode->mMeshes + pNode->mNumMeshes))
+		{
+			if (iMesh >= staging.meshes.size()) continue;
+			const MESHDATA &data = staging.meshes[iMesh];
+			if (!data.pData[BUF_VERTEX] || !data.num[BUF_INDEX] || data.size[BUF_INDEX] != sizeof(unsigned)) continue;
+
+			// the full level of detail only
+			unsigned nFirst = data.nLODs ? data.lods[0].nFirst : 0, nCount = data.nLODs ? data.lods[0].nCount : data.num[BUF_INDEX];
+			BVHPART part = { m_bvh.getTriangleCount(), iNode, iMesh };
+			m_bvhParts.push_back(part);
+			m_bvh.addTriangles((const glm::vec3*)data.pData[BUF_VERTEX], (const unsigned*)data.pData[BUF_INDEX] + nFirst, nCount / 3, &m);
+		}
+		iNode++;
+		for (aiNode *p : vector<aiNode*>(pNode->mChildren, pNode->mChildren + pNode->mNumChildren))
+			add(p, m);
+	};
+	add(m_pRootNode, glm::mat4(1));
+
+	auto timeStart = chrono::steady_clock::now();
+	m_bvh.build();
+	char buf[128];
+	snprintf(buf, sizeof(buf), "BVH: %u triangles, %u nodes, %u KB, built in %.1f ms", m_bvh.getTriangleCount(), m_bvh.getNodeCount(), 
+		(unsigned)(m_bvh.getMemorySize() / 1024), chrono::duration<float, milli>(chrono::steady_clock::now() - timeStart).count());
+	logInfo(buf);
+}
+
+bool C3dglModel::rayCast(glm::vec3 origin, glm::vec3 dir, float tMax, RAYHIT &hit)
+{
+	C3dglBVH::RAY ray = { origin, dir, tMax };
+	C3dglBVH::HIT bvhHit;
+	hit.t = tMax;
+	if (!m_bvh.intersect(ray, bvhHit))
+		return false;
+
+	// the part the triangle belongs to
+	auto it = upper_bound(m_bvhParts.begin(), m_bvhParts.end(), bvhHit.nTriangle, [](unsigned n, const BVHPART &part) { return n < part.nFirstTriangle; }) - 1;
+	glm::vec3 v0, v1, v2;
+	m_bvh.getTriangle(bvhHit.nTriangle, v0, v1, v2);
+	hit.t = bvhHit.t;
+	hit.point = origin + bvhHit.t * dir;
+	hit.normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+	hit.iNode = it->iNode;
+	hit.iMesh = it->iMesh;
+	hit.nTriangle = bvhHit.nTriangle - it->nFirstTriangle;
+	return true;
+}
+
+bool C3dglModel::rayCast(glm::mat4 matrix, glm::vec3 origin, glm::vec3 dir, float tMax, RAYHIT &hit)
+{
+	// the ray goes to the model space; t does not change, as the direction is transformed along
+	glm::mat4 inv = glm::inverse(matrix);
+	if (!rayCast(glm::vec3(inv * glm::vec4(origin, 1)), glm::vec3(inv * glm::vec4(dir, 0)), tMax, hit))
+		return false;
+	hit.point = origin + hit.t * dir;
+	hit.normal = glm::normalize(glm::vec3(glm::transpose(inv) * glm::vec4(hit.normal, 0)));
+	return true;
+}
+
+bool C3dglModel::rayTest(glm::vec3 origin, glm::vec3 dir, float tMax)
+{
+	C3dglBVH::RAY ray = { origin, dir, tMax };
+	return m_bvh.occluded(ray);
+}
+
+bool C3dglModel::rayTest(glm::mat4 matrix, glm::vec3 origin, glm::vec3 dir, float tMax)
+{
+	glm::mat4 inv = glm::inverse(matrix);
+	return rayTest(glm::vec3(inv * glm::vec4(origin, 1)), glm::vec3(inv * glm::vec4(dir, 0)), tMax);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Mesh Optimisation
+
+#define VERTEX_CACHE_SIZE		32		// LRU cache size assumed by the optimiser
+#define VERTEX_CACHE_FIFO		16		// FIFO cache size used to measure the results
+
+// the number of vertex cache misses for a triangle list, on a simulated FIFO cache
+static unsigned simulateVertexCache(const vector<unsigned> &indices, unsigned nVertices)
+{
+	// a vertex is in the cache if fewer than VERTEX_CACHE_FIFO misses happened since it was loaded
+	vector<unsigned> stamps(nVertices, 0);		// 1 + number of misses before the vertex was loaded; 0 = never loaded
+	unsigned nMisses = 0;
+	for (unsigned i : indices)
+		if (stamps[i] == 0 || nMisses - (stamps[i] - 1) >= VERTEX_CACHE_FIFO)
+			stamps[i] = ++nMisses;
+	return nMisses;
+}
+
+// Reorders a triangle list for the post-transform vertex cache.
+// Based on Tom Forsyth, "Linear-Speed Vertex Cache Optimisation" (2006): each vertex is scored by its position
+// in a simulated LRU cache and by the number of triangles still using it; the next triangle is always
+// the best scoring one among those using the cached vertices.
+static void optimiseVertexCache(vector<unsigned> &indices, unsigned nVertices)
+{
+	unsigned nTriangles = indices.size() / 3;
+
+	// triangles using each vertex
+	vector<unsigned> offsets(nVertices + 1, 0), triangles(indices.size());
+	for (unsigned i : indices)
+		offsets[i + 1]++;
+	for (unsigned v = 0; v < nVertices; v++)
+		offsets[v + 1] += offsets[v];
+	vector<unsigned> remaining(nVertices);		// triangles not yet added
+	for (unsigned v = 0; v < nVertices; v++)
+		remaining[v] = offsets[v + 1] - offsets[v];
+	{
+		vector<unsigned> fill(offsets.begin(), offsets.end() - 1);
+		for (unsigned i = 0; i < indices.size(); i++)
+			triangles[fill[indices[i]]++] = i / 3;
+	}
+
+	// scores
+	float cacheScores[VERTEX_CACHE_SIZE];
+	for (int i = 0; i < VERTEX_CACHE_SIZE; i++)
+		cacheScores[i] = (i < 3) ? 0.75f : pow(1.0f - (float)(i - 3) / (VERTEX_CACHE_SIZE - 3), 1.5f);
+	vector<int> cachePos(nVertices, -1);
+	auto vertexScore = [&](unsigned v) -> float
+	{
+		if (remaining[v] == 0) return -1.0f;
+		float fScore = cachePos[v] >= 0 ? cacheScores[cachePos[v]] : 0.0f;
+		return fScore + 2.0f / sqrt((float)remaining[v]);	// valence boost
+	};
+	vector<float> vertexScores(nVertices), triangleScores(nTriangles, 0.0f);
+	for (unsigned v = 0; v < nVertices; v++)
+		vertexScores[v] = vertexScore(v);
+	for (unsigned i = 0; i < indices.size(); i++)
+		triangleScores[i / 3] += vertexScores[indices[i]];
+	vector<bool> added(nTriangles, false);
+
+	vector<unsigned> result;
+	result.reserve(indices.size());
+	vector<unsigned> cache, newCache;
+	unsigned nScan = 0;				// fallback: the first triangle that may not be added yet
+	int iBest = -1;
+	while (result.size() < indices.size())
+	{
+		if (iBest < 0)
+		{
+			while (added[nScan]) nScan++;
+			iBest = nScan;
+		}
+
+		// add the triangle
+		added[iBest] = true;
+		const unsigned *pTri = &indices[iBest * 3];
+		for (int j = 0; j < 3; j++)
+		{
+			result.push_back(pTri[j]);
+			remaining[pTri[j]]--;
+		}
+
+		// update the cache: the triangle vertices go to the front
+		newCache.assign(pTri, pTri + 3);
+		for (unsigned v : cache)
+			if (v != pTri[0] && v != pTri[1] && v != pTri[2])
+				newCache.push_back(v);
+		for (unsigned i = 0; i < newCache.size(); i++)
+			cachePos[newCache[i]] = (i < VERTEX_CACHE_SIZE) ? (int)i : -1;
+		if (newCache.size() > VERTEX_CACHE_SIZE)
+			newCache.resize(VERTEX_CACHE_SIZE);
+		swap(cache, newCache);
+
+		// update the scores of the affected vertices and triangles; select the next triangle
+		iBest = -1;
+		float fBest = -1.0f;
+		auto update = [&](unsigned v)
+		{
+			float fScore = vertexScore(v);
+			float fDelta = fScore - vertexScores[v];
+			vertexScores[v] = fScore;
+			for (unsigned i = offsets[v]; i < offsets[v + 1]; i++)
+			{
+				unsigned t = triangles[i];
+				if (added[t]) continue;
+				triangleScores[t] += fDelta;
+				if (triangleScores[t] > fBest)
+				{
+					fBest = triangleScores[t];
+					iBest = t;
+				}
+			}
+		};
+		for (unsigned v : newCache)		// the vertices pushed out of the cache
+			if (cachePos[v] < 0) update(v);
+		for (unsigned v : cache)
+			update(v);
+	}
+	indices.swap(result);
+}
+
+void C3dglModel::MESH::optimise(MESHDATA &data, bool bMeshlets)
+{
+	unsigned nVertices = data.num[BUF_VERTEX];
+	vector<unsigned> &indices = data.indices;
+	if (nVertices == 0 || indices.empty() || indices.size() % 3 || data.pData[BUF_INDEX] != indices.data())
+		return;
+
+	data.nMissesBefore = simulateVertexCache(indices, nVertices);
+	optimiseVertexCache(indices, nVertices);
+	if (bMeshlets)
+		buildMeshlets(data);
+	data.pData[BUF_INDEX] = indices.data();
+
+	// vertices in the order of their first use - unused ones at the end
+	vector<unsigned> remap(nVertices, (unsigned)-1);
+	unsigned nNext = 0;
+	for (unsigned &i : indices)
+	{
+		if (remap[i] == (unsigned)-1) remap[i] = nNext++;
+		i = remap[i];
+	}
+	for (unsigned &r : remap)
+		if (r == (unsigned)-1) r = nNext++;
+
+	for (int bufId = BUF_VERTEX; bufId < BUF_INDEX; bufId++)
+	{
+		if (!data.pData[bufId]) continue;
+		size_t nStride = (size_t)data.size[bufId] * data.num[bufId] / nVertices;
+		vector<char> &stream = data.reordered[bufId];
+		stream.resize(nStride * nVertices);
+		const char *pSrc = (const char*)data.pData[bufId];
+		for (unsigned v = 0; v < nVertices; v++)
+			memcpy(&stream[remap[v] * nStride], pSrc + v * nStride, nStride);
+		data.pData[bufId] = stream.data();
+	}
+
+	data.nMissesAfter = simulateVertexCache(indices, nVertices);
+}
+
+// Greedy clustering: a meshlet starts with the first triangle not yet used (in the vertex cache order) and grows by
+// the triangles sharing its vertices - those adding the fewest new vertices first, then those closest to its average normal.
+// The triangles are reordered so that each meshlet is a range of the index buffer.
+void C3dglModel::MESH::buildMeshlets(MESHDATA &data)
+{
+	vector<unsigned> &indices = data.indices;
+	const aiVector3D *pVertices = (const aiVector3D*)data.pData[BUF_VERTEX];
+	unsigned nVertices = data.num[BUF_VERTEX], nTriangles = indices.size() / 3;
+	data.meshlets.clear();
+	if (!pVertices || nTriangles == 0) return;
+
+	// triangles using each vertex
+	vector<unsigned> first(nVertices + 1, 0), adjacency(indices.size());
+	for (unsigned i : indices)
+		first[i + 1]++;
+	for (unsigned v = 0; v < nVertices; v++)
+		first[v + 1] += first[v];
+	vector<unsigned> fill(first.begin(), first.end() - 1);
+	for (unsigned i = 0; i < indices.size(); i++)
+		adjacency[fill[indices[i]]++] = i / 3;
+
+	// unit face normals - zero for the degenerate triangles
+	vector<aiVector3D> normals(nTriangles);
+	for (unsigned t = 0; t < nTriangles; t++)
+	{
+		const aiVector3D &a = pVertices[indices[t * 3]], &b = pVertices[indices[t * 3 + 1]], &c = pVertices[indices[t * 3 + 2]];
+		aiVector3D n = (b - a) ^ (c - a);
+		float fLength = n.Length();
+		normals[t] = fLength > 0 ? n / fLength : aiVector3D(0, 0, 0);
+	}
+
+	vector<char> used(nTriangles, 0);
+	vector<unsigned> tags(nVertices, (unsigned)-1);		// the last meshlet using each vertex
+	vector<unsigned> locals(nVertices);					// the index of each vertex within its last meshlet
+	vector<unsigned> result, candidates, vertices, local;
+	result.reserve(indices.size());
+	unsigned nNext = 0;									// the first triangle that may be unused
+	while (result.size() < indices.size())
+	{
+		unsigned iMeshlet = data.meshlets.size();
+		unsigned nMeshletVertices = 0, nMeshletTriangles = 0;
+		aiVector3D axis(0, 0, 0);
+		candidates.clear();
+		vertices.clear();
+
+		auto addTriangle = [&](unsigned t)
+		{
+			used[t] = 1;
+			for (unsigned k = 0; k < 3; k++)
+			{
+				unsigned v = indices[t * 3 + k];
+				result.push_back(v);
+				if (tags[v] == iMeshlet) continue;
+				tags[v] = iMeshlet;
+				locals[v] = nMeshletVertices++;
+				vertices.push_back(v);
+				for (unsigned j = first[v]; j < first[v + 1]; j++)
+					if (!used[adjacency[j]])
+						candidates.push_back(adjacency[j]);
+			}
+			axis += normals[t];
+			nMeshletTriangles++;
+		};
+
+		while (nMeshletTriangles < MAX_MESHLET_TRIANGLES)
+		{
+			aiVector3D dir = axis.SquareLength() > 0 ? aiVector3D(axis).Normalize() : axis;
+			unsigned iBest = (unsigned)-1;
+			float fBest = FLT_MAX;
+			for (unsigned c = 0; c < candidates.size(); )
+			{
+				unsigned t = candidates[c];
+				if (used[t])
+				{
+					candidates[c] = candidates.back();
+					candidates.pop_back();
+					continue;
+				}
+				unsigned nNew = (tags[indices[t * 3]] != iMeshlet) + (tags[indices[t * 3 + 1]] != iMeshlet) + (tags[indices[t * 3 + 2]] != iMeshlet);
+				float fScore = nNew + 0.5f * (1 - normals[t] * dir);
+				if (nMeshletVertices + nNew <= MAX_MESHLET_VERTICES && fScore < fBest)
+				{
+					fBest = fScore;
+					iBest = t;
+				}
+				c++;
+			}
+			if (iBest == (unsigned)-1)
+			{
+				// no neighbour fits - a new meshlet, unless the next unused triangle still fits in this one
+				if (!candidates.empty()) break;
+				while (used[nNext]) nNext++;
+				if (nMeshletVertices + 3 > MAX_MESHLET_VERTICES) break;
+				iBest = nNext;
+			}
+			addTriangle(iBest);
+			if (result.size() == indices.size()) break;
+		}
+
+		MESHLET meshlet;
+		meshlet.nCount = nMeshletTriangles * 3;
+		meshlet.nFirst = result.size() - meshlet.nCount;
+
+		// the growth order does not suit the vertex cache - the triangles of the meshlet are reordered again
+		local.clear();
+		for (unsigned i = meshlet.nFirst; i < result.size(); i++)
+			local.push_back(locals[result[i]]);
+		optimiseVertexCache(local, nMeshletVertices);
+		for (unsigned i = 0; i < local.size(); i++)
+			result[meshlet.nFirst + i] = vertices[local[i]];
+
+		// the bounding sphere around the centre of the box, and the normal cone
+		aiVector3D bb[2] = { pVertices[result[meshlet.nFirst]], pVertices[result[meshlet.nFirst]] };
+		for (unsigned i = meshlet.nFirst; i < result.size(); i++)
+		{
+			const aiVector3D &vec = pVertices[result[i]];
+			bb[0].x = min(bb[0].x, vec.x); bb[0].y = min(bb[0].y, vec.y); bb[0].z = min(bb[0].z, vec.z);
+			bb[1].x = max(bb[1].x, vec.x); bb[1].y = max(bb[1].y, vec.y); bb[1].z = max(bb[1].z, vec.z);
+		}
+		meshlet.centre = 0.5f * (bb[0] + bb[1]);
+		meshlet.radius = 0;
+		for (unsigned i = meshlet.nFirst; i < result.size(); i++)
+			meshlet.radius = max(meshlet.radius, (pVertices[result[i]] - meshlet.centre).SquareLength());
+		meshlet.radius = sqrt(meshlet.radius);
+
+		// cutoff = sin of the widest angle between the axis and a normal; a cone wider than 90 degrees (less a margin) is not culled
+		meshlet.coneAxis = axis.SquareLength() > 0 ? axis.Normalize() : aiVector3D(0, 0, 1);
+		float fMinDot = axis.SquareLength() > 0 ? 1.0f : -1.0f;
+		for (unsigned i = meshlet.nFirst; i < result.size(); i += 3)
+		{
+			const aiVector3D &a = pVertices[result[i]], &b = pVertices[result[i + 1]], &c = pVertices[result[i + 2]];
+			aiVector3D n = (b - a) ^ (c - a);
+			float fLength = n.Length();
+			if (fLength > 0)
+				fMinDot = min(fMinDot, (n / fLength) * meshlet.coneAxis);
+		}
+		meshlet.coneCutoff = fMinDot <= 0.1f ? 1.0f : sqrt(1 - fMinDot * fMinDot);
+		data.meshlets.push_back(meshlet);
+	}
+	indices.swap(result);
+	data.pMeshlets = data.meshlets.data();
+	data.nMeshlets = data.meshlets.size();
+}
+
+// Error quadric (Garland & Heckbert, "Surface Simplification Using Quadric Error Metrics", 1997):
+// the sum of the squared distances of a point to a set of planes, stored as a symmetric 4x4 matrix
+struct QUADRIC
+{
+	double a[10];		// xx xy xz xw yy yz yw zz zw ww
+
+	QUADRIC()			{ memset(a, 0, sizeof(a)); }
+
+	void addPlane(double x, double y, double z, double w)
+	{
+		a[0] += x * x; a[1] += x * y; a[2] += x * z; a[3] += x * w;
+		a[4] += y * y; a[5] += y * z; a[6] += y * w;
+		a[7] += z * z; a[8] += z * w; a[9] += w * w;
+	}
+	void add(const QUADRIC &q)
+	{
+		for (int i = 0; i < 10; i++)
+			a[i] += q.a[i];
+	}
+	double error(const aiVector3D &v) const
+	{
+		double x = v.x, y = v.y, z = v.z;
+		double e = a[0] * x * x + a[4] * y * y + a[7] * z * z + a[9]
+			+ 2 * (a[1] * x * y + a[2] * x * z + a[3] * x + a[5] * y * z + a[6] * y + a[8] * z);
+		return e > 0 ? e : 0;
+	}
+};
+
+// Simplifies a triangle list by half-edge collapses, the cheapest first (by the quadric error).
+// The vertices sharing a position (texture or normal seams) are welded, so that the surface does not tear:
+// a seam vertex only moves along the seam. As the vertices only move onto their neighbours, all the levels
+// of detail index the original vertex buffer. Border and non-manifold vertices are locked.
+class SIMPLIFIER
+{
+	const aiVector3D *m_pPositions;
+	vector<unsigned> m_posIds;					// vertex -> welded position
+	vector<unsigned> m_wedgeOffsets, m_wedges;	// welded position -> the vertices at that position
+	vector<QUADRIC> m_quadrics;					// per welded position
+	vector<bool> m_locked;
+	vector<unsigned> m_triangles;				// the current triangle list
+	float m_fError;								// the largest error of a collapse made so far
+
+	const aiVector3D &pos(unsigned p)			{ return m_pPositions[m_wedges[m_wedgeOffsets[p]]]; }
+
+	// an edge of welded positions, as a sortable key
+	static unsigned long long edge(unsigned p0, unsigned p1)
+	{
+		return p0 < p1 ? ((unsigned long long)p0 << 32) | p1 : ((unsigned long long)p1 << 32) | p0;
+	}
+
+public:
+	SIMPLIFIER(const aiVector3D *pPositions, unsigned nVertices, const vector<unsigned> &indices)
+		: m_pPositions(pPositions), m_triangles(indices), m_fError(0)
+	{
+		// weld the vertices: sorted by position, equal positions are adjacent
+		m_wedges.resize(nVertices);
+		for (unsigned v = 0; v < nVertices; v++)
+			m_wedges[v] = v;
+		sort(m_wedges.begin(), m_wedges.end(), [pPositions](unsigned i, unsigned j)
+		{
+			const aiVector3D &a = pPositions[i], &b = pPositions[j];
+			return a.x != b.x ? a.x < b.x : a.y != b.y ? a.y < b.y : a.z < b.z;
+		});
+		m_posIds.resize(nVertices);
+		m_wedgeOffsets.assign(1, 0);
+		for (unsigned i = 0; i < nVertices; i++)
+		{
+			if (i > 0 && pPositions[m_wedges[i]] != pPositions[m_wedges[i - 1]])
+				m_wedgeOffsets.push_back(i);
+			m_posIds[m_wedges[i]] = m_wedgeOffsets.size() - 1;
+		}
+		m_wedgeOffsets.push_back(nVertices);
+		unsigned nPositions = m_wedgeOffsets.size() - 1;
+
+		// the quadrics of the planes of the triangles around each position
+		m_quadrics.resize(nPositions);
+		for (unsigned t = 0; t < m_triangles.size(); t += 3)
+		{
+			const aiVector3D &a = pPositions[m_triangles[t]], &b = pPositions[m_triangles[t + 1]], &c = pPositions[m_triangles[t + 2]];
+			aiVector3D n = (b - a) ^ (c - a);
+			float fLength = n.Length();
+			if (fLength == 0) continue;
+			n /= fLength;
+			for (int j = 0; j < 3; j++)
+				m_quadrics[m_posIds[m_triangles[t + j]]].addPlane(n.x, n.y, n.z, -(n * a));
+		}
+
+		// lock the positions on the edges not shared by exactly two triangles
+		vector<unsigned long long> edges;
+		edges.reserve(m_triangles.size());
+		for (unsigned i = 0; i < m_triangles.size(); i++)
+			edges.push_back(edge(m_posIds[m_triangles[i]], m_posIds[m_triangles[i - i % 3 + (i + 1) % 3]]));
+		sort(edges.begin(), edges.end());
+		m_locked.assign(nPositions, false);
+		for (unsigned i = 0, j; i < edges.size(); i = j)
+		{
+			for (j = i + 1; j < edges.size() && edges[j] == edges[i]; j++);
+			if (j - i != 2)
+				m_locked[edges[i] >> 32] = m_locked[edges[i] & 0xffffffff] = true;
+		}
+	}
+
+	const vector<unsigned> &getTriangles()		{ return m_triangles; }
+	unsigned getTriangleCount()					{ return m_triangles.size() / 3; }
+	float getError()							{ return m_fError; }
+
+	// collapses the edges until nTarget triangles are left, or no collapse within the error fMaxError remains
+	void simplify(unsigned nTarget, float fMaxError)
+	{
+		double maxCost = (double)fMaxError * fMaxError;
+		unsigned nPositions = m_quadrics.size();
+		vector<unsigned> offsets, adjacent;
+		vector<unsigned long long> edges;
+		vector<bool> touched;
+		vector<unsigned> remap;					// vertex -> vertex it is collapsed onto
+		vector<pair<unsigned, unsigned> > wedgeMap;
+
+		struct COLLAPSE
+		{
+			unsigned u, v;						// u moves onto v
+			double cost;
+			bool operator<(const COLLAPSE &c) const	{ return cost < c.cost; }
+		};
+		vector<COLLAPSE> collapses;
+
+		// independent collapses are made in passes: a collapse touches all the triangles around u
+		while (getTriangleCount() > nTarget)
+		{
+			unsigned nTriangles = getTriangleCount();
+
+			// triangles around each position
+			offsets.assign(nPositions + 1, 0);
+			for (unsigned i : m_triangles)
+				offsets[m_posIds[i] + 1]++;
+			for (unsigned p = 0; p < nPositions; p++)
+				offsets[p + 1] += offsets[p];
+			adjacent.resize(m_triangles.size());
+			{
+				vector<unsigned> fill(offsets.begin(), offsets.end() - 1);
+				for (unsigned i = 0; i < m_triangles.size(); i++)
+					adjacent[fill[m_posIds[m_triangles[i]]]++] = i / 3;
+			}
+
+			// the cheaper direction of each edge
+			edges.clear();
+			for (unsigned i = 0; i < m_triangles.size(); i++)
+				edges.push_back(edge(m_posIds[m_triangles[i]], m_posIds[m_triangles[i - i % 3 + (i + 1) % 3]]));
+			sort(edges.begin(), edges.end());
+			edges.erase(unique(edges.begin(), edges.end()), edges.end());
+			collapses.clear();
+			for (unsigned long long e : edges)
+			{
+				unsigned p0 = (unsigned)(e >> 32), p1 = (unsigned)(e & 0xffffffff);
+				QUADRIC q = m_quadrics[p0];
+				q.add(m_quadrics[p1]);
+				COLLAPSE c0 = { p0, p1, m_locked[p0] ? DBL_MAX : q.error(pos(p1)) };
+				COLLAPSE c1 = { p1, p0, m_locked[p1] ? DBL_MAX : q.error(pos(p0)) };
+				COLLAPSE &c = c1 < c0 ? c1 : c0;
+				if (c.cost <= maxCost)
+					collapses.push_back(c);
+			}
+			sort(collapses.begin(), collapses.end());
+
+			touched.assign(nPositions, false);
+			remap.resize(m_posIds.size());
+			for (unsigned v = 0; v < remap.size(); v++)
+				remap[v] = v;
+			unsigned nCollapses = 0;
+			for (COLLAPSE &c : collapses)
+			{
+				if (nTriangles <= nTarget) break;
+				if (touched[c.u] || touched[c.v]) continue;
+
+				// the vertices of u are mapped to the vertices of v in the triangles collapsed with the edge
+				wedgeMap.clear();
+				unsigned nRemoved = 0;
+				for (unsigned i = offsets[c.u]; i < offsets[c.u + 1]; i++)
+				{
+					const unsigned *pTri = &m_triangles[adjacent[i] * 3];
+					int ju = -1, jv = -1;
+					for (int j = 0; j < 3; j++)
+						if (m_posIds[pTri[j]] == c.u) ju = j;
+						else if (m_posIds[pTri[j]] == c.v) jv = j;
+					if (jv < 0) continue;
+					wedgeMap.push_back(make_pair(pTri[ju], pTri[jv]));
+					nRemoved++;
+				}
+
+				// the remaining triangles around u: each vertex of u must have a match (or the seam would be broken),
+				// and no triangle may flip
+				bool bValid = true;
+				for (unsigned i = offsets[c.u]; bValid && i < offsets[c.u + 1]; i++)
+				{
+					const unsigned *pTri = &m_triangles[adjacent[i] * 3];
+					int ju = 0;
+					bool bCollapsed = false;
+					for (int j = 0; j < 3; j++)
+						if (m_posIds[pTri[j]] == c.u) ju = j;
+						else if (m_posIds[pTri[j]] == c.v) bCollapsed = true;
+					if (bCollapsed) continue;
+
+					bool bMatched = false;
+					for (auto &w : wedgeMap)
+						bMatched = bMatched || w.first == pTri[ju];
+					const aiVector3D &a = m_pPositions[pTri[(ju + 1) % 3]], &b = m_pPositions[pTri[(ju + 2) % 3]];
+					aiVector3D n0 = (a - m_pPositions[pTri[ju]]) ^ (b - m_pPositions[pTri[ju]]);
+					aiVector3D n1 = (a - pos(c.v)) ^ (b - pos(c.v));
+					bValid = bMatched && n0 * n1 > 0.25f * n0.Length() * n1.Length();
+				}
+				if (!bValid) continue;
+
+				for (unsigned i = offsets[c.u]; i < offsets[c.u + 1]; i++)
+					for (int j = 0; j < 3; j++)
+						touched[m_posIds[m_triangles[adjacent[i] * 3 + j]]] = true;
+				for (auto &w : wedgeMap)
+					remap[w.first] = w.second;
+				m_quadrics[c.v].add(m_quadrics[c.u]);
+				m_fError = max(m_fError, (float)sqrt(c.cost));
+				nTriangles -= nRemoved;
+				nCollapses++;
+			}
+			if (nCollapses == 0) break;
+
+			// apply the collapses, dropping the degenerate triangles
+			unsigned nOut = 0;
+			for (unsigned t = 0; t < m_triangles.size(); t += 3)
+			{
+				unsigned i0 = remap[m_triangles[t]], i1 = remap[m_triangles[t + 1]], i2 = remap[m_triangles[t + 2]];
+				unsigned p0 = m_posIds[i0], p1 = m_posIds[i1], p2 = m_posIds[i2];
+				if (p0 == p1 || p1 == p2 || p2 == p0) continue;
+				m_triangles[nOut++] = i0;
+				m_triangles[nOut++] = i1;
+				m_triangles[nOut++] = i2;
+			}
+			m_triangles.resize(nOut);
+		}
+	}
+};
+
+void C3dglModel::MESH::simplify(MESHDATA &data, unsigned nLevels, float fMaxError)
+{
+	unsigned nVertices = data.num[BUF_VERTEX];
+	vector<unsigned> &indices = data.indices;
+	if (nVertices == 0 || indices.empty() || indices.size() % 3 || data.pData[BUF_INDEX] != indices.data())
+		return;
+
+	LOD lod = { 0, (unsigned)indices.size(), 0.0f };
+	data.lods[0] = lod;
+	data.nLODs = 1;
+
+	// each level has at most half the triangles of the previous one; the error allowed doubles with each level,
+	// up to fMaxError times the size of the mesh for the coarsest one
+	SIMPLIFIER simplifier((const aiVector3D*)data.pData[BUF_VERTEX], nVertices, indices);
+	float fSize = (data.bb[1] - data.bb[0]).Length();
+	for (unsigned n = 1; n < nLevels && n < MAX_LODS; n++)
+	{
+		unsigned nBefore = data.lods[data.nLODs - 1].nCount / 3;
+		simplifier.simplify(nBefore / 2, fMaxError * fSize / (1 << (nLevels - 1 - n)));
+
+		// not worth a level unless at least a quarter of the triangles are gone - the next, coarser pass may do better
+		if (simplifier.getTriangleCount() * 4 > nBefore * 3)
+			continue;
+
+		vector<unsigned> triangles = simplifier.getTriangles();
+		optimiseVertexCache(triangles, nVertices);
+		lod.nFirst = indices.size();
+		lod.nCount = triangles.size();
+		lod.fError = simplifier.getError();
+		data.lods[data.nLODs++] = lod;
+		indices.insert(indices.end(), triangles.begin(), triangles.end());
+	}
+	data.pData[BUF_INDEX] = indices.data();
+	data.num[BUF_INDEX] = indices.size();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Cooked Format
+
+// sequential reader of a mapped cooked file: all reads are bounds checked and 4-byte aligned
+struct C3dglModel::COOKEDREADER
+{
+	const char *p, *pEnd;
+
+	template<class T> const T *read(size_t n = 1)
+	{
+		size_t nSize = sizeof(T) * n;
+		if (n > (size_t)(pEnd - p) / sizeof(T)) return NULL;
+		const T *pData = (const T*)p;
+		p += min((nSize + 3) & ~(size_t)3, (size_t)(pEnd - p));
+		return pData;
+	}
+};
+
+bool C3dglModel::saveCooked(const char* pFile)
+{
+	if (!m_pScene)
+	{
+		logWarning("the scene has been released - see enableKeepScene");
+		return false;
+	}
+
+	// the streams are converted again, exactly as for the upload
+	vector<MESHDATA> meshes(m_meshes.size());
+	for (unsigned i = 0; i < m_meshes.size(); i++)
+		m_meshes[i].prepare(m_pScene->mMeshes[i], meshes[i]);
+	return saveCooked(pFile, 0, m_nFlags, meshes);
+}
+
+bool C3dglModel::saveCooked(const char* pFile, unsigned long long nHash, unsigned flags, const vector<MESHDATA> &meshes)
+{
+	if (!m_pRootNode || meshes.size() != m_meshes.size()) return false;
+	if (!m_animations.empty())
+	{
+		logWarning("animations cannot be cooked");
+		return false;
+	}
+
+	COOKEDHEADER header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.id, "3DGM", 4);
+	header.version = 4;
+	header.hash = nHash;
+	header.flags = flags;
+	header.nMeshes = m_meshes.size();
+	header.nMaterials = m_materialData.size();
+	header.nBones = m_mapBones.size();
+	header.nOffsetBones = m_offsetBones.size();
+	header.nLODLevels = m_nLODLevels;
+	header.fLODError = m_fLODError;
+	header.bMeshlets = m_bMeshlets;
+	header.globalInverseTransform = m_GlobalInverseTransform;
+
+	// written to a temporary file first, so that a concurrent reader never sees a partial file
+	string tempFile = string(pFile) + ".tmp";
+	ofstream file(tempFile, ios::binary);
+	if (!file) return false;
+	auto write = [&](const void *pData, size_t nSize)
+	{
+		static const char padding[4] = { 0, 0, 0, 0 };
+		if (nSize) file.write((const char*)pData, nSize);
+		file.write(padding, ((nSize + 3) & ~(size_t)3) - nSize);
+		header.fileSize += (nSize + 3) & ~(size_t)3;
+	};
+	write(&header, sizeof(header));
+
+	// meshes - the streams as prepared for the upload
+	for (const MESHDATA &data : meshes)
+	{
+		COOKEDMESH mesh;
+		memset(&mesh, 0, sizeof(mesh));
+		if (data.num[BUF_INDEX])
+		{
+			memcpy(mesh.size, data.size, sizeof(mesh.size));
+			memcpy(mesh.num, data.num, sizeof(mesh.num));
+			mesh.nUVComponents = data.nUVComponents;
+			mesh.nMaterialIndex = data.nMaterialIndex;
+			mesh.bb[0] = data.bb[0];
+			mesh.bb[1] = data.bb[1];
+			mesh.nLODs = data.nLODs;
+			memcpy(mesh.lods, data.lods, sizeof(mesh.lods));
+			mesh.nMeshlets = data.nMeshlets;
+		}
+		write(&mesh, sizeof(mesh));
+		for (int b = 0; b < BUF_LAST; b++)
+			write(data.pData[b], mesh.size[b] * mesh.num[b]);
+		write(data.pMeshlets, mesh.nMeshlets * sizeof(MESHLET));
+	}
+
+	// materials
+	for (const MATERIALDATA &data : m_materialData)
+	{
+		COOKEDMATERIAL material;
+		memcpy(material.amb, data.amb, sizeof(material.amb));
+		memcpy(material.diff, data.diff, sizeof(material.diff));
+		memcpy(material.spec, data.spec, sizeof(material.spec));
+		memcpy(material.emiss, data.emiss, sizeof(material.emiss));
+		material.shininess = data.shininess;
+		material.nTexPath = data.texPath.size();
+		write(&material, sizeof(material));
+		write(data.texPath.c_str(), data.texPath.size());
+	}
+
+	// nodes, in pre-order
+	std::function<void(const aiNode*)> writeNode = [&](const aiNode *pNode)
+	{
+		COOKEDNODE node;
+		node.transformation = pNode->mTransformation;
+		node.nChildren = pNode->mNumChildren;
+		node.nMeshes = pNode->mNumMeshes;
+		node.nName = pNode->mName.length;
+		write(&node, sizeof(node));
+		write(pNode->mMeshes, pNode->mNumMeshes * sizeof(unsigned));
+		write(pNode->mName.data, pNode->mName.length);
+		header.nNodes++;
+		for (unsigned i = 0; i < pNode->mNumChildren; i++)
+			writeNode(pNode->mChildren[i]);
+	};
+	writeNode(m_pRootNode);
+
+	// bones, in the order of their ids
+	vector<string> boneNames(m_mapBones.size());
+	for (auto &bone : m_mapBones)
+		boneNames[bone.second] = bone.first;
+	for (unsigned i = 0; i < boneNames.size(); i++)
+	{
+		COOKEDBONE bone;
+		if (i < m_offsetBones.size())
+			bone.offset = m_offsetBones[i];
+		bone.nName = boneNames[i].size();
+		write(&bone, sizeof(bone));
+		write(boneNames[i].c_str(), boneNames[i].size());
+	}
+
+	// the header again - with the counts and the size known
+	file.seekp(0);
+	file.write((const char*)&header, sizeof(header));
+	bool bOK = file.good();
+	file.close();
+	if (bOK)
+	{
+		remove(pFile);
+		bOK = rename(tempFile.c_str(), pFile) == 0;
+	}
+	if (!bOK)
+		remove(tempFile.c_str());
+	return bOK;
+}
+
+aiNode *C3dglModel::readNode(COOKEDREADER &reader, aiNode *pParent, unsigned &nNodes)
+{
+	const COOKEDNODE *pNode = reader.read<COOKEDNODE>();
+	if (!pNode || nNodes == 0 || pNode->nChildren >= nNodes) return NULL;
+	nNodes--;
+	const unsigned *pMeshes = reader.read<unsigned>(pNode->nMeshes);
+	const char *pName = reader.read<char>(pNode->nName);
+	if (!pMeshes || !pName || pNode->nName >= MAXLEN) return NULL;
+	for (unsigned i = 0; i < pNode->nMeshes; i++)
+		if (pMeshes[i] >= m_meshes.size()) return NULL;
+
+	aiNode *p = new aiNode(string(pName, pNode->nName));
+	p->mTransformation = pNode->transformation;
+	p->mParent = pParent;
+	if (pNode->nMeshes)
+	{
+		p->mNumMeshes = pNode->nMeshes;
+		p->mMeshes = new unsigned[pNode->nMeshes];
+		memcpy(p->mMeshes, pMeshes, pNode->nMeshes * sizeof(unsigned));
+	}
+	if (pNode->nChildren)
+	{
+		p->mNumChildren = pNode->nChildren;
+		p->mChildren = new aiNode*[pNode->nChildren];
+		memset(p->mChildren, 0, pNode->nChildren * sizeof(aiNode*));
+		for (unsigned i = 0; i < pNode->nChildren; i++)
+			if ((p->mChildren[i] = readNode(reader, p, nNodes)) == NULL)
+			{
+				delete p;
+				return NULL;
+			}
+	}
+	return p;
+}
+
+bool C3dglModel::loadCooked(const char* pFile, unsigned long long nHash, unsigned flags, STAGING &staging)
+{
+	C3dglMappedFile &file = staging.file;
+	if (!file.open(pFile)) return false;
+	COOKEDREADER reader = { (const char*)file.getData(), (const char*)file.getData() + file.getSize() };
+
+	// nHash == 0 accepts any cooked file
+	const COOKEDHEADER *pHeader = reader.read<COOKEDHEADER>();
+	if (!pHeader || memcmp(pHeader->id, "3DGM", 4) != 0 || pHeader->version != 4 || pHeader->fileSize != file.getSize()
+		|| pHeader->nOffsetBones > pHeader->nBones)
+		return false;
+	if (nHash && (pHeader->hash != nHash || pHeader->flags != flags || pHeader->nLODLevels != m_nLODLevels || pHeader->fLODError != m_fLODError
+		|| (pHeader->bMeshlets != 0) != m_bMeshlets))
+		return false;
+
+	// meshes: the streams remain in the mapped file until uploaded
+	vector<MESHDATA> &meshes = staging.meshes;
+	meshes.assign(pHeader->nMeshes, MESHDATA());
+	for (MESHDATA &data : meshes)
+	{
+		const COOKEDMESH *pMesh = reader.read<COOKEDMESH>();
+		if (!pMesh) return false;
+		for (int b = 0; b < BUF_LAST; b++)
+		{
+			data.size[b] = pMesh->size[b];
+			data.num[b] = pMesh->num[b];
+			if (pMesh->size[b] * pMesh->num[b] == 0) continue;
+			if (pMesh->size[b] > 64 || (data.pData[b] = reader.read<char>((size_t)pMesh->size[b] * pMesh->num[b])) == NULL)
+				return false;
+		}
+		if (pMesh->nMeshlets && (data.pMeshlets = reader.read<MESHLET>(pMesh->nMeshlets)) == NULL)
+			return false;
+		data.nMeshlets = pMesh->nMeshlets;
+		data.nUVComponents = pMesh->nUVComponents;
+		data.nMaterialIndex = pMesh->nMaterialIndex;
+		data.bb[0] = pMesh->bb[0];
+		data.bb[1] = pMesh->bb[1];
+		if (pMesh->nLODs > MAX_LODS)
+			return false;
+		data.nLODs = pMesh->nLODs;
+		memcpy(data.lods, pMesh->lods, sizeof(data.lods));
+		for (unsigned n = 0; n < data.nLODs; n++)
+			if (data.lods[n].nCount % 3 || data.lods[n].nFirst > data.num[BUF_INDEX] || data.lods[n].nCount > data.num[BUF_INDEX] - data.lods[n].nFirst)
+				return false;
+		for (unsigned n = 0; n < data.nMeshlets; n++)
+			if (data.pMeshlets[n].nCount % 3 || data.pMeshlets[n].nFirst > data.num[BUF_INDEX] || data.pMeshlets[n].nCount > data.num[BUF_INDEX] - data.pMeshlets[n].nFirst)
+				return false;
+
+		// the streams must agree with each other - they are used without further checks
+		unsigned nNum = data.num[BUF_VERTEX];
+		for (int b = 0; b < BUF_LAST; b++)
+		{
+			if (!data.pData[b])
+			{
+				data.size[b] = data.num[b] = 0;
+				continue;
+			}
+			unsigned nExpected = (b == BUF_INDEX) ? data.num[b] : (b == BUF_TEXCOORD) ? nNum * data.nUVComponents : nNum;
+			if (data.size[b] != MESHDATA::getElementSize(b) || data.num[b] != nExpected)
+				return false;
+		}
+		if (data.pData[BUF_TEXCOORD] && data.nUVComponents != 2 && data.nUVComponents != 3)
+			return false;
+		if (data.num[BUF_INDEX] % 3)
+			return false;
+		const unsigned *pIndices = (const unsigned*)data.pData[BUF_INDEX];
+		for (unsigned i = 0; i < data.num[BUF_INDEX]; i++)
+			if (pIndices[i] >= nNum)
+				return false;
+	}
+
+	// materials
+	vector<MATERIALDATA> materials(pHeader->nMaterials);
+	for (MATERIALDATA &data : materials)
+	{
+		const COOKEDMATERIAL *pMat = reader.read<COOKEDMATERIAL>();
+		const char *pTexPath = pMat ? reader.read<char>(pMat->nTexPath) : NULL;
+		if (!pTexPath) return false;
+		memcpy(data.amb, pMat->amb, sizeof(data.amb));
+		memcpy(data.diff, pMat->diff, sizeof(data.diff));
+		memcpy(data.spec, pMat->spec, sizeof(data.spec));
+		memcpy(data.emiss, pMat->emiss, sizeof(data.emiss));
+		data.shininess = pMat->shininess;
+		data.texPath.assign(pTexPath, pMat->nTexPath);
+	}
+
+	// the file is valid so far: replace the current model
+	destroy();
+	m_meshes.resize(meshes.size(), MESH(this));
+
+	// nodes
+	unsigned nNodes = pHeader->nNodes;
+	m_pRootNode = readNode(reader, NULL, nNodes);
+
+	// bones
+	m_mapBones.clear();
+	m_offsetBones.clear();
+	for (unsigned i = 0; m_pRootNode && i < pHeader->nBones; i++)
+	{
+		const COOKEDBONE *pBone = reader.read<COOKEDBONE>();
+		const char *pName = pBone ? reader.read<char>(pBone->nName) : NULL;
+		if (!pName)
+		{
+			delete m_pRootNode;
+			m_pRootNode = NULL;
+			break;
+		}
+		m_mapBones[string(pName, pBone->nName)] = i;
+		if (i < pHeader->nOffsetBones)
+			m_offsetBones.push_back(pBone->offset);
+	}
+	if (!m_pRootNode || nNodes != 0)
+	{
+		delete m_pRootNode;
+		m_pRootNode = NULL;
+		m_meshes.clear();
+		return false;
+	}
+
+	logInfo(string("Loading cooked file: ") + pFile);
+	m_GlobalInverseTransform = pHeader->globalInverseTransform;
+	m_nFlags = pHeader->flags;
+	m_materialData.swap(materials);
+	prepareBVH(staging);
+	return true;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////
 // Articulated Animation Functions
 
-aiVector3D Interpolate(float AnimationTime, const aiVectorKey *pKeys, unsigned nKeys)
+void C3dglModel::resolveAnimations()
+{
+	m_nodeBones.assign(m_nodes.size(), -1);
+	m_nodeChannels.clear();
+	if (m_animations.empty()) return;	// cooked models carry no animations
+
+	for (unsigned i = 0; i < m_nodes.size(); i++)
+	{
+		auto it = m_mapBones.find(m_nodes[i].pNode->mName.data);
+		if (it != m_mapBones.end() && it->second < m_offsetBones.size())
+			m_nodeBones[i] = it->second;
+	}
+
+	m_nodeChannels.resize(m_animations.size());
+	for (unsigned iAnim = 0; iAnim < m_animations.size(); iAnim++)
+	{
+		// channels by node name - the first one wins; channels with no keys are ignored
+		const ANIMATION &animation = m_animations[iAnim];
+		map<string, int> mapChannels;
+		for (unsigned i = 0; i < animation.channels.size(); i++)
+		{
+			const ANIMCHANNEL &channel = animation.channels[i];
+			if (!channel.positionKeys.empty() && !channel.rotationKeys.empty() && !channel.scalingKeys.empty())
+				mapChannels.insert(make_pair(channel.nodeName, (int)i));
+		}
+
+		vector<int> &channels = m_nodeChannels[iAnim];
+		channels.assign(m_nodes.size(), -1);
+		for (unsigned i = 0; i < m_nodes.size(); i++)
+		{
+			auto it = mapChannels.find(m_nodes[i].pNode->mName.data);
+			if (it != mapChannels.end())
+				channels[i] = it->second;
+		}
+	}
+}
+
+// finds the key to interpolate from: the last one not later than time (or the first one).
+// The key found last time and the one after it are tried first - playing forward rarely skips more than a key.
+template <class KEY>
+static unsigned findKey(const KEY *pKeys, unsigned nKeys, float time, unsigned &cursor)
 {
-	// find a pair of keys to interpolate
-	unsigned i = 0;
-	while (i < nKeys - 1 && AnimationTime >= (float)pKeys[i + 1].mTime)
-		i++;
+	auto isValid = [&](unsigned i) { return (i == 0 || (float)pKeys[i].mTime <= time) && (i + 1 >= nKeys || time < (float)pKeys[i + 1].mTime); };
+	if (cursor < nKeys && isValid(cursor))
+		return cursor;
+	if (cursor + 1 < nKeys && isValid(cursor + 1))
+		return ++cursor;
+
+	// random seek
+	unsigned i = upper_bound(pKeys, pKeys + nKeys, time, [](float t, const KEY &key) { return t < (float)key.mTime; }) - pKeys;
+	return cursor = (i > 0) ? i - 1 : 0;
+}
 
-	// if out of bounds, return the last key
-	if (i >= nKeys - 1)
-		return pKeys[nKeys - 1].mValue;
+static aiVector3D interpolate(const aiVectorKey *pKeys, unsigned nKeys, float time, unsigned &cursor)
+{
+	unsigned i = findKey(pKeys, nKeys, time, cursor);
+	if (i + 1 >= nKeys)
+		return pKeys[i].mValue;		// past the last key
 
-	// interpolate
 	const aiVector3D& Start = pKeys[i].mValue;
 	const aiVector3D& End = pKeys[i + 1].mValue;
-	float f = (AnimationTime - (float)pKeys[i].mTime) / ((float)(pKeys[i + 1].mTime - pKeys[i].mTime));
+	float f = (time - (float)pKeys[i].mTime) / ((float)(pKeys[i + 1].mTime - pKeys[i].mTime));
 	return Start + f * (End - Start);
 }
 
-aiQuaternion Interpolate(float AnimationTime, const aiQuatKey *pKeys, unsigned nKeys)
+#ifdef _3DGL_SSE2
+static inline float dot4(__m128 a, __m128 b)
 {
-	// find a pair of keys to interpolate
-	unsigned i = 0;
-	while (i < nKeys - 1 && AnimationTime >= (float)pKeys[i + 1].mTime)
-		i++;
+	__m128 m = _mm_mul_ps(a, b);
+	m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+	m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtss_f32(m);
+}
+#endif
 
-	// if out of bounds, return the last key
-	if (i >= nKeys - 1)
-		return pKeys[nKeys - 1].mValue;
+// spherical interpolation (SLERP), normalised - the same as aiQuaternion::Interpolate followed by Normalize
+static aiQuaternion slerp(const aiQuaternion &q0, const aiQuaternion &q1, float f)
+{
+#ifdef _3DGL_SSE2
+	__m128 a = _mm_loadu_ps(&q0.w);
+	__m128 b = _mm_loadu_ps(&q1.w);
+	float cosom = dot4(a, b);
+	if (cosom < 0)
+	{
+		cosom = -cosom;
+		b = _mm_sub_ps(_mm_setzero_ps(), b);
+	}
 
-	const aiQuaternion& StartRotationQ = pKeys[i].mValue;
-	const aiQuaternion& EndRotationQ   = pKeys[i + 1].mValue;    
-	float f = (AnimationTime - (float)pKeys[i].mTime) / ((float)(pKeys[i + 1].mTime - pKeys[i].mTime));
+	float sclp = 1 - f, sclq = f;	// very close: linear interpolation
+	if (1 - cosom > 0.0001f)
+	{
+		float omega = acos(cosom);
+		float sinom = sin(omega);
+		sclp = sin((1 - f) * omega) / sinom;
+		sclq = sin(f * omega) / sinom;
+	}
+	__m128 q = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(sclp), a), _mm_mul_ps(_mm_set1_ps(sclq), b));
+
+	float mag = sqrt(dot4(q, q));
+	if (mag)
+		q = _mm_mul_ps(q, _mm_set1_ps(1 / mag));
+	aiQuaternion res;
+	_mm_storeu_ps(&res.w, q);
+	return res;
+#else
 	aiQuaternion q;
-	aiQuaternion::Interpolate(q, StartRotationQ, EndRotationQ, f);	// spherical interpolation (SLERP)
+	aiQuaternion::Interpolate(q, q0, q1, f);
 	return q.Normalize();
+#endif
 }
 
-void ReadNodeHierarchy(const aiAnimation *pAnimation, float AnimationTime, const aiNode* pNode, const aiMatrix4x4& ParentTransform, vector<pair<string, aiMatrix4x4>>& transforms)
-{    
-	aiMatrix4x4 transform;
-     
-	// find animation node
-	unsigned i = 0;
-	string strNodeName = pNode->mName.data;
-	while (i < pAnimation->mNumChannels && string(pAnimation->mChannels[i]->mNodeName.data) != strNodeName)
-		i++;
-    
-	if (i < pAnimation->mNumChannels)
-	{
-		const aiNodeAnim *pNodeAnim = pAnimation->mChannels[i];
-
-		// Interpolate position, rotation and scaling
-		aiVector3D vecTranslate = Interpolate(AnimationTime, pNodeAnim->mPositionKeys, pNodeAnim->mNumPositionKeys);
-		aiQuaternion quatRotate = Interpolate(AnimationTime, pNodeAnim->mRotationKeys, pNodeAnim->mNumRotationKeys);
-		aiVector3D vecScale =     Interpolate(AnimationTime, pNodeAnim->mScalingKeys, pNodeAnim->mNumScalingKeys);
-
-		// create matrices
-		aiMatrix4x4 matTranslate, matScale;
-		aiMatrix4x4::Translation(vecTranslate, matTranslate);
-		aiMatrix4x4 matRotate = aiMatrix4x4(quatRotate.GetMatrix());
-		aiMatrix4x4::Scaling(vecScale, matScale);
-        
-		// Combine the above transformations
-		transform = ParentTransform * matTranslate * matRotate * matScale;
-	}
-	else
-		transform = ParentTransform * pNode->mTransformation;
+static aiQuaternion interpolate(const aiQuatKey *pKeys, unsigned nKeys, float time, unsigned &cursor)
+{
+	unsigned i = findKey(pKeys, nKeys, time, cursor);
+	if (i + 1 >= nKeys)
+		return pKeys[i].mValue;		// past the last key
 
-	transforms.push_back(pair<string, aiMatrix4x4>(strNodeName, transform));
+	float f = (time - (float)pKeys[i].mTime) / ((float)(pKeys[i + 1].mTime - pKeys[i].mTime));
+	return slerp(pKeys[i].mValue, pKeys[i + 1].mValue, f);
+}
 
-	for (unsigned i = 0 ; i < pNode->mNumChildren ; i++)
-		ReadNodeHierarchy(pAnimation, AnimationTime, pNode->mChildren[i], transform, transforms);
+// c = a * b; c may be the same as a or b
+static inline void multiply(const aiMatrix4x4 &a, const aiMatrix4x4 &b, aiMatrix4x4 &c)
+{
+#ifdef _3DGL_SSE2
+	// each row of c is a combination of the rows of b
+	const float *pA = &a.a1;
+	const float *pB = &b.a1;
+	__m128 b0 = _mm_loadu_ps(pB), b1 = _mm_loadu_ps(pB + 4), b2 = _mm_loadu_ps(pB + 8), b3 = _mm_loadu_ps(pB + 12);
+	for (unsigned i = 0; i < 4; i++)
+	{
+		const float *pRow = pA + 4 * i;
+		__m128 r = _mm_mul_ps(_mm_set1_ps(pRow[0]), b0);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(pRow[1]), b1));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(pRow[2]), b2));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(pRow[3]), b3));
+		_mm_storeu_ps(&c.a1 + 4 * i, r);
+	}
+#else
+	c = a * b;
+#endif
 }
 
-void C3dglModel::getBoneTransforms(unsigned iAnimation, float time, vector<float>& Transforms)
+// writes (a * b) transposed - column-major, as expected by OpenGL
+static inline void multiplyTransposed(const aiMatrix4x4 &a, const aiMatrix4x4 &b, float *pOut)
 {
-	float fTicksPerSecond = (float)GetScene()->mAnimations[0]->mTicksPerSecond;
-	if (fTicksPerSecond == 0) fTicksPerSecond = 25.0f;
-	time = fmod(time * fTicksPerSecond, (float)GetScene()->mAnimations[0]->mDuration);
+#ifdef _3DGL_SSE2
+	aiMatrix4x4 m;
+	multiply(a, b, m);
+	__m128 r0 = _mm_loadu_ps(&m.a1), r1 = _mm_loadu_ps(&m.b1), r2 = _mm_loadu_ps(&m.c1), r3 = _mm_loadu_ps(&m.d1);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_ps(pOut, r0);
+	_mm_storeu_ps(pOut + 4, r1);
+	_mm_storeu_ps(pOut + 8, r2);
+	_mm_storeu_ps(pOut + 12, r3);
+#else
+	aiMatrix4x4 m = (a * b).Transpose();
+	memcpy(pOut, &m, sizeof(m));
+#endif
+}
 
-	vector<pair<string, aiMatrix4x4>> pairs;
-	aiMatrix4x4 transform;
-	ReadNodeHierarchy(GetScene()->mAnimations[iAnimation], time, GetScene()->mRootNode, transform, pairs);
+void C3dglModel::getBoneTransforms(unsigned iAnimation, float time, vector<float>& Transforms)
+{
+	if (m_animations.empty()) return;	// cooked models carry no animations
 
 	Transforms.resize(m_offsetBones.size() * 16);	// 16 floats per bone matrix
+	if (!Transforms.empty())
+		getBoneTransforms(iAnimation, time, Transforms.data(), m_cursor);
+}
+
+void C3dglModel::getBoneTransforms(unsigned iAnimation, float time, float *pTransforms, ANIMCURSOR &cursor)
+{
+	if (iAnimation >= m_nodeChannels.size()) return;
+	const ANIMATION &animation = m_animations[iAnimation];
+
+	float fTicksPerSecond = animation.fTicksPerSecond;
+	if (fTicksPerSecond == 0) fTicksPerSecond = 25.0f;
+	float fDuration = animation.fDuration;
+	time = (fDuration > 0) ? fmod(time * fTicksPerSecond, fDuration) : 0;
+
+	// a cursor last used with another animation starts from the first keys
+	if (cursor.iAnimation != iAnimation || cursor.keys.size() != animation.channels.size() * 3)
+	{
+		cursor.iAnimation = iAnimation;
+		cursor.keys.assign(animation.channels.size() * 3, 0);
+	}
+	cursor.globals.resize(m_nodes.size());
 
-	for (pair<string, aiMatrix4x4> pair : pairs)
+	// a single pass - parents are always ready before their children
+	const vector<int> &channels = m_nodeChannels[iAnimation];
+	for (unsigned i = 0; i < m_nodes.size(); i++)
 	{
-		unsigned iBone = getBoneId(pair.first);
-		if (iBone < m_offsetBones.size())
+		aiMatrix4x4 transform;
+		int iChannel = channels[i];
+		if (iChannel >= 0)
 		{
-			aiMatrix4x4 m = (m_GlobalInverseTransform * pair.second * m_offsetBones[iBone]).Transpose();
-			memcpy(&Transforms[iBone * 16], &m, sizeof(m));
+			const ANIMCHANNEL &channel = animation.channels[iChannel];
+			unsigned *pKeys = &cursor.keys[iChannel * 3];
+
+			// Interpolate position, rotation and scaling
+			aiVector3D t = interpolate(channel.positionKeys.data(), channel.positionKeys.size(), time, pKeys[0]);
+			aiMatrix3x3 r = interpolate(channel.rotationKeys.data(), channel.rotationKeys.size(), time, pKeys[1]).GetMatrix();
+			aiVector3D s = interpolate(channel.scalingKeys.data(), channel.scalingKeys.size(), time, pKeys[2]);
+
+			// translation * rotation * scaling, composed directly
+			transform = aiMatrix4x4(
+				r.a1 * s.x, r.a2 * s.y, r.a3 * s.z, t.x,
+				r.b1 * s.x, r.b2 * s.y, r.b3 * s.z, t.y,
+				r.c1 * s.x, r.c2 * s.y, r.c3 * s.z, t.z,
+				0, 0, 0, 1);
 		}
+		else
+			transform = m_nodes[i].pNode->mTransformation;
+
+		if (m_nodes[i].nParent >= 0)
+			multiply(cursor.globals[m_nodes[i].nParent], transform, transform);
+		cursor.globals[i] = transform;
+
+		int iBone = m_nodeBones[i];
+		if (iBone >= 0)
+		{
+			multiply(m_GlobalInverseTransform, transform, transform);
+			multiplyTransposed(transform, m_offsetBones[iBone], pTransforms + iBone * 16);
+		}
+	}
+}
+
+unsigned C3dglModel::getBoneTransforms(ANIMINSTANCE *pInstances, unsigned nInstances, vector<float>& Transforms)
+{
+	// the palettes, one after another
+	unsigned nSize = 0;
+	for (unsigned i = 0; i < nInstances; i++)
+	{
+		pInstances[i].nOffset = nSize;
+		nSize += pInstances[i].pModel->getBoneCount() * 16;
 	}
+	if (Transforms.size() < nSize)
+		Transforms.resize(nSize);
+
+	// instances without a cursor of their own use a cursor of the thread - the keys are then found by binary search
+	C3dglThreadPool::getDefault().parallelFor(0, nInstances, [&](unsigned i0, unsigned i1)
+	{
+		static thread_local ANIMCURSOR cursor;
+		for (unsigned i = i0; i < i1; i++)
+		{
+			ANIMINSTANCE &inst = pInstances[i];
+			inst.pModel->getBoneTransforms(inst.iAnimation, inst.time, Transforms.data() + inst.nOffset, inst.pCursor ? *inst.pCursor : cursor);
+		}
+	});
+	return nSize;
 }
 
@@ -2,7 +2,9 @@
 #include "../GL/3dglShader.h"
 #include "../GL/3dglBitmap.h"
 #include "../GL/3dglSkyBox.h"
+#include "../GL/3dglLoader.h"
 #include <iostream>
+#include <memory>
 
 using namespace _3dgl;
 using namespace std;
@@ -13,23 +15,58 @@ C3dglSkyBox::C3dglSkyBox()
 
 bool C3dglSkyBox::load(const char* pFd, const char* pRt, const char* pBk, const char* pLt, const char* pUp, const char* pDn) 
 {
-	glGenTextures(6, m_idTex);
-
-	// load six textures
-	glActiveTexture(GL_TEXTURE0);
 	const char*pFilenames[] = { pBk, pRt, pFd, pLt, pUp, pDn };
+	C3dglTextureCache::IMAGE images[6];
 	for (int i = 0; i < 6; ++i)
+		if (!C3dglTextureCache::decode(pFilenames[i], images[i]))
+			return false;
+	return create(images);
+}
+
+void C3dglSkyBox::loadAsync(C3dglLoader &loader, const char* pFd, const char* pRt, const char* pBk, const char* pLt, const char* pUp, const char* pDn)
+{
+	std::vector<std::string> filenames = { pBk, pRt, pFd, pLt, pUp, pDn };
+	std::shared_ptr<C3dglTextureCache::IMAGE> pImages(new C3dglTextureCache::IMAGE[6], std::default_delete<C3dglTextureCache::IMAGE[]>());
+	loader.add([=]
 	{
-		C3dglBitmap bm(pFilenames[i], GL_RGBA);
-		glGenTextures(1, &m_idTex[i]);
-		glBindTexture(GL_TEXTURE_2D, m_idTex[i]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		for (int i = 0; i < 6; ++i)
+			if (!C3dglTextureCache::decode(filenames[i], pImages.get()[i]))
+				return false;
+		return true;
+	},
+	[=, &loader]
+	{
+		// one step per face, so that the loader keeps to its budget
+		for (int i = 0; i < 6; ++i)
+			loader.next([=] { createTexture(i, pImages.get()[i]); return true; });
+		loader.next([=] { createBuffers(); return true; });
+		return true;
+	});
+}
 
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bm.GetWidth(), abs(bm.GetHeight()), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-	}
+bool C3dglSkyBox::create(const C3dglTextureCache::IMAGE images[6])
+{
+	// load six textures
+	for (int i = 0; i < 6; ++i)
+		createTexture(i, images[i]);
+	createBuffers();
+	return true;
+}
 
+void C3dglSkyBox::createTexture(int i, const C3dglTextureCache::IMAGE &image)
+{
+	glActiveTexture(GL_TEXTURE0);
+	glGenTextures(1, &m_idTex[i]);
+	glBindTexture(GL_TEXTURE_2D, m_idTex[i]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.bits.empty() ? NULL : image.bits.data());
+}
+
+void C3dglSkyBox::createBuffers()
+{
 	float vertices[] = 
 	{
 		-1.0f,-1.0f,-1.0f,	 1.0f,-1.0f,-1.0f,	 1.0f, 1.0f,-1.0f,	-1.0f, 1.0f,-1.0f,	//Back
@@ -73,7 +110,6 @@ bool C3dglSkyBox::load(const char* pFd, const char* pRt, const char* pBk, const
 	glBufferData(GL_ARRAY_BUFFER, sizeof(textCoord), &textCoord[0], GL_STATIC_DRAW); //Send the data to OpenGL
 
 	std::cout << "working"<< std::endl;
-	return true;
 }
 
 void C3dglSkyBox::render(glm::mat4 matrix)
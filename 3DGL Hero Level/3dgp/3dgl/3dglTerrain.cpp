@@ -1,65 +1,116 @@
 #include <fstream>
 #include <iostream>
+#include <cstring>
+#include <cstdio>
 
 #include <Windows.h>
 #include "../GL/glew.h"
 #include "../GL/3dglShader.h"
 #include "../GL/3dglTerrain.h"
 #include "../GL/3dglBitmap.h"
+#include "../GL/3dglFrustum.h"
+#include "../GL/3dglThreadPool.h"
+#include "../GL/3dglLoader.h"
+
+#include "../glm/geometric.hpp"
+#include "../glm/gtc/matrix_inverse.hpp"
+#include "../glm/gtc/constants.hpp"
+
+#include <algorithm>
+#include <memory>
+
+// SSE2 is available on all x64 and (by default, since VS2012) on x86 targets
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define _3DGL_SSE2
+#endif
 
 using std::vector;
+using std::min;
+using std::max;
 using namespace _3dgl;
 
 C3dglTerrain::C3dglTerrain()
 {
-    m_nSizeX = m_nSizeZ = m_vertexBuffer = m_normalBuffer = m_texCoordBuffer = m_indexBuffer = 0;
+    m_nSizeX = m_nSizeZ = m_vertexBuffer = m_normalBuffer = m_texCoordBuffer = m_indexBuffer = m_linesBuffer = 0;
+	m_bLOD = false;
+	m_nChunkSize = 32;
+	m_fPixelError = 2.0f;
+	m_fSkirtDepth = 0;
+	m_lodIndexBuffer = m_nSkirtBase = 0;
+	m_nSkirtLinesX = 0;
+	m_nRenderedTriangles = 0;
+	m_pTiles = NULL;
+	m_fTileScale = 0;
+	m_nTileSize = m_nTilesX = m_nTilesZ = 0;
+	m_tileIndexBuffer = 0;
+	m_bStreamDirty = m_bStreamQuit = false;
+	m_bDisplacement = false;
+	m_nHeightMapUnit = 7;
+	m_heightTexture = m_instanceBuffer = 0;
+	m_fHeightMapScale = 0;
+	m_nStaticInstances = 0;
+	m_bRTIN = m_bAdaptive = false;
+	m_fRTINError = 0.1f;
+	m_nIndices = 0;
+	m_bAO = false;
+	m_nAOUnit = 6;
+	m_fAORadius = 32;
+	m_aoTexture = 0;
+	m_bCache = false;
+	c_nTerrains++;
 }
 
-float C3dglTerrain::getHeight(int x, int z)
+C3dglTerrain::~C3dglTerrain()
 {
-	x += m_nSizeX/2;
-	z += m_nSizeZ/2;
-	if (x < 0 || x >= m_nSizeX) return 0;
-	if (z < 0 || z >= m_nSizeZ) return 0;
-	return m_heights[x * m_nSizeZ + z];
-}
+	stopStreaming();
+	deleteBuffers();
 
-	// compute the area of a triangle using Heron's formula
-	float triarea(float a, float b, float c)
+	// the patches are shared by all the terrains
+	if (--c_nTerrains == 0)
 	{
-		float s = (a + b + c)/2.0f;
-		float area=sqrt(fabs(s*(s-a)*(s-b)*(s-c)));
-		return area;     
+		for (auto &p : c_patches)
+		{
+			GLuint buffers[] = { p.second.vertexBuffer, p.second.indexBuffer };
+			glDeleteBuffers(2, buffers);
+		}
+		c_patches.clear();
 	}
+}
 
-	// compute the distance between two 
-	float dist(float x0, float y0, float x1, float y1)
-	{
-		float a = x1 - x0;	  
-		float b = y1 - y0;
-		return sqrt(a*a + b*b);
-	}
+void C3dglTerrain::enableCache(bool bEnable)
+{
+	m_bCache = bEnable;
+}
 
-	// barycentric interpolation of (x, y) within a triangle (x0, y0), (x1, y1), (x2, y2) with values v0, v1, v2
-	float barycent(float x, float y, float x0, float y0, float v0, float x1, float y1, float v1, float x2, float y2, float v2)
-	{
-		// compute the area of the big triangle
-		float a = dist(x0, y0, x1, y1);
-		float b = dist(x1, y1, x2, y2);
-		float c = dist(x2, y2, x0, y0);
-		float totalarea = triarea(a, b, c);
+void C3dglTerrain::enableAO(bool bEnable, int nTextureUnit, float fRadius)
+{
+	m_bAO = bEnable;
+	m_nAOUnit = nTextureUnit;
+	m_fAORadius = fRadius;
+}
 
-		// compute the distances from the outer vertices to the inner vertex
-		float length0 = dist(x0, y0, x, y);
-		float length1 = dist(x1, y1, x, y);
-		float length2 = dist(x2, y2, x, y);
+void C3dglTerrain::enableRTIN(bool bEnable, float fMaxError)
+{
+	m_bRTIN = bEnable;
+	m_fRTINError = fMaxError;
+}
 
-		float f0 = triarea(b, length1, length2) / totalarea;
-		float f1 = triarea(c, length0, length2) / totalarea;
-		float f2 = triarea(a, length0, length1) / totalarea;
+void C3dglTerrain::enableDisplacement(bool bEnable, int nTextureUnit)
+{
+	m_bDisplacement = bEnable;
+	m_nHeightMapUnit = nTextureUnit;
+}
 
-		return v0 * f0 + v1 * f1 + v2 * f2;
-	}
+void C3dglTerrain::enableLOD(bool bEnable, int nChunkSize)
+{
+	m_bLOD = bEnable;
+
+	// round the chunk size down to a power of two
+	m_nChunkSize = 2;
+	while (m_nChunkSize * 2 <= nChunkSize)
+		m_nChunkSize *= 2;
+}
 
 float C3dglTerrain::getInterpolatedHeight(float fx, float fz)
 {
@@ -67,35 +118,173 @@ float C3dglTerrain::getInterpolatedHeight(float fx, float fz)
 	int z = (int)floor(fz);
 	fx -= x;
 	fz -= z;
+
+	// planar interpolation within one of the two triangles of the cell - the same split as in the index buffer
 	if (fx + fz < 1)
-		return barycent(fx, fz, 0, 0, getHeight(x, z), 0, 1, getHeight(x, z + 1), 1, 0, getHeight(x + 1, z));
+	{
+		float h00 = getHeight(x, z);
+		return h00 + fx * (getHeight(x + 1, z) - h00) + fz * (getHeight(x, z + 1) - h00);
+	}
 	else
-		return barycent(fx, fz, 0, 1, getHeight(x, z + 1), 1, 0, getHeight(x + 1, z), 1, 1, getHeight(x + 1, z + 1));
+	{
+		float h11 = getHeight(x + 1, z + 1);
+		return h11 + (1 - fx) * (getHeight(x, z + 1) - h11) + (1 - fz) * (getHeight(x + 1, z) - h11);
+	}
+}
+
+void C3dglTerrain::getInterpolatedHeights(const float *pX, const float *pZ, float *pY, unsigned n)
+{
+	unsigned i = 0;
+#ifdef _3DGL_SSE2
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 fx = _mm_loadu_ps(pX + i);
+		__m128 fz = _mm_loadu_ps(pZ + i);
 
+		// floor (SSE2 only truncates): subtract 1 where truncation rounded up
+		__m128i ix = _mm_cvttps_epi32(fx);
+		__m128i iz = _mm_cvttps_epi32(fz);
+		ix = _mm_add_epi32(ix, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(ix), fx)));
+		iz = _mm_add_epi32(iz, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(iz), fz)));
+		fx = _mm_sub_ps(fx, _mm_cvtepi32_ps(ix));
+		fz = _mm_sub_ps(fz, _mm_cvtepi32_ps(iz));
 
-	return m_heights[z * m_nSizeX + x];
+		// gather the corner heights (no gather instruction in SSE2)
+		int X[4], Z[4];
+		_mm_storeu_si128((__m128i*)X, ix);
+		_mm_storeu_si128((__m128i*)Z, iz);
+		__m128 h00 = _mm_setr_ps(getHeight(X[0], Z[0]), getHeight(X[1], Z[1]), getHeight(X[2], Z[2]), getHeight(X[3], Z[3]));
+		__m128 h01 = _mm_setr_ps(getHeight(X[0], Z[0] + 1), getHeight(X[1], Z[1] + 1), getHeight(X[2], Z[2] + 1), getHeight(X[3], Z[3] + 1));
+		__m128 h10 = _mm_setr_ps(getHeight(X[0] + 1, Z[0]), getHeight(X[1] + 1, Z[1]), getHeight(X[2] + 1, Z[2]), getHeight(X[3] + 1, Z[3]));
+		__m128 h11 = _mm_setr_ps(getHeight(X[0] + 1, Z[0] + 1), getHeight(X[1] + 1, Z[1] + 1), getHeight(X[2] + 1, Z[2] + 1), getHeight(X[3] + 1, Z[3] + 1));
+
+		// evaluate both triangle planes and select
+		__m128 lower = _mm_add_ps(h00, _mm_add_ps(_mm_mul_ps(fx, _mm_sub_ps(h10, h00)), _mm_mul_ps(fz, _mm_sub_ps(h01, h00))));
+		__m128 upper = _mm_add_ps(h11, _mm_add_ps(_mm_mul_ps(_mm_sub_ps(one, fx), _mm_sub_ps(h01, h11)), _mm_mul_ps(_mm_sub_ps(one, fz), _mm_sub_ps(h10, h11))));
+		__m128 mask = _mm_cmplt_ps(_mm_add_ps(fx, fz), one);
+		_mm_storeu_ps(pY + i, _mm_or_ps(_mm_and_ps(mask, lower), _mm_andnot_ps(mask, upper)));
+	}
+#endif
+	for (; i < n; i++)
+		pY[i] = getInterpolatedHeight(pX[i], pZ[i]);
 }
 
 bool C3dglTerrain::loadHeightmap(const std::string filename, float scaleHeight)
 {
+	stopStreaming();
+
+	STAGING staging;
+	if (!prepareHeightmap(filename, scaleHeight, staging))
+		return false;
+	uploadBuffers(staging.buffers);
+	return true;
+}
+
+void C3dglTerrain::loadHeightmapAsync(C3dglLoader &loader, const std::string filename, float scaleHeight)
+{
+	// prepared by a terrain of its own, with the same settings - so that this one may be rendered, queried
+	// and edited on the GL thread in the meantime
+	std::shared_ptr<STAGING> pStaging = std::make_shared<STAGING>();
+	C3dglTerrain *pTerrain = new C3dglTerrain;
+	pStaging->pTerrain.reset(pTerrain);
+	pTerrain->m_bLOD = m_bLOD;
+	pTerrain->m_nChunkSize = m_nChunkSize;
+	pTerrain->m_bDisplacement = m_bDisplacement;
+	pTerrain->m_bRTIN = m_bRTIN;
+	pTerrain->m_fRTINError = m_fRTINError;
+	pTerrain->m_bAO = m_bAO;
+	pTerrain->m_fAORadius = m_fAORadius;
+	pTerrain->m_bCache = m_bCache;
+
+	pTerrain->m_nHeightMapUnit = m_nHeightMapUnit;
+	pTerrain->m_nAOUnit = m_nAOUnit;
+
+	loader.add([=] { return pStaging->pTerrain->prepareHeightmap(filename, scaleHeight, *pStaging); },
+		[=, &loader]
+		{
+			// uploaded by the terrain that prepared it, one buffer per step, so that the loader keeps to its budget
+			for (int i = 0; i < UPLOAD_STEPS; i++)
+				loader.next([=] { pStaging->pTerrain->uploadStep(pStaging->buffers, i); return true; });
+			loader.next([=]
+			{
+				stopStreaming();
+				takeHeightmap(*pStaging->pTerrain);
+				return true;
+			});
+			return true;
+		});
+}
+
+void C3dglTerrain::takeHeightmap(C3dglTerrain &terrain)
+{
+	// everything prepareHeightmap leaves in the terrain
+	m_nSizeX = terrain.m_nSizeX;
+	m_nSizeZ = terrain.m_nSizeZ;
+	m_heights.swap(terrain.m_heights);
+	m_minMax.swap(terrain.m_minMax);
+	m_nodes.swap(terrain.m_nodes);
+	m_skirtLineX.swap(terrain.m_skirtLineX);
+	m_skirtLineZ.swap(terrain.m_skirtLineZ);
+	m_nSkirtLinesX = terrain.m_nSkirtLinesX;
+	m_nSkirtBase = terrain.m_nSkirtBase;
+	m_fSkirtDepth = terrain.m_fSkirtDepth;
+	m_nChunkSize = terrain.m_nChunkSize;
+	m_bAdaptive = terrain.m_bAdaptive;
+	m_fHeightMapScale = terrain.m_fHeightMapScale;
+
+	// and the GL objects, if uploaded by the terrain
+	deleteBuffers();
+	std::swap(m_vertexBuffer, terrain.m_vertexBuffer);
+	std::swap(m_normalBuffer, terrain.m_normalBuffer);
+	std::swap(m_texCoordBuffer, terrain.m_texCoordBuffer);
+	std::swap(m_indexBuffer, terrain.m_indexBuffer);
+	std::swap(m_lodIndexBuffer, terrain.m_lodIndexBuffer);
+	std::swap(m_instanceBuffer, terrain.m_instanceBuffer);
+	std::swap(m_heightTexture, terrain.m_heightTexture);
+	std::swap(m_aoTexture, terrain.m_aoTexture);
+	m_nIndices = terrain.m_nIndices;
+	m_nStaticInstances = terrain.m_nStaticInstances;
+}
+
+bool C3dglTerrain::prepareHeightmap(const std::string filename, float scaleHeight, STAGING &staging)
+{
+	// the cache is keyed by the contents of the source file - so the file is hashed, but not decoded
+	std::string cacheFilename = filename + ".3dgc";
+	unsigned long long nHash = 0;
+	if (m_bCache)
+	{
+		C3dglMappedFile source;
+		if (source.open(filename))
+			nHash = source.getHash();
+		if (nHash && loadCache(cacheFilename, nHash, scaleHeight, staging))
+			return true;
+	}
+
 	C3dglBitmap bm;
-	bm.load(filename, GL_RGBA);
+	if (!bm.load(filename, GL_RGBA)) return false;
+	if (bm.getWidth() < 2 || abs(bm.getHeight()) < 2) return false;
 
 	m_nSizeX = bm.getWidth();
 	m_nSizeZ = abs(bm.getHeight());
 
+	// all the per-vertex work below is split into bands of rows (constant x) processed by the worker threads
+	C3dglThreadPool &pool = C3dglThreadPool::getDefault();
+
 	// Collect Height Values
-	m_heights.clear();
-    m_heights.reserve(m_nSizeX * m_nSizeZ); //Reserve some space (faster)
-	for (int i = 0; i < m_nSizeX; i++)
-		for (int j = m_nSizeZ - 1; j >= 0; j--)
-		{
-			int index = (i + j * m_nSizeX) * 4;
-			unsigned char *pBytes = (unsigned char*)(bm.GetBits());
-			unsigned char val = pBytes[index];
-			float f = (float)val / 256.0f;
-			m_heights.push_back(f * scaleHeight);
-		}
+	m_heights.resize(m_nSizeX * m_nSizeZ);
+	unsigned char *pBytes = (unsigned char*)(bm.GetBits());
+	pool.parallelFor(0, m_nSizeX, [&](unsigned x0, unsigned x1)
+	{
+		for (int i = x0; i < (int)x1; i++)
+			for (int j = m_nSizeZ - 1; j >= 0; j--)
+			{
+				int index = (i + j * m_nSizeX) * 4;
+				unsigned char val = pBytes[index];
+				float f = (float)val / 256.0f;
+				m_heights[i * m_nSizeZ + m_nSizeZ - 1 - j] = f * scaleHeight;
+			}
+	});
 
 //bool C3dglTerrain::loadHeightmap(const std::wstring& rawFile, float scaleHeight)
 //{
@@ -121,103 +310,1719 @@ bool C3dglTerrain::loadHeightmap(const std::string filename, float scaleHeight)
 //			m_heights.push_back(f);
 //		}
 
-	// Collect Vertices, Normals and Lines (the latter - for the visualisation of normal vectors)
-    vector<float> vertices;
-    vector<float> normals;
-    vector<float> texCoords;
-	vector<float> lines;
+	// the min-max pyramid for ray casting
+	buildMinMax();
+
+	// everything below is collected in these buffers, then uploaded (and cached)
+	BUFFERS &buffers = staging.buffers;
+	memset(&buffers, 0, sizeof(buffers));
+	vector<unsigned char> &aoTexels = staging.ao;
+	if (m_bAO && computeAO(aoTexels))
+		buffers.pAO = &aoTexels[0];
+
+	// Build the LOD quadtree, its indices and the skirts
+	vector<unsigned int> &indices = staging.indices;
+	unsigned nSkirtVertices = 0;
+	if (m_bDisplacement)
+		m_nChunkSize = min(m_nChunkSize, 128);	// the patch vertices are addressed with 16-bit indices
+	if (m_bLOD)
+	{
+		// lines of grid points lying on the chunk borders - these need skirt vertices
+		m_skirtLineX.assign(m_nSizeX, -1);
+		m_skirtLineZ.assign(m_nSizeZ, -1);
+		m_nSkirtLinesX = 0;
+		int nLinesZ = 0;
+		for (int x = 0; x < m_nSizeX; x++)
+			if (x % m_nChunkSize == 0 || x == m_nSizeX - 1)
+				m_skirtLineX[x] = m_nSkirtLinesX++;
+		for (int z = 0; z < m_nSizeZ; z++)
+			if (z % m_nChunkSize == 0 || z == m_nSizeZ - 1)
+				m_skirtLineZ[z] = nLinesZ++;
+		m_nSkirtBase = m_nSizeX * m_nSizeZ;
+		nSkirtVertices = m_nSkirtLinesX * m_nSizeZ + nLinesZ * m_nSizeX;
+
+		// the quadtree - the root must cover the entire height map
+		int size = m_nChunkSize;
+		while (size < m_nSizeX - 1 || size < m_nSizeZ - 1)
+			size *= 2;
+		m_nodes.clear();
+		indices.reserve((m_nSizeX - 1) * (m_nSizeZ - 1) * 8);	// the leaves alone take 6 per cell, plus the coarser levels and skirts
+		buildNode(0, 0, size, indices);
+
+		// skirts must be deep enough to cover the largest crack
+		m_fSkirtDepth = m_nodes[0].error + 1.0f;
+	}
+
+	vector<GLushort> &texels = staging.texels;
+	vector<float> &vertices = staging.vertices, &normals = staging.normals, &texCoords = staging.texCoords;
+	m_bAdaptive = false;
+	if (m_bDisplacement)
+	{
+		// Prepare the Height Map Texture - the 8-bit samples are scaled to 16 bits, so the heights remain unchanged
+		texels.resize(m_nSizeX * m_nSizeZ);
+		pool.parallelFor(0, m_nSizeX, [&](unsigned x0, unsigned x1)
+		{
+			for (int i = x0; i < (int)x1; i++)
+				for (int j = 0; j < m_nSizeZ; j++)
+					texels[i * m_nSizeZ + m_nSizeZ - 1 - j] = pBytes[(i + j * m_nSizeX) * 4] << 8;
+		});
+		buffers.pTexels = &texels[0];
+		m_fHeightMapScale = scaleHeight * 65535.0f / 65536.0f;	// the shader reads normalised values
+	}
+	else
+	{
+		// Adaptive triangulation: the triangles go first, then only the vertices they use are collected
+		m_bAdaptive = m_bRTIN && !m_bLOD;
+		vector<unsigned> gridVertices;		// the grid index of each vertex
+		if (m_bAdaptive)
+			buildRTIN(indices, gridVertices);
+
+		// Collect Vertices and Normals - the buffers are sized once, then filled in parallel
+		unsigned nGridVertices = m_bAdaptive ? gridVertices.size() : m_nSizeX * m_nSizeZ;
+		unsigned nVertices = nGridVertices + nSkirtVertices;
+		vertices.resize(nVertices * 3);
+		normals.resize(nVertices * 3);
+		texCoords.resize(nVertices * 2);
+		int minx = -m_nSizeX/2;
+		int minz = -m_nSizeZ/2;
+		auto collectVertex = [&](unsigned i, int x, int z)
+		{
+			vertices[i * 3] = (float)(x + minx);
+			vertices[i * 3 + 1] = m_heights[x * m_nSizeZ + z];
+			vertices[i * 3 + 2] = (float)(z + minz);
+			computeNormal(x, z, &normals[i * 3]);
+			texCoords[i * 2] = (float)(x + minx) / 2.f;
+			texCoords[i * 2 + 1] = (float)(z + minz) / 2.f;
+		};
+		if (m_bAdaptive)
+			pool.parallelFor(0, nGridVertices, [&](unsigned i0, unsigned i1)
+			{
+				for (unsigned i = i0; i < i1; i++)
+					collectVertex(i, gridVertices[i] / m_nSizeZ, gridVertices[i] % m_nSizeZ);
+			});
+		else
+			pool.parallelFor(0, m_nSizeX, [&](unsigned x0, unsigned x1)
+			{
+				for (int x = x0; x < (int)x1; x++)
+					for (int z = 0; z < m_nSizeZ; z++)
+						collectVertex(x * m_nSizeZ + z, x, z);
+			});
+
+		// skirt vertices: copies of the border vertices, dropped down by the skirt depth
+		if (m_bLOD)
+		{
+			auto copySkirtVertex = [&](unsigned iSkirt, unsigned i)
+			{
+				vertices[iSkirt * 3] = vertices[i * 3];
+				vertices[iSkirt * 3 + 1] = vertices[i * 3 + 1] - m_fSkirtDepth;
+				vertices[iSkirt * 3 + 2] = vertices[i * 3 + 2];
+				normals[iSkirt * 3] = normals[i * 3];
+				normals[iSkirt * 3 + 1] = normals[i * 3 + 1];
+				normals[iSkirt * 3 + 2] = normals[i * 3 + 2];
+				texCoords[iSkirt * 2] = texCoords[i * 2];
+				texCoords[iSkirt * 2 + 1] = texCoords[i * 2 + 1];
+			};
+			for (int x = 0; x < m_nSizeX; x++)		// lines of constant x (see skirtVertex)
+				if (m_skirtLineX[x] >= 0)
+					for (int z = 0; z < m_nSizeZ; z++)
+						copySkirtVertex(skirtVertex(x, z, false), x * m_nSizeZ + z);
+			for (int z = 0; z < m_nSizeZ; z++)		// lines of constant z
+				if (m_skirtLineZ[z] >= 0)
+					for (int x = 0; x < m_nSizeX; x++)
+						copySkirtVertex(skirtVertex(x, z, true), x * m_nSizeZ + z);
+		}
+
+		// Generate Indices
+	
+		/*
+			We loop through building the triangles that
+			make up each grid square in the heightmap
+
+			(z*w+x) *----* (z*w+x+1)
+					|   /|
+					|  / |
+					| /  |
+		 ((z+1)*w+x)*----* ((z+1)*w+x+1)
+		*/
+		//Generate the triangle indices - each band of rows writes to its own part of the buffer
+		if (!m_bLOD && !m_bAdaptive)
+		{
+			indices.resize((m_nSizeX - 1) * (m_nSizeZ - 1) * 6);
+			pool.parallelFor(0, m_nSizeZ - 1, [&](unsigned z0, unsigned z1)
+			{
+				for (int z = z0; z < (int)z1; ++z)
+				{
+					unsigned *p = &indices[z * (m_nSizeX - 1) * 6];
+					for (int x = 0; x < m_nSizeX - 1; ++x)
+					{
+						*p++ = x * m_nSizeZ + z; // current point
+						*p++ = x * m_nSizeZ + z + 1; // next row
+						*p++ = (x + 1) * m_nSizeZ + z; // same row, next col
+
+						*p++ = x * m_nSizeZ + z + 1; // next row
+						*p++ = (x + 1) * m_nSizeZ + z + 1; //next row, next col
+						*p++ = (x + 1) * m_nSizeZ + z; // same row, next col
+					}
+				}
+			});
+		}
+
+		buffers.pVertices = &vertices[0];
+		buffers.pNormals = &normals[0];
+		buffers.pTexCoords = &texCoords[0];
+		buffers.nVertices = nVertices;
+	}
+	if (!indices.empty())
+		buffers.pIndices = &indices[0];
+	buffers.nIndices = indices.size();
+
+	if (nHash)
+		saveCache(cacheFilename, nHash, scaleHeight, buffers);
+	return true;
+}
+
+void C3dglTerrain::uploadBuffers(const BUFFERS &buffers)
+{
+	// the buffers of the previous height map - including the one for the visualisation of normal vectors,
+	// which is only built on the first call to renderNormals
+	deleteBuffers();
+
+	for (int i = 0; i < UPLOAD_STEPS; i++)
+		uploadStep(buffers, i);
+}
+
+void C3dglTerrain::uploadStep(const BUFFERS &buffers, int nStep)
+{
+	// displacement: no per-vertex buffers - everything is done with the textures
+	if (buffers.pTexels && nStep != UPLOAD_TEXTURES)
+		return;
+
+	switch (nStep)
+	{
+	case UPLOAD_TEXTURES:
+		if (buffers.pAO)
+			uploadAO(buffers.pAO);
+		if (!buffers.pTexels)
+			break;
+		{
+			// the texture rows are the lines of constant x - the same layout as m_heights
+			GLint nActiveTexture, nAlignment;
+			glGetIntegerv(GL_ACTIVE_TEXTURE, &nActiveTexture);
+			glGetIntegerv(GL_UNPACK_ALIGNMENT, &nAlignment);
+			glActiveTexture(GL_TEXTURE0 + m_nHeightMapUnit);
+			glGenTextures(1, &m_heightTexture);
+			glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, m_nSizeZ, m_nSizeX, 0, GL_RED, GL_UNSIGNED_SHORT, buffers.pTexels);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, nAlignment);
+			glActiveTexture(nActiveTexture);
+
+			// Prepare the Instance Buffer - without LOD, the patches are laid out once, at full resolution
+			glGenBuffers(1, &m_instanceBuffer);
+			m_nStaticInstances = 0;
+			if (!m_bLOD)
+			{
+				vector<glm::vec4> instances;
+				for (int x = 0; x < m_nSizeX - 1; x += m_nChunkSize)
+					for (int z = 0; z < m_nSizeZ - 1; z += m_nChunkSize)
+						instances.push_back(glm::vec4(x, z, 1, 0));
+				m_nStaticInstances = instances.size();
+				glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+				glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4) * instances.size(), &instances[0], GL_STATIC_DRAW);
+			}
+
+			// no per-vertex buffers in this mode
+			getPatch(m_nChunkSize);
+			break;
+		}
+
+	case UPLOAD_VERTICES:
+		// Prepare Vertex Buffer
+		glGenBuffers(1, &m_vertexBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * buffers.nVertices, buffers.pVertices, GL_STATIC_DRAW);
+		break;
+
+	case UPLOAD_NORMALS:
+		// Prepare Normal Buffer
+		glGenBuffers(1, &m_normalBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * buffers.nVertices, buffers.pNormals, GL_STATIC_DRAW);
+		break;
+
+	case UPLOAD_TEXCOORDS:
+		// Prepare TexCoords Buffer
+		glGenBuffers(1, &m_texCoordBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 2 * buffers.nVertices, buffers.pTexCoords, GL_STATIC_DRAW);
+		break;
+
+	case UPLOAD_INDICES:
+		if (m_bLOD)
+		{
+			// Prepare LOD Index Buffer
+			glGenBuffers(1, &m_lodIndexBuffer);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_lodIndexBuffer);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * buffers.nIndices, buffers.pIndices, GL_STATIC_DRAW);
+			break;
+		}
+
+		// Prepare Index Buffer
+		m_nIndices = buffers.nIndices;
+		glGenBuffers(1, &m_indexBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * buffers.nIndices, buffers.pIndices, GL_STATIC_DRAW);
+		break;
+	}
+}
+
+void C3dglTerrain::deleteBuffers()
+{
+	// names of zero are silently ignored
+	GLuint buffers[] = { m_vertexBuffer, m_normalBuffer, m_texCoordBuffer, m_indexBuffer, m_lodIndexBuffer, m_linesBuffer, m_instanceBuffer };
+	glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+	GLuint textures[] = { m_heightTexture, m_aoTexture };
+	glDeleteTextures(sizeof(textures) / sizeof(textures[0]), textures);
+	m_vertexBuffer = m_normalBuffer = m_texCoordBuffer = m_indexBuffer = m_lodIndexBuffer = m_linesBuffer = m_instanceBuffer = 0;
+	m_heightTexture = m_aoTexture = 0;
+}
+
+void C3dglTerrain::initCacheHeader(CACHEHEADER &header, unsigned long long nHash, float scaleHeight)
+{
+	memset(&header, 0, sizeof(header));
+	memcpy(header.id, "3DGC", 4);
+	header.version = 1;
+	header.hash = nHash;
+	header.scaleHeight = scaleHeight;
+	header.flags = (m_bLOD ? CACHE_LOD : 0) | (m_bDisplacement ? CACHE_DISPLACEMENT : 0) | (m_bRTIN ? CACHE_RTIN : 0) | (m_bAO ? CACHE_AO_BAKED : 0);
+	header.chunkSize = m_bDisplacement ? min(m_nChunkSize, 128) : m_nChunkSize;
+	header.rtinError = m_fRTINError;
+	header.aoRadius = m_fAORadius;
+}
+
+bool C3dglTerrain::saveCache(const std::string filename, unsigned long long nHash, float scaleHeight, const BUFFERS &buffers)
+{
+	CACHEHEADER header;
+	initCacheHeader(header, nHash, scaleHeight);
+	header.sizeX = m_nSizeX;
+	header.sizeZ = m_nSizeZ;
+	header.skirtDepth = m_fSkirtDepth;
+	header.skirtLinesX = m_nSkirtLinesX;
+
+	// the sections, in the order of CACHE_SECTION; absent ones are left empty
+	const void *pSections[CACHE_SECTIONS] = {
+		&m_heights[0], m_nodes.empty() ? NULL : &m_nodes[0],
+		m_skirtLineX.empty() ? NULL : &m_skirtLineX[0], m_skirtLineZ.empty() ? NULL : &m_skirtLineZ[0],
+		buffers.pVertices, buffers.pNormals, buffers.pTexCoords, buffers.pIndices, buffers.pTexels, buffers.pAO };
+	size_t nSizes[CACHE_SECTIONS] = {
+		m_heights.size() * sizeof(float), m_nodes.size() * sizeof(NODE),
+		m_bLOD ? m_skirtLineX.size() * sizeof(int) : 0, m_bLOD ? m_skirtLineZ.size() * sizeof(int) : 0,
+		buffers.pVertices ? buffers.nVertices * 3 * sizeof(float) : 0, buffers.pNormals ? buffers.nVertices * 3 * sizeof(float) : 0,
+		buffers.pTexCoords ? buffers.nVertices * 2 * sizeof(float) : 0, buffers.nIndices * sizeof(unsigned),
+		buffers.pTexels ? m_heights.size() * sizeof(unsigned short) : 0, buffers.pAO ? m_heights.size() : 0 };
+	size_t nOffset = sizeof(header);
+	for (int i = 0; i < CACHE_SECTIONS; i++)
+	{
+		header.sections[i].offset = nOffset;
+		header.sections[i].size = nSizes[i];
+		nOffset += (nSizes[i] + 3) & ~3;		// 4-byte alignment
+	}
+	header.fileSize = nOffset;
+
+	// written to a temporary file first, so that a concurrent reader never sees a partial cache
+	std::string tempFilename = filename + ".tmp";
+	{
+		std::ofstream file(tempFilename, std::ios::binary);
+		if (!file) return false;
+		file.write((char*)&header, sizeof(header));
+		const char padding[4] = { 0, 0, 0, 0 };
+		for (int i = 0; i < CACHE_SECTIONS; i++)
+		{
+			if (nSizes[i]) file.write((const char*)pSections[i], nSizes[i]);
+			file.write(padding, ((nSizes[i] + 3) & ~3) - nSizes[i]);
+		}
+		if (!file.good())
+		{
+			file.close();
+			remove(tempFilename.c_str());
+			return false;
+		}
+	}
+	remove(filename.c_str());
+	return rename(tempFilename.c_str(), filename.c_str()) == 0;
+}
+
+bool C3dglTerrain::loadCache(const std::string filename, unsigned long long nHash, float scaleHeight, STAGING &staging)
+{
+	C3dglMappedFile &file = staging.file;
+	if (!file.open(filename)) return false;
+
+	// the cache is only valid for the same source, height scale and settings
+	CACHEHEADER expected;
+	initCacheHeader(expected, nHash, scaleHeight);
+	const CACHEHEADER *pHeader = (const CACHEHEADER*)file.getData();
+	if (file.getSize() < sizeof(CACHEHEADER) || pHeader->fileSize != file.getSize()
+		|| memcmp(pHeader->id, expected.id, 4) != 0 || pHeader->version != expected.version || pHeader->hash != nHash
+		|| pHeader->scaleHeight != scaleHeight || pHeader->flags != expected.flags || pHeader->chunkSize != expected.chunkSize
+		|| pHeader->rtinError != expected.rtinError || pHeader->aoRadius != expected.aoRadius
+		|| pHeader->sizeX < 2 || pHeader->sizeZ < 2)
+		return false;
+	for (int i = 0; i < CACHE_SECTIONS; i++)
+		if (pHeader->sections[i].offset % 4 != 0 || pHeader->sections[i].offset > file.getSize()
+			|| pHeader->sections[i].size > file.getSize() - pHeader->sections[i].offset)
+			return false;
+
+	// the sizes implied by the header (the heights alone must fit in the file)
+	if ((unsigned long long)pHeader->sizeX * pHeader->sizeZ > file.getSize() / sizeof(float))
+		return false;
+	unsigned nSamples = pHeader->sizeX * pHeader->sizeZ;
+	const unsigned nVertexSize = pHeader->sections[CACHE_VERTICES].size;
+	if (pHeader->sections[CACHE_HEIGHTS].size != nSamples * sizeof(float)
+		|| pHeader->sections[CACHE_NODES].size % sizeof(NODE) != 0
+		|| pHeader->sections[CACHE_NORMALS].size != nVertexSize || pHeader->sections[CACHE_TEXCOORDS].size * 3 != nVertexSize * 2
+		|| (pHeader->sections[CACHE_TEXELS].size != 0 && pHeader->sections[CACHE_TEXELS].size != nSamples * sizeof(unsigned short))
+		|| (pHeader->sections[CACHE_AO].size != 0 && pHeader->sections[CACHE_AO].size != nSamples))
+		return false;
+	auto section = [&](int i) -> const char* { return pHeader->sections[i].size ? (const char*)pHeader + pHeader->sections[i].offset : NULL; };
+	auto count = [&](int i, size_t n) -> unsigned { return pHeader->sections[i].size / n; };
+
+	// the contents are used without further checks: the indices, the quadtree and the skirt lines must all be in range
+	bool bAdaptive = m_bRTIN && !m_bLOD && !m_bDisplacement;
+	unsigned nVertices = count(CACHE_VERTICES, 3 * sizeof(float));
+	unsigned nIndices = count(CACHE_INDICES, sizeof(unsigned));
+	const unsigned *pIndices = (const unsigned*)section(CACHE_INDICES);
+	if (nIndices % 3)
+		return false;
+	if (!m_bDisplacement)
+		for (unsigned i = 0; i < nIndices; i++)
+			if (pIndices[i] >= nVertices)
+				return false;
+
+	unsigned nNodes = count(CACHE_NODES, sizeof(NODE));
+	const NODE *pNodes = (const NODE*)section(CACHE_NODES);
+	if (m_bLOD && nNodes == 0)
+		return false;
+	for (unsigned i = 0; i < nNodes; i++)
+	{
+		const NODE &node = pNodes[i];
+		if (node.x0 < 0 || node.x0 > node.x1 || node.x1 >= pHeader->sizeX || node.z0 < 0 || node.z0 > node.z1 || node.z1 >= pHeader->sizeZ
+			|| node.step < 1 || node.offset > nIndices || node.count > nIndices - node.offset)
+			return false;
+		for (int iChild : node.child)		// the children follow their parent, so there are no cycles
+			if (iChild != -1 && (iChild <= (int)i || iChild >= (int)nNodes))
+				return false;
+	}
+
+	// the skirt vertices follow the grid: those of the lines of constant x first, then those of constant z
+	const int *pSkirtLineX = (const int*)section(CACHE_SKIRTLINESX), *pSkirtLineZ = (const int*)section(CACHE_SKIRTLINESZ);
+	unsigned long long nMinVertices = bAdaptive ? 0 : nSamples;
+	if (m_bLOD)
+	{
+		if (count(CACHE_SKIRTLINESX, sizeof(int)) != (unsigned)pHeader->sizeX || count(CACHE_SKIRTLINESZ, sizeof(int)) != (unsigned)pHeader->sizeZ
+			|| pHeader->skirtLinesX < 0 || pHeader->skirtLinesX > pHeader->sizeX)
+			return false;
+		int nLinesZ = 0;
+		for (int x = 0; x < pHeader->sizeX; x++)
+			if (pSkirtLineX[x] < -1 || pSkirtLineX[x] >= pHeader->skirtLinesX)
+				return false;
+		for (int z = 0; z < pHeader->sizeZ; z++)
+			if (pSkirtLineZ[z] < -1 || pSkirtLineZ[z] >= pHeader->sizeZ)
+				return false;
+			else
+				nLinesZ = max(nLinesZ, pSkirtLineZ[z] + 1);
+		nMinVertices += (unsigned long long)pHeader->skirtLinesX * pHeader->sizeZ + (unsigned long long)nLinesZ * pHeader->sizeX;
+	}
+	if (!m_bDisplacement && nVertices < nMinVertices)
+		return false;
+
+	// the CPU-side state
+	m_nSizeX = pHeader->sizeX;
+	m_nSizeZ = pHeader->sizeZ;
+	m_nChunkSize = pHeader->chunkSize;
+	m_fSkirtDepth = pHeader->skirtDepth;
+	m_nSkirtLinesX = pHeader->skirtLinesX;
+	m_nSkirtBase = nSamples;
+	m_fHeightMapScale = scaleHeight * 65535.0f / 65536.0f;
+	m_heights.assign((const float*)section(CACHE_HEIGHTS), (const float*)section(CACHE_HEIGHTS) + nSamples);
+	m_nodes.assign(pNodes, pNodes + nNodes);
+	m_skirtLineX.assign(pSkirtLineX, pSkirtLineX + count(CACHE_SKIRTLINESX, sizeof(int)));
+	m_skirtLineZ.assign(pSkirtLineZ, pSkirtLineZ + count(CACHE_SKIRTLINESZ, sizeof(int)));
+	m_bAdaptive = bAdaptive;
+	buildMinMax();
+
+	// the GPU buffers come straight from the mapped file
+	BUFFERS &buffers = staging.buffers;
+	buffers.pVertices = (const float*)section(CACHE_VERTICES);
+	buffers.pNormals = (const float*)section(CACHE_NORMALS);
+	buffers.pTexCoords = (const float*)section(CACHE_TEXCOORDS);
+	buffers.nVertices = nVertices;
+	buffers.pIndices = pIndices;
+	buffers.nIndices = nIndices;
+	buffers.pTexels = (const unsigned short*)section(CACHE_TEXELS);
+	buffers.pAO = (const unsigned char*)section(CACHE_AO);
+	return m_bDisplacement ? buffers.pTexels != NULL : buffers.pVertices != NULL;
+}
+
+void C3dglTerrain::computeNormal(int x, int z, float *pNormal)
+{
+	// central differences (one-sided at the borders)
+	int x0 = (x == 0) ? x : x - 1;
+	int x1 = (x == m_nSizeX - 1) ? x : x + 1;
+	int z0 = (z == 0) ? z : z - 1;
+	int z1 = (z == m_nSizeZ - 1) ? z : z + 1;
+
+	float dy_x = gridHeight(x1, z) - gridHeight(x0, z);
+	float dy_z = gridHeight(x, z1) - gridHeight(x, z0);
+	float m = sqrt(dy_x * dy_x + 4 + dy_z * dy_z);
+	pNormal[0] = -dy_x / m;
+	pNormal[1] = 2 / m;
+	pNormal[2] = -dy_z / m;
+}
+
+void C3dglTerrain::createLinesBuffer()
+{
+	// Prepare Vertex Buffer for Visualisation of Normal Vectors
+	vector<float> lines(m_nSizeX * m_nSizeZ * 6);
 	int minx = -m_nSizeX/2;
 	int minz = -m_nSizeZ/2;
-	for (int x = minx; x < minx + m_nSizeX; x++)
-		for (int z = minz; z < minz + m_nSizeZ; z++)
-		{
-			vertices.push_back((float)x);
-			vertices.push_back(getHeight(x, z));
-			vertices.push_back((float)z);
-
-			int x0 = (x == minx) ? x : x - 1;
-			int x1 = (x == minx + m_nSizeX-1) ? x : x + 1;
-			int z0 = (z == minz) ? z : z - 1;
-			int z1 = (z == minz + m_nSizeZ-1) ? z : z + 1;
-
-			float dy_x = getHeight(x1, z) - getHeight(x0, z);
-			float dy_z = getHeight(x, z1) - getHeight(x, z0);
-			float m = sqrt(dy_x * dy_x + 4 + dy_z * dy_z);
-			normals.push_back(-dy_x / m);
-			normals.push_back(2 / m);
-			normals.push_back(-dy_z / m);
-
-			texCoords.push_back((float)x / 2.f);
-			texCoords.push_back((float)z / 2.f);
-
-			lines.push_back((float)x);
-			lines.push_back(getHeight(x, z));
-			lines.push_back((float)z);
-			lines.push_back(x - dy_x / m);
-			lines.push_back(getHeight(x, z) + 2 / m);
-			lines.push_back(z - dy_z / m);
-		}
-
-	// Prepare Vertex Buffer
-    glGenBuffers(1, &m_vertexBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * vertices.size(), &vertices[0], GL_STATIC_DRAW);
-
-	// Prepare Normal Buffer
-    glGenBuffers(1, &m_normalBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * normals.size(), &normals[0], GL_STATIC_DRAW);
-
-	// Prepare TexCoords Buffer
-	glGenBuffers(1, &m_texCoordBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * texCoords.size(), &texCoords[0], GL_STATIC_DRAW);
+	C3dglThreadPool::getDefault().parallelFor(0, m_nSizeX, [&](unsigned x0, unsigned x1)
+	{
+		for (int x = x0; x < (int)x1; x++)
+			for (int z = 0; z < m_nSizeZ; z++)
+			{
+				float *p = &lines[(x * m_nSizeZ + z) * 6];
+				float n[3];
+				computeNormal(x, z, n);
+				p[0] = (float)(x + minx);
+				p[1] = m_heights[x * m_nSizeZ + z];
+				p[2] = (float)(z + minz);
+				p[3] = p[0] + n[0];
+				p[4] = p[1] + n[1];
+				p[5] = p[2] + n[2];
+			}
+	});
 
-	// Prepare Vertex Buffer for Visualisation of Normal Vectors
     glGenBuffers(1, &m_linesBuffer);
     glBindBuffer(GL_ARRAY_BUFFER, m_linesBuffer);
     glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * lines.size(), &lines[0], GL_STATIC_DRAW);
+}
 
-	// Generate Indices
-	
-    /*
-        We loop through building the triangles that
-        make up each grid square in the heightmap
+bool C3dglTerrain::convertHeightmap(const std::string srcFilename, const std::string dstFilename, float scaleHeight, int nTileSize)
+{
+	C3dglBitmap bm;
+	if (!bm.load(srcFilename, GL_RGBA)) return false;
+
+	TILEDHEADER header;
+	memcpy(header.id, "3DGH", 4);
+	header.version = 1;
+	header.sizeX = bm.getWidth();
+	header.sizeZ = abs(bm.getHeight());
+	header.tileSize = max(2, min(nTileSize, 255));	// tile vertices must be addressable with 16-bit indices
+	header.scaleHeight = scaleHeight;
+	if (header.sizeX < 2 || header.sizeZ < 2) return false;
+
+	std::ofstream file(dstFilename, std::ios::binary);
+	if (!file) return false;
+	file.write((char*)&header, sizeof(header));
+
+	// tiles are written one at a time; samples past the edge of the map repeat the edge
+	int T = header.tileSize;
+	int nTilesX = max(1, (header.sizeX - 2) / T + 1);
+	int nTilesZ = max(1, (header.sizeZ - 2) / T + 1);
+	unsigned char *pBytes = (unsigned char*)(bm.GetBits());
+	vector<unsigned short> tile((T + 1) * (T + 1));
+	for (int tx = 0; tx < nTilesX; tx++)
+		for (int tz = 0; tz < nTilesZ; tz++)
+		{
+			for (int lx = 0; lx <= T; lx++)
+				for (int lz = 0; lz <= T; lz++)
+				{
+					int x = min(tx * T + lx, header.sizeX - 1);
+					int z = min(tz * T + lz, header.sizeZ - 1);
+					// same orientation as in loadHeightmap; 8-bit values are scaled to keep the heights unchanged
+					tile[lx * (T + 1) + lz] = pBytes[(x + (header.sizeZ - 1 - z) * header.sizeX) * 4] << 8;
+				}
+			file.write((char*)&tile[0], tile.size() * sizeof(unsigned short));
+		}
+
+	return file.good();
+}
+
+bool C3dglTerrain::loadTiled(const std::string filename, int nTileBudget)
+{
+	stopStreaming();
+
+	if (!m_mappedFile.open(filename)) return false;
+	const TILEDHEADER *pHeader = (const TILEDHEADER*)m_mappedFile.getData();
+	if (m_mappedFile.getSize() < sizeof(TILEDHEADER) || memcmp(pHeader->id, "3DGH", 4) != 0 || pHeader->version != 1
+		|| pHeader->tileSize < 2 || pHeader->tileSize > 255 || pHeader->sizeX < 2 || pHeader->sizeZ < 2)
+	{
+		m_mappedFile.close();
+		return false;
+	}
+
+	int T = pHeader->tileSize;
+	int nTilesX = (pHeader->sizeX - 2) / T + 1;
+	int nTilesZ = (pHeader->sizeZ - 2) / T + 1;
+	unsigned nTileVertices = (T + 1) * (T + 1);
+	if (m_mappedFile.getSize() < sizeof(TILEDHEADER) + (size_t)nTilesX * nTilesZ * nTileVertices * sizeof(unsigned short))
+	{
+		m_mappedFile.close();
+		return false;
+	}
+
+	m_nSizeX = pHeader->sizeX;
+	m_nSizeZ = pHeader->sizeZ;
+	m_nTileSize = T;
+	m_nTilesX = nTilesX;
+	m_nTilesZ = nTilesZ;
+	m_fTileScale = pHeader->scaleHeight / 65536.0f;
+	m_pTiles = (const unsigned short*)(pHeader + 1);
+
+	// the heights are only held by the mapped file, and neither LOD nor displacement apply
+	vector<float>().swap(m_heights);
+	m_nodes.clear();
+	m_minMax.clear();
+	m_bLOD = false;
+	deleteBuffers();
+
+	// GPU slots: the vertex buffers hold nTileBudget tiles, whatever the size of the terrain
+	nTileBudget = max(1, min(nTileBudget, nTilesX * nTilesZ));
+	glGenBuffers(1, &m_vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nTileVertices * nTileBudget, NULL, GL_DYNAMIC_DRAW);
+	glGenBuffers(1, &m_normalBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nTileVertices * nTileBudget, NULL, GL_DYNAMIC_DRAW);
+	glGenBuffers(1, &m_texCoordBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 2 * nTileVertices * nTileBudget, NULL, GL_DYNAMIC_DRAW);
+
+	// one index buffer shared by all the tiles (the same triangulation as in loadHeightmap)
+	vector<GLushort> indices(T * T * 6);
+	GLushort *p = &indices[0];
+	for (int x = 0; x < T; x++)
+		for (int z = 0; z < T; z++)
+		{
+			GLushort a = x * (T + 1) + z, b = a + 1, c = a + T + 1, d = c + 1;
+			*p++ = a; *p++ = b; *p++ = c;
+			*p++ = b; *p++ = d; *p++ = c;
+		}
+	glGenBuffers(1, &m_tileIndexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_tileIndexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * indices.size(), &indices[0], GL_STATIC_DRAW);
+
+	TILESLOT slot = { -1, 0, 0 };
+	m_tileSlots.assign(nTileBudget, slot);
+	m_tileState.assign(nTilesX * nTilesZ, TILE_ABSENT);
+
+	// a few staging buffers - they limit the number of tiles uploaded per frame
+	m_tileStaging.resize(4);
+	m_freeStaging.clear();
+	m_readyStaging.clear();
+	for (unsigned i = 0; i < m_tileStaging.size(); i++)
+	{
+		m_tileStaging[i].vertices.resize(nTileVertices * 3);
+		m_tileStaging[i].normals.resize(nTileVertices * 3);
+		m_tileStaging[i].texCoords.resize(nTileVertices * 2);
+		m_freeStaging.push_back(i);
+	}
+
+	// start streaming around the centre of the map (until the first render)
+	m_streamEye = glm::vec3(m_nSizeX / 2, 0, m_nSizeZ / 2);
+	m_bStreamDirty = true;
+	m_bStreamQuit = false;
+	m_streamThread = std::thread(&C3dglTerrain::streamWorker, this);
+	return true;
+}
+
+void C3dglTerrain::stopStreaming()
+{
+	if (m_streamThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_streamMutex);
+			m_bStreamQuit = true;
+		}
+		m_streamCV.notify_all();
+		m_streamThread.join();
+	}
+	if (m_pTiles)
+	{
+		// the tile slots and the shared index buffer
+		GLuint buffers[] = { m_vertexBuffer, m_normalBuffer, m_texCoordBuffer, m_tileIndexBuffer };
+		glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+		m_vertexBuffer = m_normalBuffer = m_texCoordBuffer = m_tileIndexBuffer = 0;
+	}
+	m_pTiles = NULL;
+	m_mappedFile.close();
+	m_tileSlots.clear();
+	m_tileState.clear();
+	m_tileStaging.clear();
+	m_freeStaging.clear();
+	m_readyStaging.clear();
+}
+
+void C3dglTerrain::collectTiles(glm::vec3 eye, vector<std::pair<float, int> > &tiles)
+{
+	// candidates: a square of tiles around the eye, large enough to fill the budget
+	int nBudget = m_tileSlots.size();
+	int r = (int)ceil(sqrt((float)nBudget) / 2) + 1;
+	int ex = (int)floor(eye.x / m_nTileSize), ez = (int)floor(eye.z / m_nTileSize);
+
+	tiles.clear();
+	for (int tx = max(0, ex - r); tx <= min(m_nTilesX - 1, ex + r); tx++)
+		for (int tz = max(0, ez - r); tz <= min(m_nTilesZ - 1, ez + r); tz++)
+		{
+			float dx = (tx + 0.5f) * m_nTileSize - eye.x;
+			float dz = (tz + 0.5f) * m_nTileSize - eye.z;
+			tiles.push_back(std::make_pair(dx * dx + dz * dz, tx * m_nTilesZ + tz));
+		}
+
+	// keep the nearest ones
+	if ((int)tiles.size() > nBudget)
+	{
+		std::partial_sort(tiles.begin(), tiles.begin() + nBudget, tiles.end());
+		tiles.resize(nBudget);
+	}
+	else
+		std::sort(tiles.begin(), tiles.end());
+}
+
+void C3dglTerrain::prepareTile(TILESTAGING &staging)
+{
+	int T = m_nTileSize;
+	int tx = staging.tile / m_nTilesZ, tz = staging.tile % m_nTilesZ;
+	staging.minY = staging.maxY = gridHeight(tx * T, tz * T);
+	for (int lx = 0; lx <= T; lx++)
+		for (int lz = 0; lz <= T; lz++)
+		{
+			// vertices past the edge of the map are clamped to it - their triangles degenerate
+			int x = min(tx * T + lx, m_nSizeX - 1);
+			int z = min(tz * T + lz, m_nSizeZ - 1);
+			unsigned i = lx * (T + 1) + lz;
+			float h = gridHeight(x, z);
+			staging.minY = min(staging.minY, h);
+			staging.maxY = max(staging.maxY, h);
+
+			staging.vertices[i * 3] = (float)(x - m_nSizeX / 2);
+			staging.vertices[i * 3 + 1] = h;
+			staging.vertices[i * 3 + 2] = (float)(z - m_nSizeZ / 2);
+			computeNormal(x, z, &staging.normals[i * 3]);
+			staging.texCoords[i * 2] = (float)(x - m_nSizeX / 2) / 2.f;
+			staging.texCoords[i * 2 + 1] = (float)(z - m_nSizeZ / 2) / 2.f;
+		}
+}
+
+void C3dglTerrain::streamWorker()
+{
+	vector<std::pair<float, int> > tiles;
+	std::unique_lock<std::mutex> lock(m_streamMutex);
+	for (;;)
+	{
+		m_streamCV.wait(lock, [this] { return m_bStreamQuit || m_bStreamDirty; });
+		if (m_bStreamQuit) return;
+		m_bStreamDirty = false;
+
+		// prepare the missing tiles, nearest first, while there are free staging buffers
+		collectTiles(m_streamEye, tiles);
+		for (auto &tile : tiles)
+		{
+			if (m_tileState[tile.second] != TILE_ABSENT) continue;
+			if (m_freeStaging.empty() || m_bStreamDirty) break;
+
+			int iStaging = m_freeStaging.back();
+			m_freeStaging.pop_back();
+			m_tileState[tile.second] = TILE_PENDING;
+			m_tileStaging[iStaging].tile = tile.second;
+
+			// the heights are read (and paged in) outside the lock
+			lock.unlock();
+			prepareTile(m_tileStaging[iStaging]);
+			lock.lock();
+
+			m_readyStaging.push_back(iStaging);
+			if (m_bStreamQuit) return;
+		}
+	}
+}
+
+void C3dglTerrain::updateStreaming(glm::vec3 eye)
+{
+	// eye in grid coordinates
+	eye.x += m_nSizeX / 2;
+	eye.z += m_nSizeZ / 2;
+	int T = m_nTileSize;
+	unsigned nTileVertices = (T + 1) * (T + 1);
+	auto distance = [&](int tile) -> float
+	{
+		float dx = (tile / m_nTilesZ + 0.5f) * T - eye.x;
+		float dz = (tile % m_nTilesZ + 0.5f) * T - eye.z;
+		return dx * dx + dz * dz;
+	};
+
+	std::lock_guard<std::mutex> lock(m_streamMutex);
+
+	// the worker only needs to reconsider its choice when the eye moves to another tile
+	bool bDirty = floor(eye.x / T) != floor(m_streamEye.x / T) || floor(eye.z / T) != floor(m_streamEye.z / T);
+	m_streamEye = eye;
+
+	// upload the tiles prepared by the worker
+	for (int iStaging : m_readyStaging)
+	{
+		TILESTAGING &staging = m_tileStaging[iStaging];
+
+		// a free slot, or else the one holding the most distant tile
+		int iSlot = -1;
+		float fMaxDist = distance(staging.tile);
+		for (unsigned i = 0; i < m_tileSlots.size() && (iSlot < 0 || m_tileSlots[iSlot].tile >= 0); i++)
+			if (m_tileSlots[i].tile < 0)
+				iSlot = i;
+			else if (distance(m_tileSlots[i].tile) > fMaxDist)
+			{
+				iSlot = i;
+				fMaxDist = distance(m_tileSlots[i].tile);
+			}
+
+		if (iSlot >= 0)
+		{
+			TILESLOT &slot = m_tileSlots[iSlot];
+			if (slot.tile >= 0)
+				m_tileState[slot.tile] = TILE_ABSENT;		// paged out
+			slot.tile = staging.tile;
+			slot.minY = staging.minY;
+			slot.maxY = staging.maxY;
+			m_tileState[staging.tile] = TILE_RESIDENT;
+
+			glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nTileVertices * iSlot, sizeof(GLfloat) * staging.vertices.size(), &staging.vertices[0]);
+			glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nTileVertices * iSlot, sizeof(GLfloat) * staging.normals.size(), &staging.normals[0]);
+			glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 2 * nTileVertices * iSlot, sizeof(GLfloat) * staging.texCoords.size(), &staging.texCoords[0]);
+		}
+		else
+			m_tileState[staging.tile] = TILE_ABSENT;		// the eye has moved away meanwhile
+
+		m_freeStaging.push_back(iStaging);
+		bDirty = true;
+	}
+	m_readyStaging.clear();
+
+	if (bDirty)
+	{
+		m_bStreamDirty = true;
+		m_streamCV.notify_one();
+	}
+}
+
+void C3dglTerrain::selectTiles(const C3dglFrustum *pFrustum)
+{
+	m_drawCounts.clear();
+	m_drawOffsets.clear();
+	m_drawBaseVertices.clear();
+	m_nRenderedTriangles = 0;
+
+	int T = m_nTileSize;
+	for (unsigned i = 0; i < m_tileSlots.size(); i++)
+	{
+		const TILESLOT &slot = m_tileSlots[i];
+		if (slot.tile < 0) continue;
+
+		int x0 = (slot.tile / m_nTilesZ) * T, z0 = (slot.tile % m_nTilesZ) * T;
+		glm::vec3 vecMin((float)(x0 - m_nSizeX / 2), slot.minY, (float)(z0 - m_nSizeZ / 2));
+		glm::vec3 vecMax(vecMin.x + T, slot.maxY, vecMin.z + T);
+		if (pFrustum && !pFrustum->testAABB(vecMin, vecMax))
+			continue;
 
-        (z*w+x) *----* (z*w+x+1)
-                |   /|
-                |  / |
-                | /  |
-     ((z+1)*w+x)*----* ((z+1)*w+x+1)
-    */
-    //Generate the triangle indices
-	vector<unsigned int> indices;
-	for (int z = 0; z < m_nSizeZ - 1; ++z)
-		for (int x = 0; x < m_nSizeX - 1; ++x)
+		m_drawCounts.push_back(T * T * 6);
+		m_drawOffsets.push_back(NULL);
+		m_drawBaseVertices.push_back(i * (T + 1) * (T + 1));
+		m_nRenderedTriangles += T * T * 2;
+	}
+}
+
+bool C3dglTerrain::bakeAO()
+{
+	vector<unsigned char> texels;
+	if (!computeAO(texels)) return false;
+	uploadAO(&texels[0]);
+	return true;
+}
+
+bool C3dglTerrain::computeAO(vector<unsigned char> &texels)
+{
+	if (m_heights.empty() || m_nSizeX < 2 || m_nSizeZ < 2) return false;
+
+	// Horizon-based ambient occlusion: in each direction, the highest elevation angle within the radius hides
+	// the part of the sky below it. For the cosine-weighted sky, the visible part of a slice is cos^2 of that
+	// angle, i.e. 1 / (1 + tan^2) - so only the slopes are needed.
+	// The directions are processed in groups of four (one per SIMD lane).
+	const int nDirections = 16;
+	int nSteps = 0;
+	for (float d = 1; d <= m_fAORadius; d *= 1.5f)
+		nSteps++;
+	if (nSteps == 0) return false;
+
+	// sample offsets, [step][direction]: exponentially spaced, so the near occluders are sampled densely
+	vector<int> offX(nSteps * nDirections), offZ(nSteps * nDirections), offset(nSteps * nDirections);
+	vector<float> invDist(nSteps * nDirections);
+	int nReach = 0;
+	float d = 1;
+	for (int s = 0; s < nSteps; s++, d *= 1.5f)
+		for (int dir = 0; dir < nDirections; dir++)
+		{
+			float a = glm::two_pi<float>() * (dir + 0.5f) / nDirections;
+			int k = s * nDirections + dir;
+			offX[k] = (int)floor(d * cos(a) + 0.5f);
+			offZ[k] = (int)floor(d * sin(a) + 0.5f);
+			offset[k] = offX[k] * m_nSizeZ + offZ[k];
+			invDist[k] = 1.0f / sqrt((float)(offX[k] * offX[k] + offZ[k] * offZ[k]));
+			nReach = max(nReach, max(abs(offX[k]), abs(offZ[k])));
+		}
+
+	texels.resize(m_nSizeX * m_nSizeZ);
+	C3dglThreadPool::getDefault().parallelFor(0, m_nSizeX, [&](unsigned x0, unsigned x1)
+	{
+		for (int x = x0; x < (int)x1; x++)
+			for (int z = 0; z < m_nSizeZ; z++)
+			{
+				const float *p = &m_heights[x * m_nSizeZ + z];
+				// away from the borders, the samples need no clamping
+				bool bInterior = x >= nReach && x < m_nSizeX - nReach && z >= nReach && z < m_nSizeZ - nReach;
+				float visibility = 0;
+				for (int dir = 0; dir < nDirections; dir += 4)
+				{
+					float h[4];
+#ifdef _3DGL_SSE2
+					__m128 h0 = _mm_set1_ps(p[0]);
+					__m128 maxSlope = _mm_setzero_ps();
+#else
+					float maxSlope[4] = { 0, 0, 0, 0 };
+#endif
+					for (int s = 0; s < nSteps; s++)
+					{
+						int k = s * nDirections + dir;
+						if (bInterior)
+							for (int j = 0; j < 4; j++)
+								h[j] = p[offset[k + j]];
+						else
+							for (int j = 0; j < 4; j++)
+								h[j] = m_heights[min(max(x + offX[k + j], 0), m_nSizeX - 1) * m_nSizeZ + min(max(z + offZ[k + j], 0), m_nSizeZ - 1)];
+#ifdef _3DGL_SSE2
+						__m128 slope = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(h), h0), _mm_loadu_ps(&invDist[k]));
+						maxSlope = _mm_max_ps(maxSlope, slope);
+#else
+						for (int j = 0; j < 4; j++)
+							maxSlope[j] = max(maxSlope[j], (h[j] - p[0]) * invDist[k + j]);
+#endif
+					}
+#ifdef _3DGL_SSE2
+					const __m128 one = _mm_set1_ps(1.0f);
+					_mm_storeu_ps(h, _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(maxSlope, maxSlope))));
+#else
+					for (int j = 0; j < 4; j++)
+						h[j] = 1 / (1 + maxSlope[j] * maxSlope[j]);
+#endif
+					visibility += h[0] + h[1] + h[2] + h[3];
+				}
+				texels[x * m_nSizeZ + z] = (GLubyte)(255 * visibility / nDirections + 0.5f);
+			}
+	});
+	return true;
+}
+
+void C3dglTerrain::uploadAO(const unsigned char *pTexels)
+{
+	// the same layout as the height map texture: the rows are the lines of constant x
+	GLint nActiveTexture, nAlignment;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &nActiveTexture);
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &nAlignment);
+	glActiveTexture(GL_TEXTURE0 + m_nAOUnit);
+	if (!m_aoTexture)
+		glGenTextures(1, &m_aoTexture);
+	glBindTexture(GL_TEXTURE_2D, m_aoTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, m_nSizeZ, m_nSizeX, 0, GL_RED, GL_UNSIGNED_BYTE, pTexels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, nAlignment);
+	glActiveTexture(nActiveTexture);
+}
+
+void C3dglTerrain::buildMinMax()
+{
+	m_minMax.clear();
+	if (m_nSizeX < 2 || m_nSizeZ < 2) return;
+
+	// level 1: blocks of 2x2 cells, taken directly from the height map
+	int sizeX = m_nSizeX - 1, sizeZ = m_nSizeZ - 1;		// in cells
+	do
+	{
+		int nLevel = m_minMax.size() + 1;
+		MINMAXLEVEL level;
+		level.sizeX = (sizeX + 1) / 2;
+		level.sizeZ = (sizeZ + 1) / 2;
+		level.cells.resize(level.sizeX * level.sizeZ);
+		m_minMax.push_back(level);
+		sizeX = level.sizeX;
+		sizeZ = level.sizeZ;
+		updateMinMax(nLevel, 0, 0, sizeX, sizeZ, true);
+	} while (sizeX > 1 || sizeZ > 1);
+}
+
+void C3dglTerrain::updateMinMax(int nLevel, int cx0, int cz0, int cx1, int cz1, bool bParallel)
+{
+	// recalculates the cells [cx0, cx1) x [cz0, cz1) of the given level from the level below
+	MINMAXLEVEL &level = m_minMax[nLevel - 1];
+	auto update = [&](unsigned x0, unsigned x1)
+	{
+		for (int cx = x0; cx < (int)x1; cx++)
+			for (int cz = cz0; cz < cz1; cz++)
+			{
+				MINMAX mm = { FLT_MAX, -FLT_MAX };
+				if (nLevel == 1)
+				{
+					// grid points covered by the block, including its far edges
+					for (int x = 2 * cx; x <= min(2 * cx + 2, m_nSizeX - 1); x++)
+						for (int z = 2 * cz; z <= min(2 * cz + 2, m_nSizeZ - 1); z++)
+						{
+							float h = m_heights[x * m_nSizeZ + z];
+							mm.minY = min(mm.minY, h);
+							mm.maxY = max(mm.maxY, h);
+						}
+				}
+				else
+				{
+					MINMAXLEVEL &below = m_minMax[nLevel - 2];
+					for (int x = 2 * cx; x < min(2 * cx + 2, below.sizeX); x++)
+						for (int z = 2 * cz; z < min(2 * cz + 2, below.sizeZ); z++)
+						{
+							const MINMAX &c = below.cells[x * below.sizeZ + z];
+							mm.minY = min(mm.minY, c.minY);
+							mm.maxY = max(mm.maxY, c.maxY);
+						}
+				}
+				level.cells[cx * level.sizeZ + cz] = mm;
+			}
+	};
+	if (bParallel)
+		C3dglThreadPool::getDefault().parallelFor(cx0, cx1, update);
+	else
+		update(cx0, cx1);
+}
+
+// a ray in grid coordinates
+struct C3dglTerrain::RAY
+{
+	glm::vec3 o, d;
+	bool bAnyHit;
+};
+
+// ray - box test; narrows [t0, t1] to the part of the ray inside the box
+static bool clipRay(const glm::vec3 &o, const glm::vec3 &d, glm::vec3 vecMin, glm::vec3 vecMax, float &t0, float &t1)
+{
+	const float eps = 1e-4f;	// grow the box slightly, so that the rays do not slip through the shared edges
+	for (int i = 0; i < 3; i++)
+	{
+		float lo = vecMin[i] - eps, hi = vecMax[i] + eps;
+		if (d[i] == 0)
+		{
+			if (o[i] < lo || o[i] > hi) return false;
+			continue;
+		}
+		float inv = 1 / d[i];
+		float tNear = (lo - o[i]) * inv, tFar = (hi - o[i]) * inv;
+		if (tNear > tFar) std::swap(tNear, tFar);
+		t0 = max(t0, tNear);
+		t1 = min(t1, tFar);
+		if (t0 > t1) return false;
+	}
+	return true;
+}
+
+// Moller-Trumbore ray - triangle test
+static bool intersectTriangle(const glm::vec3 &o, const glm::vec3 &d, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c, float tMin, float &t)
+{
+	glm::vec3 e1 = b - a, e2 = c - a;
+	glm::vec3 p = glm::cross(d, e2);
+	float det = glm::dot(e1, p);
+	if (det == 0) return false;
+	float inv = 1 / det;
+	glm::vec3 s = o - a;
+	float u = glm::dot(s, p) * inv;
+	if (u < 0 || u > 1) return false;
+	glm::vec3 q = glm::cross(s, e1);
+	float v = glm::dot(d, q) * inv;
+	if (v < 0 || u + v > 1) return false;
+	float tt = glm::dot(e2, q) * inv;
+	if (tt < tMin || tt >= t) return false;
+	t = tt;
+	return true;
+}
+
+bool C3dglTerrain::intersectNode(const RAY &ray, int nLevel, int cx, int cz, float tMin, float &tHit)
+{
+	if (nLevel == 0)
+	{
+		// a single cell: the same two triangles as in the index buffer
+		glm::vec3 a((float)cx, m_heights[cx * m_nSizeZ + cz], (float)cz);
+		glm::vec3 b((float)cx, m_heights[cx * m_nSizeZ + cz + 1], (float)(cz + 1));
+		glm::vec3 c((float)(cx + 1), m_heights[(cx + 1) * m_nSizeZ + cz], (float)cz);
+		glm::vec3 d((float)(cx + 1), m_heights[(cx + 1) * m_nSizeZ + cz + 1], (float)(cz + 1));
+		bool bHit = intersectTriangle(ray.o, ray.d, a, b, c, tMin, tHit);
+		if (bHit && ray.bAnyHit) return true;
+		return intersectTriangle(ray.o, ray.d, b, d, c, tMin, tHit) || bHit;
+	}
+
+	// the bounding box of the block
+	const MINMAXLEVEL &level = m_minMax[nLevel - 1];
+	const MINMAX &mm = level.cells[cx * level.sizeZ + cz];
+	glm::vec3 vecMin((float)(cx << nLevel), mm.minY, (float)(cz << nLevel));
+	glm::vec3 vecMax((float)min((cx + 1) << nLevel, m_nSizeX - 1), mm.maxY, (float)min((cz + 1) << nLevel, m_nSizeZ - 1));
+	float t0 = tMin, t1 = tHit;
+	if (!clipRay(ray.o, ray.d, vecMin, vecMax, t0, t1))
+		return false;
+
+	// the children, roughly front to back
+	int nSizeX = nLevel > 1 ? m_minMax[nLevel - 2].sizeX : m_nSizeX - 1;
+	int nSizeZ = nLevel > 1 ? m_minMax[nLevel - 2].sizeZ : m_nSizeZ - 1;
+	int ix = ray.d.x < 0 ? 1 : 0, iz = ray.d.z < 0 ? 1 : 0;
+	bool bHit = false;
+	for (int i = 0; i < 4; i++)
+	{
+		int x = 2 * cx + (ix ^ (i & 1)), z = 2 * cz + (iz ^ (i >> 1));
+		if (x >= nSizeX || z >= nSizeZ) continue;
+		if (intersectNode(ray, nLevel - 1, x, z, tMin, tHit))
+		{
+			bHit = true;
+			if (ray.bAnyHit) break;
+		}
+	}
+	return bHit;
+}
+
+bool C3dglTerrain::intersectRay(glm::vec3 origin, glm::vec3 dir, float &t, float tMax)
+{
+	if (m_minMax.empty()) return false;
+
+	RAY ray;
+	ray.o = origin + glm::vec3(m_nSizeX / 2, 0, m_nSizeZ / 2);
+	ray.d = dir;
+	ray.bAnyHit = false;
+	float tHit = tMax;
+	if (!intersectNode(ray, m_minMax.size(), 0, 0, 0, tHit))
+		return false;
+	t = tHit;
+	return true;
+}
+
+bool C3dglTerrain::intersectSegment(glm::vec3 p0, glm::vec3 p1, glm::vec3 *pHit)
+{
+	if (m_minMax.empty()) return false;
+
+	// without pHit, any hit will do
+	RAY ray;
+	ray.o = p0 + glm::vec3(m_nSizeX / 2, 0, m_nSizeZ / 2);
+	ray.d = p1 - p0;
+	ray.bAnyHit = (pHit == NULL);
+	float tHit = 1;
+	if (!intersectNode(ray, m_minMax.size(), 0, 0, 0, tHit))
+		return false;
+	if (pHit) *pHit = p0 + tHit * (p1 - p0);
+	return true;
+}
+
+void C3dglTerrain::intersectRays(const glm::vec3 *pOrigins, const glm::vec3 *pDirs, float *pT, unsigned n, float tMax)
+{
+	C3dglThreadPool::getDefault().parallelFor(0, n, [&](unsigned i0, unsigned i1)
+	{
+		for (unsigned i = i0; i < i1; i++)
+			if (!intersectRay(pOrigins[i], pDirs[i], pT[i], tMax))
+				pT[i] = -1;
+	}, 256);
+}
+
+bool C3dglTerrain::raise(float x, float z, float radius, float amount)
+{
+	return applyBrush(BRUSH_RAISE, x, z, radius, amount, 0);
+}
+
+bool C3dglTerrain::lower(float x, float z, float radius, float amount)
+{
+	return applyBrush(BRUSH_RAISE, x, z, radius, -amount, 0);
+}
+
+bool C3dglTerrain::flatten(float x, float z, float radius, float height, float strength)
+{
+	return applyBrush(BRUSH_FLATTEN, x, z, radius, strength, height);
+}
+
+bool C3dglTerrain::smooth(float x, float z, float radius, float strength)
+{
+	return applyBrush(BRUSH_SMOOTH, x, z, radius, strength, 0);
+}
+
+bool C3dglTerrain::applyBrush(BRUSH brush, float fx, float fz, float radius, float strength, float height)
+{
+	if (m_pTiles || m_bAdaptive || m_heights.empty() || radius <= 0) return false;
+
+	// the affected rectangle, in grid coordinates
+	float cx = fx + m_nSizeX / 2, cz = fz + m_nSizeZ / 2;
+	int x0 = max(0, (int)ceil(cx - radius)), x1 = min(m_nSizeX - 1, (int)floor(cx + radius));
+	int z0 = max(0, (int)ceil(cz - radius)), z1 = min(m_nSizeZ - 1, (int)floor(cz + radius));
+	if (x0 > x1 || z0 > z1) return false;
+
+	// smoothing reads the original heights, including a margin of one sample
+	int sx0 = max(0, x0 - 1), sx1 = min(m_nSizeX - 1, x1 + 1);
+	int sz0 = max(0, z0 - 1), sz1 = min(m_nSizeZ - 1, z1 + 1);
+	int nCopy = sz1 - sz0 + 1;
+	if (brush == BRUSH_SMOOTH)
+	{
+		m_editHeights.resize((sx1 - sx0 + 1) * nCopy);
+		for (int x = sx0; x <= sx1; x++)
+			memcpy(&m_editHeights[(x - sx0) * nCopy], &m_heights[x * m_nSizeZ + sz0], nCopy * sizeof(float));
+	}
+
+	float fMaxChange = 0;
+	for (int x = x0; x <= x1; x++)
+		for (int z = z0; z <= z1; z++)
+		{
+			float d2 = ((x - cx) * (x - cx) + (z - cz) * (z - cz)) / (radius * radius);
+			if (d2 >= 1) continue;
+			float w = (1 - d2) * (1 - d2);		// smooth falloff
+
+			float &h = m_heights[x * m_nSizeZ + z];
+			float h0 = h;
+			switch (brush)
+			{
+			case BRUSH_RAISE:
+				h += w * strength;
+				break;
+			case BRUSH_FLATTEN:
+				h += (height - h) * min(1.0f, w * strength);
+				break;
+			case BRUSH_SMOOTH:
+				{
+					float sum = 0;
+					int n = 0;
+					for (int i = max(x - 1, sx0); i <= min(x + 1, sx1); i++)
+						for (int j = max(z - 1, sz0); j <= min(z + 1, sz1); j++, n++)
+							sum += m_editHeights[(i - sx0) * nCopy + j - sz0];
+					h += (sum / n - h) * min(1.0f, w * strength);
+				}
+				break;
+			}
+
+			// displacement: the heights are limited to the range of the height map texture, so that the queries
+			// and the ray casts follow the rendered surface
+			if (m_heightTexture)
+				h = max(0.0f, min(m_fHeightMapScale, h));
+			fMaxChange = max(fMaxChange, (float)fabs(h - h0));
+		}
+
+	updateRegion(x0, z0, x1, z1, fMaxChange);
+	return true;
+}
+
+void C3dglTerrain::updateRegion(int x0, int z0, int x1, int z1, float fMaxChange)
+{
+	// height range of the modified area
+	float minY = FLT_MAX, maxY = -FLT_MAX;
+	for (int x = x0; x <= x1; x++)
+		for (int z = z0; z <= z1; z++)
+		{
+			minY = min(minY, m_heights[x * m_nSizeZ + z]);
+			maxY = max(maxY, m_heights[x * m_nSizeZ + z]);
+		}
+
+	// LOD: bounding boxes are only ever grown, and the errors grow by the largest change
+	// (the coarse samples and the fine ones may move in opposite directions)
+	if (m_bLOD && !m_nodes.empty())
+		updateNodeBounds(0, x0, z0, x1, z1, minY, maxY, 2 * fMaxChange);
+
+	// the skirts must remain deeper than the largest crack - once the errors outgrow them, they are dropped
+	// to at least twice the depth (so that it happens rarely) and all rebuilt. With displacement, the depth is
+	// passed with the instances and there is nothing to rebuild.
+	bool bDeeperSkirts = false;
+	if (m_bLOD && !m_nodes.empty() && m_nodes[0].error + 1.0f > m_fSkirtDepth)
+	{
+		m_fSkirtDepth = max(m_nodes[0].error + 1.0f, 2 * m_fSkirtDepth);
+		bDeeperSkirts = true;
+	}
+
+	if (m_heightTexture)
+	{
+		// displacement: only the height texture needs updating (the shader calculates the normals)
+		int nCols = z1 - z0 + 1;
+		m_editTexels.resize((x1 - x0 + 1) * nCols);
+		for (int x = x0; x <= x1; x++)
+			for (int z = z0; z <= z1; z++)
+				m_editTexels[(x - x0) * nCols + z - z0] = (GLushort)max(0.0f, min(65535.0f, m_heights[x * m_nSizeZ + z] / m_fHeightMapScale * 65535.0f + 0.5f));
+
+		GLint nActiveTexture, nAlignment;
+		glGetIntegerv(GL_ACTIVE_TEXTURE, &nActiveTexture);
+		glGetIntegerv(GL_UNPACK_ALIGNMENT, &nAlignment);
+		glActiveTexture(GL_TEXTURE0 + m_nHeightMapUnit);
+		glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, z0, x0, nCols, x1 - x0 + 1, GL_RED, GL_UNSIGNED_SHORT, &m_editTexels[0]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, nAlignment);
+		glActiveTexture(nActiveTexture);
+
+		// the normal vectors visualisation will be rebuilt when next rendered
+		if (m_linesBuffer)
+			glDeleteBuffers(1, &m_linesBuffer);
+		m_linesBuffer = 0;
+	}
+	else
+	{
+		// the normals depend on the neighbours, so the area grows by one sample
+		int nx0 = max(0, x0 - 1), nx1 = min(m_nSizeX - 1, x1 + 1);
+		int nz0 = max(0, z0 - 1), nz1 = min(m_nSizeZ - 1, z1 + 1);
+		int nMax = bDeeperSkirts ? max(m_nSizeX, m_nSizeZ) : max(nx1 - nx0, nz1 - nz0) + 1;
+		m_editData.resize(nMax * 12);
+		float *pVertices = &m_editData[0], *pNormals = &m_editData[nMax * 3], *pLines = &m_editData[nMax * 6];
+
+		// vertex data for a range of grid points, then uploaded to the given (contiguous) range of vertices
+		auto fill = [&](int x, int z, int i)
+		{
+			pVertices[i * 3] = (float)(x - m_nSizeX / 2);
+			pVertices[i * 3 + 1] = m_heights[x * m_nSizeZ + z];
+			pVertices[i * 3 + 2] = (float)(z - m_nSizeZ / 2);
+			computeNormal(x, z, pNormals + i * 3);
+		};
+		auto upload = [&](unsigned nFirstVertex, int n)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nFirstVertex, sizeof(GLfloat) * 3 * n, pVertices);
+			glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nFirstVertex, sizeof(GLfloat) * 3 * n, pNormals);
+		};
+		auto dropSkirt = [&](int n)
+		{
+			for (int i = 0; i < n; i++)
+				pVertices[i * 3 + 1] -= m_fSkirtDepth;
+		};
+
+		// one range per line of constant x
+		int nCols = nz1 - nz0 + 1;
+		for (int x = nx0; x <= nx1; x++)
+		{
+			for (int z = nz0; z <= nz1; z++)
+				fill(x, z, z - nz0);
+			upload(x * m_nSizeZ + nz0, nCols);
+
+			// normal vectors visualisation
+			if (m_linesBuffer)
+			{
+				for (int i = 0; i < nCols * 3; i++)
+				{
+					pLines[(i / 3) * 6 + i % 3] = pVertices[i];
+					pLines[(i / 3) * 6 + 3 + i % 3] = pVertices[i] + pNormals[i];
+				}
+				glBindBuffer(GL_ARRAY_BUFFER, m_linesBuffer);
+				glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 6 * (x * m_nSizeZ + nz0), sizeof(GLfloat) * 6 * nCols, pLines);
+			}
+
+			// skirts attached to this line
+			if (m_bLOD && m_skirtLineX[x] >= 0)
+			{
+				dropSkirt(nCols);
+				upload(skirtVertex(x, nz0, false), nCols);
+			}
+		}
+
+		// skirts attached to the lines of constant z
+		if (m_bLOD)
+			for (int z = nz0; z <= nz1; z++)
+				if (m_skirtLineZ[z] >= 0)
+				{
+					for (int x = nx0; x <= nx1; x++)
+						fill(x, z, x - nx0);
+					dropSkirt(nx1 - nx0 + 1);
+					upload(skirtVertex(nx0, z, true), nx1 - nx0 + 1);
+				}
+
+		// all the skirts, if dropped deeper
+		if (bDeeperSkirts)
+		{
+			for (int x = 0; x < m_nSizeX; x++)
+				if (m_skirtLineX[x] >= 0)
+				{
+					for (int z = 0; z < m_nSizeZ; z++)
+						fill(x, z, z);
+					dropSkirt(m_nSizeZ);
+					upload(skirtVertex(x, 0, false), m_nSizeZ);
+				}
+			for (int z = 0; z < m_nSizeZ; z++)
+				if (m_skirtLineZ[z] >= 0)
+				{
+					for (int x = 0; x < m_nSizeX; x++)
+						fill(x, z, x);
+					dropSkirt(m_nSizeX);
+					upload(skirtVertex(0, z, true), m_nSizeX);
+				}
+		}
+	}
+
+	// min-max pyramid: the blocks containing the cells around the modified points
+	int cx0 = max(0, x0 - 1), cx1 = min(m_nSizeX - 2, x1);
+	int cz0 = max(0, z0 - 1), cz1 = min(m_nSizeZ - 2, z1);
+	for (unsigned nLevel = 1; nLevel <= m_minMax.size(); nLevel++)
+		updateMinMax(nLevel, cx0 >> nLevel, cz0 >> nLevel, (cx1 >> nLevel) + 1, (cz1 >> nLevel) + 1, false);
+}
+
+void C3dglTerrain::updateNodeBounds(int iNode, int x0, int z0, int x1, int z1, float minY, float maxY, float fErrorGrowth)
+{
+	NODE &node = m_nodes[iNode];
+	if (node.x1 < x0 || node.x0 > x1 || node.z1 < z0 || node.z0 > z1)
+		return;
+	node.minY = min(node.minY, minY);
+	node.maxY = max(node.maxY, maxY);
+	if (node.step > 1)
+		node.error += fErrorGrowth;
+	for (int iChild : node.child)
+		if (iChild >= 0)
+			updateNodeBounds(iChild, x0, z0, x1, z1, minY, maxY, fErrorGrowth);
+}
+
+void C3dglTerrain::buildRTIN(vector<unsigned> &indices, vector<unsigned> &vertices)
+{
+	// RTIN (right-triangulated irregular network), after Martini: a binary tree of right triangles, each split
+	// at the midpoint of its hypotenuse. It needs a square grid of 2^k+1 points - if the map does not fit,
+	// a larger virtual grid is used, and the triangles reaching beyond the map are refined down to the cells.
+	int nTile = 1;
+	while (nTile < m_nSizeX - 1 || nTile < m_nSizeZ - 1)
+		nTile *= 2;
+	int nGrid = nTile + 1;
+	auto inside = [&](int x, int z) { return x < m_nSizeX && z < m_nSizeZ; };
+	auto height = [&](int x, int z) { return m_heights[min(x, m_nSizeX - 1) * m_nSizeZ + min(z, m_nSizeZ - 1)]; };
+
+	// errors at the hypotenuse midpoints, collected bottom-up (the children always follow their parents)
+	vector<float> errors(nGrid * nGrid, 0);
+	int nTriangles = nTile * nTile * 2 - 2;
+	int nParents = nTriangles - nTile * nTile;
+	for (int i = nTriangles - 1; i >= 0; i--)
+	{
+		// decode the triangle from its position in the tree
+		int id = i + 2;
+		int ax = 0, az = 0, bx = 0, bz = 0, cx = 0, cz = 0;
+		if (id & 1)
+			bx = bz = cx = nTile;
+		else
+			ax = az = cz = nTile;
+		while ((id >>= 1) > 1)
 		{
-			indices.push_back(x * m_nSizeZ + z); // current point
-			indices.push_back(x * m_nSizeZ + z + 1); // next row
-			indices.push_back((x + 1) * m_nSizeZ + z); // same row, next col
+			int mx = (ax + bx) >> 1, mz = (az + bz) >> 1;
+			if (id & 1)
+			{
+				bx = ax; bz = az;
+				ax = cx; az = cz;
+			}
+			else
+			{
+				ax = bx; az = bz;
+				bx = cx; bz = cz;
+			}
+			cx = mx; cz = mz;
+		}
 
-			indices.push_back(x * m_nSizeZ + z + 1); // next row
-			indices.push_back((x + 1) * m_nSizeZ + z + 1); //next row, next col
-			indices.push_back((x + 1) * m_nSizeZ + z); // same row, next col
+		int mx = (ax + bx) >> 1, mz = (az + bz) >> 1;
+		float &error = errors[mx * nGrid + mz];
+		if (!inside(ax, az) || !inside(bx, bz) || !inside(cx, cz))
+			error = FLT_MAX;
+		else
+			error = max(error, (float)fabs((height(ax, az) + height(bx, bz)) / 2 - height(mx, mz)));
+		if (i < nParents)
+		{
+			float errorLeft = errors[((ax + cx) >> 1) * nGrid + ((az + cz) >> 1)];
+			float errorRight = errors[((bx + cx) >> 1) * nGrid + ((bz + cz) >> 1)];
+			error = max(error, max(errorLeft, errorRight));
 		}
+	}
 
-	// Prepare Index Buffer
-    glGenBuffers(1, &m_indexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), &indices[0], GL_STATIC_DRAW);
+	// extract the mesh; the vertices are numbered in the order of first use
+	vector<int> vertexMap(nGrid * nGrid, -1);
+	auto vertex = [&](int x, int z) -> unsigned
+	{
+		int &i = vertexMap[x * nGrid + z];
+		if (i < 0)
+		{
+			i = vertices.size();
+			vertices.push_back(x * m_nSizeZ + z);
+		}
+		return i;
+	};
+	struct TRIANGLE { int ax, az, bx, bz, cx, cz; };
+	vector<TRIANGLE> stack;
+	TRIANGLE t1 = { 0, 0, nTile, nTile, nTile, 0 }, t2 = { nTile, nTile, 0, 0, 0, nTile };
+	stack.push_back(t2);
+	stack.push_back(t1);
+	while (!stack.empty())
+	{
+		TRIANGLE t = stack.back();
+		stack.pop_back();
+		int mx = (t.ax + t.bx) >> 1, mz = (t.az + t.bz) >> 1;
+		if (abs(t.ax - t.cx) + abs(t.az - t.cz) > 1 && errors[mx * nGrid + mz] > m_fRTINError)
+		{
+			TRIANGLE left = { t.cx, t.cz, t.ax, t.az, mx, mz }, right = { t.bx, t.bz, t.cx, t.cz, mx, mz };
+			stack.push_back(right);
+			stack.push_back(left);
+		}
+		else if (inside(t.ax, t.az) && inside(t.bx, t.bz) && inside(t.cx, t.cz))
+		{
+			// the same (upward-facing) winding as the regular grid
+			if ((t.bz - t.az) * (t.cx - t.ax) - (t.bx - t.ax) * (t.cz - t.az) < 0)
+			{
+				std::swap(t.bx, t.cx);
+				std::swap(t.bz, t.cz);
+			}
+			indices.push_back(vertex(t.ax, t.az));
+			indices.push_back(vertex(t.bx, t.bz));
+			indices.push_back(vertex(t.cx, t.cz));
+		}
+	}
+}
 
-    return true;
+unsigned C3dglTerrain::skirtVertex(int x, int z, bool bAlongX)
+{
+	// skirts along x are attached to the lines of constant z, and vice versa
+	if (bAlongX)
+		return m_nSkirtBase + m_nSkirtLinesX * m_nSizeZ + m_skirtLineZ[z] * m_nSizeX + x;
+	else
+		return m_nSkirtBase + m_skirtLineX[x] * m_nSizeZ + z;
+}
+
+int C3dglTerrain::buildNode(int x0, int z0, int size, vector<unsigned> &indices)
+{
+	int iNode = m_nodes.size();
+	m_nodes.push_back(NODE());
+
+	NODE node;
+	node.x0 = x0;
+	node.z0 = z0;
+	node.x1 = min(x0 + size, m_nSizeX - 1);
+	node.z1 = min(z0 + size, m_nSizeZ - 1);
+	node.step = size / m_nChunkSize;
+	node.error = 0;
+
+	// build the children first (depth-first order keeps the indices of neighbouring chunks close)
+	for (int i = 0; i < 4; i++)
+	{
+		int cx = x0 + (i % 2) * size / 2;
+		int cz = z0 + (i / 2) * size / 2;
+		node.child[i] = (node.step > 1 && cx < m_nSizeX - 1 && cz < m_nSizeZ - 1) ? buildNode(cx, cz, size / 2, indices) : -1;
+		if (node.child[i] >= 0)
+			node.error = max(node.error, m_nodes[node.child[i]].error);
+	}
+
+	// sampling coordinates - the last row/column is clamped to the extent of the node
+	vector<int> xs, zs;
+	for (int x = node.x0; x < node.x1; x += node.step) xs.push_back(x);
+	for (int z = node.z0; z < node.z1; z += node.step) zs.push_back(z);
+	xs.push_back(node.x1);
+	zs.push_back(node.z1);
+
+	// height range and the geometric error of this level of detail
+	node.minY = node.maxY = m_heights[node.x0 * m_nSizeZ + node.z0];
+	for (unsigned i = 0; i + 1 < xs.size(); i++)
+		for (unsigned j = 0; j + 1 < zs.size(); j++)
+		{
+			int xa = xs[i], xb = xs[i + 1], za = zs[j], zb = zs[j + 1];
+			float h00 = m_heights[xa * m_nSizeZ + za], h01 = m_heights[xa * m_nSizeZ + zb];
+			float h10 = m_heights[xb * m_nSizeZ + za], h11 = m_heights[xb * m_nSizeZ + zb];
+			for (int x = xa; x <= xb; x++)
+				for (int z = za; z <= zb; z++)
+				{
+					float h = m_heights[x * m_nSizeZ + z];
+					node.minY = min(node.minY, h);
+					node.maxY = max(node.maxY, h);
+
+					// interpolate within the coarse cell, the same way it is triangulated below
+					float fx = (float)(x - xa) / (xb - xa);
+					float fz = (float)(z - za) / (zb - za);
+					float f = (fx + fz <= 1) ? h00 + fx * (h10 - h00) + fz * (h01 - h00) : h11 + (1 - fx) * (h01 - h11) + (1 - fz) * (h10 - h11);
+					node.error = max(node.error, (float)fabs(h - f));
+				}
+		}
+
+	// chunk triangles
+	node.offset = indices.size();
+	for (unsigned i = 0; i + 1 < xs.size(); i++)
+		for (unsigned j = 0; j + 1 < zs.size(); j++)
+		{
+			unsigned a = xs[i] * m_nSizeZ + zs[j], b = xs[i] * m_nSizeZ + zs[j + 1];
+			unsigned c = xs[i + 1] * m_nSizeZ + zs[j], d = xs[i + 1] * m_nSizeZ + zs[j + 1];
+			indices.push_back(a); indices.push_back(b); indices.push_back(c);
+			indices.push_back(b); indices.push_back(d); indices.push_back(c);
+		}
+
+	// skirts along the four edges
+	for (unsigned i = 0; i + 1 < xs.size(); i++)
+		for (int z : { node.z0, node.z1 })
+		{
+			unsigned a = xs[i] * m_nSizeZ + z, b = xs[i + 1] * m_nSizeZ + z;
+			unsigned sa = skirtVertex(xs[i], z, true), sb = skirtVertex(xs[i + 1], z, true);
+			indices.push_back(a); indices.push_back(sa); indices.push_back(b);
+			indices.push_back(b); indices.push_back(sa); indices.push_back(sb);
+		}
+	for (unsigned j = 0; j + 1 < zs.size(); j++)
+		for (int x : { node.x0, node.x1 })
+		{
+			unsigned a = x * m_nSizeZ + zs[j], b = x * m_nSizeZ + zs[j + 1];
+			unsigned sa = skirtVertex(x, zs[j], false), sb = skirtVertex(x, zs[j + 1], false);
+			indices.push_back(a); indices.push_back(sa); indices.push_back(b);
+			indices.push_back(b); indices.push_back(sa); indices.push_back(sb);
+		}
+	node.count = indices.size() - node.offset;
+
+	m_nodes[iNode] = node;
+	return iNode;
+}
+
+void C3dglTerrain::selectNodes(int iNode, const C3dglFrustum *pFrustum, glm::vec3 eye, float fPixelsPerUnit)
+{
+	const NODE &node = m_nodes[iNode];
+
+	// bounding box (in the model space)
+	glm::vec3 vecMin((float)(node.x0 - m_nSizeX / 2), node.minY - m_fSkirtDepth, (float)(node.z0 - m_nSizeZ / 2));
+	glm::vec3 vecMax((float)(node.x1 - m_nSizeX / 2), node.maxY, (float)(node.z1 - m_nSizeZ / 2));
+	if (pFrustum && !pFrustum->testAABB(vecMin, vecMax))
+		return;
+
+	// refine if the projected error is too big (or always, if no projection given)
+	bool bRefine = node.step > 1;
+	if (bRefine && fPixelsPerUnit > 0)
+	{
+		float dist = glm::length(glm::max(glm::max(vecMin - eye, eye - vecMax), glm::vec3(0)));
+		bRefine = dist <= 0 || node.error * fPixelsPerUnit / dist > m_fPixelError;
+	}
+
+	if (bRefine)
+	{
+		for (int iChild : node.child)
+			if (iChild >= 0)
+				selectNodes(iChild, pFrustum, eye, fPixelsPerUnit);
+	}
+	else if (m_heightTexture)
+	{
+		m_patchInstances.push_back(glm::vec4(node.x0, node.z0, node.step, m_fSkirtDepth));
+		m_nRenderedTriangles += getPatch(m_nChunkSize).nIndices / 3;
+	}
+	else
+	{
+		m_drawCounts.push_back(node.count);
+		m_drawOffsets.push_back((void*)(node.offset * sizeof(GLuint)));
+		m_nRenderedTriangles += node.count / 3;
+	}
 }
 
 void C3dglTerrain::render(glm::mat4 matrix)
+{
+	// streaming mode: no culling, but the tiles still follow the camera
+	if (m_pTiles)
+	{
+		updateStreaming(glm::vec3(glm::inverse(matrix)[3]));
+		selectTiles(NULL);
+		renderBuffers(matrix);
+		return;
+	}
+
+	m_drawCounts.clear();
+	m_drawOffsets.clear();
+	m_patchInstances.clear();
+	m_nRenderedTriangles = 0;
+
+	// without the projection, LOD mode renders all the leaf chunks (full resolution)
+	if (m_bLOD && !m_nodes.empty())
+		selectNodes(0, NULL, glm::vec3(0), 0);
+	else
+		m_nRenderedTriangles = m_nIndices / 3;
+
+	renderBuffers(matrix);
+}
+
+void C3dglTerrain::render(glm::mat4 matrix, glm::mat4 matrixProjection)
+{
+	if (m_pTiles)
+	{
+		updateStreaming(glm::vec3(glm::inverse(matrix)[3]));
+		C3dglFrustum frustum(matrixProjection, matrix);
+		selectTiles(&frustum);
+		renderBuffers(matrix);
+		return;
+	}
+
+	if (!m_bLOD || m_nodes.empty())
+	{
+		render(matrix);
+		return;
+	}
+
+	m_drawCounts.clear();
+	m_drawOffsets.clear();
+	m_patchInstances.clear();
+	m_nRenderedTriangles = 0;
+
+	// the eye position and the frustum, both in the model space
+	glm::vec3 eye = glm::vec3(glm::inverse(matrix)[3]);
+	C3dglFrustum frustum(matrixProjection, matrix);
+
+	// number of pixels per unit of height at the distance of 1 unit
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	float fPixelsPerUnit = 0.5f * viewport[3] * matrixProjection[1][1];
+
+	selectNodes(0, &frustum, eye, fPixelsPerUnit);
+	renderBuffers(matrix);
+}
+
+void C3dglTerrain::drawElements()
+{
+	if (m_pTiles)
+	{
+		if (m_drawCounts.empty()) return;
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_tileIndexBuffer);
+		glMultiDrawElementsBaseVertex(GL_TRIANGLES, &m_drawCounts[0], GL_UNSIGNED_SHORT, (const GLvoid**)&m_drawOffsets[0], m_drawCounts.size(), &m_drawBaseVertices[0]);
+	}
+	else if (m_bLOD)
+	{
+		if (m_drawCounts.empty()) return;
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_lodIndexBuffer);
+		glMultiDrawElements(GL_TRIANGLES, &m_drawCounts[0], GL_UNSIGNED_INT, (const GLvoid**)&m_drawOffsets[0], m_drawCounts.size());
+	}
+	else
+	{
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+		glDrawElements(GL_TRIANGLES, m_nIndices, GL_UNSIGNED_INT, 0);
+	}
+}
+
+void C3dglTerrain::renderBuffers(glm::mat4 matrix)
 {
 	// check if a shading program is active
 	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
 
-	if (pProgram)
+	// the baked ambient occlusion (see terrain.frag)
+	if (pProgram && m_aoTexture)
+	{
+		pProgram->SendUniform("aoMapOn", (GLint)1);
+		pProgram->SendUniform("aoMap", (GLint)m_nAOUnit);
+		GLint nActiveTexture;
+		glGetIntegerv(GL_ACTIVE_TEXTURE, &nActiveTexture);
+		glActiveTexture(GL_TEXTURE0 + m_nAOUnit);
+		glBindTexture(GL_TEXTURE_2D, m_aoTexture);
+		glActiveTexture(nActiveTexture);
+	}
+
+	if (m_heightTexture)
+		renderPatches(matrix);
+	else if (pProgram)
 	{
 		pProgram->SendStandardUniform(C3dglProgram::UNI_MODELVIEW, matrix);
 
@@ -243,8 +2048,7 @@ void C3dglTerrain::render(glm::mat4 matrix)
 		glVertexAttribPointer(attribTexCoord, 2, GL_FLOAT, GL_FALSE, 0, 0);
 
 		//Bind the index array and draw triangles
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-		glDrawElements(GL_TRIANGLES, (m_nSizeX - 1) * (m_nSizeZ - 1) * 6, GL_UNSIGNED_INT, 0);
+		drawElements();
 
 		glDisableVertexAttribArray(attribVertex);
 		glDisableVertexAttribArray(attribNormal);
@@ -273,12 +2077,126 @@ void C3dglTerrain::render(glm::mat4 matrix)
 		glTexCoordPointer(2, GL_FLOAT, 0, 0);
 
 		//Bind the index array and draw triangles
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-		glDrawElements(GL_TRIANGLES, (m_nSizeX - 1) * (m_nSizeZ - 1) * 6, GL_UNSIGNED_INT, 0);
+		drawElements();
 
 		glDisableClientState(GL_VERTEX_ARRAY);
 		glDisableClientState(GL_NORMAL_ARRAY);
 	}
+
+	if (pProgram && m_aoTexture)
+		pProgram->SendUniform("aoMapOn", (GLint)0);
+}
+
+std::map<int, C3dglTerrain::PATCH> C3dglTerrain::c_patches;
+unsigned C3dglTerrain::c_nTerrains = 0;
+
+const C3dglTerrain::PATCH &C3dglTerrain::getPatch(int nSize)
+{
+	auto i = c_patches.find(nSize);
+	if (i != c_patches.end())
+		return i->second;
+
+	// grid vertices, then the skirt vertices: along x (z = 0 and z = P), then along z (x = 0 and x = P)
+	int P = nSize;
+	vector<GLubyte> vertices;
+	auto addVertex = [&](int x, int z, int skirt)
+	{
+		vertices.push_back(x); vertices.push_back(z); vertices.push_back(skirt); vertices.push_back(0);
+	};
+	for (int x = 0; x <= P; x++)
+		for (int z = 0; z <= P; z++)
+			addVertex(x, z, 0);
+	for (int z : { 0, P })
+		for (int x = 0; x <= P; x++)
+			addVertex(x, z, 1);
+	for (int x : { 0, P })
+		for (int z = 0; z <= P; z++)
+			addVertex(x, z, 1);
+
+	// the same triangulation as in loadHeightmap and the same skirts as in buildNode
+	vector<GLushort> indices;
+	auto grid = [&](int x, int z) { return (GLushort)(x * (P + 1) + z); };
+	for (int x = 0; x < P; x++)
+		for (int z = 0; z < P; z++)
+		{
+			GLushort a = grid(x, z), b = grid(x, z + 1), c = grid(x + 1, z), d = grid(x + 1, z + 1);
+			indices.push_back(a); indices.push_back(b); indices.push_back(c);
+			indices.push_back(b); indices.push_back(d); indices.push_back(c);
+		}
+	unsigned nGridIndices = indices.size();
+	GLushort nSkirtBase = (P + 1) * (P + 1);
+	for (int k = 0; k < 2; k++)
+		for (int x = 0; x < P; x++)
+		{
+			GLushort a = grid(x, k * P), b = grid(x + 1, k * P);
+			GLushort sa = nSkirtBase + k * (P + 1) + x, sb = sa + 1;
+			indices.push_back(a); indices.push_back(sa); indices.push_back(b);
+			indices.push_back(b); indices.push_back(sa); indices.push_back(sb);
+		}
+	for (int k = 0; k < 2; k++)
+		for (int z = 0; z < P; z++)
+		{
+			GLushort a = grid(k * P, z), b = grid(k * P, z + 1);
+			GLushort sa = nSkirtBase + (2 + k) * (P + 1) + z, sb = sa + 1;
+			indices.push_back(a); indices.push_back(sa); indices.push_back(b);
+			indices.push_back(b); indices.push_back(sa); indices.push_back(sb);
+		}
+
+	PATCH patch;
+	patch.nGridIndices = nGridIndices;
+	patch.nIndices = indices.size();
+	glGenBuffers(1, &patch.vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, patch.vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size(), &vertices[0], GL_STATIC_DRAW);
+	glGenBuffers(1, &patch.indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, patch.indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * indices.size(), &indices[0], GL_STATIC_DRAW);
+	return c_patches[nSize] = patch;
+}
+
+void C3dglTerrain::renderPatches(glm::mat4 matrix)
+{
+	// displacement requires a shading program
+	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
+	if (!pProgram) return;
+
+	const PATCH &patch = getPatch(m_nChunkSize);
+	GLsizei nInstances = m_bLOD ? m_patchInstances.size() : m_nStaticInstances;
+	if (nInstances == 0) return;
+
+	pProgram->SendStandardUniform(C3dglProgram::UNI_MODELVIEW, matrix);
+	pProgram->SendUniform("heightMapOn", (GLint)1);
+	pProgram->SendUniform("heightMap", (GLint)m_nHeightMapUnit);
+	pProgram->SendUniform("heightMapScale", m_fHeightMapScale);
+
+	GLint nActiveTexture;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &nActiveTexture);
+	glActiveTexture(GL_TEXTURE0 + m_nHeightMapUnit);
+	glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+	glActiveTexture(nActiveTexture);
+
+	GLuint attribPatchVertex = pProgram->GetAttribLocation("aPatchVertex");
+	GLuint attribPatchOrigin = pProgram->GetAttribLocation("aPatchOrigin");
+	glEnableVertexAttribArray(attribPatchVertex);
+	glEnableVertexAttribArray(attribPatchOrigin);
+
+	glBindBuffer(GL_ARRAY_BUFFER, patch.vertexBuffer);
+	glVertexAttribPointer(attribPatchVertex, 3, GL_UNSIGNED_BYTE, GL_FALSE, 4, 0);
+
+	// instances: uploaded each frame in LOD mode, static otherwise (and without the skirts)
+	glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+	if (m_bLOD)
+		glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4) * m_patchInstances.size(), &m_patchInstances[0], GL_STREAM_DRAW);
+	glVertexAttribPointer(attribPatchOrigin, 4, GL_FLOAT, GL_FALSE, 0, 0);
+	glVertexAttribDivisor(attribPatchOrigin, 1);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, patch.indexBuffer);
+	glDrawElementsInstanced(GL_TRIANGLES, m_bLOD ? patch.nIndices : patch.nGridIndices, GL_UNSIGNED_SHORT, 0, nInstances);
+
+	glVertexAttribDivisor(attribPatchOrigin, 0);
+	glDisableVertexAttribArray(attribPatchVertex);
+	glDisableVertexAttribArray(attribPatchOrigin);
+	pProgram->SendUniform("heightMapOn", (GLint)0);
 }
 
 void C3dglTerrain::render()
@@ -290,6 +2208,10 @@ void C3dglTerrain::render()
 
 void C3dglTerrain::renderNormals()
 {
+	if (m_pTiles) return;		// not available in the streaming mode
+	if (!m_linesBuffer)
+		createLinesBuffer();
+
 	// check if a shading program is active
 	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
 	if (pProgram)
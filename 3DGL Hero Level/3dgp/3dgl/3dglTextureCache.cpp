@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#ifndef _WIN32
+#include <limits.h>
+#endif
+#include <algorithm>
+#include <cctype>
+#include <memory>
+
+#include "../GL/glew.h"
+#include "../GL/3dglTextureCache.h"
+#include "../GL/3dglBitmap.h"
+#include "../GL/3dglLoader.h"
+
+using namespace std;
+using namespace _3dgl;
+
+C3dglTextureCache &C3dglTextureCache::getDefault()
+{
+	static C3dglTextureCache cache;
+	return cache;
+}
+
+string C3dglTextureCache::getCanonicalPath(const string filename)
+{
+	string path = filename;
+#ifdef _WIN32
+	char buf[_MAX_PATH];
+	if (_fullpath(buf, filename.c_str(), _MAX_PATH))
+		path = buf;
+	transform(path.begin(), path.end(), path.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+#else
+	replace(path.begin(), path.end(), '\\', '/');
+	char buf[PATH_MAX];
+	if (realpath(path.c_str(), buf))
+		path = buf;
+#endif
+	replace(path.begin(), path.end(), '\\', '/');
+	return path;
+}
+
+string C3dglTextureCache::getKey(const string filename, unsigned options)
+{
+	return getCanonicalPath(filename) + "|" + to_string(options);
+}
+
+unsigned C3dglTextureCache::addRef(const string &key)
+{
+	auto it = m_entries.find(key);
+	if (it == m_entries.end()) return 0;
+	it->second.m_nRefs++;
+	return it->second.m_id;
+}
+
+bool C3dglTextureCache::decode(const string filename, IMAGE &image)
+{
+	image.filename = filename;
+	image.bits.clear();
+
+	C3dglBitmap bm;
+	if (!bm.load(filename, GL_RGBA))
+		return false;
+	image.width = bm.getWidth();
+	image.height = abs(bm.getHeight());
+	const unsigned char *pBits = (const unsigned char*)bm.getBits();
+	image.bits.assign(pBits, pBits + (size_t)image.width * image.height * 4);
+	return true;
+}
+
+unsigned C3dglTextureCache::acquire(const string filename, unsigned options)
+{
+	unsigned idTexture = addRef(getKey(filename, options));
+	if (idTexture)
+		return idTexture;
+
+	IMAGE image;
+	if (!decode(filename, image))
+		return 0;
+	return acquire(image, options);
+}
+
+unsigned C3dglTextureCache::acquire(const IMAGE &image, unsigned options)
+{
+	if (image.bits.empty())
+		return 0;
+	string key = getKey(image.filename, options);
+	unsigned idTexture = addRef(key);
+	if (idTexture)
+		return idTexture;
+	long width = image.width, height = image.height;
+
+	glGenTextures(1, &idTexture);
+	glBindTexture(GL_TEXTURE_2D, idTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (options & TEX_MIPMAPS) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	if (options & TEX_CLAMP)
+	{
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.bits.data());
+	if (options & TEX_MIPMAPS)
+		glGenerateMipmap(GL_TEXTURE_2D);
+
+	// RGBA8; a full mipmap chain adds one third
+	size_t nBytes = (size_t)width * height * 4;
+	if (options & TEX_MIPMAPS)
+		nBytes += nBytes / 3;
+
+	ENTRY entry = { idTexture, 1, nBytes };
+	m_entries[key] = entry;
+	m_keys[idTexture] = key;
+	m_nResidentBytes += nBytes;
+	return idTexture;
+}
+
+void C3dglTextureCache::acquireAsync(C3dglLoader &loader, const string filename, unsigned *pIdTexture, unsigned options)
+{
+	shared_ptr<IMAGE> pImage = make_shared<IMAGE>();
+	loader.add([=] { return decode(filename, *pImage); },
+		[=] { return (*pIdTexture = acquire(*pImage, options)) != 0; });
+}
+
+unsigned C3dglTextureCache::acquireBlank()
+{
+	// the key cannot clash with a canonical path, which always includes the options
+	const string key = "<blank>";
+	unsigned idTexture = addRef(key);
+	if (idTexture)
+		return idTexture;
+
+	glGenTextures(1, &idTexture);
+	glBindTexture(GL_TEXTURE_2D, idTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	unsigned char bytes[] = { 255, 255, 255 };
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_BGR, GL_UNSIGNED_BYTE, &bytes);
+
+	ENTRY entry = { idTexture, 1, 4 };
+	m_entries[key] = entry;
+	m_keys[idTexture] = key;
+	m_nResidentBytes += entry.m_nBytes;
+	return idTexture;
+}
+
+void C3dglTextureCache::release(unsigned idTexture)
+{
+	auto itKey = m_keys.find(idTexture);
+	if (itKey == m_keys.end()) return;
+	auto it = m_entries.find(itKey->second);
+	if (--it->second.m_nRefs > 0) return;
+
+	glDeleteTextures(1, &idTexture);
+	m_nResidentBytes -= it->second.m_nBytes;
+	m_entries.erase(it);
+	m_keys.erase(itKey);
+}
+
+unsigned C3dglTextureCache::getRefCount(unsigned idTexture)
+{
+	auto itKey = m_keys.find(idTexture);
+	if (itKey == m_keys.end()) return 0;
+	return m_entries[itKey->second].m_nRefs;
+}
+
+size_t C3dglTextureCache::getTextureBytes(unsigned idTexture)
+{
+	auto itKey = m_keys.find(idTexture);
+	if (itKey == m_keys.end()) return 0;
+	return m_entries[itKey->second].m_nBytes;
+}
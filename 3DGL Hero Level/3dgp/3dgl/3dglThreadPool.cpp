@@ -0,0 +1,106 @@
+#include "../GL/3dglThreadPool.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace _3dgl;
+
+// true in the threads running the chunks (the workers and the calling thread) - used to run nested parallelFor calls serially
+static thread_local bool c_bWorkerThread = false;
+
+C3dglThreadPool::C3dglThreadPool(unsigned nThreads)
+{
+	m_pJob = NULL;
+	m_nNext = m_nEnd = m_nGrain = 0;
+	m_nBusy = m_nGeneration = 0;
+	m_bQuit = false;
+
+	if (nThreads == 0)
+		nThreads = max(1u, thread::hardware_concurrency());
+	for (unsigned i = 1; i < nThreads; i++)
+		m_threads.push_back(thread(&C3dglThreadPool::worker, this));
+}
+
+C3dglThreadPool::~C3dglThreadPool()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_bQuit = true;
+	}
+	m_cvWork.notify_all();
+	for (thread &t : m_threads)
+		t.join();
+}
+
+C3dglThreadPool &C3dglThreadPool::getDefault()
+{
+	static C3dglThreadPool pool;
+	return pool;
+}
+
+void C3dglThreadPool::worker()
+{
+	c_bWorkerThread = true;
+	unsigned nGeneration = 0;
+	unique_lock<mutex> lock(m_mutex);
+	for (;;)
+	{
+		m_cvWork.wait(lock, [&] { return m_bQuit || m_nGeneration != nGeneration; });
+		if (m_bQuit) return;
+		nGeneration = m_nGeneration;
+
+		lock.unlock();
+		runChunks();
+		lock.lock();
+
+		if (--m_nBusy == 0)
+			m_cvDone.notify_all();
+	}
+}
+
+void C3dglThreadPool::runChunks()
+{
+	for (;;)
+	{
+		unsigned nBegin = m_nNext.fetch_add(m_nGrain);
+		if (nBegin >= m_nEnd) break;
+		(*m_pJob)(nBegin, min(nBegin + m_nGrain, m_nEnd));
+	}
+}
+
+void C3dglThreadPool::parallelFor(unsigned nBegin, unsigned nEnd, const function<void(unsigned, unsigned)> &fn, unsigned nGrain)
+{
+	if (nEnd <= nBegin) return;
+
+	// by default: about four chunks per thread
+	if (nGrain == 0)
+		nGrain = max(1u, (nEnd - nBegin + 4 * getThreadCount() - 1) / (4 * getThreadCount()));
+
+	// run serially if there is nothing to share
+	if (m_threads.empty() || c_bWorkerThread || nEnd - nBegin <= nGrain)
+	{
+		fn(nBegin, nEnd);
+		return;
+	}
+
+	lock_guard<mutex> jobLock(m_jobMutex);
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_pJob = &fn;
+		m_nNext = nBegin;
+		m_nEnd = nEnd;
+		m_nGrain = nGrain;
+		m_nBusy = m_threads.size();
+		m_nGeneration++;
+	}
+	m_cvWork.notify_all();
+
+	// the calling thread takes part, too
+	c_bWorkerThread = true;
+	runChunks();
+	c_bWorkerThread = false;
+
+	unique_lock<mutex> lock(m_mutex);
+	m_cvDone.wait(lock, [&] { return m_nBusy == 0; });
+	m_pJob = NULL;
+}
@@ -33,6 +33,12 @@ freely, subject to the following restrictions:
 #include "3dglTerrain.h"
 #include "3dglSkyBox.h"
 #include "3dglBitmap.h"
+#include "3dglFrustum.h"
+#include "3dglThreadPool.h"
+#include "3dglMappedFile.h"
+#include "3dglTextureCache.h"
+#include "3dglLoader.h"
+#include "3dglBVH.h"
 
 // link with AssImp and DevIL libraries
 #pragma comment (lib, "assimp.lib") 
@@ -0,0 +1,117 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+Bounding volume hierarchy of triangles, for ray queries (picking, line of sight, hit tests).
+Usage:
+addTriangles to collect the triangles (optionally transformed), then build
+intersect for the closest hit, occluded for any hit - single rays or packets of rays
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglBVH_h_
+#define __3dglBVH_h_
+
+#include <vector>
+
+#include "../glm/vec3.hpp"
+#include "../glm/mat4x4.hpp"
+
+namespace _3dgl
+{
+
+class C3dglBVH
+{
+public:
+	struct RAY
+	{
+		glm::vec3 origin, dir;				// dir need not be normalised
+		float tMax;							// the hits are looked for within origin + t * dir, 0 <= t <= tMax
+	};
+	struct HIT
+	{
+		float t;							// the distance, in the units of dir; tMax if no hit
+		float u, v;							// barycentric coordinates of the hit point: v0 + u * (v1 - v0) + v * (v2 - v0)
+		unsigned nTriangle;					// in the order of addTriangles; (unsigned)-1 if no hit
+	};
+
+private:
+	// tree nodes: children are always adjacent - a leaf refers to a range of triangle blocks
+	struct NODE
+	{
+		glm::vec3 bbMin;
+		unsigned nFirst;					// the first child (interior) or the first block (leaf)
+		glm::vec3 bbMax;
+		unsigned nCount;					// 0 for interior nodes, the number of blocks for leaves
+	};
+	// four triangles, stored for the 4-wide ray/triangle test (Moller & Trumbore): the vertex v0 and the edges v1 - v0, v2 - v0
+	struct TRI4
+	{
+		float v0[3][4], e1[3][4], e2[3][4];
+		unsigned ids[4];
+	};
+
+	std::vector<NODE> m_nodes;
+	std::vector<TRI4> m_blocks;
+
+	// triangles collected for the build
+	std::vector<glm::vec3> m_vertices;		// 3 per triangle
+
+	// build
+	struct BUILDREF;
+	unsigned split(std::vector<BUILDREF> &refs, unsigned nBegin, unsigned nEnd, const NODE &node, unsigned nDepth);
+	void buildSubtree(std::vector<BUILDREF> &refs, std::vector<NODE> &nodes, unsigned nNode, unsigned nBegin, unsigned nEnd, unsigned nDepth);
+	void makeLeaf(std::vector<NODE> &nodes, unsigned nNode, unsigned nBegin, unsigned nEnd);
+
+public:
+	C3dglBVH()								{ }
+
+	// adds nTriangles triangles, indexing pVertices; pMatrix transforms the vertices if not NULL. Returns the index of the first one.
+	// The triangles are only collected - build must be called before any queries.
+	unsigned addTriangles(const glm::vec3 *pVertices, const unsigned *pIndices, unsigned nTriangles, const glm::mat4 *pMatrix = NULL);
+	// builds the tree with the surface area heuristic; the subtrees are built on the default thread pool
+	void build();
+	void clear();
+
+	// closest hit - false if none
+	bool intersect(const RAY &ray, HIT &hit) const;
+	// any hit - faster than intersect, for visibility tests
+	bool occluded(const RAY &ray) const;
+	// packets of rays: traversed four at a time, which pays off for coherent rays (such as those of neighbouring pixels).
+	// Return the number of rays that hit.
+	unsigned intersect(const RAY *pRays, HIT *pHits, unsigned nRays) const;
+	unsigned occluded(const RAY *pRays, bool *pOccluded, unsigned nRays) const;
+
+	bool isBuilt() const					{ return !m_nodes.empty(); }
+	unsigned getTriangleCount() const		{ return m_vertices.size() / 3; }
+	unsigned getNodeCount() const			{ return m_nodes.size(); }
+	size_t getMemorySize() const			{ return m_nodes.size() * sizeof(NODE) + m_blocks.size() * sizeof(TRI4) + m_vertices.size() * sizeof(glm::vec3); }
+
+	// the vertices of a triangle, as added (transformed)
+	void getTriangle(unsigned nTriangle, glm::vec3 &v0, glm::vec3 &v1, glm::vec3 &v2) const	{ v0 = m_vertices[nTriangle * 3]; v1 = m_vertices[nTriangle * 3 + 1]; v2 = m_vertices[nTriangle * 3 + 2]; }
+};
+
+}; // namespace _3dgl
+
+#endif
@@ -34,6 +34,7 @@ freely, subject to the following restrictions:
 
 #include <string>
 #include <string>
+#include <mutex>
 
 namespace _3dgl
 {
@@ -42,6 +43,7 @@ class C3dglBitmap : public C3dglObject
 {
 	unsigned int m_idImage;
 	static C3dglBitmap *c_pBound;
+	static std::recursive_mutex c_mutex;	// DevIL is not thread safe: all calls are serialised
 
 public:
 	C3dglBitmap()	{ m_idImage = 0; }
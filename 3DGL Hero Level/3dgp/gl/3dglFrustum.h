@@ -0,0 +1,64 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+A very simple view frustum class.
+Usage:
+construct from the projection and model-view matrices (or call set)
+testAABB / testSphere to check visibility of bounding volumes (in model space)
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglFrustum_h_
+#define __3dglFrustum_h_
+
+#include "../glm/vec3.hpp"
+#include "../glm/vec4.hpp"
+#include "../glm/mat4x4.hpp"
+
+namespace _3dgl
+{
+
+class C3dglFrustum
+{
+	// planes: left, right, bottom, top, near, far - (a, b, c, d) with normals pointing inside
+	glm::vec4 m_planes[6];
+
+public:
+	C3dglFrustum()													{ }
+	C3dglFrustum(glm::mat4 matrixProjection, glm::mat4 matrixModelView)	{ set(matrixProjection, matrixModelView); }
+
+	// extract the planes from the combined matrix - the planes are expressed in the model space
+	void set(glm::mat4 matrixProjection, glm::mat4 matrixModelView);
+
+	// visibility tests - true if the volume is (at least partially) inside the frustum
+	bool testAABB(glm::vec3 vecMin, glm::vec3 vecMax) const;
+	bool testSphere(glm::vec3 centre, float radius) const;
+
+	const glm::vec4 &getPlane(unsigned i) const						{ return m_planes[i]; }
+};
+
+}; // namespace _3dgl
+
+#endif
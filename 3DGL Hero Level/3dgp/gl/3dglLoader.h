@@ -0,0 +1,114 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+Asynchronous asset loader.
+Each job is a preparation step, run on the worker threads (file reading, parsing, image decoding - no GL calls),
+followed by an upload step, run on the GL thread (buffer and texture uploads).
+Usage:
+add (or loadAsync / acquireAsync of the asset classes) to queue the jobs
+pump once per frame to run the uploads that are ready, within a time budget
+next, from an upload step, to split a large upload into smaller steps
+wait to pump until all the jobs are done
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglLoader_h_
+#define __3dglLoader_h_
+
+#include "3dglObject.h"
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace _3dgl
+{
+
+class C3dglLoader : public C3dglObject
+{
+public:
+	typedef std::function<bool()> STEP;
+
+private:
+	struct JOB
+	{
+		STEP prepare, upload;
+	};
+	std::vector<JOB> m_jobs;				// the current batch
+	std::vector<std::thread> m_threads;		// run the preparation steps - the thread pool remains free for their parallelFor calls
+	unsigned m_nThreads;
+	bool m_bStarted;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cvReady;
+	std::vector<unsigned> m_ready;			// jobs prepared, in the order of completion
+	unsigned m_nNextJob;					// the next one to prepare
+	unsigned m_nNextReady;					// the next one to upload
+	std::vector<STEP> m_steps;				// further upload steps of the job being uploaded (see next)
+	unsigned m_nNextStep;
+	unsigned m_nPrepared, m_nUploaded, m_nFailed;
+
+	// not copyable
+	C3dglLoader(const C3dglLoader&);
+	C3dglLoader &operator=(const C3dglLoader&);
+
+	void worker();
+	void finish();
+
+public:
+	// nThreads is the number of jobs prepared at a time; 0 means all hardware threads
+	C3dglLoader(unsigned nThreads = 0);
+	~C3dglLoader();
+
+	// queues a job - call before the loading starts (with the first pump or wait).
+	// prepare runs on a worker thread and must not call GL; upload runs on the thread that calls pump,
+	// and only if prepare succeeded. Both return false on failure.
+	void add(STEP prepare, STEP upload);
+
+	// starts the preparation steps on the worker threads - pump and wait start them if not yet started
+	void start();
+	// runs the upload steps that are ready, for up to fBudgetMs milliseconds (at least one step is run if any is ready).
+	// The budget is checked between the steps: a step is never interrupted, so it may overrun the budget by its own length.
+	// Returns true when all the jobs are done.
+	bool pump(float fBudgetMs = 2.0f);
+	// call from an upload step - queues a further step of the same job, run after it and before the uploads of other jobs,
+	// possibly in a later pump. The job is done with its last step, and it fails, with the remaining steps dropped,
+	// as soon as one of them returns false.
+	void next(STEP upload);
+	// pumps until all the jobs are done. Returns false if any of them failed.
+	bool wait();
+
+	unsigned getJobCount()					{ return m_jobs.size(); }
+	unsigned getUploadedCount()				{ return m_nUploaded; }
+	unsigned getFailedCount()				{ return m_nFailed; }
+
+	std::string getName()					{ return "Loader"; }
+};
+
+}; // namespace _3dgl
+
+#endif
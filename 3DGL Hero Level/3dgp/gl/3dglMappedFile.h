@@ -0,0 +1,73 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+A very simple read-only memory-mapped file.
+Usage:
+open to map the entire file into the address space
+getData / getSize to access its contents - the OS pages the data in and out on demand
+getHash to identify the contents (e.g. to validate caches derived from the file)
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglMappedFile_h_
+#define __3dglMappedFile_h_
+
+#include <string>
+
+namespace _3dgl
+{
+
+class C3dglMappedFile
+{
+	const void *m_pData;
+	size_t m_nSize;
+#ifdef _WIN32
+	void *m_hFile, *m_hMapping;
+#else
+	int m_fd;
+#endif
+
+	// not copyable
+	C3dglMappedFile(const C3dglMappedFile&);
+	C3dglMappedFile &operator=(const C3dglMappedFile&);
+
+public:
+	C3dglMappedFile();
+	~C3dglMappedFile()					{ close(); }
+
+	bool open(const std::string filename);
+	void close();
+
+	bool isOpen()						{ return m_pData != NULL; }
+	const void *getData()				{ return m_pData; }
+	size_t getSize()					{ return m_nSize; }
+
+	// 64-bit FNV-1a hash of the contents (0 if not open)
+	unsigned long long getHash();
+};
+
+}; // namespace _3dgl
+
+#endif
@@ -30,20 +30,32 @@ freely, subject to the following restrictions:
 #ifndef _3dglSkyBox_H
 #define _3dglSkyBox_H
 
+#include "3dglTextureCache.h"
+
 namespace _3dgl
 {
+class C3dglLoader;
+
 class C3dglSkyBox
 {
 public:
     C3dglSkyBox();
 
 	bool load(const char* pFd, const char* pRt, const char* pBk, const char* pLt, const char* pUp, const char* pDn);
+	// as above, the images are decoded on a worker thread of the loader
+	void loadAsync(C3dglLoader &loader, const char* pFd, const char* pRt, const char* pBk, const char* pLt, const char* pUp, const char* pDn);
 	void render(glm::mat4 matrix);
 	void render();
 
 private:
     unsigned int  m_idTex[6];
 
+	// images in the order: back, right, front, left, up, down
+	bool create(const C3dglTextureCache::IMAGE images[6]);
+	// the steps of create: each face (i as above), then the buffers
+	void createTexture(int i, const C3dglTextureCache::IMAGE &image);
+	void createBuffers();
+
 	unsigned int  m_vertexBuffer;
     unsigned int  m_normalBuffer;
     unsigned int  m_texCoordBuffer;
@@ -9,7 +9,16 @@ A very simple terrain class.
 Usage:
 loadHeightmap to load the height map and scale its height
 render to render the terrain
-renderNormals to render terrain normal vectors
+renderNormals to render terrain normal vectors (the buffer is built on the first call)
+enableLOD (before loadHeightmap) to switch on chunked quadtree LOD with frustum culling
+convertHeightmap + loadTiled to stream large terrains from a memory-mapped tiled height file
+enableDisplacement (before loadHeightmap) to displace a shared grid patch with a height texture in the shader
+intersectRay / intersectSegment / intersectRays for ray casting and picking
+raise / lower / flatten / smooth to deform the terrain at runtime
+enableRTIN (before loadHeightmap) to build an adaptive triangulation within a given height error
+enableAO (before loadHeightmap) to bake the ambient occlusion into a texture used by the terrain shader
+enableCache (before loadHeightmap) to keep the prepared buffers in a binary file next to the height map
+loadHeightmapAsync to prepare the terrain on a worker thread of C3dglLoader and upload it when the loader is pumped
 ----------------------------------------------------------------------------------
 This software is provided 'as-is', without any express or implied
 warranty. In no event will the authors be held liable for any damages
@@ -37,9 +46,21 @@ freely, subject to the following restrictions:
 
 #include <string>
 #include <vector>
+#include <cfloat>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include "../glm/mat4x4.hpp"
+#include "3dglMappedFile.h"
 
 namespace _3dgl
 {
+
+class C3dglFrustum;
+class C3dglLoader;
 	
 class C3dglTerrain
 {
@@ -53,19 +74,299 @@ class C3dglTerrain
     unsigned int m_indexBuffer;
     unsigned int m_linesBuffer;
 
+	// Chunked LOD: a quadtree of chunks, each chunk is a regular grid of m_nChunkSize x m_nChunkSize cells
+	// sampled with a step that doubles at each level up the tree. Seams are covered with skirts.
+	struct NODE
+	{
+		int x0, z0, x1, z1;			// extent in grid coordinates (inclusive)
+		int step;					// sampling step (1 for the leaves)
+		float minY, maxY;			// height range (for the bounding box)
+		float error;				// max height deviation from the full resolution grid (incl. children)
+		unsigned offset, count;		// index range in the LOD index buffer
+		int child[4];				// children (-1 if not present)
+	};
+	bool m_bLOD;
+	int m_nChunkSize;
+	float m_fPixelError;
+	float m_fSkirtDepth;
+	std::vector<NODE> m_nodes;
+	unsigned m_lodIndexBuffer;
+	unsigned m_nSkirtBase;					// index of the first skirt vertex
+	std::vector<int> m_skirtLineX;			// line number for x coordinates lying on a chunk border (or -1)
+	std::vector<int> m_skirtLineZ;			// line number for z coordinates lying on a chunk border (or -1)
+	int m_nSkirtLinesX;
+
+	// Streaming: heights are read from a memory-mapped tiled file (see convertHeightmap). Only the tiles
+	// nearest to the camera are kept on the GPU, in a fixed pool of slots within the vertex buffers.
+	// Tiles are prepared on a background thread and uploaded with glBufferSubData in render.
+	struct TILEDHEADER
+	{
+		char id[4];					// "3DGH"
+		unsigned version;
+		int sizeX, sizeZ;			// height map size
+		int tileSize;				// cells per tile; tiles share their border samples
+		float scaleHeight;
+	};								// followed by (tileSize+1)^2 16-bit samples per tile, tiles ordered by x then z
+	struct TILESLOT
+	{
+		int tile;					// tile index (-1 if free)
+		float minY, maxY;
+	};
+	struct TILESTAGING
+	{
+		int tile;
+		float minY, maxY;
+		std::vector<float> vertices, normals, texCoords;
+	};
+	enum { TILE_ABSENT, TILE_PENDING, TILE_RESIDENT };
+	C3dglMappedFile m_mappedFile;
+	const unsigned short *m_pTiles;			// tile data in the mapped file (NULL if not streaming)
+	float m_fTileScale;
+	int m_nTileSize, m_nTilesX, m_nTilesZ;
+	unsigned m_tileIndexBuffer;
+	std::vector<TILESLOT> m_tileSlots;		// GPU slots (fixed budget)
+	std::vector<unsigned char> m_tileState;	// TILE_ABSENT/PENDING/RESIDENT for each tile
+	std::vector<TILESTAGING> m_tileStaging;	// CPU buffers for the tiles prepared by the worker
+	std::vector<int> m_freeStaging, m_readyStaging;
+	std::thread m_streamThread;
+	std::mutex m_streamMutex;
+	std::condition_variable m_streamCV;
+	glm::vec3 m_streamEye;					// in grid coordinates
+	bool m_bStreamDirty, m_bStreamQuit;
+
+	// Displacement: the heights are uploaded as a single channel 16-bit texture (2 bytes per sample), and the
+	// terrain is drawn as instances of a grid patch, displaced in the vertex shader (see terrain.vert).
+	// Patches are shared by all the terrains, and released with the last one; LOD nodes use the same patch with a larger step.
+	struct PATCH
+	{
+		unsigned vertexBuffer, indexBuffer;	// vertices: x, z (in cells), skirt flag, padding - 4 bytes each
+		unsigned nGridIndices, nIndices;	// the grid triangles go first, followed by the skirts
+	};
+	static std::map<int, PATCH> c_patches;
+	static unsigned c_nTerrains;			// terrains alive
+	static const PATCH &getPatch(int nSize);
+	bool m_bDisplacement;
+	int m_nHeightMapUnit;					// texture unit used for the height map
+	unsigned m_heightTexture;
+	float m_fHeightMapScale;
+	unsigned m_instanceBuffer;				// per instance: x0, z0, step, skirt depth
+	unsigned m_nStaticInstances;			// the full-resolution cover (without LOD)
+	std::vector<glm::vec4> m_patchInstances;// LOD only - per-frame
+
+	// Ambient occlusion: baked from the heights into a single channel 8-bit texture, laid out as the height map
+	bool m_bAO;
+	int m_nAOUnit;							// texture unit used for the ambient occlusion
+	float m_fAORadius;						// in grid cells
+	unsigned m_aoTexture;
+	bool computeAO(std::vector<unsigned char> &texels);
+	void uploadAO(const unsigned char *pTexels);
+
+	// Everything loadHeightmap prepares for the GPU - built from the height map, or mapped from the cache
+	struct BUFFERS
+	{
+		const float *pVertices, *pNormals, *pTexCoords;
+		unsigned nVertices;
+		const unsigned *pIndices;
+		unsigned nIndices;
+		const unsigned short *pTexels;		// displacement only
+		const unsigned char *pAO;			// ambient occlusion (if enabled)
+	};
+	void uploadBuffers(const BUFFERS &buffers);
+	void deleteBuffers();
+	// the upload split into steps (see C3dglLoader::next) - uploadBuffers runs them all, in this order
+	enum UPLOAD_STEP { UPLOAD_TEXTURES, UPLOAD_VERTICES, UPLOAD_NORMALS, UPLOAD_TEXCOORDS, UPLOAD_INDICES, UPLOAD_STEPS };
+	void uploadStep(const BUFFERS &buffers, int nStep);
+
+	// The buffers are built (or mapped from the cache) without any GL calls, so that it may run on a worker thread.
+	// Everything they point to is kept here until uploaded.
+	struct STAGING
+	{
+		C3dglMappedFile file;				// the cache
+		std::vector<float> vertices, normals, texCoords;
+		std::vector<unsigned> indices;
+		std::vector<unsigned short> texels;
+		std::vector<unsigned char> ao;
+		BUFFERS buffers;
+		std::unique_ptr<C3dglTerrain> pTerrain;	// loadHeightmapAsync: prepares the heights, the quadtree etc. apart from the terrain in use
+	};
+	bool prepareHeightmap(const std::string filename, float scaleHeight, STAGING &staging);
+	void takeHeightmap(C3dglTerrain &terrain);
+
+	// Cache: a binary file holding the heights, the LOD quadtree and the buffers, keyed by the hash of the
+	// source file, the height scale and the settings. Sections are 4-byte aligned and may be empty.
+	enum CACHE_SECTION { CACHE_HEIGHTS, CACHE_NODES, CACHE_SKIRTLINESX, CACHE_SKIRTLINESZ, CACHE_VERTICES, CACHE_NORMALS,
+		CACHE_TEXCOORDS, CACHE_INDICES, CACHE_TEXELS, CACHE_AO, CACHE_SECTIONS };
+	enum { CACHE_LOD = 1, CACHE_DISPLACEMENT = 2, CACHE_RTIN = 4, CACHE_AO_BAKED = 8 };
+	struct CACHEHEADER
+	{
+		char id[4];					// "3DGC"
+		unsigned version;
+		unsigned long long hash;	// FNV-1a of the source file
+		float scaleHeight;
+		unsigned flags;				// CACHE_LOD etc.
+		int chunkSize;
+		float rtinError, aoRadius;
+		int sizeX, sizeZ;
+		float skirtDepth;
+		int skirtLinesX;
+		unsigned long long fileSize;
+		struct { unsigned long long offset, size; } sections[CACHE_SECTIONS];
+	};
+	bool m_bCache;
+	void initCacheHeader(CACHEHEADER &header, unsigned long long nHash, float scaleHeight);
+	bool saveCache(const std::string filename, unsigned long long nHash, float scaleHeight, const BUFFERS &buffers);
+	bool loadCache(const std::string filename, unsigned long long nHash, float scaleHeight, STAGING &staging);
+
+	// Min-max pyramid for ray casting: level n (stored at m_minMax[n-1]) holds the height range of blocks
+	// of 2^n x 2^n cells, up to a single block covering the entire map. Cells (level 0) are tested directly.
+	struct MINMAX { float minY, maxY; };
+	struct MINMAXLEVEL
+	{
+		int sizeX, sizeZ;
+		std::vector<MINMAX> cells;
+	};
+	std::vector<MINMAXLEVEL> m_minMax;
+	struct RAY;
+
+	void buildMinMax();
+	void updateMinMax(int nLevel, int cx0, int cz0, int cx1, int cz1, bool bParallel);
+	bool intersectNode(const RAY &ray, int nLevel, int cx, int cz, float tMin, float &tHit);
+
+	// Editing: only the modified rectangle is recalculated and uploaded. The scratch buffers are kept between the edits.
+	enum BRUSH { BRUSH_RAISE, BRUSH_FLATTEN, BRUSH_SMOOTH };
+	std::vector<float> m_editHeights;
+	std::vector<float> m_editData;
+	std::vector<unsigned short> m_editTexels;
+	bool applyBrush(BRUSH brush, float x, float z, float radius, float strength, float height);
+	void updateRegion(int x0, int z0, int x1, int z1, float fMaxChange);
+	void updateNodeBounds(int iNode, int x0, int z0, int x1, int z1, float minY, float maxY, float fErrorGrowth);
+
+	// Adaptive triangulation (RTIN): the vertex buffers only hold the vertices used by the triangles
+	bool m_bRTIN;
+	float m_fRTINError;
+	bool m_bAdaptive;						// true if the current mesh is adaptive
+	unsigned m_nIndices;					// size of the index buffer (without LOD)
+	void buildRTIN(std::vector<unsigned> &indices, std::vector<unsigned> &vertices);
+
+	// draw lists for glMultiDrawElements - kept between the frames to avoid allocations
+	std::vector<int> m_drawCounts;
+	std::vector<void*> m_drawOffsets;
+	std::vector<int> m_drawBaseVertices;	// streaming only
+	unsigned m_nRenderedTriangles;
+
+	// height at grid coordinates (no bounds check)
+	float gridHeight(int x, int z)
+	{
+		if (!m_pTiles) return m_heights[x * m_nSizeZ + z];
+		int tx = x / m_nTileSize, tz = z / m_nTileSize;
+		if (tx == m_nTilesX) tx--;
+		if (tz == m_nTilesZ) tz--;
+		size_t i = ((size_t)(tx * m_nTilesZ + tz) * (m_nTileSize + 1) + x - tx * m_nTileSize) * (m_nTileSize + 1) + z - tz * m_nTileSize;
+		return m_pTiles[i] * m_fTileScale;
+	}
+
+	void streamWorker();
+	void collectTiles(glm::vec3 eye, std::vector<std::pair<float, int> > &tiles);
+	void prepareTile(TILESTAGING &staging);
+	void updateStreaming(glm::vec3 eye);
+	void selectTiles(const C3dglFrustum *pFrustum);
+	void stopStreaming();
+
+	void computeNormal(int x, int z, float *pNormal);	// x, z in grid coordinates
+	void createLinesBuffer();
+	int buildNode(int x0, int z0, int size, std::vector<unsigned> &indices);
+	unsigned skirtVertex(int x, int z, bool bAlongX);
+	void selectNodes(int iNode, const C3dglFrustum *pFrustum, glm::vec3 eye, float fPixelsPerUnit);
+	void renderBuffers(glm::mat4 matrix);
+	void renderPatches(glm::mat4 matrix);
+	void drawElements();
+
 public:
     C3dglTerrain();
+	~C3dglTerrain();
 
 	// height map
 	std::vector<float> m_heights;
+	int getSizeX()								{ return m_nSizeX; }
+	int getSizeZ()								{ return m_nSizeZ; }
 
-	float getHeight(int x, int z);
+	float getHeight(int x, int z)
+	{
+		x += m_nSizeX / 2;
+		z += m_nSizeZ / 2;
+		if (x < 0 || x >= m_nSizeX || z < 0 || z >= m_nSizeZ) return 0;
+		return gridHeight(x, z);
+	}
 	float getInterpolatedHeight(float x, float z);
+	// batch version of getInterpolatedHeight: pY[i] = height at (pX[i], pZ[i]) for i < n
+	void getInterpolatedHeights(const float *pX, const float *pZ, float *pY, unsigned n);
+
+	// ray casting (in the model space) against the triangulated height map; not available when streaming.
+	// intersectRay finds the nearest hit at origin + t * dir for t in [0, tMax].
+	// intersectSegment tests the segment p0-p1; if pHit is NULL, it stops at any hit (line of sight).
+	// intersectRays processes n rays on all threads; pT[i] is negative if the ray misses.
+	bool intersectRay(glm::vec3 origin, glm::vec3 dir, float &t, float tMax = FLT_MAX);
+	bool intersectSegment(glm::vec3 p0, glm::vec3 p1, glm::vec3 *pHit = NULL);
+	void intersectRays(const glm::vec3 *pOrigins, const glm::vec3 *pDirs, float *pT, unsigned n, float tMax = FLT_MAX);
+
+	// editing brushes, centred at (x, z) in the model space; the effect fades out smoothly towards the radius.
+	// strength (0..1) is the fraction of the way towards the target height (flatten) or the local average (smooth).
+	// Not available when streaming. With displacement, the heights are clamped to the range of the height map texture.
+	bool raise(float x, float z, float radius, float amount);
+	bool lower(float x, float z, float radius, float amount);
+	bool flatten(float x, float z, float radius, float height, float strength = 1);
+	bool smooth(float x, float z, float radius, float strength = 1);
+
+	// call before loadHeightmap - chunk size must be a power of two
+	void enableLOD(bool bEnable = true, int nChunkSize = 32);
+	// maximum screen space error (in pixels) tolerated when selecting the LOD
+	void setLODPixelError(float fPixelError)	{ m_fPixelError = fPixelError; }
+	bool isLODEnabled()							{ return m_bLOD; }
+
+	// call before loadHeightmap - maximum height error of the adaptive mesh (in the model units).
+	// Not used with LOD or displacement; the adaptive mesh cannot be edited.
+	void enableRTIN(bool bEnable = true, float fMaxError = 0.1f);
+	bool isRTINEnabled()						{ return m_bRTIN; }
+
+	// call before loadHeightmap - the vertex shader must support the height map (see terrain.vert).
+	// The chunk size (see enableLOD) is used as the patch size, limited to 128.
+	void enableDisplacement(bool bEnable = true, int nTextureUnit = 7);
+	bool isDisplacementEnabled()				{ return m_bDisplacement; }
+	// displacement only: the height map texture (GL_R16, a row for each line of constant x) and the height
+	// of its maximum value - the edits keep the heights within 0..getHeightMapScale()
+	unsigned getHeightTexture()					{ return m_heightTexture; }
+	float getHeightMapScale()					{ return m_fHeightMapScale; }
+
+	// call before loadHeightmap - the fragment shader must support the ambient occlusion map (see terrain.frag).
+	// fRadius is the distance (in grid cells) searched for the occluders.
+	void enableAO(bool bEnable = true, int nTextureUnit = 6, float fRadius = 32);
+	bool isAOEnabled()							{ return m_bAO; }
+	// bakes the ambient occlusion again, e.g. after editing
+	bool bakeAO();
+
+	// call before loadHeightmap - the first load writes <filename>.3dgc, later loads map it instead of
+	// decoding the image. The cache is rebuilt when the image, the height scale or the settings change.
+	void enableCache(bool bEnable = true);
+	bool isCacheEnabled()						{ return m_bCache; }
 
 	bool loadHeightmap(const std::string filename, float scaleHeight);
+	// as above, queued in the loader. The height map is prepared apart, so the terrain remains in use
+	// (with the previous height map, if any) until uploaded.
+	void loadHeightmapAsync(C3dglLoader &loader, const std::string filename, float scaleHeight);
+
+	// streaming mode: convert a height map into the tiled format once, then stream it with loadTiled.
+	// nTileSize is in cells (2..255); nTileBudget is the number of tiles kept on the GPU.
+	static bool convertHeightmap(const std::string srcFilename, const std::string dstFilename, float scaleHeight, int nTileSize = 64);
+	bool loadTiled(const std::string filename, int nTileBudget = 64);
+	bool isStreaming()							{ return m_pTiles != NULL; }
+
 	void render(glm::mat4 matrix);
+	void render(glm::mat4 matrix, glm::mat4 matrixProjection);	// with LOD selection and frustum culling
 	void render();
 	void renderNormals();
+
+	// number of triangles rendered in the last call to render (skirts included)
+	unsigned getRenderedTriangles()				{ return m_nRenderedTriangles; }
 };
 
 }; // namespace _3dgl
@@ -0,0 +1,121 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+Process-wide cache of 2D textures loaded from image files.
+Usage:
+C3dglTextureCache::getDefault() to access the cache shared by all models and materials
+acquire to get a texture - each file is decoded and uploaded only once for each set of options
+release when the texture is no longer needed - it is deleted when the last reference goes
+getResidentBytes / getTextureCount to check how much is loaded
+decode (on any thread) + acquire(image), or acquireAsync, to decode the images on the worker threads
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglTextureCache_h_
+#define __3dglTextureCache_h_
+
+#include "3dglObject.h"
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace _3dgl
+{
+
+class C3dglLoader;
+
+class C3dglTextureCache : public C3dglObject
+{
+public:
+	// load options - textures loaded with different options are cached separately
+	enum OPTIONS { TEX_DEFAULT = 0, TEX_MIPMAPS = 1, TEX_CLAMP = 2 };
+
+	// an image decoded into memory, ready for the upload
+	struct IMAGE
+	{
+		std::string filename;
+		long width, height;
+		std::vector<unsigned char> bits;	// RGBA, empty if not loaded
+
+		IMAGE()							{ width = height = 0; }
+	};
+
+private:
+	struct ENTRY
+	{
+		unsigned m_id;
+		unsigned m_nRefs;
+		size_t m_nBytes;
+	};
+	std::map<std::string, ENTRY> m_entries;		// keyed by canonical path and options
+	std::map<unsigned, std::string> m_keys;		// texture id => key
+	size_t m_nResidentBytes;
+
+	// not copyable
+	C3dglTextureCache(const C3dglTextureCache&);
+	C3dglTextureCache &operator=(const C3dglTextureCache&);
+
+	static std::string getKey(const std::string filename, unsigned options);
+	unsigned addRef(const std::string &key);
+
+public:
+	C3dglTextureCache()					{ m_nResidentBytes = 0; }
+	~C3dglTextureCache()				{ }
+
+	// returns a texture loaded from the file, or 0 if it cannot be loaded.
+	// Each successful call must be matched with a call to release.
+	unsigned acquire(const std::string filename, unsigned options = TEX_DEFAULT);
+	// as above, with the image already decoded - the image is not uploaded if its file is already in the cache
+	unsigned acquire(const IMAGE &image, unsigned options = TEX_DEFAULT);
+	// decodes on a worker thread of the loader and stores the texture in *pIdTexture on the upload (0 if not loaded)
+	void acquireAsync(C3dglLoader &loader, const std::string filename, unsigned *pIdTexture, unsigned options = TEX_DEFAULT);
+	// returns a shared 1x1 white texture
+	unsigned acquireBlank();
+	// releases a texture acquired earlier; the texture is deleted when the last reference is released
+	void release(unsigned idTexture);
+
+	unsigned getRefCount(unsigned idTexture);
+	// estimated GPU memory used by a texture, 0 if not in the cache
+	size_t getTextureBytes(unsigned idTexture);
+	unsigned getTextureCount()			{ return m_entries.size(); }
+	// estimated GPU memory used by all the textures in the cache
+	size_t getResidentBytes()			{ return m_nResidentBytes; }
+
+	// decodes an image file into memory - may be called on any thread
+	static bool decode(const std::string filename, IMAGE &image);
+
+	// absolute path with forward slashes (case insensitive on Windows); used as the cache key
+	static std::string getCanonicalPath(const std::string filename);
+
+	// the process-wide cache
+	static C3dglTextureCache &getDefault();
+
+	std::string getName()				{ return "Texture Cache"; }
+};
+
+}; // namespace _3dgl
+
+#endif
@@ -0,0 +1,82 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+A very simple worker thread pool.
+Usage:
+C3dglThreadPool::getDefault() to access the process-wide pool
+parallelFor to split a range of indices into chunks processed on all threads
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglThreadPool_h_
+#define __3dglThreadPool_h_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+namespace _3dgl
+{
+
+class C3dglThreadPool
+{
+	std::vector<std::thread> m_threads;
+
+	// current parallelFor job
+	std::mutex m_mutex;
+	std::mutex m_jobMutex;				// serialises parallelFor calls from different threads
+	std::condition_variable m_cvWork, m_cvDone;
+	const std::function<void(unsigned, unsigned)> *m_pJob;
+	std::atomic<unsigned> m_nNext;
+	unsigned m_nEnd, m_nGrain;
+	unsigned m_nBusy;
+	unsigned m_nGeneration;
+	bool m_bQuit;
+
+	void worker();
+	void runChunks();
+
+public:
+	// nThreads is the total number of threads, including the calling one; 0 means all hardware threads
+	C3dglThreadPool(unsigned nThreads = 0);
+	~C3dglThreadPool();
+
+	unsigned getThreadCount()		{ return m_threads.size() + 1; }
+
+	// calls fn(begin, end) for consecutive chunks of [nBegin, nEnd) on all threads and waits until all are done.
+	// Chunks are handed out dynamically, so uneven workloads balance out. nGrain = 0 chooses the chunk size automatically.
+	// Nested calls (from within fn) run serially on the calling thread.
+	void parallelFor(unsigned nBegin, unsigned nEnd, const std::function<void(unsigned, unsigned)> &fn, unsigned nGrain = 0);
+
+	// the process-wide pool
+	static C3dglThreadPool &getDefault();
+};
+
+}; // namespace _3dgl
+
+#endif
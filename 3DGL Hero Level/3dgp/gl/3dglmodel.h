@@ -12,8 +12,18 @@ Main features:
 - VBO based rendering (vertices, normals, tangents, bitangents, colours, bone ids & weights
 - automatically loads textures
 - integration with C3dglProgram shader program
-- very simple Bounding Boxes
+- bounding boxes and spheres of meshes and nodes; frustum culling of the node hierarchy (see render with the projection matrix)
 - support for skeletal animation
+- cooked binary format (see saveCooked and enableCache) - loads without AssImp
+- optional compact vertex layout: a single interleaved buffer with quantised attributes (see enableCompactVertices)
+- optional shared buffers: all meshes in one VAO, drawn with base vertex and multi-draw calls (see enableSharedBuffers)
+- meshes optimised on load: triangles ordered for the post-transform vertex cache, vertices for fetch locality, 16-bit indices if possible
+- hardware instancing (see renderInstanced)
+- levels of detail generated by quadric error simplification, selected by the projected error (see enableLOD)
+- meshlets: clusters of triangles culled against the frustum and by their normal cones (see enableMeshlets)
+- ray queries against the triangles, for picking and line of sight, accelerated with a BVH (see enableBVH)
+- the AssImp scene is released once uploaded: only compact copies of the nodes, materials and animations are kept (see getMemoryUsage)
+- asynchronous loading: parsing and texture decoding on the worker threads, uploads on the GL thread (see loadAsync)
 ----------------------------------------------------------------------------------
 This software is provided 'as-is', without any express or implied
 warranty. In no event will the authors be held liable for any damages
@@ -41,6 +51,9 @@ freely, subject to the following restrictions:
 #define __3dglModel_h_
 
 #include "3dglObject.h"
+#include "3dglMappedFile.h"
+#include "3dglTextureCache.h"
+#include "3dglBVH.h"
 
 // AssImp Scene include
 #include "assimp/scene.h"
@@ -49,13 +62,21 @@ freely, subject to the following restrictions:
 // standard libraries
 #include <vector>
 #include <map>
+#include <string>
+#include <memory>
 
 #include "../glm/mat4x4.hpp"
 
 namespace _3dgl
 {
 
+class C3dglLoader;
+class C3dglFrustum;
+
 #define MAX_BONES_PER_VEREX 4
+#define MAX_LODS 4
+#define MAX_MESHLET_VERTICES 64
+#define MAX_MESHLET_TRIANGLES 124
 
 	enum ATTRIB_STD	{ BUF_VERTEX, BUF_NORMAL, BUF_TEXCOORD, BUF_TANGENT, BUF_BITANGENT, BUF_COLOR, BUF_BONE, BUF_INDEX, BUF_LAST };
 
@@ -64,6 +85,104 @@ class C3dglModel : public C3dglObject
 	struct MESH;
 	struct MATERIAL;
 
+	// per-vertex bone data, as stored in the BUF_BONE buffer
+	struct VERTEXBONES
+	{
+		unsigned ids[MAX_BONES_PER_VEREX];
+		float weights[MAX_BONES_PER_VEREX];
+	};
+
+	// a level of detail: a range within the index buffer, drawn with the vertices of the full mesh
+	struct LOD
+	{
+		unsigned nFirst, nCount;
+		float fError;							// simplification error, in the mesh units
+	};
+
+	// a meshlet: a cluster of up to MAX_MESHLET_TRIANGLES triangles using up to MAX_MESHLET_VERTICES vertices,
+	// as a range within the full level of detail. The cluster is back-facing for any camera position c for which
+	// dot(centre - c, coneAxis) >= coneCutoff * |centre - c| + radius.
+	struct MESHLET
+	{
+		unsigned nFirst, nCount;
+		aiVector3D centre;						// bounding sphere, in the mesh units
+		float radius;
+		aiVector3D coneAxis;					// the average normal
+		float coneCutoff;						// 1 if the cluster cannot be culled by its normals
+	};
+
+	// CPU-side staging of everything a mesh uploads - converted from an aiMesh, or mapped from a cooked file
+	struct MESHDATA
+	{
+		const void *pData[BUF_LAST];			// NULL if not present
+		unsigned size[BUF_LAST], num[BUF_LAST];	// element size and number of elements
+		unsigned nUVComponents;
+		unsigned nMaterialIndex;
+		aiVector3D bb[2];
+		unsigned nLODs;							// 0 if not simplified - then the whole index stream is the only level
+		LOD lods[MAX_LODS];
+		const MESHLET *pMeshlets;				// NULL if not built
+		unsigned nMeshlets;
+
+		// storage for the converted streams
+		std::vector<float> texCoords;
+		std::vector<VERTEXBONES> bones;
+		std::vector<unsigned> indices;
+		std::vector<char> reordered[BUF_LAST];	// vertex streams in the optimised order
+		std::vector<MESHLET> meshlets;
+
+		// vertex cache misses before and after the optimisation (simulated FIFO cache)
+		unsigned nMissesBefore, nMissesAfter;
+
+		MESHDATA()	{ memset(pData, 0, sizeof(pData)); memset(size, 0, sizeof(size)); memset(num, 0, sizeof(num)); nUVComponents = nMaterialIndex = 0; nMissesBefore = nMissesAfter = 0; nLODs = 0; pMeshlets = NULL; nMeshlets = 0; }
+
+		// element size of each stream (texture coordinates are stored as separate floats)
+		static unsigned getElementSize(int bufId)
+		{
+			static const unsigned size[BUF_LAST] = { sizeof(aiVector3D), sizeof(aiVector3D), sizeof(float), sizeof(aiVector3D), sizeof(aiVector3D), sizeof(aiColor4D), sizeof(VERTEXBONES), sizeof(unsigned) };
+			return size[bufId];
+		}
+	};
+
+	// per-instance data, as stored in the instance buffer (see renderInstanced)
+	struct INSTANCE
+	{
+		glm::mat4 matrix;
+		glm::vec4 tint;
+	};
+
+public:
+	// per-instance animation playback state: the keys sampled last time, so that playing forward finds the next keys in O(1).
+	// Each animated instance should have its own - see getBoneTransforms
+	struct ANIMCURSOR
+	{
+		unsigned iAnimation;				// the animation the cursor was last used with
+		std::vector<unsigned> keys;			// position, rotation and scaling key for each channel
+		std::vector<aiMatrix4x4> globals;	// node transforms, in the order of the flattened nodes
+
+		ANIMCURSOR()						{ iAnimation = (unsigned)-1; }
+	};
+
+	// an animated instance, for the batched getBoneTransforms
+	struct ANIMINSTANCE
+	{
+		C3dglModel *pModel;
+		unsigned iAnimation;
+		float time;
+		ANIMCURSOR *pCursor;				// the cursor of the instance; if NULL, the keys are found by binary search
+		unsigned nOffset;					// output: the first float of the instance's palette
+	};
+
+private:
+
+	// material properties - read from an aiMaterial, or from a cooked file
+	struct MATERIALDATA
+	{
+		float amb[3], diff[3], spec[3], emiss[3];
+		float shininess;
+		std::string texPath;					// diffuse texture (empty if none)
+	};
+
 	struct MESH
 	{
 	private:
@@ -78,14 +197,16 @@ class C3dglModel : public C3dglObject
 			unsigned m_id;
 			void *m_pData;
 			unsigned m_num, m_size;
+			size_t m_nBytes;			// uploaded
 
-			BUFFER()	{ m_id = (unsigned)-1; m_pData = NULL; m_size = m_num = 0; }
+			BUFFER()	{ m_id = (unsigned)-1; m_pData = NULL; m_size = m_num = 0; m_nBytes = 0; }
 
 			void populate(unsigned size, unsigned num, const void *pData, GLenum target = GL_ARRAY_BUFFER, GLenum usage = GL_STATIC_DRAW)
 			{
 				glGenBuffers(1, &m_id);
 				glBindBuffer(target, m_id);
 				glBufferData(target, size * num, pData, usage);
+				m_nBytes = (size_t)size * num;
 			}
 			void storeData(unsigned size, unsigned num, const void *pData)
 			{
@@ -96,14 +217,35 @@ class C3dglModel : public C3dglObject
 				memcpy(m_pData, pData, m_size * m_num);
 			}
 			void getData(void **p, unsigned &size, unsigned &num)	{ if (p) *p = m_pData; size = m_size; num = m_num; }
-			void release()		{ glDeleteBuffers(1, &m_id); if (m_pData) delete[] m_pData; m_size = m_num = 0; }
+			void release()		{ glDeleteBuffers(1, &m_id); if (m_pData) delete[] m_pData; m_pData = NULL; m_size = m_num = 0; m_nBytes = 0; }
 		};
 
 		// Buffers
 		BUFFER m_buf[BUF_LAST];
 
-		// number of elements to draw (size of index buffer)
+		// number of elements to draw (size of index buffer) and their type (GL_UNSIGNED_SHORT or GL_UNSIGNED_INT)
 		int m_indexSize;
+		GLenum m_indexType;
+
+		// levels of detail - level 0 is the full mesh
+		LOD m_lods[MAX_LODS];
+		unsigned m_nLODs;
+		void setLODs(const MESHDATA &data);
+
+		// meshlets of the full level of detail (empty if not built)
+		std::vector<MESHLET> m_meshlets;
+
+		// shared buffers: the mesh that owns the VAO and the location of this mesh within its buffers (NULL if not shared)
+		MESH *m_pShared;
+		unsigned m_nBaseVertex, m_nFirstIndex;
+
+		// compact layout: positions are stored quantised, m_matDequant converts them back to the model space
+		bool m_bCompact;
+		glm::mat4 m_matDequant;
+		void createCompact(const MESHDATA &data, GLuint attrib[]);
+
+		// true once the instance attributes are set up in the VAO
+		bool m_bInstancing;
 
 		// number of texture UV coords (2 or 3 implemented)
 		unsigned m_nUVComponents;
@@ -111,25 +253,77 @@ class C3dglModel : public C3dglObject
 		// Material Index - points to the main m_materials collection
 		unsigned m_nMaterialIndex;
 		
-		// Bounding Box (experimental feature)
+		// Bounding Box and Sphere (around the centre of the box)
 		aiVector3D bb[2];
 		aiVector3D centre;
+		float radius;
+		aiVector3D bbPosed[2];				// as bb, or in the pose set with C3dglModel::updateBounds
+
+		// bounds of the vertices influenced by each bone (skinned meshes only) - iBone is -1 for the vertices with no bones
+		struct BONEBB
+		{
+			unsigned iBone;
+			aiVector3D bb[2];
+		};
+		std::vector<BONEBB> m_boneBBs;
+		void setBounds(const MESHDATA &data);
 
 	public:
-		MESH(C3dglModel *pOwner) : m_pOwner(pOwner) { }
+		MESH(C3dglModel *pOwner) : m_pOwner(pOwner), m_idVAO(0), m_indexSize(0), m_indexType(GL_UNSIGNED_INT), m_nLODs(0), m_pShared(NULL), m_nBaseVertex(0), m_nFirstIndex(0), m_bCompact(false), m_matDequant(1.0f), m_bInstancing(false), radius(0) { }
 
 		void create(const aiMesh *pMesh, unsigned maskEnabledBufData = 0);
+		void create(const MESHDATA &data, unsigned maskEnabledBufData = 0);
+		void create(const MESHDATA &data, MESH *pShared, unsigned nBaseVertex, unsigned nFirstIndex, unsigned maskEnabledBufData = 0);
+		bool prepare(const aiMesh *pMesh, MESHDATA &data);		// false if the mesh cannot be rendered
+		static void optimise(MESHDATA &data, bool bMeshlets = false);	// reorders triangles and vertices (called by prepare)
+		static void buildMeshlets(MESHDATA &data);				// groups the triangles into meshlets (called by optimise)
+		static void simplify(MESHDATA &data, unsigned nLevels, float fMaxError);	// adds the levels of detail (called by prepare)
 		void destroy();
-		void render();
+		void render(unsigned nLevel = 0);
+		void render(const GLsizei *pCounts, const GLvoid *const *pOffsets, unsigned nRanges);	// index ranges, in a single multi-draw call
+		void renderInstanced(unsigned nInstances);
+		void enableInstancing(GLuint idBuffer, GLuint attribMatrix, GLuint attribTint);	// attaches the instance buffer to the VAO
+		void setOwner(C3dglModel *pOwner)	{ m_pOwner = pOwner; if (m_pShared) m_pShared = &pOwner->m_shared; }	// when moved to another model
 
 		MATERIAL *getMaterial()		{ return m_pOwner ? m_pOwner->getMaterial(m_nMaterialIndex) : NULL; }
+		unsigned getMaterialIndex()	{ return m_nMaterialIndex; }
 		MATERIAL *createNewMaterial();
 
 		// get buffer binary data - call C3dglModel::enableBufferData before loading!
+		// Note: the data is in the optimised order, and the indices are always 32-bit
 		void getBufferData(ATTRIB_STD bufId, void **p, unsigned &size, unsigned &num)	{ m_buf[bufId].getData(p, size, num); }
+
+		// memory used by the buffers uploaded, and by the copies kept for getBufferData
+		size_t getBufferBytes()		{ size_t n = 0; for (BUFFER &buf : m_buf) n += buf.m_nBytes; return n; }
+		size_t getDataBytes()		{ size_t n = 0; for (BUFFER &buf : m_buf) n += (size_t)buf.m_size * buf.m_num; return n; }
 		
 		aiVector3D *getBB()			{ return bb; }
 		aiVector3D getCentre()		{ return centre; } 
+		float getRadius()			{ return radius; }
+		aiVector3D *getPosedBB()	{ return bbPosed; }
+		void updatePosedBB(const float *pTransforms);	// NULL for the bind pose
+
+		// compact layout only: the model-view matrix must be multiplied by the dequantisation matrix before render is called
+		bool isCompact()						{ return m_pShared ? m_pShared->m_bCompact : m_bCompact; }
+		glm::mat4 getDequantization()			{ return m_pShared ? m_pShared->m_matDequant : m_matDequant; }
+
+		// shared buffers only: the draw call parameters within the shared VAO
+		MESH *getShared()						{ return m_pShared; }
+		unsigned getVAO()						{ return m_idVAO; }
+		GLsizei getIndexCount(unsigned nLevel = 0)			{ return nLevel < m_nLODs ? m_lods[nLevel].nCount : m_indexSize; }
+		GLenum getIndexType()								{ return m_indexType; }
+		const GLvoid *getIndexOffset(unsigned nLevel = 0)	{ return (const GLvoid*)((size_t)(m_nFirstIndex + (nLevel < m_nLODs ? m_lods[nLevel].nFirst : 0)) * (m_indexType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned))); }
+		GLint getBaseVertex()								{ return m_nBaseVertex; }
+
+		// levels of detail: the coarsest level whose error does not exceed fError (in the mesh units)
+		unsigned getLODCount()					{ return m_nLODs; }
+		unsigned getLOD(float fError)			{ unsigned n = 0; while (n + 1 < m_nLODs && m_lods[n + 1].fError <= fError) n++; return n; }
+
+		// meshlets: appends the index ranges (as for the multi-draw calls) of the clusters inside the frustum and, if bCones,
+		// not facing away from the camera. The frustum is in the model space, where the mesh is transformed by global;
+		// the camera is in the mesh space. Consecutive clusters are drawn as one range. Returns the number of ranges appended.
+		unsigned getMeshletCount()				{ return m_meshlets.size(); }
+		unsigned cullMeshlets(const C3dglFrustum &frustum, const glm::mat4 &global, glm::vec3 camera, bool bCones, std::vector<GLsizei> &counts, std::vector<const GLvoid*> &offsets);
 	};
 
 	struct MATERIAL
@@ -138,7 +332,7 @@ class C3dglModel : public C3dglObject
 		// Owner
 		C3dglModel *m_pOwner;
 
-		// texture id
+		// texture id - a reference held in C3dglTextureCache
 		unsigned m_idTexture;
 
 		// materials
@@ -147,13 +341,15 @@ class C3dglModel : public C3dglObject
 		float m_spec[3];
 		float m_emiss[3];
 		float m_shininess;
-		static unsigned c_idTexBlank;
 
 	public:
 		MATERIAL(C3dglModel *pOwner);
 		void create(const aiMaterial *pMat, const char* pDefTexPath);
+		void create(const MATERIALDATA &data, const char* pDefTexPath, const C3dglTextureCache::IMAGE *pImage = NULL);
+		static void read(const aiMaterial *pMat, MATERIALDATA &data);
 		void destroy();
 		void bind();
+		void setOwner(C3dglModel *pOwner)							{ m_pOwner = pOwner; }	// when moved to another model
 
 		void getAmbientMaterial(float &r, float &g, float &b)		{ r = m_amb[0];   g = m_amb[1];   b = m_amb[2]; }
 		void getDiffuseMaterial(float &r, float &g, float &b)		{ r = m_diff[0];  g = m_diff[1];  b = m_diff[2]; }
@@ -167,30 +363,187 @@ class C3dglModel : public C3dglObject
 		void setEmissiveMaterial(float r, float g, float b)			{ m_emiss[0] = r; m_emiss[1] = g; m_emiss[2] = b; }
 		void setShininess(float s)									{ m_shininess = s; }
 
-		void loadTexture(std::string strTexRootPath, std::string strPath);
+		void loadTexture(std::string strTexRootPath, std::string strPath, const C3dglTextureCache::IMAGE *pImage = NULL);
 		void loadBlankTexture();
+		unsigned getTexture()										{ return m_idTexture; }
+		static std::string getTexturePath(std::string strTexRootPath, std::string strPath);
 	};
 
-	const aiScene *m_pScene;
+	const aiScene *m_pScene;				// released after the upload, unless kept (see enableKeepScene)
+	aiNode *m_pRootNode;					// the node hierarchy (owned): copied from the scene, or read from a cooked file
+	std::vector<MATERIALDATA> m_materialData;	// used by loadMaterials
+	bool m_bKeepScene;
+	void releaseScene();
 	std::vector<MESH> m_meshes;
+	MESH m_shared;							// shared buffers: holds the VAO and the buffers of all meshes
 	std::vector<MATERIAL> m_materials;
 	std::string m_name;
 
 	unsigned m_maskEnabledBufData;
+	bool m_bCompactVertices;
+	bool m_bSharedBuffers;
+	unsigned m_nLODLevels;					// levels of detail generated for each mesh (1 = none)
+	float m_fLODError, m_fLODPixelError;
+	bool m_bMeshlets;
+	void createShared(std::vector<MESHDATA> &meshes);
+
+	// Loading is split into the preparation, which only touches the CPU-side data (and may run on a worker thread),
+	// and the upload. Everything prepared for the upload is kept here in between.
+	struct STAGING
+	{
+		C3dglMappedFile file;				// the cooked file - the streams are uploaded straight from it
+		std::vector<MESHDATA> meshes;
+		std::vector<C3dglTextureCache::IMAGE> images;	// decoded textures, for each material (loadAsync only)
+		std::unique_ptr<C3dglModel> pModel;	// loadAsync: prepares and uploads the model apart from the one in use
+	};
+	bool prepare(const char* pFile, unsigned flags, STAGING &staging);
+	void takeModel(C3dglModel &model);
+	void prepareScene(const aiScene *pScene, STAGING &staging);
+	void prepareMaterials(const char* pDefTexPath, STAGING &staging);
+	void upload(STAGING &staging);
+	void loadMaterials(const char* pDefTexPath, const std::vector<C3dglTextureCache::IMAGE> *pImages);
+	void logMemoryUsage();
+
+	// the node hierarchy flattened in pre-order (parents before children) - built on load, used for rendering
+	struct FLATNODE
+	{
+		aiNode *pNode;
+		int nParent;						// -1 for the root
+		unsigned nEnd;						// one past the last node of the subtree
+		glm::mat4 local;					// local transform
+		glm::mat4 global;					// transform to the model space
+		aiVector3D bb[2];					// bounds of the subtree in the model space - bb[0] > bb[1] if empty
+		unsigned nFirstDraw, nDraws;		// range within m_draws
+	};
+	struct FLATDRAW							// meshes of a node with the same material - with shared buffers, a single multi-draw call
+	{
+		unsigned nMaterialIndex;
+		unsigned nFirst, nCount;			// range within m_drawMeshes (and m_drawCounts, m_drawOffsets, m_drawBaseVertices)
+	};
+	std::vector<FLATNODE> m_nodes;
+	std::vector<FLATDRAW> m_draws;
+	std::vector<unsigned> m_drawMeshes;
+	std::vector<GLsizei> m_drawCounts;		// shared buffers only: multi-draw parameters
+	std::vector<const GLvoid*> m_drawOffsets;
+	std::vector<GLint> m_drawBaseVertices;
+	std::vector<glm::mat4> m_worldTransforms;	// computed for each render
+	std::vector<GLsizei> m_lodCounts;		// multi-draw parameters of the selected levels of detail and the visible meshlets
+	std::vector<const GLvoid*> m_lodOffsets;
+	std::vector<GLint> m_lodBaseVertices;
+	void flattenNodes();
+	void computeBounds();
+	void renderNodes(unsigned nFirst, unsigned nEnd, glm::mat4 matrix, unsigned nInstances = 0, const C3dglFrustum *pFrustum = NULL, float fPixelsPerUnit = 0);
+
+	// ray queries: the triangles of all the nodes in the model space, built on load (on the loading thread)
+	bool m_bBVH;
+	C3dglBVH m_bvh;
+	struct BVHPART
+	{
+		unsigned nFirstTriangle;			// within the BVH
+		unsigned iNode, iMesh;
+	};
+	std::vector<BVHPART> m_bvhParts;		// in the order of the triangles
+	void prepareBVH(const STAGING &staging);
+
+	// instancing
+	unsigned m_idInstanceBuffer;
+	size_t m_nInstanceBytes;				// uploaded to the instance buffer
+	std::vector<INSTANCE> m_instances;		// staging for the instance buffer
 
 	// bone related
 	std::map<std::string, unsigned> m_mapBones;		// map of bone names
 	std::vector<aiMatrix4x4> m_offsetBones;
 	aiMatrix4x4 m_GlobalInverseTransform;
+
+	// animations, copied from the scene
+	struct ANIMCHANNEL
+	{
+		std::string nodeName;
+		std::vector<aiVectorKey> positionKeys, scalingKeys;
+		std::vector<aiQuatKey> rotationKeys;
+	};
+	struct ANIMATION
+	{
+		float fDuration, fTicksPerSecond;
+		std::vector<ANIMCHANNEL> channels;
+	};
+	std::vector<ANIMATION> m_animations;
+
+	// animations: channels and bones resolved for each flattened node - built with the node hierarchy
+	std::vector<int> m_nodeBones;					// bone index for each node, or -1
+	std::vector<std::vector<int>> m_nodeChannels;	// [animation][node] channel index, or -1
+	ANIMCURSOR m_cursor;							// used by getBoneTransforms called without a cursor
+	void resolveAnimations();
+
+	// Cooked format: the final mesh streams, the materials, the node hierarchy and the bones.
+	// All records are 4-byte aligned, so that the streams are uploaded straight from the mapped file.
+	struct COOKEDHEADER
+	{
+		char id[4];					// "3DGM"
+		unsigned version;
+		unsigned long long hash;	// FNV-1a of the source file (0 if not known)
+		unsigned flags;				// AssImp post-processing flags
+		unsigned nMeshes, nMaterials, nNodes, nBones, nOffsetBones;
+		unsigned nLODLevels;		// the LOD settings used to cook the meshes
+		float fLODError;
+		unsigned bMeshlets;			// the meshlet setting used to cook the meshes
+		unsigned long long fileSize;
+		aiMatrix4x4 globalInverseTransform;
+	};								// followed by the meshes, materials, nodes (pre-order) and bones (in the order of ids)
+	struct COOKEDMESH
+	{
+		unsigned size[BUF_LAST], num[BUF_LAST];
+		unsigned nUVComponents, nMaterialIndex;
+		aiVector3D bb[2];
+		unsigned nLODs;
+		LOD lods[MAX_LODS];
+		unsigned nMeshlets;
+	};								// followed by the streams and the meshlets
+	struct COOKEDMATERIAL
+	{
+		float amb[3], diff[3], spec[3], emiss[3];
+		float shininess;
+		unsigned nTexPath;
+	};								// followed by the texture path
+	struct COOKEDNODE
+	{
+		aiMatrix4x4 transformation;
+		unsigned nChildren, nMeshes, nName;
+	};								// followed by the mesh indices and the name
+	struct COOKEDBONE
+	{
+		aiMatrix4x4 offset;
+		unsigned nName;
+	};								// followed by the name
+	struct COOKEDREADER;
+	unsigned m_nFlags;						// flags used to load the model
+	bool m_bCache;
+	bool loadCooked(const char* pFile, unsigned long long nHash, unsigned flags, STAGING &staging);
+	bool saveCooked(const char* pFile, unsigned long long nHash, unsigned flags, const std::vector<MESHDATA> &meshes);
+	aiNode *readNode(COOKEDREADER &reader, aiNode *pParent, unsigned &nNodes);
 	
 public:
-	C3dglModel() : C3dglObject()			{ m_pScene = NULL; m_maskEnabledBufData = NULL;  }
+	C3dglModel() : C3dglObject(), m_shared(this)	{ m_pScene = NULL; m_pRootNode = NULL; m_maskEnabledBufData = NULL; m_nFlags = 0; m_bCache = false; m_bCompactVertices = false; m_bSharedBuffers = false; m_idInstanceBuffer = 0; m_nInstanceBytes = 0; m_nLODLevels = 1; m_fLODError = 0.01f; m_fLODPixelError = 1.0f; m_bBVH = false; m_bKeepScene = false; m_bMeshlets = false; }
 	~C3dglModel()							{ destroy(); }
 
+	// the AssImp scene - NULL once the model is uploaded, unless kept (see enableKeepScene)
 	const aiScene *GetScene()				{ return m_pScene; }
 
-	// load a model from file
+	// load a model from file - cooked files (see saveCooked) are recognised and loaded without AssImp
 	bool load(const char* pFile, unsigned int flags = aiProcessPreset_TargetRealtime_MaxQuality);
+	// queue the loading in the loader: the file is parsed on a worker thread, and uploaded when the loader is pumped.
+	// If pDefTexPath is not NULL, the materials are loaded, too (see loadMaterials) - with the textures decoded on the worker thread.
+	// The model is prepared apart, so it remains in use (with the previous model, if any) until uploaded.
+	void loadAsync(C3dglLoader &loader, const char* pFile, const char* pDefTexPath = NULL, unsigned int flags = aiProcessPreset_TargetRealtime_MaxQuality);
+	// write the model in the cooked format - only after loading with AssImp, with the scene kept (see enableKeepScene);
+	// animations are not supported
+	bool saveCooked(const char* pFile);
+	// call before load - keeps the AssImp scene after the upload, for GetScene and saveCooked. By default, the scene is
+	// released as soon as the model is uploaded: the nodes, materials, bones and animations are kept in compact copies.
+	void enableKeepScene(bool bEnable = true)	{ m_bKeepScene = bEnable; }
+	// call before load - keeps a cooked copy of the model (<file>.3dgm) and uses it while the model file does not change.
+	// Note: only the model file is checked, not its material libraries.
+	void enableCache(bool bEnable = true)	{ m_bCache = bEnable; }
 	// create a model from AssImp handle - useful if you are using AssImp directly
 	void create(const aiScene *pScene);
 	// create material information and load textures - must be preceded by either load or create
@@ -200,6 +553,32 @@ public:
 
 	// call before load - to enable buffer binary data access - see MESH::getBufferData
 	void enableBufData(ATTRIB_STD bufId, bool bEnable = true);
+	// call before load - uploads each mesh as a single interleaved buffer: positions quantised to 16 bits within the bounding box,
+	// normals and tangents packed as GL_INT_2_10_10_10_REV (tangent w = bitangent handedness), half float texture coordinates,
+	// 8-bit colours and bone weights. Bitangents are not uploaded - the shader rebuilds them from the normal and the tangent.
+	// Requires a shader program; buffer binary data (see enableBufData) keeps the original floats.
+	void enableCompactVertices(bool bEnable = true)	{ m_bCompactVertices = bEnable; }
+	// call before load - packs all meshes into a single set of buffers behind one VAO. Each node draws its meshes
+	// with one glMultiDrawElementsBaseVertex call per material, and consecutive draws skip redundant material binds.
+	// Attributes missing in some meshes are filled with zeros; with the compact layout one quantisation covers the whole model.
+	void enableSharedBuffers(bool bEnable = true)	{ m_bSharedBuffers = bEnable; }
+	// call before load - generates up to nLevels levels of detail for each mesh (including the full one), each with about half
+	// the triangles of the previous one. fMaxError limits the simplification error of the coarsest level, relative to the size
+	// of the mesh. The levels share the vertices of the mesh; they are kept in the cooked files.
+	// Used by render with the projection matrix - see setLODPixelError.
+	void enableLOD(unsigned nLevels = MAX_LODS, float fMaxError = 0.01f)	{ m_nLODLevels = nLevels < 1 ? 1 : nLevels > MAX_LODS ? MAX_LODS : nLevels; m_fLODError = fMaxError; }
+	// the error allowed on the screen, in pixels, when a level of detail is selected
+	void setLODPixelError(float fPixels)	{ m_fLODPixelError = fPixels; }
+	// call before load - splits the meshes into meshlets (see MAX_MESHLET_VERTICES and MAX_MESHLET_TRIANGLES), each with
+	// a bounding sphere and a normal cone. Render with the projection matrix then draws only the meshlets inside the frustum
+	// and not facing away from the camera - with one multi-draw call per mesh (or per material, with the shared buffers).
+	// Only the full level of detail is split; skinned meshes are not split.
+	// Note: the normal cones are only used while GL_CULL_FACE is enabled, with glCullFace(GL_BACK) and glFrontFace(GL_CCW)
+	// (read at each render) - otherwise the meshlets are culled against the frustum only. Enable it for closed, single-sided models.
+	void enableMeshlets(bool bEnable = true)	{ m_bMeshlets = bEnable; }
+	// call before load - builds a BVH of the triangles (of the full level of detail), for the ray queries - see rayCast.
+	// The triangles are taken in the bind pose, transformed by the node transforms.
+	void enableBVH(bool bEnable = true)		{ m_bBVH = bEnable; }
 
 	unsigned getMeshCount()					{ return m_meshes.size(); }
 	MESH *getMesh(unsigned i)				{ return (i < m_meshes.size()) ? &m_meshes[i] : NULL; }
@@ -209,25 +588,74 @@ public:
 	// rendering
 	void render(glm::mat4 matrix);					// render the entire model
 	void render(unsigned iNode, glm::mat4 matrix);	// render the entire model
+	// as above, skipping the nodes outside of the view frustum - the node bounds form a bounding volume hierarchy.
+	// The levels of detail (see enableLOD) are selected by their error projected to the screen.
+	void render(glm::mat4 matrix, glm::mat4 matrixProjection);
+	void render(unsigned iNode, glm::mat4 matrix, glm::mat4 matrixProjection);
 
 	void render();									// render the entire model
 	void render(unsigned iNode);					// render one of the main nodes
 	void renderNode(aiNode *pNode, glm::mat4 m);	// render a node
 
+	// render nInstances copies of the model, with a single draw call per mesh. pInstances are the model matrices of the instances
+	// (combined with matrix, usually the view matrix); pTints are optional colour multipliers (white if NULL).
+	// Requires a shader program with the aInstanceMatrix (mat4) and aInstanceTint (vec4) attributes
+	// and the instancing uniform, set to 1 while rendering - see basic.vert.
+	void renderInstanced(glm::mat4 matrix, const glm::mat4 *pInstances, unsigned nInstances, const glm::vec4 *pTints = NULL);
+
 	// retrieves the transform associated with the given node. If (bRecursive) the transform is recursively combined with parental transform(s)
 	void getNodeTransform(aiNode *pNode, float pMatrix[16], bool bRecursive = true);
 	
 	// retrieves bone animations. Transforms vector will be resized to match the number of bones in the model
 	void getBoneTransforms(unsigned iAnimation, float time, std::vector<float>& Transforms);
-
-	// get bounding box
+	// as above, written straight to pTransforms (16 floats for each of getBoneCount() bones), with no allocations
+	// once the cursor has been used. Use a separate cursor for each animated instance of the model.
+	void getBoneTransforms(unsigned iAnimation, float time, float *pTransforms, ANIMCURSOR &cursor);
+	// evaluates the animations of many instances (of any models) on the thread pool. The palettes are written one after another
+	// into Transforms, ready for a single upload - see nOffset. Transforms only grows; returns the number of floats written.
+	// Instances sharing a cursor must not be in the same batch.
+	static unsigned getBoneTransforms(ANIMINSTANCE *pInstances, unsigned nInstances, std::vector<float>& Transforms);
+	unsigned getBoneCount()					{ return m_offsetBones.size(); }
+	unsigned getAnimationCount()			{ return m_animations.size(); }
+
+	// get bounding box - in the model space, in the current pose (see updateBounds)
 	void getBB(aiVector3D BB[2]);
-	void getBB(unsigned iNode, aiVector3D BB[2]);
+	void getBB(unsigned iNode, aiVector3D BB[2]);		// one of the main nodes
 	bool getBBNode(aiNode *pNode, aiVector3D BB[2], aiMatrix4x4* trafo);
+	void getBoundingSphere(aiVector3D &centre, float &radius);
+
+	// ray queries (need enableBVH): the closest hit along origin + t * dir, 0 <= t <= tMax.
+	// The ray is in the model space, or in the world space if the model matrix is given - the results are in the same space.
+	struct RAYHIT
+	{
+		float t;							// in the units of dir
+		glm::vec3 point, normal;			// the hit point and the (unit) face normal
+		unsigned iNode, iMesh;				// the node (in pre-order, the root is 0) and its mesh
+		unsigned nTriangle;					// within the mesh
+	};
+	bool rayCast(glm::vec3 origin, glm::vec3 dir, float tMax, RAYHIT &hit);
+	bool rayCast(glm::mat4 matrix, glm::vec3 origin, glm::vec3 dir, float tMax, RAYHIT &hit);
+	// any hit - for line of sight and similar tests; cheaper than rayCast
+	bool rayTest(glm::vec3 origin, glm::vec3 dir, float tMax);
+	bool rayTest(glm::mat4 matrix, glm::vec3 origin, glm::vec3 dir, float tMax);
+	// the BVH itself, in the model space - for the packet queries
+	const C3dglBVH &getBVH()				{ return m_bvh; }
+
+	// refreshes the bounds of the skinned meshes (and the nodes) for the pose given by the bone transforms (see getBoneTransforms),
+	// so that the culling follows the animation. NULL restores the bind pose.
+	void updateBounds(const float *pTransforms);
 
 	// bone system related
 	unsigned getBoneId(std::string boneName);
 
+	// memory used by the model: the CPU-side data (nodes, animations, the copies kept for getBufferData, the BVH and so on),
+	// the vertex, index and instance buffers (as last uploaded), and the textures of the materials (the shared ones counted in full)
+	struct MEMORYUSAGE
+	{
+		size_t nCPUBytes, nBufferBytes, nTextureBytes;
+	};
+	MEMORYUSAGE getMemoryUsage();
+
 	std::string getName();
 };
 
@@ -8,6 +8,13 @@
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
+// uncomment to run the terrain tests and benchmarks in the console once the assets are loaded
+//#define TERRAIN_TESTS
+#ifdef TERRAIN_TESTS
+#include <chrono>
+#include <functional>
+#endif
+
 #pragma comment (lib, "glew32.lib")
 
 using namespace std;
@@ -54,9 +61,102 @@ const int NPARTICLES = (int)(LIFETIME / PERIOD);
 
 // camera position (for first person type camera navigation)
 mat4 matrixView;			// The View Matrix
+mat4 matrixProjection;		// The Projection Matrix (used for terrain LOD & culling)
 float angleTilt = 15.f;		// Tilt Angle
 vec3 cam(0);				// Camera movement values
 
+#ifdef TERRAIN_TESTS
+// displacement: the heights edited beyond the range of the height map texture must follow the texels
+void testTerrainClamp()
+{
+	C3dglTerrain t;
+	t.enableDisplacement();
+	if (!t.loadHeightmap("models\\heightmap3.png", 10)) return;
+
+	// the texels, read back from the GPU: the rows are the lines of constant x
+	auto texelHeight = [&](int x, int z)
+	{
+		GLint w, h;
+		glBindTexture(GL_TEXTURE_2D, t.getHeightTexture());
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &w);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &h);
+		vector<GLushort> texels(w * h);
+		glPixelStorei(GL_PACK_ALIGNMENT, 2);
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_UNSIGNED_SHORT, texels.data());
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return texels[(x + h / 2) * w + z + w / 2] * t.getHeightMapScale() / 65535.0f;
+	};
+	auto check = [&](const char *pName, float fExpected)
+	{
+		float fHeight = t.getHeight(0, 0), fTexel = texelHeight(0, 0);
+		bool bOK = fabs(fHeight - fTexel) <= t.getHeightMapScale() / 65535.0f && fabs(fHeight - fExpected) <= t.getHeightMapScale() / 65535.0f;
+		cout << pName << ": height " << fHeight << ", texel " << fTexel << (bOK ? " - OK" : " - FAILED") << endl;
+	};
+
+	t.lower(0, 0, 8, 1000);
+	check("lowered below 0", 0);
+	t.raise(0, 0, 8, 1000);
+	check("raised above the scale", t.getHeightMapScale());
+}
+
+// the height queries before the planar interpolation: barycentric weights from the areas, with Heron's formula
+static float triarea(float a, float b, float c)
+{
+	float s = (a + b + c) / 2.0f;
+	return sqrt(fabs(s * (s - a) * (s - b) * (s - c)));
+}
+static float dist(float x0, float y0, float x1, float y1)
+{
+	return sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
+}
+static float barycent(float x, float y, float x0, float y0, float v0, float x1, float y1, float v1, float x2, float y2, float v2)
+{
+	float a = dist(x0, y0, x1, y1), b = dist(x1, y1, x2, y2), c = dist(x2, y2, x0, y0);
+	float totalarea = triarea(a, b, c);
+	float length0 = dist(x0, y0, x, y), length1 = dist(x1, y1, x, y), length2 = dist(x2, y2, x, y);
+	return (v0 * triarea(b, length1, length2) + v1 * triarea(c, length0, length2) + v2 * triarea(a, length0, length1)) / totalarea;
+}
+static float barycentHeight(C3dglTerrain &t, float fx, float fz)
+{
+	int x = (int)floor(fx), z = (int)floor(fz);
+	fx -= x;
+	fz -= z;
+	if (fx + fz < 1)
+		return barycent(fx, fz, 0, 0, t.getHeight(x, z), 0, 1, t.getHeight(x, z + 1), 1, 0, t.getHeight(x + 1, z));
+	else
+		return barycent(fx, fz, 0, 1, t.getHeight(x, z + 1), 1, 0, t.getHeight(x + 1, z), 1, 1, t.getHeight(x + 1, z + 1));
+}
+
+// queries per second: the old barycentric path, getInterpolatedHeight and the (SSE2) batch getInterpolatedHeights
+void benchmarkHeightQueries()
+{
+	C3dglTerrain t;
+	if (!t.loadHeightmap("models\\heightmap3.png", 10)) return;
+
+	const unsigned N = 1000000;
+	vector<float> xs(N), zs(N), ys(N);
+	for (unsigned i = 0; i < N; i++)
+	{
+		xs[i] = ((float)rand() / RAND_MAX - 0.5f) * (t.getSizeX() - 1);
+		zs[i] = ((float)rand() / RAND_MAX - 0.5f) * (t.getSizeZ() - 1);
+	}
+
+	auto measure = [&](const char *pName, function<void()> fn)
+	{
+		auto timeStart = chrono::steady_clock::now();
+		fn();
+		float fSeconds = chrono::duration<float>(chrono::steady_clock::now() - timeStart).count();
+		float fSum = 0;
+		for (float y : ys) fSum += y;		// keeps the results alive
+		cout << pName << ": " << N / fSeconds / 1e6f << " M queries/s (sum " << fSum << ")" << endl;
+	};
+	measure("barycent", [&] { for (unsigned i = 0; i < N; i++) ys[i] = barycentHeight(t, xs[i], zs[i]); });
+	measure("getInterpolatedHeight", [&] { for (unsigned i = 0; i < N; i++) ys[i] = t.getInterpolatedHeight(xs[i], zs[i]); });
+	measure("getInterpolatedHeights", [&] { t.getInterpolatedHeights(xs.data(), zs.data(), ys.data(), N); });
+}
+#endif
+
 bool init()
 {
 	// switch on: transparency/blending
@@ -71,9 +171,77 @@ bool init()
 	glEnable(GL_NORMALIZE);		// normalization is needed by AssImp library models
 	glShadeModel(GL_SMOOTH);	// smooth shading mode is the default one; try GL_FLAT here!
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);	// this is the default one; try GL_LINE!
+	glCullFace(GL_BACK);		// back-face culling - switched on for the closed models only (see renderObjects);
+	glFrontFace(GL_CCW);		// the meshlets facing away from the camera are culled then, too
+
+	// start loading the assets: the files are parsed and decoded on the worker threads while the shaders compile;
+	// the uploads are done below (see loader.wait)
+	C3dglLoader loader;
+	C3dglTextureCache &texCache = C3dglTextureCache::getDefault();
+
+	terrain.enableLOD();
+	terrain.enableDisplacement();
+	terrain.enableAO();
+	terrain.enableCache();
+	water.enableDisplacement();
+	water.enableCache();
+	terrain.loadHeightmapAsync(loader, "models\\heightmap3.png", 10);
+	water.loadHeightmapAsync(loader, "models\\watermap.png", 10);
+
+	C3dglModel *pModels[] = { &woodCabin, &ufo, &tree, &boat, &stone, &lamp };
+	for (C3dglModel *pModel : pModels)
+	{
+		pModel->enableCache();
+		pModel->enableCompactVertices();
+		pModel->enableSharedBuffers();
+		pModel->enableLOD();
+		pModel->enableMeshlets();
+	}
+	woodCabin.loadAsync(loader, "models\\WoodenCabinObj\\WoodenCabin.obj", "models\\WoodenCabinObj");
+	ufo.loadAsync(loader, "models\\saucerObj\\ufo-fixed.obj", "models\\saucerObj");
+	tree.loadAsync(loader, "models\\Spruce_obj\\Spruce.obj", "models\\Spruce_obj");
+	boat.loadAsync(loader, "models\\OldBoat\\OldBoat.obj", "models\\OldBoat");
+	stone.loadAsync(loader, "models\\stone\\stone.obj");
+	lamp.loadAsync(loader, "models\\StreetLamp\\streetLamp.obj");
+
+	// moon skybox
+	skybox.loadAsync(loader, "models\\skybox2\\front.png", "models\\skybox2\\left.png", "models\\skybox2\\back.png", "models\\skybox2\\right.png", "models\\skybox2\\up.png", "models\\skybox2\\down.png");
+
+	// moon cube map
+	auto cubeImages = make_shared<vector<C3dglTextureCache::IMAGE> >(6);
+	loader.add([=]
+	{
+		const char *pFilenames[] = { "models\\cube2\\left.png", "models\\cube2\\right.png", "models\\cube2\\down.png", "models\\cube2\\up.png", "models\\cube2\\front.png", "models\\cube2\\back.png" };
+		for (int i = 0; i < 6; i++)
+			if (!C3dglTextureCache::decode(pFilenames[i], (*cubeImages)[i])) return false;
+		return true;
+	},
+	[=]
+	{
+		glActiveTexture(GL_TEXTURE3);
+		glGenTextures(1, &idTexCube);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, idTexCube);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		for (int i = 0; i < 6; i++)
+		{
+			const C3dglTextureCache::IMAGE &image = (*cubeImages)[i];
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.bits.data());
+		}
+		return true;
+	});
+
+	// Grass, sand, water, stone and rain textures - shared through the texture cache
+	texCache.acquireAsync(loader, "models/grass.png", &idTexGrass);
+	texCache.acquireAsync(loader, "models/sand.png", &idTexSand);
+	texCache.acquireAsync(loader, "models/water.png", &idTexWater);
+	texCache.acquireAsync(loader, "models/stone/stone.png", &idTexStone);
+	texCache.acquireAsync(loader, "models/water.bmp", &idTexParticle);
+	loader.start();
 
-	// create & load textures
-	C3dglBitmap bm;
 	glActiveTexture(GL_TEXTURE0);
 
 	// Initialise Shaders
@@ -176,83 +344,19 @@ bool init()
 	glutSetVertexAttribCoord3(ProgramBasic.GetAttribLocation("aVertex"));
 	glutSetVertexAttribNormal(ProgramBasic.GetAttribLocation("aNormal"));
 
-	// load your 3D models here!
-	if (!terrain.loadHeightmap("models\\heightmap3.png", 10)) return false;
-	if (!water.loadHeightmap("models\\watermap.png", 10)) return false;
-
-	if (!woodCabin.load("models\\WoodenCabinObj\\WoodenCabin.obj")) return false;
-	woodCabin.loadMaterials("models\\WoodenCabinObj");
-
-	if (!ufo.load("models\\saucerObj\\ufo-fixed.obj")) return false;
-	ufo.loadMaterials("models\\saucerObj");
-
-	if (!tree.load("models\\Spruce_obj\\Spruce.obj")) return false;
-	tree.loadMaterials("models\\Spruce_obj");
-
-	if (!boat.load("models\\OldBoat\\OldBoat.obj")) return false;
-	boat.loadMaterials("models\\OldBoat");
+	// finish loading the 3D models and textures - the uploads need the shader programs
+	if (!loader.wait()) return false;
 
-	if (!stone.load("models\\stone\\stone.obj")) return false;
+#ifdef TERRAIN_TESTS
+	testTerrainClamp();
+	benchmarkHeightQueries();
+#endif
 
-	if (!lamp.load("models\\StreetLamp\\streetLamp.obj")) return false;
-
-	// load moon skybox
-	if (!skybox.load("models\\skybox2\\front.png", "models\\skybox2\\left.png", "models\\skybox2\\back.png", "models\\skybox2\\right.png", "models\\skybox2\\up.png", "models\\skybox2\\down.png")) return false;
-
-	// load Cube Map
+	// cube map on GL_TEXTURE3, rain texture on GL_TEXTURE5
 	glActiveTexture(GL_TEXTURE3);
-	glGenTextures(3, &idTexCube);
 	glBindTexture(GL_TEXTURE_CUBE_MAP, idTexCube);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	
-	// load moon cube map images
-	bm.Load("models\\cube2\\left.png", GL_RGBA); glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_RGBA, bm.GetWidth(), abs(bm.GetHeight()), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-	bm.Load("models\\cube2\\right.png", GL_RGBA); glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_X, 0, GL_RGBA, bm.GetWidth(), abs(bm.GetHeight()), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-	bm.Load("models\\cube2\\down.png", GL_RGBA); glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Y, 0, GL_RGBA, bm.GetWidth(), abs(bm.GetHeight()), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-	bm.Load("models\\cube2\\up.png", GL_RGBA); glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, 0, GL_RGBA, bm.GetWidth(), abs(bm.GetHeight()), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-	bm.Load("models\\cube2\\front.png", GL_RGBA); glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Z, 0, GL_RGBA, bm.GetWidth(), abs(bm.GetHeight()), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-	bm.Load("models\\cube2\\back.png", GL_RGBA); glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, 0, GL_RGBA, bm.GetWidth(), abs(bm.GetHeight()), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-
-	// Grass texture
-	bm.Load("models/grass.png", GL_RGBA);
-	glGenTextures(1, &idTexGrass);
-	glBindTexture(GL_TEXTURE_2D, idTexGrass);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bm.GetWidth(), bm.GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-
-	// Sand texture
-	bm.Load("models/sand.png", GL_RGBA);
-	glGenTextures(1, &idTexSand);
-	glBindTexture(GL_TEXTURE_2D, idTexSand);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bm.GetWidth(), bm.GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-
-	// Water texture
-	bm.Load("models/water.png", GL_RGBA);
-	glGenTextures(1, &idTexWater);
-	glBindTexture(GL_TEXTURE_2D, idTexWater);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bm.GetWidth(), bm.GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-
-	// Stone texture
-	bm.Load("models/stone/stone.png", GL_RGBA);
-	glActiveTexture(GL_TEXTURE0);
-	glGenTextures(1, &idTexStone);
-	glBindTexture(GL_TEXTURE_2D, idTexStone);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bm.GetWidth(), bm.GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
-
-	// Setup the Rain Texture
-	bm.Load("models/water.bmp", GL_RGBA);
-	glGenTextures(1, &idTexParticle);
 	glActiveTexture(GL_TEXTURE5);
 	glBindTexture(GL_TEXTURE_2D, idTexParticle);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bm.GetWidth(), bm.GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, bm.GetBits());
 
 	// Send the texture info to the shaders
 	ProgramBasic.SendUniform("texture0", 0);
@@ -332,6 +436,8 @@ bool init()
 	// setup the screen background colour
 	glClearColor(0.2f, 0.6f, 1.f, 1.0f);   // blue sky colour
 
+	cout << "Textures: " << texCache.getTextureCount() << " loaded, " << texCache.getResidentBytes() / 1024 << " KB resident" << endl;
+
 	cout << endl;
 	cout << "Use:" << endl;
 	cout << "  WASD or arrow key to navigate" << endl;
@@ -344,7 +450,7 @@ bool init()
 
 void renderReflections(mat4 matrixView, float theta, float Y);
 
-void renderObjects(mat4 matrixView, float theta, float Y);
+void renderObjects(mat4 matrixView, mat4 matrixProjection, float theta, float Y);
 
 void prepareCubeMap(float x, float y, float z, float theta);
 
@@ -394,7 +500,7 @@ void render()
 	// render the terrain
 	ProgramTerrain.Use();
 	m = translate(matrixView, vec3(0, Y, 0));
-	terrain.render(m);
+	terrain.render(m, matrixProjection);
 
 	// setup the water texture
 	glBindTexture(GL_TEXTURE_2D, idTexWater);
@@ -408,7 +514,7 @@ void render()
 	water.render(m);
 
 	renderReflections(matrixView, theta, Y);
-	renderObjects(matrixView, theta, Y);
+	renderObjects(matrixView, matrixProjection, theta, Y);
 	prepareParticles(m, Y);
 
 	// essential for double-buffering technique
@@ -418,7 +524,7 @@ void render()
 	glutPostRedisplay();
 }
 
-void renderObjects(mat4 matrixView, float theta, float Y)
+void renderObjects(mat4 matrixView, mat4 matrixProjection, float theta, float Y)
 {
 	mat4 m;
 	ProgramBasic.Use();
@@ -426,20 +532,23 @@ void renderObjects(mat4 matrixView, float theta, float Y)
 	// normal rendering without reflections
 	glActiveTexture(GL_TEXTURE0);
 	ProgramBasic.SendUniform("reflectionPower", 0.0);
+	glEnable(GL_CULL_FACE);
 
 	// Wooden Cabin
 	m = matrixView;
 	m = translate(m, vec3(3.0f, Y + 5.3f, 2.0f));
 	m = scale(m, vec3(0.05f, 0.05f, 0.05f));
 	ProgramBasic.SendUniform("matrixModelView", m);
-	woodCabin.render(m);
+	woodCabin.render(m, matrixProjection);
 	
-	// Trees
+	// Trees - the branches are single quads, seen from both sides
+	glDisable(GL_CULL_FACE);
 	m = matrixView;
 	m = translate(m, vec3(-3.0f, Y + 8.6f, -5.0f));
 	m = scale(m, vec3(0.5f, 0.5f, 0.5f));
 	ProgramBasic.SendUniform("matrixModelView", m);
-	tree.render(m);
+	tree.render(m, matrixProjection);
+	glEnable(GL_CULL_FACE);
 
 	// Boat
 	m = matrixView;
@@ -447,7 +556,7 @@ void renderObjects(mat4 matrixView, float theta, float Y)
 	m = scale(m, vec3(0.1f, 0.1f, 0.1f));
 	m = rotate(m, radians(90.0f), vec3(0.0f, 1.0f, 0.0f));
 	ProgramBasic.SendUniform("matrixModelView", m);
-	boat.render(m);
+	boat.render(m, matrixProjection);
 
 	// UFO non-reflective
 	m = matrixView;
@@ -455,37 +564,27 @@ void renderObjects(mat4 matrixView, float theta, float Y)
 	m = scale(m, vec3(0.15f, 0.15f, 0.15f));
 	m = rotate(m, radians(30.f) * theta * 0.1f, vec3(0.0f, 1.0f, 0.0f));
 	ProgramBasic.SendUniform("matrixModelView", m);
-	ufo.render(m);
+	ufo.render(m, matrixProjection);
 
-	// Stones
+	// Stones - all four in a single instanced draw
 	glBindTexture(GL_TEXTURE_2D, idTexStone);
-	m = matrixView;
-	m = translate(m, vec3(15.0f, Y + 10.2f, 2.0f));
-	m = scale(m, vec3(0.015f, 0.015f, 0.015f));
-	m = rotate(m, radians(90.f) * theta * 0.1f, vec3(1.0f, 1.0f, 1.0f));
-	ProgramBasic.SendUniform("matrixModelView", m);
-	stone.render(m);
+	mat4 stones[4];
+	stones[0] = translate(mat4(1.f), vec3(15.0f, Y + 10.2f, 2.0f));
+	stones[0] = scale(stones[0], vec3(0.015f, 0.015f, 0.015f));
+	stones[0] = rotate(stones[0], radians(90.f) * theta * 0.1f, vec3(1.0f, 1.0f, 1.0f));
 
-	m = matrixView;
-	m = translate(m, vec3(15.0f, Y + 18.0f, 1.0f));
-	m = scale(m, vec3(0.015f, 0.015f, 0.015f));
-	m = rotate(m, radians(30.f) * theta * 0.1f, vec3(1.0f, 0.0f, 0.5f));
-	ProgramBasic.SendUniform("matrixModelView", m);
-	stone.render(m);
+	stones[1] = translate(mat4(1.f), vec3(15.0f, Y + 18.0f, 1.0f));
+	stones[1] = scale(stones[1], vec3(0.015f, 0.015f, 0.015f));
+	stones[1] = rotate(stones[1], radians(30.f) * theta * 0.1f, vec3(1.0f, 0.0f, 0.5f));
 
-	m = matrixView;
-	m = translate(m, vec3(13.0f, Y + 9.0f, 4.0f));
-	m = scale(m, vec3(0.015f, 0.015f, 0.015f));
-	m = rotate(m, radians(100.f) * theta * 0.1f, vec3(0.5f, 0.0f, 0.5f));
-	ProgramBasic.SendUniform("matrixModelView", m);
-	stone.render(m);
+	stones[2] = translate(mat4(1.f), vec3(13.0f, Y + 9.0f, 4.0f));
+	stones[2] = scale(stones[2], vec3(0.015f, 0.015f, 0.015f));
+	stones[2] = rotate(stones[2], radians(100.f) * theta * 0.1f, vec3(0.5f, 0.0f, 0.5f));
 
-	m = matrixView;
-	m = translate(m, vec3(15.0f, Y + 14.0f, -2.5f));
-	m = scale(m, vec3(0.015f, 0.015f, 0.015f));
-	m = rotate(m, radians(55.f) * theta * 0.1f, vec3(0.5f, 1.0f, 0.5f));
-	ProgramBasic.SendUniform("matrixModelView", m);
-	stone.render(m);
+	stones[3] = translate(mat4(1.f), vec3(15.0f, Y + 14.0f, -2.5f));
+	stones[3] = scale(stones[3], vec3(0.015f, 0.015f, 0.015f));
+	stones[3] = rotate(stones[3], radians(55.f) * theta * 0.1f, vec3(0.5f, 1.0f, 0.5f));
+	stone.renderInstanced(matrixView, stones, 4);
 
 	// Streelamp
 	ProgramBasic.SendUniform("materialDiffuse", 1.0f, 0.0f, 0.0f);
@@ -494,7 +593,8 @@ void renderObjects(mat4 matrixView, float theta, float Y)
 	m = translate(m, vec3(0.0f, Y + 5.2f, 3.5f));
 	m = scale(m, vec3(0.025f, 0.025f, 0.025f));
 	ProgramBasic.SendUniform("matrixModelView", m);
-	lamp.render(m);
+	lamp.render(m, matrixProjection);
+	glDisable(GL_CULL_FACE);
 
 	// Lamp bulb
 	ProgramBasic.SendUniform("materialDiffuse", 1.0f, 1.0f, 1.0f);
@@ -524,7 +624,9 @@ void renderReflections(mat4 matrixView, float theta, float Y)
 	m = scale(m, vec3(0.1f, 0.1f, 0.1f));
 	m = rotate(m, radians(-120.f) * theta * 0.1f, vec3(0.0f, 1.0f, 0.0f));
 	ProgramBasic.SendUniform("matrixModelView", m);
-	ufo.render(m);
+	glEnable(GL_CULL_FACE);
+	ufo.render(m, matrixProjection);
+	glDisable(GL_CULL_FACE);
 
 	//// sphere reflection test
 	//ProgramBasic.SendUniform("spotLight.on", 1);
@@ -546,7 +648,8 @@ void prepareCubeMap(float x, float y, float z, float theta)
 
 	// setup the viewport to 256x256, 90 degrees FoV (Field of View)
 	glViewport(0, 0, 256, 256);
-	ProgramBasic.SendUniform("matrixProjection", perspective(radians(90.f), 1.0f, 0.02f, 1000.0f));
+	mat4 matrixProjection2 = perspective(radians(90.f), 1.0f, 0.02f, 1000.0f);
+	ProgramBasic.SendUniform("matrixProjection", matrixProjection2);
 
 	// render environment 6 times
 	ProgramBasic.SendUniform("reflectionPower", 0.0);
@@ -576,7 +679,7 @@ void prepareCubeMap(float x, float y, float z, float theta)
 		// render scene objects - all but the reflective one
 		glActiveTexture(GL_TEXTURE0);
 		float Y = -std::max(terrain.getInterpolatedHeight(inverse(matrixView2)[3][0], inverse(matrixView2)[3][2]), waterLevel);
-		renderObjects(matrixView2, theta, Y);
+		renderObjects(matrixView2, matrixProjection2, theta, Y);
 
 		// send the image to the cube texture
 		glActiveTexture(GL_TEXTURE3);
@@ -631,6 +734,7 @@ void reshape(int w, int h)
 	float ratio = w * 1.0f / h;      // we hope that h is not zero
 	glViewport(0, 0, w, h);
 	mat4 m = perspective(radians(60.f), ratio, 0.02f, 1000.f);
+	matrixProjection = m;
 	ProgramBasic.SendUniform("matrixProjection", m);
 	ProgramTerrain.SendUniform("matrixProjection", m);
 	ProgramWater.SendUniform("matrixProjection", m);
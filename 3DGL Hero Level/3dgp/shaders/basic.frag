@@ -8,6 +8,7 @@ in vec2 texCoord0;
 in vec3 texCoordCubeMap;
 in float fogFactor;
 in mat3 matrixTangent;
+in vec4 instanceTint;
 
 vec3 normalNew;
 
@@ -115,5 +116,6 @@ void main(void)
 	// outColor order is as follows: normal mapping, environment mapping w/ reflections, fog
 	outColor *= texture(texture0, texCoord0);
 	outColor *= mix(texture(texture0, texCoord0.st), texture(textureCubeMap, texCoordCubeMap), reflectionPower);
+	outColor *= instanceTint;
 	outColor = mix(vec4(fogColour, 1), outColor, fogFactor);
 }
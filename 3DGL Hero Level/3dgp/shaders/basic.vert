@@ -5,6 +5,9 @@ uniform mat4 matrixProjection;
 uniform mat4 matrixView;
 uniform mat4 matrixModelView;
 
+// Uniforms: Instancing - see C3dglModel::renderInstanced
+uniform int instancing;
+
 // Uniforms: Material Colours
 uniform vec3 materialAmbient;
 uniform vec3 materialDiffuse;
@@ -17,8 +20,10 @@ uniform float fogDensity;
 layout (location = 0) in vec3 aVertex;
 layout (location = 2) in vec3 aNormal;
 layout (location = 3) in vec2 aTexCoord;
-layout (location = 4) in vec3 aTangent;
+layout (location = 4) in vec4 aTangent;		// w: handedness of the bitangent (1 if not given)
 layout (location = 5) in vec3 aBiTangent;
+layout (location = 8) in mat4 aInstanceMatrix;	// locations 8 - 11
+layout (location = 12) in vec4 aInstanceTint;
 
 // Output Variables
 out vec4 color;
@@ -29,6 +34,7 @@ out vec3 texCoordCubeMap;
 out vec4 normal2;
 out float fogFactor;
 out mat3 matrixTangent;
+out vec4 instanceTint;
 
 // Light declarations
 struct AMBIENT
@@ -65,18 +71,27 @@ vec4 DirectionalLight(DIRECTIONAL light)
 
 void main(void) 
 {
+	// model view matrix - with the instance matrix applied on top if instancing
+	mat4 matrixMV = matrixModelView;
+	instanceTint = vec4(1, 1, 1, 1);
+	if (instancing == 1)
+	{
+		matrixMV = aInstanceMatrix * matrixModelView;
+		instanceTint = aInstanceTint;
+	}
+
 	// calculate position
-	position = matrixModelView * vec4(aVertex, 1.0);
+	position = matrixMV * vec4(aVertex, 1.0);
 	gl_Position = matrixProjection * position;
 
 	// calculate normal
-	normal = normalize(mat3(matrixModelView) * aNormal);
-	normal2 = vec4(normalize(mat3(matrixModelView) * aNormal), 1);
+	normal = normalize(mat3(matrixMV) * aNormal);
+	normal2 = vec4(normalize(mat3(matrixMV) * aNormal), 1);
 
 	// calculate tangent local system transformation
-	vec3 tangent = normalize(mat3(matrixModelView) * aTangent);
+	vec3 tangent = normalize(mat3(matrixMV) * aTangent.xyz);
 	tangent = normalize(tangent - dot(tangent, normal) * normal);	// Gramm-Schmidt process
-	vec3 biTangent = cross(normal, tangent);
+	vec3 biTangent = cross(normal, tangent) * (aTangent.w < 0 ? -1.0 : 1.0);
 	matrixTangent = mat3(tangent, biTangent, normal);
 
 	// calculate texture coordinate
@@ -2,6 +2,7 @@
 
 // Input Variables (received from Vertex Shader)
 in vec4 color;
+in vec4 ambient;
 in vec4 position;
 in vec3 normal;
 in vec2 texCoord0;
@@ -22,6 +23,11 @@ in float scenefogFactor;
 uniform sampler2D textureBed;
 uniform sampler2D textureShore;
 
+// Ambient Occlusion
+uniform int aoMapOn;
+uniform sampler2D aoMap;
+in vec2 aoTexCoord;
+
 // Output Variable (sent down through the Pipeline)
 out vec4 outColor;
 
@@ -29,6 +35,12 @@ void main(void)
 {
 	outColor = color;
 
+	// ambient light, occluded by the surrounding terrain
+	if (aoMapOn == 1)
+		outColor += ambient * texture(aoMap, aoTexCoord).r;
+	else
+		outColor += ambient;
+
  	// shoreline multitexturing
 	float isAboveWater = 1 - clamp(waterDepth, 0, 1); 
 	outColor *= mix(texture(textureBed, texCoord0), texture(textureShore, texCoord0), isAboveWater);
@@ -25,7 +25,20 @@ layout (location = 0) in vec3 aVertex;
 layout (location = 2) in vec3 aNormal;
 layout (location = 3) in vec2 aTexCoord;
 
+// Displacement Mode: vertices come from a shared grid patch, displaced with the height map
+uniform int heightMapOn;
+uniform sampler2D heightMap;		// 16-bit heights; rows are the lines of constant x
+uniform float heightMapScale;
+layout (location = 4) in vec3 aPatchVertex;	// x, z (in cells), 1 for skirt vertices
+layout (location = 5) in vec4 aPatchOrigin;	// per instance: x0, z0, step, skirt depth
+
+// Ambient Occlusion: baked per grid point (see C3dglTerrain::enableAO)
+uniform int aoMapOn;
+uniform sampler2D aoMap;			// rows are the lines of constant x, as in the height map
+out vec2 aoTexCoord;
+
 out vec4 color;
+out vec4 ambient;					// ambient light - occluded in the fragment shader
 out vec4 position;
 out vec3 normal;
 out vec2 texCoord0;
@@ -63,27 +76,59 @@ vec4 DirectionalLight(DIRECTIONAL light)
 	return color;
 }
 
+float height(ivec2 p)
+{
+	return texelFetch(heightMap, p.yx, 0).r * heightMapScale;
+}
+
 void main(void) 
 {
+	vec3 vertex = aVertex;
+	vec3 norm = aNormal;
+	vec2 texCoord = aTexCoord;
+	if (heightMapOn == 1)
+	{
+		// grid point - clamped to the edge of the map
+		ivec2 size = textureSize(heightMap, 0).yx;
+		ivec2 p = min(ivec2(aPatchOrigin.xy + aPatchVertex.xy * aPatchOrigin.z), size - 1);
+
+		// the normal from central differences (one-sided at the borders), as in C3dglTerrain
+		float dx = height(ivec2(min(p.x + 1, size.x - 1), p.y)) - height(ivec2(max(p.x - 1, 0), p.y));
+		float dz = height(ivec2(p.x, min(p.y + 1, size.y - 1))) - height(ivec2(p.x, max(p.y - 1, 0)));
+
+		vec2 xz = vec2(p - size / 2);
+		vertex = vec3(xz.x, height(p) - aPatchVertex.z * aPatchOrigin.w, xz.y);
+		norm = normalize(vec3(-dx, 2, -dz));
+		texCoord = xz / 2;
+	}
+
 	// calculate position
-	position = matrixModelView * vec4(aVertex, 1.0);
+	position = matrixModelView * vec4(vertex, 1.0);
 	gl_Position = matrixProjection * position;
 
 	// calculate normal
-	normal = normalize(mat3(matrixModelView) * aNormal);
+	normal = normalize(mat3(matrixModelView) * norm);
 
 	// calculate texture coordinate
-	texCoord0 = aTexCoord;
+	texCoord0 = texCoord;
+
+	// calculate ambient occlusion texture coordinate (texel centres at the grid points)
+	if (aoMapOn == 1)
+	{
+		ivec2 aoSize = textureSize(aoMap, 0);
+		aoTexCoord = (vertex.zx + vec2(aoSize / 2) + 0.5) / vec2(aoSize);
+	}
 
 	// calculate light
 	color = vec4(0, 0, 0, 1);
+	ambient = vec4(0, 0, 0, 0);
 	if (lightAmbient.on == 1) 
-		color += AmbientLight(lightAmbient);
+		ambient = AmbientLight(lightAmbient);
 	if (lightDir.on == 1) 
 		color += DirectionalLight(lightDir);
 
 	// calculate depth of water
-	waterDepth = waterLevel - aVertex.y;
+	waterDepth = waterLevel - vertex.y;
 	waterDepth = max(waterDepth, 0);
 
 	// calculate the observer's altitude above the observed vertex
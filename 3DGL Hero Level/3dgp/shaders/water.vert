@@ -11,6 +11,12 @@ layout (location = 0) in vec3 aVertex;
 layout (location = 2) in vec3 aNormal;
 layout (location = 3) in vec2 aTexCoord;
 
+// Displacement Mode: vertices come from a shared grid patch (see terrain.vert) - only x and z are used here
+uniform int heightMapOn;
+uniform sampler2D heightMap;
+layout (location = 4) in vec3 aPatchVertex;	// x, z (in cells), 1 for skirt vertices
+layout (location = 5) in vec4 aPatchOrigin;	// per instance: x0, z0, step, skirt depth
+
 out vec4 color;
 out vec4 position;
 out vec3 normal;
@@ -29,15 +35,26 @@ float wave(float A, float x, float y, float t)
 
 void main(void) 
 {
+	vec3 vertex = aVertex;
+	vec2 texCoord = aTexCoord;
+	if (heightMapOn == 1)
+	{
+		ivec2 size = textureSize(heightMap, 0).yx;
+		ivec2 p = min(ivec2(aPatchOrigin.xy + aPatchVertex.xy * aPatchOrigin.z), size - 1);
+		vec2 xz = vec2(p - size / 2);
+		vertex = vec3(xz.x, 0, xz.y);
+		texCoord = xz / 2;
+	}
+
 	// Calculate the wave
 	float a = 0.025;
-	float y = wave(a, aVertex.x, aVertex.z, t);
+	float y = wave(a, vertex.x, vertex.z, t);
 
 	float d = 0.05;
-	float dx = (wave(a, aVertex.x+d, aVertex.z, t) - wave(a, aVertex.x-d, aVertex.z, t)) / 2 / d;
-	float dz = (wave(a, aVertex.x, aVertex.z+d, t) - wave(a, aVertex.x, aVertex.z-d, t)) / 2 / d;
+	float dx = (wave(a, vertex.x+d, vertex.z, t) - wave(a, vertex.x-d, vertex.z, t)) / 2 / d;
+	float dz = (wave(a, vertex.x, vertex.z+d, t) - wave(a, vertex.x, vertex.z-d, t)) / 2 / d;
 
-	vec3 newVertex = vec3(aVertex.x, y, aVertex.z);
+	vec3 newVertex = vec3(vertex.x, y, vertex.z);
 	vec3 newNormal = normalize(vec3(-dx, 1, -dz));
 
 	// calculate position
@@ -48,7 +65,7 @@ void main(void)
 	normal = normalize(mat3(matrixModelView) * newNormal);
 
 	// calculate texture coordinate
-	texCoord0 = aTexCoord;
+	texCoord0 = texCoord;
 
 	// no light calculation for water
 	color = vec4(1, 1, 1, 1);
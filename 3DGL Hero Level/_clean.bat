@@ -24,6 +24,8 @@ if exist game\Debug\*.* rmdir /S /Q game\Debug
 if exist game\Release\*.* rmdir /S /Q game\Release
 if exist 3dgp\Debug\*.* rmdir /S /Q 3dgp\Debug
 if exist 3dgp\Release\*.* rmdir /S /Q 3dgp\Release
+if exist 3dgp\models\*.3dgc del 3dgp\models\*.3dgc
+for /R 3dgp\models %%f in (*.3dgm) do del "%%f"
 if exist ipch\*.* rmdir /S /Q ipch
 if exist .vs\*.* rmdir /S /Q .vs
 echo.